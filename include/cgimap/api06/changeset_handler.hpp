@@ -13,6 +13,8 @@ public:
   changeset_responder(mime::type, osm_changeset_id_t, bool, factory_ptr &);
   ~changeset_responder();
 
+  std::string data_version();
+
 private:
   osm_changeset_id_t id;
   bool include_discussion;
@@ -13,6 +13,8 @@ public:
   node_responder(mime::type, osm_nwr_id_t, factory_ptr &);
   ~node_responder();
 
+  std::string data_version();
+
 private:
   osm_nwr_id_t id;
 
@@ -15,6 +15,8 @@ public:
   nodes_responder(mime::type, std::vector<osm_nwr_id_t>, factory_ptr &);
   ~nodes_responder();
 
+  std::string data_version();
+
 private:
   std::vector<osm_nwr_id_t> ids;
 };
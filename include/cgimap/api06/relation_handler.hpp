@@ -13,6 +13,8 @@ public:
   relation_responder(mime::type, osm_nwr_id_t, factory_ptr &);
   ~relation_responder();
 
+  std::string data_version();
+
 private:
   osm_nwr_id_t id;
 
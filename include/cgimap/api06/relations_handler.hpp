@@ -16,6 +16,8 @@ public:
   relations_responder(mime::type, std::vector<osm_nwr_id_t>, factory_ptr &);
   ~relations_responder();
 
+  std::string data_version();
+
 private:
   std::vector<osm_nwr_id_t> ids;
 };
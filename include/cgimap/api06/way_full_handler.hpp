@@ -26,6 +26,7 @@ public:
 
   std::string log_name() const;
   responder_ptr_t responder(factory_ptr &x) const;
+  bool response_cacheable() const;
 
 private:
   osm_nwr_id_t id;
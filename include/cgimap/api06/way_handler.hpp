@@ -13,6 +13,8 @@ public:
   way_responder(mime::type, osm_nwr_id_t, factory_ptr &);
   ~way_responder();
 
+  std::string data_version();
+
 private:
   osm_nwr_id_t id;
 
@@ -15,6 +15,8 @@ public:
   ways_responder(mime::type, std::vector<osm_nwr_id_t>, factory_ptr &);
   ~ways_responder();
 
+  std::string data_version();
+
 private:
   std::vector<osm_nwr_id_t> ids;
 };
@@ -8,6 +8,7 @@
 #include "cgimap/config.hpp"
 #include "cgimap/request.hpp"
 #include <string>
+#include <boost/optional.hpp>
 
 #ifndef ENABLE_API07
 #error This file should not be included unless experimental API 0.7 features are enabled.
@@ -17,20 +18,43 @@ namespace api07 {
 
 class map_responder : public osm_current_responder {
 public:
-  map_responder(mime::type, bbox, factory_ptr &);
+  // fixed_grid is true if the bbox is one of the tiles, and so is worth
+  // caching.
+  map_responder(mime::type, bbox, factory_ptr &, bool fixed_grid = false);
   ~map_responder();
+  std::string cache_control() const;
+
+private:
+  bool m_fixed_grid;
 };
 
+/**
+ * the map call, either for a bbox as in API 0.6, or for one of a fixed grid
+ * of tiles. the tiles are quadtiles at a fixed zoom, numbered by
+ * interleaving the bits of their x and y coordinates in the same way as the
+ * tile column of the nodes. a tile's URL always means the same area, so the
+ * responses can be cached and shared, unlike those for arbitrary bboxes.
+ */
 class map_handler : public handler {
 public:
+  // the zoom of the tile grid, at which tiles are about 0.022 degrees of
+  // longitude by 0.011 of latitude.
+  static const int TILE_ZOOM = 14;
+
   explicit map_handler(request &req);
-  map_handler(request &req, int tile_id);
+  map_handler(request &req, osm_nwr_id_t tile_id);
   ~map_handler();
   std::string log_name() const;
   responder_ptr_t responder(factory_ptr &x) const;
+  bool response_cacheable() const;
+
+  // the area covered by a tile, throwing bad_request if there's no such
+  // tile.
+  static bbox tile_bounds(osm_nwr_id_t tile_id);
 
 private:
   bbox bounds;
+  boost::optional<osm_nwr_id_t> tile;
 
   static bbox validate_request(request &req);
 };
@@ -27,6 +27,10 @@ struct backend {
   // create an oauth store based on arguments.
   virtual boost::shared_ptr<oauth::store>
   create_oauth_store(const boost::program_options::variables_map &) = 0;
+  // set up anything which all the instances of cgimap should share, such
+  // as shared memory. this is called once, before any instances are forked.
+  // the default does nothing.
+  virtual void setup_shared(const boost::program_options::variables_map &);
 };
 
 // figures out which backend should be selected and adds its options to the
@@ -43,6 +47,10 @@ create_backend(const boost::program_options::variables_map &);
 boost::shared_ptr<oauth::store>
 create_oauth_store(const boost::program_options::variables_map &);
 
+// singleton call to set up whatever the backend selected by the options
+// shares between instances. must be called before forking.
+void setup_backend_shared(const boost::program_options::variables_map &);
+
 // this function registers a backend for use when creating backends
 // from user-provided options.
 bool register_backend(boost::shared_ptr<backend>);
@@ -2,7 +2,9 @@
 #define CHANGESET_HPP
 
 #include "cgimap/types.hpp"
+#include "cgimap/cache.hpp"
 #include <string>
+#include <vector>
 #include <pqxx/pqxx>
 
 /**
@@ -18,6 +20,39 @@ struct changeset {
   changeset(bool dp, const std::string &dn, osm_user_id_t id);
 };
 
+// changesets are charged for their display name too, for the cache's limit
+// on its size in bytes.
+inline size_t cache_object_size(const changeset &c) {
+  return sizeof(changeset) + c.display_name.capacity();
+}
+
+// the size in bytes of the changeset cache to use for the --cache-bytes and
+// --cachesize options. an explicit size in bytes is used if it's non-zero,
+// otherwise it's about what cachesize changesets would take up.
+size_t changeset_cache_bytes(size_t cache_bytes, size_t cachesize);
+
 changeset *fetch_changeset(pqxx::transaction_base &w, osm_changeset_id_t id);
 
+// prepare the statement used by fetch_changesets on the cache connection.
+void prepare_changeset_statements(pqxx::connection_base &conn);
+
+// fetch the user records for a batch of changesets with a single query,
+// for cache::prefetch.
+void fetch_changesets(pqxx::transaction_base &w,
+                      const std::vector<osm_changeset_id_t> &ids,
+                      cache<osm_changeset_id_t, changeset>::batch_type &out);
+
+class memcached_changeset_cache;
+
+// as fetch_changeset and fetch_changesets, but looking in the shared
+// changeset cache first, if there is one, then in memcache, if memcache
+// isn't NULL, and adding anything fetched from the database to both.
+changeset *fetch_changeset_shared(pqxx::transaction_base &w,
+                                  memcached_changeset_cache *memcache,
+                                  osm_changeset_id_t id);
+void fetch_changesets_shared(
+    pqxx::transaction_base &w, memcached_changeset_cache *memcache,
+    const std::vector<osm_changeset_id_t> &ids,
+    cache<osm_changeset_id_t, changeset>::batch_type &out);
+
 #endif /* CHANGESET_HPP */
@@ -0,0 +1,103 @@
+#ifndef BACKEND_APIDB_EXISTENCE_FILTER_HPP
+#define BACKEND_APIDB_EXISTENCE_FILTER_HPP
+
+#include "cgimap/types.hpp"
+#include "cgimap/output_formatter.hpp"
+#include <vector>
+#include <stdint.h>
+#include <pqxx/pqxx>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/program_options.hpp>
+
+/**
+ * answers requests for nodes, ways and relations which have never been
+ * created without going to the database, as crawlers and broken clients
+ * ask for a lot of them.
+ *
+ * IDs are handed out in order, and elements are never removed from the
+ * current_* tables, only marked as not visible, so everything which has
+ * ever been created has an ID no higher than the highest in its table.
+ * that makes the highest IDs, reloaded every so often, an exact and tiny
+ * filter where a bloom filter over billions of IDs would be neither.
+ *
+ * elements created since the last reload have higher IDs, so before
+ * answering that an ID above the highest can't exist, the highest IDs are
+ * reloaded, at most once every recheck interval. IDs up to the highest
+ * plus some slack go straight to the database without that reload, so
+ * that the elements created since the last one don't each cause a
+ * reload. the slack is twice what the highest ID grew by over the last
+ * reload interval, or the configured minimum if that's more.
+ */
+class existence_filter : public boost::noncopyable {
+public:
+  struct max_ids {
+    osm_nwr_id_t node, way, relation;
+  };
+  typedef boost::function<max_ids()> fetch_function;
+
+  struct stats {
+    // number of reloads, and how many of them failed.
+    uint64_t refreshes, failures;
+    // number of reloads made before answering a lookup.
+    uint64_t rechecks;
+    // number of lookups answered without going to the database.
+    uint64_t filtered;
+    // how long the last reload took, and the memory the filter uses.
+    boost::posix_time::time_duration last_refresh_time;
+    size_t bytes;
+  };
+
+  existence_filter(const fetch_function &fetch,
+                   const boost::posix_time::time_duration &interval,
+                   const boost::posix_time::time_duration &recheck,
+                   osm_nwr_id_t min_slack);
+
+  // reload the highest IDs if they're more than the interval old. if the
+  // reload fails, the filter lets everything through until one succeeds.
+  // the time is also the one lookups use to decide whether to recheck.
+  void refresh(const boost::posix_time::ptime &now);
+
+  // false if no element of the type with the ID can exist.
+  bool can_exist(element_type type, osm_nwr_id_t id);
+
+  // false if none of the elements of the type with the IDs can exist.
+  bool any_can_exist(element_type type, const std::vector<osm_nwr_id_t> &ids);
+
+  stats get_stats() const;
+
+  // creates the filter from the apidb backend's options, fetching the
+  // highest IDs on the given transaction, or returns NULL if it isn't
+  // configured.
+  static existence_filter *
+  create(const boost::program_options::variables_map &opts,
+         pqxx::transaction_base &w);
+
+private:
+  // the highest ID which might exist for the type, including the slack.
+  osm_nwr_id_t limit(element_type type) const;
+
+  // true if no element of the type with the ID can exist, reloading the
+  // highest IDs first if the ID is above them and they might be stale.
+  bool filter_out(element_type type, osm_nwr_id_t id);
+
+  // fetches the highest IDs, or switches the filter off and returns false
+  // if that fails.
+  bool fetch(max_ids &ids);
+
+  fetch_function m_fetch;
+  boost::posix_time::time_duration m_interval, m_recheck;
+  osm_nwr_id_t m_min_slack;
+
+  bool m_loaded;
+  // the time given to the last refresh, when the highest IDs were last
+  // fetched, by a reload or a recheck, and when the last reload was.
+  boost::posix_time::ptime m_now, m_checked_at, m_loaded_at;
+  // the highest IDs as of the last fetch, and as of the last reload,
+  // which the slack is worked out from.
+  max_ids m_max, m_loaded_max, m_slack;
+  stats m_stats;
+};
+
+#endif /* BACKEND_APIDB_EXISTENCE_FILTER_HPP */
@@ -0,0 +1,104 @@
+#ifndef BACKEND_APIDB_ID_SET_HPP
+#define BACKEND_APIDB_ID_SET_HPP
+
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <cstddef>
+
+/**
+ * a set of element IDs, stored as a sorted vector rather than a tree.
+ *
+ * IDs are mostly added in batches of query results, so rather than paying
+ * for an allocation and rebalance per ID (as with std::set), each batch is
+ * sorted and de-duplicated on its own, then merged into the existing IDs in
+ * one pass. iterating, and chunking the IDs up for sending back to the
+ * database, is then a walk over contiguous memory.
+ *
+ * note that each merge is linear in the size of the set, so this works best
+ * with a few large batches (e.g: one per query) rather than many small ones.
+ */
+template <typename T>
+class id_set {
+public:
+  typedef T value_type;
+  typedef typename std::vector<T>::const_iterator const_iterator;
+  typedef const_iterator iterator;
+  typedef typename std::vector<T>::size_type size_type;
+
+  const_iterator begin() const { return m_ids.begin(); }
+  const_iterator end() const { return m_ids.end(); }
+  size_type size() const { return m_ids.size(); }
+  bool empty() const { return m_ids.empty(); }
+  void clear() { m_ids.clear(); }
+
+  bool count(T id) const {
+    return std::binary_search(m_ids.begin(), m_ids.end(), id);
+  }
+
+  // insert a single ID, returning true if it wasn't already in the set.
+  // this is a linear operation, so prefer the batch insert if there are
+  // more than a few IDs to add.
+  bool insert(T id) {
+    typename std::vector<T>::iterator itr =
+        std::lower_bound(m_ids.begin(), m_ids.end(), id);
+    if ((itr != m_ids.end()) && (*itr == id)) {
+      return false;
+    }
+    m_ids.insert(itr, id);
+    return true;
+  }
+
+  // insert a batch of IDs, which may be in any order and contain
+  // duplicates. returns the number of IDs which weren't already in the
+  // set.
+  template <typename InputIterator>
+  size_type insert(InputIterator first, InputIterator last) {
+    std::vector<T> batch(first, last);
+    return insert_batch(batch);
+  }
+
+  // as above, but the batch is sorted in place, saving a copy.
+  size_type insert_batch(std::vector<T> &batch) {
+    std::sort(batch.begin(), batch.end());
+    batch.erase(std::unique(batch.begin(), batch.end()), batch.end());
+
+    // the common case when filling the set for the first time.
+    if (m_ids.empty()) {
+      m_ids.swap(batch);
+      return m_ids.size();
+    }
+
+    // find the IDs which are actually new, and append them. both ranges
+    // are sorted, so merging them in place keeps the whole set sorted. the
+    // reserve means appending can't invalidate the iterators being read.
+    const size_type old_size = m_ids.size();
+    m_ids.reserve(old_size + batch.size());
+    std::set_difference(batch.begin(), batch.end(), m_ids.begin(),
+                        m_ids.begin() + old_size, std::back_inserter(m_ids));
+    std::inplace_merge(m_ids.begin(), m_ids.begin() + old_size, m_ids.end());
+
+    return m_ids.size() - old_size;
+  }
+
+  // remove a batch of IDs, which may be in any order and contain
+  // duplicates. the batch is sorted in place. returns the number of IDs
+  // which were in the set.
+  size_type erase_batch(std::vector<T> &batch) {
+    std::sort(batch.begin(), batch.end());
+    batch.erase(std::unique(batch.begin(), batch.end()), batch.end());
+
+    std::vector<T> remaining;
+    remaining.reserve(m_ids.size());
+    std::set_difference(m_ids.begin(), m_ids.end(), batch.begin(),
+                        batch.end(), std::back_inserter(remaining));
+    const size_type erased = m_ids.size() - remaining.size();
+    m_ids.swap(remaining);
+    return erased;
+  }
+
+private:
+  std::vector<T> m_ids;
+};
+
+#endif /* BACKEND_APIDB_ID_SET_HPP */
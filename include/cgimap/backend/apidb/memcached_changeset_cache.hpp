@@ -0,0 +1,84 @@
+#ifndef BACKEND_APIDB_MEMCACHED_CHANGESET_CACHE_HPP
+#define BACKEND_APIDB_MEMCACHED_CHANGESET_CACHE_HPP
+
+#include "cgimap/types.hpp"
+#include "cgimap/cache.hpp"
+#include "cgimap/backend/apidb/changeset.hpp"
+#include <ctime>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <libmemcached/memcached.h>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/program_options.hpp>
+
+/**
+ * a cache of the user information for changesets in memcached, so that all
+ * the cgimap hosts running against the same database share what any of
+ * them have fetched. it's meant to sit between the per-host caches and the
+ * database, so that after a rolling restart the hosts fill their caches
+ * from memcached rather than all asking the database for the same popular
+ * changesets.
+ *
+ * entries are written with a TTL, as a user's display name or
+ * data_public can change and nothing tells the cache about it. keys start
+ * with a configurable prefix followed by the version of the format of the
+ * values, so that either can be changed to move to a fresh set of keys.
+ *
+ * anything which goes wrong talking to memcached is treated as a miss:
+ * it's only a cache, and the database is always there to fall back to.
+ */
+class memcached_changeset_cache : public boost::noncopyable {
+public:
+  typedef boost::function<changeset *(osm_changeset_id_t)> fetch_function;
+  typedef boost::function<void(const std::vector<osm_changeset_id_t> &,
+                               cache<osm_changeset_id_t, changeset>::batch_type
+                                   &)> batch_fetch_function;
+
+  struct stats {
+    uint64_t hits, misses, errors;
+  };
+
+  // connect to the memcached servers, given as for memcached_servers_parse,
+  // e.g: "host1:11211,host2:11211".
+  memcached_changeset_cache(const std::string &servers,
+                            const std::string &prefix, time_t ttl);
+  ~memcached_changeset_cache();
+
+  // get a changeset from memcached, or use fetch to get it and add it to
+  // memcached if it isn't there. returns a newly allocated changeset.
+  changeset *get_or_fetch(osm_changeset_id_t id, const fetch_function &fetch);
+
+  // as get_or_fetch, for a batch of changesets, which are looked up in
+  // memcached a chunk at a time and the missing ones fetched together.
+  void get_or_fetch(const std::vector<osm_changeset_id_t> &ids,
+                    cache<osm_changeset_id_t, changeset>::batch_type &out,
+                    const batch_fetch_function &fetch);
+
+  // counters for this process only.
+  stats get_stats() const;
+
+  // the key used for a changeset.
+  std::string key(osm_changeset_id_t id) const;
+
+  // the value stored for a changeset, and the changeset it decodes to, or
+  // NULL if the value is malformed.
+  static std::string encode(const changeset &c);
+  static changeset *decode(const char *data, size_t length);
+
+  // creates the cache from the apidb backend's options, or returns NULL if
+  // it isn't configured.
+  static memcached_changeset_cache *
+  create(const boost::program_options::variables_map &opts);
+
+private:
+  void put(osm_changeset_id_t id, const changeset &c);
+
+  memcached_st *m_memc;
+  std::string m_prefix;
+  time_t m_ttl;
+  stats m_stats;
+};
+
+#endif /* BACKEND_APIDB_MEMCACHED_CHANGESET_CACHE_HPP */
@@ -0,0 +1,62 @@
+#ifndef BACKEND_APIDB_NODE_DENSITY_HPP
+#define BACKEND_APIDB_NODE_DENSITY_HPP
+
+#include "cgimap/bbox.hpp"
+#include "cgimap/types.hpp"
+#include <utility>
+#include <vector>
+#include <stdint.h>
+#include <pqxx/pqxx>
+#include <boost/noncopyable.hpp>
+#include <boost/program_options.hpp>
+
+/**
+ * turns away map calls for areas with too many nodes without scanning
+ * current_nodes, using counts of the nodes in each cell of a coarse grid
+ * loaded at startup from the node_density table. that is kept up to date
+ * by running scripts/update_node_density.sql every so often.
+ *
+ * only cells wholly inside the bbox are counted, so the total is a lower
+ * bound on the nodes in it, as of the last update. nodes deleted since
+ * then would make it too high, so bboxes are only turned away when the
+ * total is well over the limit. anything nearer the limit, or not covered
+ * by the counts, goes to the database as before.
+ */
+class node_density : public boost::noncopyable {
+public:
+  // the cells are tiles at this zoom, about 0.18 by 0.09 degrees.
+  static const int ZOOM = 11;
+
+  // pairs of cell number and number of nodes in the cell.
+  typedef std::vector<std::pair<tile_id_t, uint64_t> > counts_t;
+
+  struct stats {
+    // the number of cells loaded and the memory they use.
+    size_t cells, bytes;
+    // number of bboxes turned away without a query.
+    uint64_t rejected;
+  };
+
+  explicit node_density(const counts_t &counts);
+
+  // the number of nodes in cells wholly inside the bbox.
+  uint64_t min_nodes(const bbox &bounds) const;
+
+  // true if the bbox has well over max_nodes nodes in it.
+  bool too_many_nodes(const bbox &bounds, int max_nodes);
+
+  stats get_stats() const;
+
+  // loads the counts on the given transaction if the apidb backend's
+  // options ask for them, or returns NULL if not, or if they can't be
+  // loaded.
+  static node_density *
+  create(const boost::program_options::variables_map &opts,
+         pqxx::transaction_base &w);
+
+private:
+  counts_t m_counts;
+  stats m_stats;
+};
+
+#endif /* BACKEND_APIDB_NODE_DENSITY_HPP */
@@ -0,0 +1,118 @@
+#ifndef BACKEND_APIDB_PGSQL_COPY_HPP
+#define BACKEND_APIDB_PGSQL_COPY_HPP
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/noncopyable.hpp>
+#include <pqxx/pqxx>
+#include <libpq-fe.h>
+
+/**
+ * a libpqxx connection which also keeps hold of its underlying libpq
+ * connection handle. libpqxx doesn't have a way to read binary COPY output,
+ * so that has to be done with libpq directly, but it needs to be on the same
+ * session (and in the same transaction) as the rest of the selection.
+ *
+ * this is put together in the same way as pqxx::basic_connection, but with
+ * a connection policy which records the handle whenever it (re)connects.
+ */
+class copy_connection : public pqxx::connection_base {
+public:
+  explicit copy_connection(const std::string &opts);
+  ~copy_connection() throw();
+
+  // the libpq connection handle, or NULL if not currently connected.
+  PGconn *handle() const;
+
+private:
+  struct policy : public pqxx::connect_direct {
+    explicit policy(const std::string &opts);
+    virtual handle do_startconnect(handle orig);
+    virtual handle do_completeconnect(handle orig);
+    virtual handle do_dropconnect(handle orig) throw();
+    virtual handle do_disconnect(handle orig) throw();
+    handle m_handle;
+  };
+
+  // note that the options must be initialised before the policy, which is
+  // handed to the base class before either of them are.
+  std::string m_options;
+  policy m_policy;
+};
+
+/**
+ * parses the messages of a binary format COPY. each message holds a single
+ * tuple, or the end-of-data trailer, and the first message is also preceded
+ * by the file header. see the "Binary Format" section of the Postgres COPY
+ * documentation for details.
+ *
+ * fields are read straight out of the message buffer, which must stay alive
+ * until the next call to parse.
+ */
+class pgsql_copy_parser {
+public:
+  pgsql_copy_parser();
+
+  // parse a message, returning true if it contained a tuple and false if it
+  // was the end-of-data trailer. throws if the message is malformed.
+  bool parse(const char *data, size_t len);
+
+  size_t num_fields() const;
+  bool is_null(size_t i) const;
+
+  // accessors for the binary send format of bigint, integer, boolean and
+  // text-like (text, varchar, enum) columns. the size of the field must
+  // match the type asked for, or an exception is thrown.
+  int64_t get_int64(size_t i) const;
+  int32_t get_int32(size_t i) const;
+  bool get_bool(size_t i) const;
+  std::string get_string(size_t i) const;
+
+private:
+  const char *field(size_t i, int32_t expected_len) const;
+
+  bool m_seen_header;
+  const char *m_data;
+  // offset and length of each field, with a length of -1 meaning null.
+  std::vector<std::pair<size_t, int32_t> > m_fields;
+};
+
+/**
+ * runs "COPY (query) TO STDOUT (FORMAT binary)" on a connection and reads
+ * the rows as they arrive. on construction the reader is positioned at the
+ * first row, if there is one.
+ *
+ * nothing else can be run on the connection until the reader has reached
+ * the end or been destroyed.
+ */
+class pgsql_copy_reader : public boost::noncopyable {
+public:
+  pgsql_copy_reader(PGconn *conn, const std::string &query);
+  ~pgsql_copy_reader();
+
+  // true if there are no more rows to read.
+  bool done() const;
+
+  // move on to the next row.
+  void next();
+
+  size_t num_fields() const { return m_parser.num_fields(); }
+  bool is_null(size_t i) const { return m_parser.is_null(i); }
+  int64_t get_int64(size_t i) const { return m_parser.get_int64(i); }
+  int32_t get_int32(size_t i) const { return m_parser.get_int32(i); }
+  bool get_bool(size_t i) const { return m_parser.get_bool(i); }
+  std::string get_string(size_t i) const { return m_parser.get_string(i); }
+
+private:
+  // read anything left of the COPY, and the final result. returns the
+  // error message, if there was one.
+  std::string finish();
+
+  PGconn *m_conn;
+  char *m_buffer;
+  bool m_done;
+  pgsql_copy_parser m_parser;
+};
+
+#endif /* BACKEND_APIDB_PGSQL_COPY_HPP */
@@ -0,0 +1,65 @@
+#ifndef BACKEND_APIDB_PQXX_BINARY_ARRAY_HPP
+#define BACKEND_APIDB_PQXX_BINARY_ARRAY_HPP
+
+#include <string>
+#include <stdint.h>
+#include <pqxx/pqxx>
+
+/*
+ * packs a container of IDs into Postgres' binary wire format for a one-
+ * dimensional bigint[] array, so that it can be passed to a prepared
+ * statement as a binary parameter. this avoids formatting the IDs as text
+ * on our side, and parsing them again on the server, which adds up for the
+ * large arrays of IDs passed around in the map call.
+ *
+ * the elements are always sent as int8, so the parameter must be inferred
+ * as bigint[] by the server (e.g: "id = ANY($1)" on a bigint column), or
+ * the server will reject the array as having the wrong element type.
+ */
+namespace pqxx_binary_array {
+
+// OID of the int8 (bigint) type, as in the server's pg_type.h
+const uint32_t INT8_OID = 20;
+
+inline void append_uint32(std::string &buf, uint32_t i) {
+  buf.push_back(char((i >> 24) & 0xff));
+  buf.push_back(char((i >> 16) & 0xff));
+  buf.push_back(char((i >> 8) & 0xff));
+  buf.push_back(char(i & 0xff));
+}
+
+inline void append_uint64(std::string &buf, uint64_t i) {
+  append_uint32(buf, uint32_t(i >> 32));
+  append_uint32(buf, uint32_t(i & 0xffffffff));
+}
+
+} // namespace pqxx_binary_array
+
+template <typename T>
+pqxx::binarystring to_binary_array(const T &ids) {
+  using namespace pqxx_binary_array;
+
+  std::string buf;
+  buf.reserve(20 + 12 * ids.size());
+
+  // header: number of dimensions, "has nulls" flag and the element type,
+  // followed by the size and lower bound of the one dimension. an empty
+  // array has zero dimensions.
+  append_uint32(buf, ids.empty() ? 0 : 1);
+  append_uint32(buf, 0);
+  append_uint32(buf, INT8_OID);
+  if (!ids.empty()) {
+    append_uint32(buf, uint32_t(ids.size()));
+    append_uint32(buf, 1);
+  }
+
+  // each element is its length in bytes, then the big-endian value.
+  for (typename T::const_iterator itr = ids.begin(); itr != ids.end(); ++itr) {
+    append_uint32(buf, 8);
+    append_uint64(buf, uint64_t(int64_t(*itr)));
+  }
+
+  return pqxx::binarystring(buf.data(), buf.size());
+}
+
+#endif /* BACKEND_APIDB_PQXX_BINARY_ARRAY_HPP */
@@ -3,6 +3,7 @@
 
 #include "cgimap/types.hpp"
 #include "cgimap/infix_ostream_iterator.hpp"
+#include "cgimap/backend/apidb/id_set.hpp"
 #include <vector>
 #include <set>
 #include <sstream>
@@ -46,6 +47,8 @@ PQXX_ARRAY_STRING_TRAITS(std::set<osm_nwr_id_t>);
 PQXX_ARRAY_STRING_TRAITS(std::vector<tile_id_t>);
 PQXX_ARRAY_STRING_TRAITS(std::vector<osm_changeset_id_t>);
 PQXX_ARRAY_STRING_TRAITS(std::set<osm_changeset_id_t>);
+PQXX_ARRAY_STRING_TRAITS(id_set<osm_nwr_id_t>);
+PQXX_ARRAY_STRING_TRAITS(id_set<osm_changeset_id_t>);
 
 } // namespace pqxx
 
@@ -1,10 +1,54 @@
 #ifndef QUAD_TILE_HPP
 #define QUAD_TILE_HPP
 
+#include <cstddef>
+#include <utility>
 #include <vector>
 #include "cgimap/types.hpp"
 
+// an inclusive range of tile numbers.
+typedef std::pair<tile_id_t, tile_id_t> tile_range_t;
+
+// the most ranges a bbox is split into for the node query by default.
+const size_t DEFAULT_MAX_TILE_RANGES = 64;
+
 std::vector<tile_id_t> tiles_for_area(double minlat, double minlon, double maxlat,
                                       double maxlon);
 
+/**
+ * the tiles covering the area, as a sorted list of non-overlapping ranges
+ * of tile numbers rather than each tile on its own.
+ *
+ * tile numbers interleave the bits of the x and y coordinates, so they run
+ * along a Z-order curve, and any square block of tiles aligned to a power
+ * of two is one contiguous range. the area is split into the largest such
+ * blocks which fit inside it, and neighbouring blocks are joined up, which
+ * leaves a number of ranges roughly proportional to the perimeter of the
+ * area rather than the number of tiles in it.
+ *
+ * if that's still more than max_ranges then the smallest gaps between
+ * ranges are filled in until it isn't. the result then covers some tiles
+ * outside the area, which is fine as long as whatever uses it still checks
+ * the latitude and longitude.
+ */
+std::vector<tile_range_t> tile_ranges_for_area(
+    double minlat, double minlon, double maxlat, double maxlon,
+    size_t max_ranges = DEFAULT_MAX_TILE_RANGES);
+
+/**
+ * the cells of a coarser grid which are wholly inside the area, where a
+ * cell at zoom (between 0 and 16) is the tile number shifted down by
+ * 2 * (16 - zoom) bits. tiles on the edge of the area can have nodes just
+ * outside it, so cells including them aren't counted as inside.
+ */
+std::vector<tile_id_t> cells_inside_area(double minlat, double minlon,
+                                         double maxlat, double maxlon,
+                                         int zoom);
+
+// split ranges into separate lists of their first and last tiles, as they
+// are passed to the database as a pair of arrays.
+void split_tile_ranges(const std::vector<tile_range_t> &ranges,
+                       std::vector<tile_id_t> &first_tiles,
+                       std::vector<tile_id_t> &last_tiles);
+
 #endif /* QUAD_TILE_HPP */
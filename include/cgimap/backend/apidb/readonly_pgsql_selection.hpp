@@ -3,10 +3,17 @@
 
 #include "cgimap/data_selection.hpp"
 #include "cgimap/backend/apidb/changeset.hpp"
-#include "cgimap/backend/apidb/cache.hpp"
+#include "cgimap/cache.hpp"
+#include "cgimap/backend/apidb/existence_filter.hpp"
+#include "cgimap/backend/apidb/node_density.hpp"
+#include "cgimap/backend/apidb/memcached_changeset_cache.hpp"
+#include "cgimap/backend/apidb/id_set.hpp"
+#include "cgimap/backend/apidb/pgsql_copy.hpp"
 #include <pqxx/pqxx>
 #include <boost/program_options.hpp>
-#include <set>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <map>
 
 /**
  * a selection which operates against a readonly (e.g: replicating
@@ -17,8 +24,15 @@
  */
 class readonly_pgsql_selection : public data_selection {
 public:
-  readonly_pgsql_selection(pqxx::connection &conn,
-                           cache<osm_changeset_id_t, changeset> &changeset_cache);
+  typedef std::vector<boost::shared_ptr<copy_connection> > connections_t;
+
+  readonly_pgsql_selection(pqxx::connection_base &conn,
+                           cache<osm_changeset_id_t, changeset> &changeset_cache,
+                           bool binary_arrays = false,
+                           PGconn *copy_handle = NULL,
+                           const connections_t &helpers = connections_t(),
+                           existence_filter *filter = NULL,
+                           node_density *density = NULL);
   ~readonly_pgsql_selection();
 
   void write_nodes(output_formatter &formatter);
@@ -42,10 +56,15 @@ public:
   void select_relations_from_nodes();
   void select_relations_from_relations();
   void select_relations_members_of_relations();
+  void select_plan(const selection_plan &plan);
 
   bool supports_changesets();
   int select_changesets(const std::vector<osm_changeset_id_t> &);
   void select_changeset_discussions();
+  void omit_metadata();
+
+  bool selected_versions(element_type type, id_versions_t &out);
+  void deselect(element_type type, const std::vector<osm_nwr_id_t> &ids);
 
   /**
    * a factory for the creation of read-only selections, so it
@@ -58,15 +77,33 @@ public:
     virtual boost::shared_ptr<data_selection> make_selection();
 
   private:
-    pqxx::connection m_connection, m_cache_connection;
+    // open the helper connections for fetching in parallel, if any.
+    void create_helpers(const boost::program_options::variables_map &);
+
+    copy_connection m_connection;
+    pqxx::connection m_cache_connection;
 #if PQXX_VERSION_MAJOR >= 4
     pqxx::quiet_errorhandler m_errorhandler, m_cache_errorhandler;
 #endif
     pqxx::nontransaction m_cache_tx;
+    boost::scoped_ptr<existence_filter> m_existence;
+    boost::scoped_ptr<node_density> m_density;
+    boost::scoped_ptr<memcached_changeset_cache> m_memcache;
     cache<osm_changeset_id_t, changeset> m_cache;
+    bool m_binary_arrays, m_copy_extract;
+    connections_t m_helper_connections;
+#if PQXX_VERSION_MAJOR >= 4
+    std::vector<boost::shared_ptr<pqxx::quiet_errorhandler> >
+        m_helper_errorhandlers;
+#endif
   };
 
 private:
+  // execute a prepared statement which takes an array of IDs as its only
+  // parameter, in either text or binary format.
+  template <typename T>
+  pqxx::result exec_ids(const std::string &name, const T &ids);
+
   // the transaction in which the selection takes place. this is
   // fully read-only, and cannot create any temporary tables,
   // unlike writeable_pgsql_selection.
@@ -76,10 +113,131 @@ private:
   // the changesets themselves. defaults to false.
   bool include_changeset_discussions;
 
+  // false if the elements are written without their changeset and user,
+  // in which case the changesets aren't looked up. defaults to true.
+  bool include_metadata;
+
+  // the changeset cache to fill in the elements' users from, or NULL if
+  // they're written without.
+  cache<osm_changeset_id_t, changeset> *user_cache();
+
+  // true if arrays of IDs should be sent to the database in binary
+  // rather than text format.
+  bool binary_arrays;
+
+  // if not null, the elements are extracted using binary COPY on this
+  // connection, which must be the one the transaction is on.
+  PGconn *copy_handle;
+
+  // extra connections on which the ways and relations are fetched while
+  // the nodes are being written out. the transactions on them share this
+  // transaction's snapshot, so see exactly the same data. note that the
+  // pipelines must be destroyed before the transactions they're on.
+  connections_t helpers;
+  std::vector<boost::shared_ptr<pqxx::work> > helper_txs;
+  std::vector<boost::shared_ptr<pqxx::pipeline> > helper_pipelines;
+
+  // the queries sent to a helper for one chunk of ways or relations.
+  struct prefetch_chunk {
+    std::vector<osm_nwr_id_t> ids;
+    size_t helper;
+    bool has_rows;
+    pqxx::pipeline::query_id rows, children, tags;
+  };
+  std::vector<prefetch_chunk> way_prefetch, relation_prefetch;
+
   // the set of selected nodes, ways and relations
-  std::set<osm_changeset_id_t> sel_changesets;
-  std::set<osm_nwr_id_t> sel_nodes, sel_ways, sel_relations;
+  id_set<osm_changeset_id_t> sel_changesets;
+  id_set<osm_nwr_id_t> sel_nodes, sel_ways, sel_relations;
+
+  // the element columns returned by the select queries. these are kept so
+  // that the write phase doesn't need to go back to the current_* tables
+  // for rows which have already been seen. lon/lat are only used for nodes.
+  struct element_row {
+    element_info info;
+    double lon, lat;
+  };
+  typedef std::map<osm_nwr_id_t, element_row> element_rows_t;
+  element_rows_t node_rows, way_rows, relation_rows;
+
+  // child rows (tags, way nodes or members) for a chunk of elements, as
+  // pairs of the parent element's ID and the child, sorted by parent ID.
+  typedef std::vector<std::pair<osm_nwr_id_t, tags_t::value_type> >
+      tag_rows_t;
+  typedef std::vector<std::pair<osm_nwr_id_t, nodes_t::value_type> >
+      way_node_rows_t;
+  typedef std::vector<std::pair<osm_nwr_id_t, members_t::value_type> >
+      member_rows_t;
+
+  // the selected IDs and kept rows for a type of element.
+  id_set<osm_nwr_id_t> &selected(element_type type);
+  element_rows_t &rows_for(element_type type);
+
+  // made-up versions of the selected changesets, for selected_versions().
+  bool selected_changeset_versions(id_versions_t &out);
+
+  // fetch the element rows, tags, way nodes and members for a chunk of
+  // elements, using either the prepared statements or binary COPY.
+  void fetch_rows(element_type type, const std::vector<osm_nwr_id_t> &ids);
+  void fetch_tags(element_type type, const std::vector<osm_nwr_id_t> &ids,
+                  tag_rows_t &rows);
+  void fetch_way_nodes(const std::vector<osm_nwr_id_t> &ids,
+                       way_node_rows_t &rows);
+  void fetch_members(const std::vector<osm_nwr_id_t> &ids,
+                     member_rows_t &rows);
+
+  // the select_*_from_* calls aren't run straight away, but are queued
+  // until something needs their results. any which don't depend on each
+  // other can then be sent to the database together, sharing a round trip.
+  struct pending_select {
+    std::string name;
+    std::vector<osm_nwr_id_t> ids;
+    id_set<osm_nwr_id_t> *to;
+    element_rows_t *rows;
+    bool with_location;
+  };
+  std::vector<pending_select> pending_selects;
+
+  // queue the prepared statement to add the results of selecting from the
+  // "from" set to the "to" set.
+  void queue_select(const std::string &name, const id_set<osm_nwr_id_t> &from,
+                    id_set<osm_nwr_id_t> &to, element_rows_t &rows,
+                    bool with_location);
+
+  // run all the queued selects.
+  void flush_selects();
+
+  // if there are helper connections, send them the queries for all the
+  // selected ways and relations. this only happens once per selection.
+  void start_prefetch();
+
+  // queue the queries for all the elements in sel on the helpers, using
+  // the prepared statements named for fetching the rows, child rows (way
+  // nodes or members) and tags.
+  void queue_prefetch(const id_set<osm_nwr_id_t> &sel,
+                      const element_rows_t &rows,
+                      const std::string &rows_name,
+                      const std::string &children_name,
+                      const std::string &tags_name,
+                      std::vector<prefetch_chunk> &chunks);
+
+  // read any results which have arrived on the helper connections, so that
+  // the servers don't stall waiting for them to be read.
+  void poll_prefetch();
+
+  // find the prefetched chunk for the given IDs, or NULL if there isn't one.
+  const prefetch_chunk *
+  find_prefetch(const std::vector<prefetch_chunk> &chunks, size_t chunk_num,
+                const std::vector<osm_nwr_id_t> &ids) const;
+
   cache<osm_changeset_id_t, changeset> &cc;
+
+  // if not null, used to skip queries for elements which can't exist.
+  existence_filter *filter;
+
+  // if not null, used to turn away bboxes with too many nodes without a
+  // query.
+  node_density *density;
 };
 
 #endif /* READONLY_PGSQL_SELECTION_HPP */
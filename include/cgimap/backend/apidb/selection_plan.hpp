@@ -0,0 +1,37 @@
+#ifndef BACKEND_APIDB_SELECTION_PLAN_HPP
+#define BACKEND_APIDB_SELECTION_PLAN_HPP
+
+#include "cgimap/data_selection.hpp"
+#include <string>
+
+/**
+ * the SQL for running all the steps of a selection plan in a single query,
+ * as a chain of common table expressions. each step is a CTE holding the
+ * full set of IDs of one element type after that step has run, built from
+ * the sets of the steps before it.
+ *
+ * the sets start from the "seed" queries, which must each return a single
+ * "id" column, e.g: the IDs already selected.
+ */
+struct plan_ctes {
+  // the "WITH ..." clause, to be followed by the statement which uses the
+  // final sets.
+  std::string with;
+
+  // the names of the CTEs holding the seed and final sets of node, way and
+  // relation IDs. if a plan has no steps adding to an element type then
+  // its final set is the seed set.
+  std::string seed_nodes, seed_ways, seed_relations;
+  std::string nodes, ways, relations;
+};
+
+plan_ctes compile_selection_plan(const data_selection::selection_plan &plan,
+                                 const std::string &seed_nodes,
+                                 const std::string &seed_ways,
+                                 const std::string &seed_relations);
+
+// a name for the plan which is the same for all plans with the same steps,
+// and so can be used to name a prepared statement for it.
+std::string selection_plan_name(const data_selection::selection_plan &plan);
+
+#endif /* BACKEND_APIDB_SELECTION_PLAN_HPP */
@@ -0,0 +1,82 @@
+#ifndef BACKEND_APIDB_SHARED_CHANGESET_CACHE_HPP
+#define BACKEND_APIDB_SHARED_CHANGESET_CACHE_HPP
+
+#include "cgimap/types.hpp"
+#include "cgimap/backend/apidb/changeset.hpp"
+#include <vector>
+#include <stdint.h>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+
+/**
+ * a cache of the user information for changesets, held in a shared memory
+ * segment so that all the forked instances of cgimap share the same hits,
+ * and the memory is paid for once rather than once per instance. it has to
+ * be created in the parent process, before the instances are forked.
+ *
+ * the cache is a fixed-size, open-addressed table. readers don't take any
+ * locks: each slot has a sequence number, which a writer makes odd while
+ * it's changing the slot, so a reader can tell if what it copied out was
+ * torn and treat that as a miss. writers claim a slot by making the
+ * sequence number odd, and simply give up on inserting if another process
+ * is writing the same slot. this is only a cache, so losing an insert now
+ * and again doesn't matter.
+ *
+ * it sits underneath the per-process cache<>, which still hands out the
+ * shared_ptrs that the selections use, but can be much smaller.
+ */
+class shared_changeset_cache : public boost::noncopyable {
+public:
+  typedef boost::function<changeset *(osm_changeset_id_t)> fetch_function;
+  typedef boost::function<void(const std::vector<osm_changeset_id_t> &,
+                               cache<osm_changeset_id_t, changeset>::batch_type
+                                   &)> batch_fetch_function;
+
+  struct stats {
+    uint64_t hits, misses, inserts, evictions;
+    // the number of slots, and the size of the whole segment in bytes.
+    size_t capacity, bytes;
+  };
+
+  // map a shared segment with room for at least num_entries changesets.
+  explicit shared_changeset_cache(size_t num_entries);
+  ~shared_changeset_cache();
+
+  // returns a newly allocated copy of the changeset's user information, or
+  // NULL if it isn't in the cache.
+  changeset *get(osm_changeset_id_t id);
+
+  // add a changeset to the cache, evicting the oldest entry nearby if
+  // there's no room. display names too long for a slot aren't cached.
+  void put(osm_changeset_id_t id, const changeset &c);
+
+  // get a changeset from the cache, or use fetch to get it and add it to
+  // the cache if it isn't there.
+  changeset *get_or_fetch(osm_changeset_id_t id, const fetch_function &fetch);
+
+  // as get_or_fetch, for a batch of changesets, adding the ones found to
+  // out and fetching all the missing ones together.
+  void get_or_fetch(const std::vector<osm_changeset_id_t> &ids,
+                    cache<osm_changeset_id_t, changeset>::batch_type &out,
+                    const batch_fetch_function &fetch);
+
+  // counters, summed over all processes sharing the cache.
+  stats get_stats() const;
+
+  // the cache set up by initialise(), or NULL if there isn't one.
+  static shared_changeset_cache *instance();
+
+  // set up the cache which instance() returns, for the processes forked
+  // after this to share. a num_entries of zero removes it.
+  static void initialise(size_t num_entries);
+
+private:
+  struct header;
+  struct slot;
+
+  header *m_header;
+  slot *m_slots;
+  size_t m_mask, m_bytes;
+};
+
+#endif /* BACKEND_APIDB_SHARED_CHANGESET_CACHE_HPP */
@@ -0,0 +1,43 @@
+#ifndef BACKEND_APIDB_STATEMENT_QUEUE_HPP
+#define BACKEND_APIDB_STATEMENT_QUEUE_HPP
+
+#include <string>
+#include <vector>
+#include <pqxx/pqxx>
+
+/**
+ * queues up statements whose results aren't needed straight away, so that
+ * they can be sent to the database together through a pqxx::pipeline and
+ * share a round trip, rather than waiting for one each.
+ *
+ * statements run in the order they were queued, so later ones can depend
+ * on the effects of earlier ones on the server (e.g: filling a temporary
+ * table which the next statement reads). they can't depend on anything the
+ * client does with the results, though, as those only come back on flush.
+ */
+class statement_queue {
+public:
+  explicit statement_queue(pqxx::transaction_base &w);
+
+  // queue a plain SQL statement.
+  void push(const std::string &sql);
+
+  // queue a call to a prepared statement, with each of the arguments
+  // already quoted as an SQL literal (e.g: with transaction_base::quote).
+  void push_prepared(const std::string &name,
+                     const std::vector<std::string> &args =
+                         std::vector<std::string>());
+
+  bool empty() const;
+
+  // send all the queued statements and wait for them to finish, returning
+  // their results in the order they were queued. the queue is empty
+  // afterwards, even if one of the statements threw an error.
+  std::vector<pqxx::result> flush();
+
+private:
+  pqxx::transaction_base &m_tx;
+  std::vector<std::string> m_statements;
+};
+
+#endif /* BACKEND_APIDB_STATEMENT_QUEUE_HPP */
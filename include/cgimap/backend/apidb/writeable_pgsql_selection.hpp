@@ -3,9 +3,14 @@
 
 #include "cgimap/data_selection.hpp"
 #include "cgimap/backend/apidb/changeset.hpp"
-#include "cgimap/backend/apidb/cache.hpp"
+#include "cgimap/cache.hpp"
+#include "cgimap/backend/apidb/existence_filter.hpp"
+#include "cgimap/backend/apidb/node_density.hpp"
+#include "cgimap/backend/apidb/memcached_changeset_cache.hpp"
+#include "cgimap/backend/apidb/statement_queue.hpp"
 #include <pqxx/pqxx>
 #include <boost/program_options.hpp>
+#include <boost/scoped_ptr.hpp>
 
 /**
  * a selection which operates against a writeable (i.e: non read-only
@@ -15,7 +20,11 @@
 class writeable_pgsql_selection : public data_selection {
 public:
   writeable_pgsql_selection(pqxx::connection &conn,
-                            cache<osm_changeset_id_t, changeset> &changeset_cache);
+                            cache<osm_changeset_id_t, changeset> &changeset_cache,
+                            size_t extract_batch_size = 0,
+                            existence_filter *filter = NULL,
+                            node_density *density = NULL,
+                            bool create_tables = false);
   ~writeable_pgsql_selection();
 
   void write_nodes(output_formatter &formatter);
@@ -39,10 +48,15 @@ public:
   void select_relations_from_nodes();
   void select_relations_from_relations();
   void select_relations_members_of_relations();
+  void select_plan(const selection_plan &plan);
 
   bool supports_changesets();
   int select_changesets(const std::vector<osm_changeset_id_t> &);
   void select_changeset_discussions();
+  void omit_metadata();
+
+  bool selected_versions(element_type type, id_versions_t &out);
+  void deselect(element_type type, const std::vector<osm_nwr_id_t> &ids);
 
   /**
    * abstracts the creation of transactions for the writeable
@@ -55,12 +69,28 @@ public:
     virtual boost::shared_ptr<data_selection> make_selection();
 
   private:
+    // create the temporary tables which the selections use to hold their
+    // working sets, if they don't already exist on this connection.
+    void create_tables();
+
     pqxx::connection m_connection, m_cache_connection;
 #if PQXX_VERSION_MAJOR >= 4
     pqxx::quiet_errorhandler m_errorhandler, m_cache_errorhandler;
 #endif
     pqxx::nontransaction m_cache_tx;
+    boost::scoped_ptr<existence_filter> m_existence;
+    boost::scoped_ptr<node_density> m_density;
+    boost::scoped_ptr<memcached_changeset_cache> m_memcache;
     cache<osm_changeset_id_t, changeset> m_cache;
+    size_t m_extract_batch_size;
+
+    // if true, each selection creates its own temporary tables inside its
+    // transaction, and the factory doesn't create them.
+    bool m_tables_per_request;
+
+    // the backend process which the temporary tables were created on, so
+    // that they can be created again after a reconnect.
+    int m_tables_backend_pid;
   };
 
 private:
@@ -68,7 +98,25 @@ private:
   // this *is* read-only, it may create temporary tables.
   pqxx::work w;
 
-  cache<osm_changeset_id_t, changeset> cc;
+  // statements which don't return anything needed straight away, such as
+  // those filling the temporary tables, are queued up here and sent
+  // together when a result is next needed. this means the steps of a map
+  // call share a single round trip to the database.
+  statement_queue pending;
+
+  // queue a prepared statement taking an array of IDs, then run everything
+  // queued, returning the number of rows affected by the statement.
+  template <typename T>
+  int exec_pending(const std::string &name, const std::vector<T> &ids);
+
+  cache<osm_changeset_id_t, changeset> &cc;
+
+  // if not null, used to skip queries for elements which can't exist.
+  existence_filter *filter;
+
+  // if not null, used to turn away bboxes with too many nodes without a
+  // query.
+  node_density *density;
 
   // true if a query hasn't been run yet, i.e: it's possible to
   // assume that all the temporary tables are empty.
@@ -77,6 +125,18 @@ private:
   // true if we want to include changeset discussions along with
   // the changesets themselves. defaults to false.
   bool include_changeset_discussions;
+
+  // false if the elements are written without their changeset and user,
+  // in which case the changesets aren't looked up. defaults to true.
+  bool include_metadata;
+
+  // the changeset cache to fill in the elements' users from, or NULL if
+  // they're written without.
+  cache<osm_changeset_id_t, changeset> *user_cache();
+
+  // if non-zero, the number of rows to fetch at a time through a cursor
+  // when writing out elements. if zero, all rows are fetched at once.
+  size_t extract_batch_size;
 };
 
 #endif /* WRITEABLE_PGSQL_SELECTION_HPP */
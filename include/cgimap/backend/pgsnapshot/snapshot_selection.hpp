@@ -2,7 +2,9 @@
 #define PGSNAPSHOT_SELECTION_HPP
 
 #include "cgimap/data_selection.hpp"
+#include "cgimap/bbox.hpp"
 #include <pqxx/pqxx>
+#include <boost/optional.hpp>
 #include <boost/program_options.hpp>
 
 /**
@@ -11,7 +13,9 @@
  */
 class snapshot_selection : public data_selection {
 public:
-  snapshot_selection(pqxx::connection &conn);
+  // if has_way_geometry is true then the "ways_from_bbox" statement has
+  // been prepared, and can be used in place of the way_nodes join.
+  snapshot_selection(pqxx::connection &conn, bool has_way_geometry);
   ~snapshot_selection();
 
   void write_nodes(output_formatter &formatter);
@@ -36,6 +40,11 @@ public:
   void select_relations_from_relations();
   void select_relations_members_of_relations();
 
+  void omit_metadata();
+
+  bool selected_versions(element_type type, id_versions_t &out);
+  void deselect(element_type type, const std::vector<osm_nwr_id_t> &ids);
+
   /**
    * abstracts the creation of transactions for the writeable
    * data selection.
@@ -51,12 +60,34 @@ public:
 #if PQXX_VERSION_MAJOR >= 4
     pqxx::quiet_errorhandler m_errorhandler;
 #endif
+    // true if the ways table has one of the optional bbox or linestring
+    // geometry columns, which are indexed.
+    bool m_has_way_geometry;
   };
 
 private:
+  // called whenever nodes are added to tmp_nodes other than from a bbox.
+  void nodes_selected();
+
   // the transaction in which the selection takes place. although
   // this *is* read-only, it may create temporary tables.
   pqxx::work w;
+
+  // false if the elements are written without metadata, in which case
+  // they're extracted without joining the users table.
+  bool m_include_metadata;
+
+  // the name of the statement to extract elements with, which skips the
+  // users if they aren't wanted.
+  std::string extract_statement(const std::string &name);
+
+  // whether ways can be looked up by their geometry, and the bounds that
+  // tmp_nodes was filled from, if that was the only way it was filled.
+  // when both are there, ways can be found by checking the index for ones
+  // which overlap the bounds, rather than joining through way_nodes.
+  bool m_has_way_geometry;
+  bool m_tmp_nodes_empty;
+  boost::optional<bbox> m_bounds;
 };
 
 #endif /* PGSNAPSHOT_SELECTION_HPP */
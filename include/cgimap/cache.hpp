@@ -0,0 +1,598 @@
+/*
+ * Copyright (c) 2009
+ * Matt Amos, John Maddock
+ *
+ * Based on boost/regex/pending/object_cache.hpp
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <stdint.h>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+// the number of bytes an object takes up, for the cache's size limit. this
+// can be overloaded for objects which own other memory, such as strings,
+// but shouldn't return less than sizeof(Object).
+template <class Object> size_t cache_object_size(const Object &) {
+  return sizeof(Object);
+}
+
+/**
+ * a cache of objects, fetched by key when they're not already there, and
+ * bounded by the total number of bytes the objects and their bookkeeping
+ * take up.
+ *
+ * eviction is S3-FIFO: new objects go into a small FIFO queue, and only
+ * move to the main queue if they're asked for again before reaching the
+ * front of it. objects dropped from the small queue are remembered as
+ * "ghosts" for a while, and go straight into the main queue if they're
+ * fetched again. the main queue is a CLOCK-like FIFO, giving objects which
+ * have been used since they were last at the front another go round. this
+ * means a single request touching a lot of objects once only churns the
+ * small queue, rather than flushing out the objects everyone else uses.
+ * a request may well read the same object many times, e.g: the changeset
+ * of every element it writes, so lookups can be grouped into batches, one
+ * per request, in which each object counts as used at most once.
+ *
+ * the objects are indexed by an open-addressed hash table of positions in
+ * a vector of entries, which needs std::hash<Key>.
+ */
+template <class Key, class Object> class cache : public boost::noncopyable {
+public:
+  typedef size_t size_type;
+  typedef boost::function<Object *(Key)> function_type;
+
+  // fetches the objects for a whole batch of keys at once, adding each one
+  // found to the batch_type vector. keys which aren't found can be left
+  // out, and will be fetched one at a time (and fail) as usual.
+  typedef std::vector<std::pair<Key, ::boost::shared_ptr<Object const> > >
+      batch_type;
+  typedef boost::function<void(const std::vector<Key> &, batch_type &)>
+      batch_function_type;
+
+  struct stats {
+    uint64_t hits, misses, evictions;
+    // the number of objects held, and the bytes they're charged for.
+    size_type entries, bytes;
+  };
+
+  cache(function_type f, size_type max_bytes,
+        batch_function_type bf = batch_function_type());
+
+  boost::shared_ptr<Object const> get(const Key &k);
+
+  // start a new batch of lookups, usually for a new request. within a
+  // batch, an object only counts as used once, however many times it's
+  // asked for. until the first batch is started, every lookup counts.
+  void start_batch();
+
+  // the object for a key if it's in the cache, which counts as a use of it,
+  // or an empty pointer if it isn't. this never fetches anything.
+  boost::shared_ptr<Object const> peek(const Key &k);
+
+  // add an object which the caller has got some other way, replacing any
+  // object already in the cache for the key.
+  void put(const Key &k, const boost::shared_ptr<Object const> &o);
+
+  // fetch all the objects for a range of keys which aren't in the cache
+  // together, so that get() doesn't have to fetch them one at a time. they
+  // are only added to the cache as get() asks for them, just as if they'd
+  // been fetched then, so a large batch doesn't push out anything before
+  // it's used. until the next prefetch, the batch is held on to outside
+  // the cache's byte limit. does nothing if there's no batch function.
+  template <typename Iterator> void prefetch(Iterator first, Iterator last);
+
+  stats get_stats() const;
+
+  // the number of bytes an object is charged for, including the cache's
+  // own bookkeeping.
+  static size_type charge(const Object &o);
+
+private:
+  // the bytes charged for each entry on top of the object itself.
+  static size_type overhead();
+
+  enum queue_type { queue_small, queue_main, queue_ghost, queue_free };
+
+  struct entry {
+    Key key;
+    boost::shared_ptr<Object const> object;
+    size_type bytes;
+    // bumped whenever the entry is moved to a queue, so that any record of
+    // where it was before can be recognised as stale.
+    uint32_t generation;
+    // the batch in which the entry was last counted as used.
+    uint32_t batch;
+    uint8_t freq;
+    uint8_t queue;
+  };
+
+  // queues hold the entry index and its generation when it was queued.
+  typedef std::deque<std::pair<uint32_t, uint32_t> > queue_t;
+
+  static const uint32_t NO_ENTRY = 0xffffffff;
+  // the maximum frequency recorded for an entry in the main queue, which is
+  // the number of extra times round it can go.
+  static const uint8_t MAX_FREQ = 3;
+
+  // the entry index for a key, which may be a ghost, or NO_ENTRY.
+  uint32_t find(const Key &k) const;
+  size_t hash_slot(const Key &k) const;
+  void index_insert(uint32_t e);
+  void index_erase(uint32_t e);
+  void rehash(size_t num_slots);
+
+  uint32_t allocate(const Key &k);
+  void release(uint32_t e);
+  void enqueue(uint32_t e, queue_type q);
+  // pop the first entry still in the queue, or NO_ENTRY if there isn't one.
+  uint32_t pop(queue_t &q, queue_type type);
+
+  // count a lookup of an entry as a use of it, if it hasn't already been
+  // used in this batch.
+  void touch(entry &ent);
+
+  // takes the object for a key from the last prefetched batch, returning
+  // false if it isn't there.
+  bool take_prefetched(const Key &k, boost::shared_ptr<Object const> &out);
+  static bool key_less(const typename batch_type::value_type &a,
+                       const typename batch_type::value_type &b);
+
+  // add a newly fetched object, reusing the ghost entry e if there is one.
+  void insert(const Key &k, const boost::shared_ptr<Object const> &result,
+              uint32_t e);
+  void evict();
+  void evict_small();
+  void evict_main();
+
+  // functor to get a value which isn't in the cache.
+  function_type fetch;
+
+  // functor to get several values which aren't in the cache at once.
+  batch_function_type fetch_batch;
+
+  // the objects fetched by the last prefetch, sorted by key.
+  batch_type m_prefetched;
+
+  // maximum total bytes of the objects, set at construction time.
+  const size_type max_cache_bytes;
+
+  std::vector<entry> m_entries;
+  std::vector<uint32_t> m_free;
+  // open-addressed, linear probing index of entries, with NO_ENTRY for an
+  // empty slot. the size is always a power of two.
+  std::vector<uint32_t> m_index;
+  size_t m_index_used;
+
+  queue_t m_small, m_main, m_ghost;
+  size_type m_small_count, m_main_count, m_ghost_count;
+  size_type m_small_bytes, m_main_bytes;
+  uint64_t m_hits, m_misses, m_evictions;
+  // the current batch of lookups, or 0 if no batch has been started.
+  uint32_t m_batch;
+};
+
+template <class Key, class Object>
+const uint32_t cache<Key, Object>::NO_ENTRY;
+
+template <class Key, class Object>
+const uint8_t cache<Key, Object>::MAX_FREQ;
+
+template <class Key, class Object>
+cache<Key, Object>::cache(function_type f, size_type max_bytes,
+                          batch_function_type bf)
+    : fetch(f), fetch_batch(bf), max_cache_bytes(max_bytes),
+      m_index(16, NO_ENTRY), m_index_used(0), m_small_count(0),
+      m_main_count(0), m_ghost_count(0), m_small_bytes(0), m_main_bytes(0),
+      m_hits(0), m_misses(0), m_evictions(0), m_batch(0) {}
+
+template <class Key, class Object>
+typename cache<Key, Object>::size_type
+cache<Key, Object>::charge(const Object &o) {
+  return cache_object_size(o) + overhead();
+}
+
+template <class Key, class Object>
+typename cache<Key, Object>::size_type cache<Key, Object>::overhead() {
+  // the entry, its slot in the index (which is at most half full) and in a
+  // queue, and the shared_ptr's control block.
+  return sizeof(entry) + 2 * sizeof(uint32_t) +
+         sizeof(typename queue_t::value_type) + 2 * sizeof(void *);
+}
+
+template <class Key, class Object>
+boost::shared_ptr<Object const> cache<Key, Object>::get(const Key &k) {
+  const uint32_t e = find(k);
+  if ((e != NO_ENTRY) && (m_entries[e].queue != queue_ghost)) {
+    ++m_hits;
+    entry &ent = m_entries[e];
+    touch(ent);
+    return ent.object;
+  }
+
+  ++m_misses;
+  boost::shared_ptr<Object const> result;
+  if (!take_prefetched(k, result)) {
+    result.reset(fetch(k));
+  }
+  insert(k, result, e);
+  return result;
+}
+
+template <class Key, class Object> void cache<Key, Object>::start_batch() {
+  // 0 means there's no batch, so it's skipped when the count wraps.
+  if (++m_batch == 0) {
+    m_batch = 1;
+  }
+}
+
+template <class Key, class Object>
+boost::shared_ptr<Object const> cache<Key, Object>::peek(const Key &k) {
+  const uint32_t e = find(k);
+  if ((e != NO_ENTRY) && (m_entries[e].queue != queue_ghost)) {
+    ++m_hits;
+    entry &ent = m_entries[e];
+    touch(ent);
+    return ent.object;
+  }
+
+  ++m_misses;
+  return boost::shared_ptr<Object const>();
+}
+
+template <class Key, class Object>
+void cache<Key, Object>::put(const Key &k,
+                             const boost::shared_ptr<Object const> &o) {
+  const uint32_t e = find(k);
+  if ((e == NO_ENTRY) || (m_entries[e].queue == queue_ghost)) {
+    insert(k, o, e);
+    return;
+  }
+
+  // replace the object in place, keeping its position in its queue.
+  entry &ent = m_entries[e];
+  const size_type bytes = o ? charge(*o) : overhead();
+  if (ent.queue == queue_small) {
+    m_small_bytes = m_small_bytes - ent.bytes + bytes;
+  } else {
+    m_main_bytes = m_main_bytes - ent.bytes + bytes;
+  }
+  ent.object = o;
+  ent.bytes = bytes;
+  evict();
+}
+
+template <class Key, class Object>
+template <typename Iterator>
+void cache<Key, Object>::prefetch(Iterator first, Iterator last) {
+  if (!fetch_batch) {
+    return;
+  }
+  m_prefetched.clear();
+
+  std::vector<Key> missing;
+  for (; first != last; ++first) {
+    const uint32_t e = find(*first);
+    if ((e == NO_ENTRY) || (m_entries[e].queue == queue_ghost)) {
+      missing.push_back(*first);
+    }
+  }
+  std::sort(missing.begin(), missing.end());
+  missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+  if (missing.empty()) {
+    return;
+  }
+
+  // the batch isn't put into the cache here: if it's bigger than the small
+  // queue, the first objects would be evicted by the last before get() was
+  // asked for any of them, and then have to be fetched again one at a time.
+  fetch_batch(missing, m_prefetched);
+  std::sort(m_prefetched.begin(), m_prefetched.end(), key_less);
+}
+
+template <class Key, class Object>
+bool cache<Key, Object>::take_prefetched(const Key &k,
+                                         boost::shared_ptr<Object const> &out) {
+  const typename batch_type::value_type target(
+      k, boost::shared_ptr<Object const>());
+  typename batch_type::iterator itr = std::lower_bound(
+      m_prefetched.begin(), m_prefetched.end(), target, key_less);
+  if ((itr == m_prefetched.end()) || (itr->first != k)) {
+    return false;
+  }
+  out = itr->second;
+  return true;
+}
+
+template <class Key, class Object>
+bool cache<Key, Object>::key_less(const typename batch_type::value_type &a,
+                                  const typename batch_type::value_type &b) {
+  return a.first < b.first;
+}
+
+template <class Key, class Object>
+typename cache<Key, Object>::stats cache<Key, Object>::get_stats() const {
+  stats s;
+  s.hits = m_hits;
+  s.misses = m_misses;
+  s.evictions = m_evictions;
+  s.entries = m_small_count + m_main_count;
+  s.bytes = m_small_bytes + m_main_bytes;
+  return s;
+}
+
+template <class Key, class Object>
+size_t cache<Key, Object>::hash_slot(const Key &k) const {
+  // std::hash is often the identity for integers, and the IDs used as keys
+  // are mostly sequential, so mix the bits before using the low ones.
+  const uint64_t h = uint64_t(std::hash<Key>()(k)) * 0x9e3779b97f4a7c15ull;
+  return size_t(h >> 32) & (m_index.size() - 1);
+}
+
+template <class Key, class Object>
+uint32_t cache<Key, Object>::find(const Key &k) const {
+  const size_t mask = m_index.size() - 1;
+  for (size_t i = hash_slot(k);; i = (i + 1) & mask) {
+    const uint32_t e = m_index[i];
+    if ((e == NO_ENTRY) || (m_entries[e].key == k)) {
+      return e;
+    }
+  }
+}
+
+template <class Key, class Object>
+void cache<Key, Object>::index_insert(uint32_t e) {
+  if (2 * (m_index_used + 1) > m_index.size()) {
+    rehash(2 * m_index.size());
+  }
+  const size_t mask = m_index.size() - 1;
+  size_t i = hash_slot(m_entries[e].key);
+  while (m_index[i] != NO_ENTRY) {
+    i = (i + 1) & mask;
+  }
+  m_index[i] = e;
+  ++m_index_used;
+}
+
+template <class Key, class Object>
+void cache<Key, Object>::index_erase(uint32_t e) {
+  const size_t mask = m_index.size() - 1;
+  size_t i = hash_slot(m_entries[e].key);
+  while (m_index[i] != e) {
+    i = (i + 1) & mask;
+  }
+
+  // shift back any entries after the hole which would no longer be found
+  // by probing from their home slot, so that there are no tombstones.
+  for (size_t j = (i + 1) & mask; m_index[j] != NO_ENTRY; j = (j + 1) & mask) {
+    const size_t home = hash_slot(m_entries[m_index[j]].key);
+    // the entry at j can move to i if its home isn't cyclically in (i, j].
+    if (((j > i) && ((home <= i) || (home > j))) ||
+        ((j < i) && ((home <= i) && (home > j)))) {
+      m_index[i] = m_index[j];
+      i = j;
+    }
+  }
+  m_index[i] = NO_ENTRY;
+  --m_index_used;
+}
+
+template <class Key, class Object>
+void cache<Key, Object>::rehash(size_t num_slots) {
+  m_index.assign(num_slots, NO_ENTRY);
+  m_index_used = 0;
+  for (uint32_t e = 0; e < m_entries.size(); ++e) {
+    if (m_entries[e].queue != queue_free) {
+      const size_t mask = m_index.size() - 1;
+      size_t i = hash_slot(m_entries[e].key);
+      while (m_index[i] != NO_ENTRY) {
+        i = (i + 1) & mask;
+      }
+      m_index[i] = e;
+      ++m_index_used;
+    }
+  }
+}
+
+template <class Key, class Object>
+uint32_t cache<Key, Object>::allocate(const Key &k) {
+  uint32_t e;
+  if (m_free.empty()) {
+    e = uint32_t(m_entries.size());
+    m_entries.push_back(entry());
+    m_entries[e].generation = 0;
+  } else {
+    e = m_free.back();
+    m_free.pop_back();
+  }
+  m_entries[e].key = k;
+  m_entries[e].queue = queue_free;
+  index_insert(e);
+  return e;
+}
+
+template <class Key, class Object>
+void cache<Key, Object>::release(uint32_t e) {
+  index_erase(e);
+  entry &ent = m_entries[e];
+  ent.object.reset();
+  ent.queue = queue_free;
+  ++ent.generation;
+  m_free.push_back(e);
+}
+
+template <class Key, class Object>
+void cache<Key, Object>::enqueue(uint32_t e, queue_type q) {
+  entry &ent = m_entries[e];
+  ent.queue = q;
+  ++ent.generation;
+  const typename queue_t::value_type rec(e, ent.generation);
+  if (q == queue_small) {
+    m_small.push_back(rec);
+  } else if (q == queue_main) {
+    m_main.push_back(rec);
+  } else {
+    m_ghost.push_back(rec);
+  }
+}
+
+template <class Key, class Object>
+uint32_t cache<Key, Object>::pop(queue_t &q, queue_type type) {
+  while (!q.empty()) {
+    const typename queue_t::value_type rec = q.front();
+    q.pop_front();
+    const entry &ent = m_entries[rec.first];
+    if ((ent.generation == rec.second) && (ent.queue == type)) {
+      return rec.first;
+    }
+  }
+  return NO_ENTRY;
+}
+
+template <class Key, class Object>
+void cache<Key, Object>::touch(entry &ent) {
+  if ((m_batch != 0) && (ent.batch == m_batch)) {
+    return;
+  }
+  ent.batch = m_batch;
+  if (ent.freq < MAX_FREQ) {
+    ++ent.freq;
+  }
+}
+
+template <class Key, class Object>
+void cache<Key, Object>::insert(const Key &k,
+                                const boost::shared_ptr<Object const> &result,
+                                uint32_t e) {
+  const size_type bytes = result ? charge(*result) : overhead();
+  const bool was_ghost = (e != NO_ENTRY);
+
+  if (was_ghost) {
+    --m_ghost_count;
+  } else {
+    e = allocate(k);
+  }
+  entry &ent = m_entries[e];
+  ent.object = result;
+  ent.bytes = bytes;
+  ent.freq = 0;
+  // being fetched is its use in this batch.
+  ent.batch = m_batch;
+
+  // something evicted recently and wanted again is likely to be wanted
+  // more, so it skips the small queue.
+  if (was_ghost) {
+    enqueue(e, queue_main);
+    ++m_main_count;
+    m_main_bytes += bytes;
+  } else {
+    enqueue(e, queue_small);
+    ++m_small_count;
+    m_small_bytes += bytes;
+  }
+
+  evict();
+}
+
+template <class Key, class Object>
+void cache<Key, Object>::evict() {
+  while (m_small_bytes + m_main_bytes > max_cache_bytes) {
+    // the small queue is kept to about a tenth of the cache.
+    if ((m_main_count == 0) || (m_small_bytes > max_cache_bytes / 10)) {
+      evict_small();
+    } else {
+      evict_main();
+    }
+  }
+}
+
+template <class Key, class Object>
+void cache<Key, Object>::evict_small() {
+  const uint32_t e = pop(m_small, queue_small);
+  if (e == NO_ENTRY) {
+    return;
+  }
+  entry &ent = m_entries[e];
+  --m_small_count;
+  m_small_bytes -= ent.bytes;
+
+  if (ent.freq > 0) {
+    // used again since it was added, so promote it.
+    ent.freq = 0;
+    enqueue(e, queue_main);
+    ++m_main_count;
+    m_main_bytes += ent.bytes;
+    return;
+  }
+
+  // otherwise drop the object, but remember the key for a while. there are
+  // no more ghosts kept than objects in the cache.
+  ++m_evictions;
+  ent.object.reset();
+  enqueue(e, queue_ghost);
+  ++m_ghost_count;
+  while (m_ghost_count > m_small_count + m_main_count) {
+    const uint32_t g = pop(m_ghost, queue_ghost);
+    if (g == NO_ENTRY) {
+      break;
+    }
+    --m_ghost_count;
+    release(g);
+  }
+}
+
+template <class Key, class Object>
+void cache<Key, Object>::evict_main() {
+  const uint32_t e = pop(m_main, queue_main);
+  if (e == NO_ENTRY) {
+    return;
+  }
+  entry &ent = m_entries[e];
+
+  if (ent.freq > 0) {
+    // used since it was last here, so give it another go round.
+    --ent.freq;
+    enqueue(e, queue_main);
+    return;
+  }
+
+  --m_main_count;
+  m_main_bytes -= ent.bytes;
+  ++m_evictions;
+  release(e);
+}
+
+#endif /* CACHE_HPP */
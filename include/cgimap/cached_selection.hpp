@@ -0,0 +1,116 @@
+#ifndef CACHED_SELECTION_HPP
+#define CACHED_SELECTION_HPP
+
+#include "cgimap/data_selection.hpp"
+#include "cgimap/output_formatter.hpp"
+
+#include <vector>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+
+template <class Key, class Object> class cache;
+
+/**
+ * everything written out for a single node, way or relation, as kept in
+ * the element cache. only the fields for the element's type are used.
+ */
+struct cached_element {
+  element_info info;
+  double lon, lat;
+  tags_t tags;
+  nodes_t nodes;
+  members_t members;
+};
+
+// the approximate number of bytes an element takes up in the cache.
+size_t cache_object_size(const cached_element &e);
+
+/**
+ * a data selection which wraps the selection of any backend, keeping
+ * copies of the whole elements it writes out in a cache shared by all the
+ * selections made by the same factory. popular elements, such as large
+ * boundary relations and motorway ways, are requested over and over, and
+ * this turns fetching their tags, way nodes and members into memory reads.
+ *
+ * before writing out each type of element, the backend is asked for the
+ * current versions of the selected elements, and any with a cached copy of
+ * the same version are written from the cache and taken out of the
+ * selection. the backend then writes the rest, which are cached as they
+ * go. backends which can't list versions cheaply are passed straight
+ * through, as are elements written without metadata, so that they don't
+ * end up in the cache without it. note that cached elements are written
+ * before the others, and that, as with the changeset cache, a user changing
+ * their display name isn't seen until the elements they edited drop out of
+ * the cache.
+ */
+class cached_selection : public data_selection {
+public:
+  typedef cache<uint64_t, cached_element> element_cache;
+
+  cached_selection(boost::shared_ptr<data_selection> inner,
+                   element_cache &elements);
+  ~cached_selection();
+
+  void write_nodes(output_formatter &formatter);
+  void write_ways(output_formatter &formatter);
+  void write_relations(output_formatter &formatter);
+  void write_changesets(output_formatter &formatter,
+                        const boost::posix_time::ptime &now);
+
+  visibility_t check_node_visibility(osm_nwr_id_t id);
+  visibility_t check_way_visibility(osm_nwr_id_t id);
+  visibility_t check_relation_visibility(osm_nwr_id_t id);
+
+  int select_nodes(const std::vector<osm_nwr_id_t> &);
+  int select_ways(const std::vector<osm_nwr_id_t> &);
+  int select_relations(const std::vector<osm_nwr_id_t> &);
+  int select_nodes_from_bbox(const bbox &bounds, int max_nodes);
+  void select_nodes_from_relations();
+  void select_ways_from_nodes();
+  void select_ways_from_relations();
+  void select_relations_from_ways();
+  void select_nodes_from_way_nodes();
+  void select_relations_from_nodes();
+  void select_relations_from_relations();
+  void select_relations_members_of_relations();
+  void select_plan(const selection_plan &plan);
+
+  bool supports_changesets();
+  int select_changesets(const std::vector<osm_changeset_id_t> &);
+  void select_changeset_discussions();
+  void omit_metadata();
+
+  bool selected_versions(element_type type, id_versions_t &out);
+  void deselect(element_type type, const std::vector<osm_nwr_id_t> &ids);
+
+  /**
+   * wraps the factory of another backend, so that all its selections share
+   * one cache of up to max_bytes.
+   */
+  class factory : public data_selection::factory {
+  public:
+    factory(boost::shared_ptr<data_selection::factory> inner,
+            size_t max_bytes);
+    virtual ~factory();
+    virtual boost::shared_ptr<data_selection> make_selection();
+
+  private:
+    boost::shared_ptr<data_selection::factory> m_inner;
+    boost::scoped_ptr<element_cache> m_elements;
+  };
+
+private:
+  // write out the selected elements of the type which have a current copy
+  // in the cache, and take them out of the inner selection. returns false
+  // if the inner selection doesn't support this.
+  bool write_from_cache(element_type type, output_formatter &formatter);
+
+  boost::shared_ptr<data_selection> m_inner;
+  element_cache &m_elements;
+
+  // false if the elements are written without metadata, and so mustn't be
+  // put in the cache.
+  bool m_include_metadata;
+};
+
+#endif /* CACHED_SELECTION_HPP */
@@ -17,10 +17,12 @@ mime::type choose_best_mime_type(request &req, responder_ptr_t hptr);
 
 /**
  * creates and initialises an output formatter which matches the MIME type
- * passed in as an argument.
+ * passed in as an argument. if include_metadata is false, the elements are
+ * written without their changeset and user.
  */
 boost::shared_ptr<output_formatter>
 create_formatter(request &req, mime::type best_type,
-                 boost::shared_ptr<output_buffer>);
+                 boost::shared_ptr<output_buffer>,
+                 bool include_metadata = true);
 
 #endif /* CHOOSE_FORMATTER_HPP */
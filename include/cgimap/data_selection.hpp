@@ -4,6 +4,7 @@
 #include "cgimap/types.hpp"
 #include "cgimap/output_formatter.hpp"
 
+#include <string>
 #include <vector>
 #include <boost/shared_ptr.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
@@ -87,6 +88,31 @@ public:
   /// select relations which are members of selected relations
   virtual void select_relations_members_of_relations() = 0;
 
+  /******************* selection plans *************************/
+
+  /// the steps which can be chained together in a selection plan. each one
+  /// does the same as the select_* function of the same name.
+  enum plan_step {
+    plan_nodes_from_relations,
+    plan_ways_from_nodes,
+    plan_ways_from_relations,
+    plan_relations_from_ways,
+    plan_nodes_from_way_nodes,
+    plan_relations_from_nodes,
+    plan_relations_from_relations,
+    plan_relations_members_of_relations
+  };
+
+  /// a sequence of steps, applied in order to whatever is already
+  /// selected. e.g: the map call is "ways from nodes, nodes from way nodes,
+  /// relations from ways, ..." applied to the nodes in the bbox.
+  typedef std::vector<plan_step> selection_plan;
+
+  /// run all the steps of a plan. backends can override this to compile
+  /// the whole plan into a single query, rather than one per step. the
+  /// default just calls the select_* function for each step in turn.
+  virtual void select_plan(const selection_plan &plan);
+
   /// does this data selection support changesets?
   virtual bool supports_changesets();
 
@@ -99,6 +125,36 @@ public:
   /// if this is called then discussions will be included.
   virtual void select_changeset_discussions();
 
+  /// the elements are going to be written without their changeset and
+  /// user, so there's no need to look them up. this effectively just sets a
+  /// flag, and must be called before anything is selected. backends which
+  /// can't skip the lookups may ignore it, as the formatter leaves them out
+  /// anyway.
+  virtual void omit_metadata();
+
+  /******************* element caches **************************/
+
+  /// pairs of element IDs and their current versions.
+  typedef std::vector<std::pair<osm_nwr_id_t, osm_nwr_id_t> > id_versions_t;
+
+  /// add the IDs and current versions of the selected nodes, ways or
+  /// relations to the vector, so that a cache of whole elements can check
+  /// which of its entries are still current before writing them out, and
+  /// responses can be given an ETag without being written out. this is
+  /// called after all the select_* calls. returns false if the backend
+  /// can't do this cheaply, which is the default.
+  ///
+  /// changesets don't have versions, so backends which support them for
+  /// changesets make up a number which changes whenever anything written
+  /// out for the changeset does, or zero if that can't be told.
+  virtual bool selected_versions(element_type type, id_versions_t &out);
+
+  /// remove elements from the selection, after selected_versions, because
+  /// they've been written out from a cache instead. the default does
+  /// nothing, as it's never called if selected_versions returns false.
+  virtual void deselect(element_type type,
+                        const std::vector<osm_nwr_id_t> &ids);
+
   /**
    * factory for the creation of data selections. this abstracts away
    * the creation process of transactions, and allows some up-front
@@ -116,7 +172,50 @@ public:
 
 // parses psql array based on specs given
 // https://www.postgresql.org/docs/current/static/arrays.html#ARRAYS-IO
-std::vector<std::string> psql_array_to_vector(std::string str);
+std::vector<std::string> psql_array_to_vector(const std::string &str);
+
+/**
+ * reads the elements of a psql text format array one at a time, straight
+ * out of the buffer it's in (e.g: a pqxx field), rather than building a
+ * vector of strings first. elements are only copied if they have escapes
+ * which need removing, and integer elements can be parsed directly.
+ *
+ * as with psql_array_to_vector, an empty string or "{NULL}" (which is what
+ * array_agg gives when there was nothing to aggregate) is an empty array.
+ */
+class psql_array_reader {
+public:
+  psql_array_reader(const char *str, size_t len);
+  explicit psql_array_reader(const char *str);
+
+  // move on to the next element, returning false if there are no more.
+  bool next();
+
+  // the current element. this points into the original buffer unless it
+  // had to be unescaped, and is only valid until the next call to next().
+  const char *data() const { return m_elem; }
+  size_t size() const { return m_elem_len; }
+  std::string str() const { return std::string(m_elem, m_elem_len); }
+
+  // true if the current element is an unquoted NULL.
+  bool is_null() const { return m_null; }
+
+  // the current element as a decimal integer. throws if it isn't one.
+  int64_t as_int64() const;
+
+private:
+  psql_array_reader(const psql_array_reader &);
+  psql_array_reader &operator=(const psql_array_reader &);
+
+  void init(const char *str, size_t len);
+  void set_element(const char *begin, const char *end, bool escaped);
+
+  const char *m_pos, *m_end;
+  const char *m_elem;
+  size_t m_elem_len;
+  bool m_null;
+  std::string m_unescaped;
+};
 
 typedef boost::shared_ptr<data_selection::factory> factory_ptr;
 
@@ -31,6 +31,17 @@ public:
   // quick hack to get "extra" response headers.
   virtual std::string extra_response_headers() const;
 
+  // the value of the Cache-Control header for a successful response. by
+  // default, responses aren't cached by anything but the client, and it
+  // has to check with us each time.
+  virtual std::string cache_control() const;
+
+  // something which changes whenever the data written out would, such as
+  // the versions of the selected elements, for the response's ETag to be
+  // made from. empty if that can't be found out without writing the
+  // response, which is the default.
+  virtual std::string data_version();
+
 private:
   mime::type mime_type;
 };
@@ -48,6 +59,10 @@ public:
   virtual std::string log_name() const = 0;
   virtual responder_ptr_t responder(factory_ptr &) const = 0;
 
+  // true if successful responses to this are the same whoever asks, and
+  // are asked for often enough to be worth keeping in the response cache.
+  virtual bool response_cacheable() const;
+
   void set_resource_type(mime::type);
 
 protected:
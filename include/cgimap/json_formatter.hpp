@@ -16,9 +16,12 @@ private:
   void write_tags(const tags_t &tags);
   void write_common(const element_info &elem);
 
+  // false if the elements' changeset and user are left out.
+  bool include_metadata;
+
 public:
   // NOTE: takes ownership of the writer!
-  json_formatter(json_writer *w);
+  json_formatter(json_writer *w, bool include_metadata = true);
   virtual ~json_formatter();
 
   mime::type mime_type() const;
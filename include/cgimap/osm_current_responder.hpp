@@ -23,6 +23,11 @@ public:
              const boost::posix_time::ptime &now);
 
 protected:
+  // the IDs and versions of the selected elements of a type, for use in
+  // data_version(). empty if the selection can't list them, or if any of
+  // them can't be given a version.
+  std::string versions_of(element_type type);
+
   // current selection of elements to be written out
   boost::shared_ptr<data_selection> sel;
 };
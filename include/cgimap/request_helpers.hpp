@@ -23,6 +23,13 @@ std::string fcgi_get_env(request &req, const char *name,
  */
 std::string get_query_string(request &req);
 
+/**
+ * false if the client asked for elements without their changeset and user,
+ * either with "metadata=false" in the query string or with an
+ * "X-OSM-Metadata: false" header.
+ */
+bool want_metadata(request &req);
+
 /**
  * get the path from the $REQUEST_URI variable.
  */
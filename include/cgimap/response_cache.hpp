@@ -0,0 +1,151 @@
+#ifndef RESPONSE_CACHE_HPP
+#define RESPONSE_CACHE_HPP
+
+#include "cgimap/bbox.hpp"
+#include "cgimap/output_formatter.hpp"
+#include "cgimap/types.hpp"
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/program_options.hpp>
+
+/**
+ * a cache of whole responses, as they were sent to the client, for the
+ * requests which are made over and over, such as map tiles and the full
+ * versions of popular ways and relations. the bodies are kept after
+ * they've been compressed, so a hit is written straight out to the
+ * client without going to the database, formatting or compressing.
+ *
+ * it's held in a shared memory segment, like the shared changeset cache,
+ * so all the forked instances share the same hits and it has to be set up
+ * before they're forked. the bodies go in a ring buffer of a fixed number
+ * of bytes, each new one overwriting the oldest, and are found through an
+ * open-addressed index of slots. neither takes any locks: readers check
+ * that nothing has written over what they copied out and treat it as a
+ * miss if it has.
+ *
+ * each response is kept with the elements it was made from, and the
+ * areas it covers, as its dependencies. a feed of osmChange files, such as
+ * minutely diffs written to a local directory, is read every so often and
+ * everything in it, along with the locations of changed nodes, is marked as
+ * changed. a response which depends on anything marked as changed since it
+ * was made is out of date and isn't served again.
+ */
+class response_cache : public boost::noncopyable {
+public:
+  // what's kept for each response: the headers which differ between them,
+  // the body exactly as it was written out, and the number of bytes which
+  // were counted against the client, which is before any compression.
+  struct entry {
+    std::string content_type, content_encoding, cache_control, body;
+    uint64_t written;
+  };
+
+  /**
+   * what a response was made from, or what a batch of changes touched.
+   * elements are kept by type and ID, and areas by the cells of a fixed
+   * grid which they overlap.
+   */
+  class dependencies {
+  public:
+    void add_element(element_type type, osm_nwr_id_t id);
+    void add_location(double lon, double lat);
+    void add_area(const bbox &bounds);
+
+    const std::vector<uint64_t> &keys() const;
+    bool empty() const;
+
+  private:
+    std::vector<uint64_t> m_keys;
+  };
+
+  struct stats {
+    uint64_t hits, misses;
+    // lookups which found a response, but one which was out of date.
+    uint64_t stale;
+    uint64_t inserts;
+    // elements and cells marked as changed, and files they were read from.
+    uint64_t changes, files;
+    // the size of the whole segment.
+    size_t bytes;
+  };
+
+  // map a shared segment which holds up to max_bytes of responses, reading
+  // changes from the osmChange files in changes_dir. files which are
+  // already there are taken to be older than anything in the cache.
+  response_cache(size_t max_bytes, const std::string &changes_dir);
+  ~response_cache();
+
+  // the biggest body which would be kept.
+  size_t max_body_bytes() const;
+
+  // the point in the feed of changes which a response started now will be
+  // up to date with, to be passed to put() once the response is finished.
+  uint64_t epoch() const;
+
+  // copies out the response for the key, returning false if there isn't one
+  // or it's out of date.
+  bool get(const std::string &key, entry &out);
+
+  // add a response made from deps, which was started at the given epoch.
+  // responses too big to be worth keeping aren't cached.
+  void put(const std::string &key, const entry &e, const dependencies &deps,
+           uint64_t started);
+
+  // mark everything in the changes as changed, so that responses depending
+  // on them are out of date. only one process may do this at a time, which
+  // read_changes() makes sure of.
+  void invalidate(const dependencies &changed);
+
+  // read any new osmChange files, if it's been long enough since this
+  // process last looked. only one process reads them at a time; the rest
+  // go straight on.
+  void read_changes(const boost::posix_time::ptime &now);
+
+  // adds everything an osmChange file creates, modifies or deletes to
+  // changed, throwing if the file can't be parsed.
+  static void parse_changes(const std::string &filename,
+                            dependencies &changed);
+
+  // counters, summed over all processes sharing the cache.
+  stats get_stats() const;
+
+  // the cache set up by initialise(), or NULL if there isn't one.
+  static response_cache *instance();
+
+  // set up the cache which instance() returns from the options, for the
+  // processes forked after this to share.
+  static void initialise(const boost::program_options::variables_map &opts);
+
+private:
+  struct header;
+  struct slot;
+  struct change;
+
+  void ring_read(uint64_t pos, char *out, size_t length) const;
+  void ring_write(uint64_t pos, const char *data, size_t length);
+
+  // the epoch at which a key was last changed, or zero if it hasn't been
+  // since the change table was last cleared.
+  uint64_t changed_at(uint64_t key) const;
+  void mark_changed(uint64_t key, uint64_t at);
+
+  // throw away everything cached before the current epoch.
+  void flush_all();
+
+  bool lock_feed();
+  void unlock_feed();
+
+  header *m_header;
+  slot *m_slots;
+  change *m_changes;
+  char *m_ring;
+  size_t m_slot_mask, m_change_mask, m_ring_bytes, m_bytes;
+
+  std::string m_changes_dir;
+  boost::posix_time::ptime m_last_poll;
+};
+
+#endif /* RESPONSE_CACHE_HPP */
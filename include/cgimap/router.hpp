@@ -58,6 +58,7 @@ struct error : public std::runtime_error {
 struct match_string;
 struct match_osm_id;
 struct match_begin;
+struct match_tile_id;
 struct match_name;
 template <typename LeftType, typename RightType> struct match_and;
 
@@ -76,6 +77,10 @@ template <typename Self> struct ops {
   match_and<Self, match_osm_id> operator/(const match_osm_id &rhs) const {
     return match_and<Self, match_osm_id>(*static_cast<const Self *>(this), rhs);
   }
+  match_and<Self, match_tile_id> operator/(const match_tile_id &rhs) const {
+    return match_and<Self, match_tile_id>(*static_cast<const Self *>(this),
+                                          rhs);
+  }
   match_and<Self, match_name> operator/(const match_name &rhs) const {
     return match_and<Self, match_name>(*static_cast<const Self *>(this), rhs);
   }
@@ -131,6 +136,15 @@ struct match_osm_id : public ops<match_osm_id> {
   match_type match(part_iterator &begin, const part_iterator &end) const;
 };
 
+/**
+ * match a tile ID. unlike OSM IDs, tiles are numbered from zero.
+ */
+struct match_tile_id : public ops<match_tile_id> {
+  typedef list<osm_nwr_id_t> match_type;
+  match_tile_id();
+  match_type match(part_iterator &begin, const part_iterator &end) const;
+};
+
 /**
  * match any string.
  */
@@ -154,6 +168,7 @@ struct match_begin : public ops<match_begin> {
 // match items, given nicer names so that expressions are easier to read.
 static const match_begin root_;
 static const match_osm_id osm_id_;
+static const match_tile_id tile_id_;
 static const match_name name_;
 }
 
@@ -2,8 +2,14 @@
 #define UTIL_TIME_HPP
 
 #include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <string>
+#include <stdint.h>
 
 // parse a time string (ISO 8601 - YYYY-MM-DDTHH:MM:SSZ)
 boost::posix_time::ptime parse_time(const std::string &);
 
+// format a number of seconds since the unix epoch as a time string, in
+// the same format as parse_time accepts.
+std::string format_time(int64_t);
+
 #endif /* UTIL_TIME_HPP */
@@ -0,0 +1,21 @@
+-- counts the visible nodes in each cell of a coarse grid, for cgimap's
+-- --node-density option. each cell is a quadtile at zoom 11, which is the
+-- node's tile shifted down by 10 bits. this scans the whole of
+-- current_nodes, so should be run every so often (e.g: nightly) rather than
+-- all the time, and cgimap restarted afterwards to load the new counts.
+--
+--   psql -d openstreetmap -f update_node_density.sql
+
+CREATE TABLE IF NOT EXISTS node_density (
+  cell bigint PRIMARY KEY,
+  nodes bigint NOT NULL
+);
+
+BEGIN;
+TRUNCATE node_density;
+INSERT INTO node_density (cell, nodes)
+  SELECT tile >> 10, count(*)
+    FROM current_nodes
+    WHERE visible = true
+    GROUP BY tile >> 10;
+COMMIT;
@@ -35,6 +35,15 @@ changeset_responder::changeset_responder(mime::type mt, osm_changeset_id_t id_,
 
 changeset_responder::~changeset_responder() {}
 
+std::string changeset_responder::data_version() {
+  std::string version = versions_of(element_type_changeset);
+  // the discussion is only written out when it's asked for.
+  if (!version.empty() && include_discussion) {
+    version += "discussion";
+  }
+  return version;
+}
+
 namespace {
 // functor to use in find_if to locate the "include_discussion" header
 struct discussion_header_finder {
@@ -32,11 +32,13 @@ map_responder::map_responder(mime::type mt, bbox b, factory_ptr &x)
   }
   // Short-circuit empty areas
   if (num_nodes > 0) {
-    sel->select_ways_from_nodes();
-    sel->select_nodes_from_way_nodes();
-    sel->select_relations_from_ways();
-    sel->select_relations_from_nodes();
-    sel->select_relations_from_relations();
+    data_selection::selection_plan plan;
+    plan.push_back(data_selection::plan_ways_from_nodes);
+    plan.push_back(data_selection::plan_nodes_from_way_nodes);
+    plan.push_back(data_selection::plan_relations_from_ways);
+    plan.push_back(data_selection::plan_relations_from_nodes);
+    plan.push_back(data_selection::plan_relations_from_relations);
+    sel->select_plan(plan);
   }
 }
 
@@ -24,6 +24,10 @@ node_responder::node_responder(mime::type mt, osm_nwr_id_t id_, factory_ptr &w_)
 
 node_responder::~node_responder() {}
 
+std::string node_responder::data_version() {
+  return versions_of(element_type_node);
+}
+
 node_handler::node_handler(request &, osm_nwr_id_t id_) : id(id_) {}
 
 node_handler::~node_handler() {}
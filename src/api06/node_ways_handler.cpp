@@ -19,7 +19,8 @@ node_ways_responder::node_ways_responder(mime::type mt, osm_nwr_id_t id_,
     error << "Node " << id << " was not found.";
     throw http::not_found(error.str());
   } else {
-    sel->select_ways_from_nodes();
+    sel->select_plan(data_selection::selection_plan(
+        1, data_selection::plan_ways_from_nodes));
     check_visibility();
   }
 }
@@ -24,6 +24,10 @@ nodes_responder::nodes_responder(mime::type mt, vector<osm_nwr_id_t> ids_,
 
 nodes_responder::~nodes_responder() {}
 
+std::string nodes_responder::data_version() {
+  return versions_of(element_type_node);
+}
+
 nodes_handler::nodes_handler(request &req) : ids(validate_request(req)) {}
 
 nodes_handler::~nodes_handler() {}
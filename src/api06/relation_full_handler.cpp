@@ -23,10 +23,12 @@ relation_full_responder::relation_full_responder(mime::type mt_, osm_nwr_id_t id
     check_visibility();
   }
 
-  sel->select_nodes_from_relations();
-  sel->select_ways_from_relations();
-  sel->select_nodes_from_way_nodes();
-  sel->select_relations_members_of_relations();
+  data_selection::selection_plan plan;
+  plan.push_back(data_selection::plan_nodes_from_relations);
+  plan.push_back(data_selection::plan_ways_from_relations);
+  plan.push_back(data_selection::plan_nodes_from_way_nodes);
+  plan.push_back(data_selection::plan_relations_members_of_relations);
+  sel->select_plan(plan);
 }
 
 relation_full_responder::~relation_full_responder() {}
@@ -65,4 +67,6 @@ responder_ptr_t relation_full_handler::responder(factory_ptr &x) const {
   return responder_ptr_t(new relation_full_responder(mime_type, id, x));
 }
 
+bool relation_full_handler::response_cacheable() const { return true; }
+
 } // namespace api06
@@ -25,6 +25,10 @@ relation_responder::relation_responder(mime::type mt, osm_nwr_id_t id_,
 
 relation_responder::~relation_responder() {}
 
+std::string relation_responder::data_version() {
+  return versions_of(element_type_relation);
+}
+
 relation_handler::relation_handler(request &, osm_nwr_id_t id_) : id(id_) {}
 
 relation_handler::~relation_handler() {}
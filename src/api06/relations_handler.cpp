@@ -23,6 +23,10 @@ relations_responder::relations_responder(mime::type mt, vector<osm_nwr_id_t> ids
 
 relations_responder::~relations_responder() {}
 
+std::string relations_responder::data_version() {
+  return versions_of(element_type_relation);
+}
+
 relations_handler::relations_handler(request &req)
     : ids(validate_request(req)) {}
 
@@ -23,7 +23,8 @@ way_full_responder::way_full_responder(mime::type mt_, osm_nwr_id_t id_,
     check_visibility();
   }
 
-  sel->select_nodes_from_way_nodes();
+  sel->select_plan(data_selection::selection_plan(
+      1, data_selection::plan_nodes_from_way_nodes));
 }
 
 way_full_responder::~way_full_responder() {}
@@ -60,4 +61,6 @@ responder_ptr_t way_full_handler::responder(factory_ptr &x) const {
   return responder_ptr_t(new way_full_responder(mime_type, id, x));
 }
 
+bool way_full_handler::response_cacheable() const { return true; }
+
 } // namespace api06
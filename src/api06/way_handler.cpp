@@ -24,6 +24,10 @@ way_responder::way_responder(mime::type mt, osm_nwr_id_t id_, factory_ptr &w_)
 
 way_responder::~way_responder() {}
 
+std::string way_responder::data_version() {
+  return versions_of(element_type_way);
+}
+
 way_handler::way_handler(request &, osm_nwr_id_t id_) : id(id_) {}
 
 way_handler::~way_handler() {}
@@ -23,6 +23,10 @@ ways_responder::ways_responder(mime::type mt, vector<osm_nwr_id_t> ids_,
 
 ways_responder::~ways_responder() {}
 
+std::string ways_responder::data_version() {
+  return versions_of(element_type_way);
+}
+
 ways_handler::ways_handler(request &req) : ids(validate_request(req)) {}
 
 ways_handler::~ways_handler() {}
@@ -3,20 +3,28 @@
 #include "cgimap/request_helpers.hpp"
 #include "cgimap/logger.hpp"
 #include <boost/format.hpp>
+#include <algorithm>
 #include <map>
 
 using boost::format;
 using std::string;
 using std::auto_ptr;
 using std::map;
+using std::pair;
+using std::vector;
 
 #define MAX_AREA 0.25
 #define MAX_NODES 50000
 
+// seconds for which caches can keep a tile's response.
+#define TILE_MAX_AGE 60
+
 namespace api07 {
 
-map_responder::map_responder(mime::type mt, bbox b, factory_ptr &x)
-    : osm_current_responder(mt, x, boost::optional<bbox>(b)) {
+map_responder::map_responder(mime::type mt, bbox b, factory_ptr &x,
+                             bool fixed_grid)
+    : osm_current_responder(mt, x, boost::optional<bbox>(b)),
+      m_fixed_grid(fixed_grid) {
   // create temporary tables of nodes, ways and relations which
   // are in or used by elements in the bbox
   int num_nodes = sel->select_nodes_from_bbox(b, MAX_NODES);
@@ -30,29 +38,66 @@ map_responder::map_responder(mime::type mt, bbox b, factory_ptr &x)
   }
   // Short-circuit empty areas
   if (num_nodes > 0) {
-    sel->select_ways_from_nodes();
-    sel->select_nodes_from_way_nodes();
-    sel->select_relations_from_ways();
-    sel->select_relations_from_nodes();
-    sel->select_relations_from_relations();
+    data_selection::selection_plan plan;
+    plan.push_back(data_selection::plan_ways_from_nodes);
+    plan.push_back(data_selection::plan_nodes_from_way_nodes);
+    plan.push_back(data_selection::plan_relations_from_ways);
+    plan.push_back(data_selection::plan_relations_from_nodes);
+    plan.push_back(data_selection::plan_relations_from_relations);
+    sel->select_plan(plan);
   }
 }
 
 map_responder::~map_responder() {}
 
+string map_responder::cache_control() const {
+  if (m_fixed_grid) {
+    return (format("public, max-age=%1%") % TILE_MAX_AGE).str();
+  }
+  return osm_current_responder::cache_control();
+}
+
 map_handler::map_handler(request &req) : bounds(validate_request(req)) {}
 
-map_handler::map_handler(request &req, int) {}
+map_handler::map_handler(request &req, osm_nwr_id_t tile_id)
+    : bounds(tile_bounds(tile_id)), tile(tile_id) {}
 
 map_handler::~map_handler() {}
 
 string map_handler::log_name() const {
+  if (tile) {
+    return (boost::format("map/tile(%1%)") % *tile).str();
+  }
   return (boost::format("map(%1%,%2%,%3%,%4%)") % bounds.minlon %
           bounds.minlat % bounds.maxlon % bounds.maxlat).str();
 }
 
 responder_ptr_t map_handler::responder(factory_ptr &x) const {
-  return responder_ptr_t(new map_responder(mime_type, bounds, x));
+  return responder_ptr_t(
+      new map_responder(mime_type, bounds, x, bool(tile)));
+}
+
+// arbitrary bounding boxes are rarely asked for twice, but tiles are.
+bool map_handler::response_cacheable() const { return bool(tile); }
+
+bbox map_handler::tile_bounds(osm_nwr_id_t tile_id) {
+  const osm_nwr_id_t num_tiles = osm_nwr_id_t(1) << (2 * TILE_ZOOM);
+  if (tile_id >= num_tiles) {
+    throw http::bad_request(
+        (boost::format("Tile IDs must be less than %1%.") % num_tiles).str());
+  }
+
+  // undo the interleaving, x having the higher bit of each pair.
+  unsigned int x = 0, y = 0;
+  for (int i = TILE_ZOOM - 1; i >= 0; --i) {
+    x = (x << 1) | ((tile_id >> (2 * i + 1)) & 1);
+    y = (y << 1) | ((tile_id >> (2 * i)) & 1);
+  }
+
+  const double width = 360.0 / (1 << TILE_ZOOM);
+  const double height = 180.0 / (1 << TILE_ZOOM);
+  return bbox(-90.0 + y * height, -180.0 + x * width,
+              -90.0 + (y + 1) * height, -180.0 + (x + 1) * width);
 }
 
 namespace {
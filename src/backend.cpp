@@ -1,7 +1,9 @@
 #include "cgimap/backend.hpp"
+#include "cgimap/cached_selection.hpp"
 #include "cgimap/config.hpp"
 #include <boost/thread.hpp>
 #include <boost/format.hpp>
+#include <boost/make_shared.hpp>
 #include <boost/foreach.hpp>
 #include <stdexcept>
 
@@ -40,6 +42,7 @@ struct registry {
   void output_options(std::ostream &out);
   shared_ptr<data_selection::factory> create(const po::variables_map &options);
   shared_ptr<oauth::store> create_oauth_store(const boost::program_options::variables_map &opts);
+  void setup_shared(const po::variables_map &options);
 
 private:
   typedef std::map<std::string, shared_ptr<backend> > backend_map_t;
@@ -87,6 +90,11 @@ void registry::setup_options(int argc, char *argv[],
   desc.add_options()("backend", po::value<std::string>()->default_value(
                                     default_backend->name()),
                      description.c_str());
+  desc.add_options()("element-cache-bytes",
+                     po::value<size_t>()->default_value(0),
+                     "bytes of whole nodes, ways and relations to cache in "
+                     "each instance, for backends which support it. 0 "
+                     "disables the element cache");
 
   po::variables_map vm = first_pass_argments(argc, argv, desc);
 
@@ -126,7 +134,17 @@ registry::create(const po::variables_map &options) {
     }
   }
 
-  return ptr->create(options);
+  shared_ptr<data_selection::factory> factory = ptr->create(options);
+
+  const size_t element_cache_bytes =
+      options.count("element-cache-bytes")
+          ? options["element-cache-bytes"].as<size_t>()
+          : 0;
+  if (element_cache_bytes > 0) {
+    factory = boost::make_shared<cached_selection::factory>(
+        factory, element_cache_bytes);
+  }
+  return factory;
 }
 
 boost::shared_ptr<oauth::store>
@@ -144,6 +162,20 @@ registry::create_oauth_store(const boost::program_options::variables_map &option
   return ptr->create_oauth_store(options);
 }
 
+void registry::setup_shared(const po::variables_map &options) {
+  shared_ptr<backend> ptr = default_backend;
+
+  if (options.count("backend")) {
+    backend_map_t::iterator itr =
+        backends.find(options["backend"].as<std::string>());
+    if (itr != backends.end()) {
+      ptr = itr->second;
+    }
+  }
+
+  ptr->setup_shared(options);
+}
+
 registry *registry_ptr = NULL;
 boost::mutex registry_mut;
 
@@ -151,6 +183,8 @@ boost::mutex registry_mut;
 
 backend::~backend() {}
 
+void backend::setup_shared(const po::variables_map &) {}
+
 bool register_backend(shared_ptr<backend> ptr) {
   boost::unique_lock<boost::mutex> lock(registry_mut);
   if (registry_ptr == NULL) {
@@ -198,3 +232,12 @@ create_oauth_store(const po::variables_map &options) {
 
   return registry_ptr->create_oauth_store(options);
 }
+
+void setup_backend_shared(const po::variables_map &options) {
+  boost::unique_lock<boost::mutex> lock(registry_mut);
+  if (registry_ptr == NULL) {
+    registry_ptr = new registry;
+  }
+
+  registry_ptr->setup_shared(options);
+}
@@ -2,6 +2,7 @@
 #include "cgimap/backend/apidb/writeable_pgsql_selection.hpp"
 #include "cgimap/backend/apidb/readonly_pgsql_selection.hpp"
 #include "cgimap/backend/apidb/oauth_store.hpp"
+#include "cgimap/backend/apidb/shared_changeset_cache.hpp"
 #include "cgimap/backend.hpp"
 
 #include <boost/make_shared.hpp>
@@ -25,8 +26,51 @@ struct apidb_backend : public backend {
       ("charset", po::value<string>()->default_value("utf8"),
        "database character set")
       ("readonly", "use the database in read-only mode")
+      ("binary-arrays",
+       "send arrays of IDs to the database in binary format (read-only mode)")
       ("cachesize", po::value<size_t>()->default_value(CACHE_SIZE),
-       "maximum size of changeset cache")
+       "maximum number of changesets to cache, if --cache-bytes isn't set")
+      ("cache-bytes", po::value<size_t>()->default_value(0),
+       "maximum size of changeset cache in bytes. 0 sizes it from "
+       "--cachesize")
+      ("changeset-memcache", po::value<string>(),
+       "memcache servers to share cached changesets between hosts, e.g: "
+       "host1:11211,host2:11211")
+      ("changeset-memcache-ttl", po::value<int>()->default_value(3600),
+       "seconds to keep changesets in memcache for")
+      ("changeset-memcache-prefix",
+       po::value<string>()->default_value("cgimap:changeset:"),
+       "prefix of the memcache keys for changesets. changing it starts a "
+       "fresh set of keys")
+      ("shared-cachesize", po::value<size_t>()->default_value(0),
+       "number of changesets to cache in memory shared between all "
+       "instances, underneath each instance's own cache. 0 disables it")
+      ("existence-filter-refresh", po::value<int>()->default_value(0),
+       "seconds between reloading the highest element IDs, which are used "
+       "to answer requests for IDs never created without a query. 0 "
+       "disables it")
+      ("existence-filter-recheck", po::value<int>()->default_value(1),
+       "minimum seconds between reloading the highest element IDs before "
+       "answering that an element above them doesn't exist")
+      ("existence-filter-slack",
+       po::value<osm_nwr_id_t>()->default_value(100000),
+       "minimum number of IDs above the highest which go to the database "
+       "without reloading them, for elements created since the last reload")
+      ("node-density",
+       "load node counts from the node_density table at startup, and use "
+       "them to turn away map calls with too many nodes without a query")
+      ("copy-extract",
+       "extract elements from the database with binary COPY (read-only mode)")
+      ("extract-connections", po::value<size_t>()->default_value(0),
+       "number of extra connections on which to fetch ways and relations "
+       "in parallel with nodes (read-only mode)")
+      ("extract-batch-size", po::value<size_t>()->default_value(0),
+       "stream elements from the database through a cursor, this many rows "
+       "at a time. 0 fetches all rows at once (not in read-only mode)")
+      ("temp-tables-per-request",
+       "create the temporary tables in each request's transaction rather "
+       "than once per connection, as older versions did (not in read-only "
+       "mode)")
       ("dbport", po::value<string>(),
        "database port number or UNIX socket file name")
       ("oauth-dbname", po::value<string>(),
@@ -73,6 +117,11 @@ struct apidb_backend : public backend {
     return store;
   }
 
+  void setup_shared(const po::variables_map &opts) {
+    shared_changeset_cache::initialise(
+        opts["shared-cachesize"].as<size_t>());
+  }
+
 private:
   string m_name;
   po::options_description m_options;
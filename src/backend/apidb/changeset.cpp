@@ -1,17 +1,56 @@
 #include "cgimap/backend/apidb/changeset.hpp"
+#include "cgimap/backend/apidb/memcached_changeset_cache.hpp"
+#include "cgimap/backend/apidb/shared_changeset_cache.hpp"
+#include "cgimap/backend/apidb/pqxx_string_traits.hpp"
 #include "cgimap/logger.hpp"
 #include "cgimap/http.hpp"
+#include <boost/bind.hpp>
 #include <boost/format.hpp>
+#include <boost/make_shared.hpp>
+
+#if PQXX_VERSION_MAJOR >= 4
+#define PREPARE_ARGS(args)
+#else
+#define PREPARE_ARGS(args) args
+#endif
 
 using std::string;
 using boost::format;
 
+namespace {
+
+changeset *make_changeset(const pqxx::result::tuple &row) {
+  int64_t user_id = row["user_id"].as<int64_t>();
+  // apidb instances external to OSM don't have access to anonymous
+  // user information and so use an ID which isn't in use for any
+  // other user to indicate this - generally 0 or negative.
+  if (user_id <= 0) {
+    return new changeset(false, "", 0);
+  } else {
+    return new changeset(row["data_public"].as<bool>(),
+                         row["display_name"].as<string>(),
+                         osm_user_id_t(user_id));
+  }
+}
+
+} // anonymous namespace
+
 changeset::changeset(bool dp, const string &dn, osm_user_id_t id)
     : data_public(dp), display_name(dn), user_id(id) {}
 
+size_t changeset_cache_bytes(size_t cache_bytes, size_t cachesize) {
+  if (cache_bytes > 0) {
+    return cache_bytes;
+  }
+  // a display name of a typical length.
+  const changeset typical(true, string(16, 'x'), 1);
+  return cachesize * cache<osm_changeset_id_t, changeset>::charge(typical);
+}
+
 changeset *fetch_changeset(pqxx::transaction_base &w, osm_changeset_id_t id) {
   pqxx::result res =
-      w.exec("select u.data_public, u.display_name, u.id from users u "
+      w.exec("select u.data_public, u.display_name, u.id as user_id "
+             "from users u "
              "join changesets c on u.id=c.user_id where c.id=" +
              pqxx::to_string(id));
 
@@ -29,14 +68,83 @@ changeset *fetch_changeset(pqxx::transaction_base &w, osm_changeset_id_t id) {
             .str());
   }
 
-  int64_t user_id = res[0][2].as<int64_t>();
-  // apidb instances external to OSM don't have access to anonymous
-  // user information and so use an ID which isn't in use for any
-  // other user to indicate this - generally 0 or negative.
-  if (user_id <= 0) {
-    return new changeset(false, "", 0);
+  return make_changeset(res[0]);
+}
+
+void prepare_changeset_statements(pqxx::connection_base &conn) {
+  // clang-format off
+  conn.prepare("fetch_changesets",
+    "SELECT c.id, u.data_public, u.display_name, u.id AS user_id "
+      "FROM changesets c "
+        "JOIN users u ON u.id = c.user_id "
+      "WHERE c.id = ANY($1)")
+    PREPARE_ARGS(("bigint[]"));
+  // clang-format on
+}
+
+void fetch_changesets(pqxx::transaction_base &w,
+                      const std::vector<osm_changeset_id_t> &ids,
+                      cache<osm_changeset_id_t, changeset>::batch_type &out) {
+  // any changesets which aren't found here are left out, and so will be
+  // looked up again one at a time, which is where the error is reported.
+  pqxx::result res = w.prepared("fetch_changesets")(ids).exec();
+  out.reserve(out.size() + res.size());
+  for (pqxx::result::const_iterator itr = res.begin(); itr != res.end();
+       ++itr) {
+    out.push_back(std::make_pair(
+        (*itr)["id"].as<osm_changeset_id_t>(),
+        boost::shared_ptr<changeset const>(make_changeset(*itr))));
+  }
+}
+
+namespace {
+
+// fetch from memcached, if there is one, or the database.
+changeset *fetch_changeset_memcached(pqxx::transaction_base &w,
+                                     memcached_changeset_cache *memcache,
+                                     osm_changeset_id_t id) {
+  if (memcache == NULL) {
+    return fetch_changeset(w, id);
+  }
+  return memcache->get_or_fetch(
+      id, boost::bind(fetch_changeset, boost::ref(w), _1));
+}
+
+void fetch_changesets_memcached(
+    pqxx::transaction_base &w, memcached_changeset_cache *memcache,
+    const std::vector<osm_changeset_id_t> &ids,
+    cache<osm_changeset_id_t, changeset>::batch_type &out) {
+  if (memcache == NULL) {
+    fetch_changesets(w, ids, out);
   } else {
-    return new changeset(res[0][0].as<bool>(), res[0][1].as<string>(),
-                         osm_user_id_t(user_id));
+    memcache->get_or_fetch(
+        ids, out, boost::bind(fetch_changesets, boost::ref(w), _1, _2));
+  }
+}
+
+} // anonymous namespace
+
+changeset *fetch_changeset_shared(pqxx::transaction_base &w,
+                                  memcached_changeset_cache *memcache,
+                                  osm_changeset_id_t id) {
+  shared_changeset_cache *shared = shared_changeset_cache::instance();
+  if (shared == NULL) {
+    return fetch_changeset_memcached(w, memcache, id);
+  }
+  return shared->get_or_fetch(
+      id, boost::bind(fetch_changeset_memcached, boost::ref(w), memcache, _1));
+}
+
+void fetch_changesets_shared(
+    pqxx::transaction_base &w, memcached_changeset_cache *memcache,
+    const std::vector<osm_changeset_id_t> &ids,
+    cache<osm_changeset_id_t, changeset>::batch_type &out) {
+  shared_changeset_cache *shared = shared_changeset_cache::instance();
+  if (shared == NULL) {
+    fetch_changesets_memcached(w, memcache, ids, out);
+  } else {
+    shared->get_or_fetch(ids, out,
+                         boost::bind(fetch_changesets_memcached,
+                                     boost::ref(w), memcache, _1, _2));
   }
 }
@@ -0,0 +1,172 @@
+#include "cgimap/backend/apidb/existence_filter.hpp"
+#include "cgimap/logger.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <boost/bind.hpp>
+#include <boost/format.hpp>
+#include <boost/ref.hpp>
+
+namespace po = boost::program_options;
+namespace pt = boost::posix_time;
+
+namespace {
+
+existence_filter::max_ids fetch_max_ids(pqxx::transaction_base &w) {
+  // each of these is a single step backwards along the primary key index.
+  pqxx::result res = w.exec("SELECT "
+                            "(SELECT max(id) FROM current_nodes), "
+                            "(SELECT max(id) FROM current_ways), "
+                            "(SELECT max(id) FROM current_relations)");
+
+  // max() is NULL on an empty table, in which case nothing can exist.
+  existence_filter::max_ids ids;
+  ids.node = res[0][0].as<osm_nwr_id_t>(0);
+  ids.way = res[0][1].as<osm_nwr_id_t>(0);
+  ids.relation = res[0][2].as<osm_nwr_id_t>(0);
+  return ids;
+}
+
+// the slack for a type: twice what the highest ID grew by since the last
+// reload, or the minimum if that's more.
+osm_nwr_id_t slack_for(osm_nwr_id_t old_max, osm_nwr_id_t new_max,
+                       osm_nwr_id_t min_slack) {
+  const osm_nwr_id_t growth = (new_max > old_max) ? (new_max - old_max) : 0;
+  return std::max(min_slack, 2 * growth);
+}
+
+} // anonymous namespace
+
+existence_filter::existence_filter(const fetch_function &fetch,
+                                   const pt::time_duration &interval,
+                                   const pt::time_duration &recheck,
+                                   osm_nwr_id_t min_slack)
+    : m_fetch(fetch), m_interval(interval), m_recheck(recheck),
+      m_min_slack(min_slack), m_loaded(false) {
+  m_max.node = m_max.way = m_max.relation = 0;
+  m_loaded_max = m_slack = m_max;
+  m_stats.refreshes = m_stats.failures = m_stats.rechecks = 0;
+  m_stats.filtered = 0;
+  m_stats.last_refresh_time = pt::time_duration();
+  m_stats.bytes = sizeof(existence_filter);
+}
+
+void existence_filter::refresh(const pt::ptime &now) {
+  m_now = now;
+  if (!m_loaded_at.is_not_a_date_time() && (now - m_loaded_at < m_interval)) {
+    return;
+  }
+  // a failed reload waits for the interval too, rather than every request
+  // trying again.
+  m_loaded_at = now;
+
+  const pt::ptime start = pt::microsec_clock::universal_time();
+  max_ids ids;
+  if (!fetch(ids)) {
+    return;
+  }
+
+  if (m_loaded) {
+    m_slack.node = slack_for(m_loaded_max.node, ids.node, m_min_slack);
+    m_slack.way = slack_for(m_loaded_max.way, ids.way, m_min_slack);
+    m_slack.relation =
+        slack_for(m_loaded_max.relation, ids.relation, m_min_slack);
+  } else {
+    m_slack.node = m_slack.way = m_slack.relation = m_min_slack;
+  }
+  m_max = m_loaded_max = ids;
+  m_checked_at = now;
+  m_loaded = true;
+
+  ++m_stats.refreshes;
+  m_stats.last_refresh_time = pt::microsec_clock::universal_time() - start;
+  logger::message(
+      boost::format("Refreshed existence filter in %1% ms (%2% bytes): "
+                    "max node %3%, way %4%, relation %5%; %6% lookups "
+                    "filtered so far") %
+      m_stats.last_refresh_time.total_milliseconds() % m_stats.bytes %
+      m_max.node % m_max.way % m_max.relation % m_stats.filtered);
+}
+
+bool existence_filter::can_exist(element_type type, osm_nwr_id_t id) {
+  return !filter_out(type, id);
+}
+
+bool existence_filter::any_can_exist(element_type type,
+                                     const std::vector<osm_nwr_id_t> &ids) {
+  if (ids.empty()) {
+    return true;
+  }
+  return !filter_out(type, *std::min_element(ids.begin(), ids.end()));
+}
+
+existence_filter::stats existence_filter::get_stats() const {
+  return m_stats;
+}
+
+existence_filter *existence_filter::create(const po::variables_map &opts,
+                                           pqxx::transaction_base &w) {
+  const int refresh = opts["existence-filter-refresh"].as<int>();
+  if (refresh <= 0) {
+    return NULL;
+  }
+  return new existence_filter(
+      boost::bind(fetch_max_ids, boost::ref(w)), pt::seconds(refresh),
+      pt::seconds(opts["existence-filter-recheck"].as<int>()),
+      opts["existence-filter-slack"].as<osm_nwr_id_t>());
+}
+
+bool existence_filter::filter_out(element_type type, osm_nwr_id_t id) {
+  if (!m_loaded || (id <= limit(type))) {
+    return false;
+  }
+
+  // the element may have been created since the highest IDs were fetched,
+  // so they're fetched again unless that was less than the recheck
+  // interval ago. the slack is left alone, as it's for the growth over a
+  // whole reload interval.
+  if (m_now - m_checked_at >= m_recheck) {
+    m_checked_at = m_now;
+    max_ids ids;
+    if (!fetch(ids)) {
+      return false;
+    }
+    m_max = ids;
+    ++m_stats.rechecks;
+    if (id <= limit(type)) {
+      return false;
+    }
+  }
+
+  ++m_stats.filtered;
+  return true;
+}
+
+bool existence_filter::fetch(max_ids &ids) {
+  try {
+    ids = m_fetch();
+
+  } catch (const std::exception &e) {
+    m_loaded = false;
+    ++m_stats.failures;
+    logger::message(
+        boost::format("Unable to refresh existence filter, not using it: %1%") %
+        e.what());
+    return false;
+  }
+  return true;
+}
+
+osm_nwr_id_t existence_filter::limit(element_type type) const {
+  switch (type) {
+  case element_type_node:
+    return m_max.node + m_slack.node;
+  case element_type_way:
+    return m_max.way + m_slack.way;
+  case element_type_relation:
+    return m_max.relation + m_slack.relation;
+  default:
+    throw std::runtime_error("Existence filter only covers nodes, ways and "
+                             "relations.");
+  }
+}
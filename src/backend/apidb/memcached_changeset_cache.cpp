@@ -0,0 +1,236 @@
+#include "cgimap/backend/apidb/memcached_changeset_cache.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <boost/format.hpp>
+
+namespace po = boost::program_options;
+
+namespace {
+
+// the version of the format of the values, which is part of the keys, and
+// has to be changed whenever encode() is.
+const char *const FORMAT_VERSION = "v1:";
+
+// the most keys asked for in a single multi-get.
+const size_t MGET_CHUNK = 256;
+
+// how long, in ms, to wait to connect to or hear back from memcached
+// before giving up and going to the database instead.
+const uint64_t TIMEOUT_MS = 100;
+
+// after this many failures in a row a server is left alone for
+// RETRY_TIMEOUT_S seconds, rather than each request waiting on it again.
+const uint64_t SERVER_FAILURE_LIMIT = 2;
+const uint64_t RETRY_TIMEOUT_S = 10;
+
+} // anonymous namespace
+
+memcached_changeset_cache::memcached_changeset_cache(
+    const std::string &servers, const std::string &prefix, time_t ttl)
+    : m_memc(memcached_create(NULL)), m_prefix(prefix + FORMAT_VERSION),
+      m_ttl(ttl) {
+  if (m_memc == NULL) {
+    throw std::runtime_error("Unable to create memcached changeset cache.");
+  }
+  m_stats.hits = m_stats.misses = m_stats.errors = 0;
+
+  memcached_behavior_set(m_memc, MEMCACHED_BEHAVIOR_NO_BLOCK, 1);
+  memcached_behavior_set(m_memc, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, 1);
+  memcached_behavior_set(m_memc, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT,
+                         TIMEOUT_MS);
+  memcached_behavior_set(m_memc, MEMCACHED_BEHAVIOR_POLL_TIMEOUT, TIMEOUT_MS);
+  memcached_behavior_set(m_memc, MEMCACHED_BEHAVIOR_SERVER_FAILURE_LIMIT,
+                         SERVER_FAILURE_LIMIT);
+  memcached_behavior_set(m_memc, MEMCACHED_BEHAVIOR_RETRY_TIMEOUT,
+                         RETRY_TIMEOUT_S);
+
+  memcached_server_st *server_list = memcached_servers_parse(servers.c_str());
+  if (server_list == NULL) {
+    memcached_free(m_memc);
+    throw std::runtime_error(
+        (boost::format("Unable to parse changeset memcache servers %1%.") %
+         servers).str());
+  }
+  memcached_server_push(m_memc, server_list);
+  memcached_server_list_free(server_list);
+}
+
+memcached_changeset_cache::~memcached_changeset_cache() {
+  memcached_free(m_memc);
+}
+
+changeset *memcached_changeset_cache::get_or_fetch(
+    osm_changeset_id_t id, const fetch_function &fetch) {
+  const std::string k = key(id);
+  size_t length = 0;
+  uint32_t flags = 0;
+  memcached_return error;
+
+  char *value =
+      memcached_get(m_memc, k.data(), k.size(), &length, &flags, &error);
+  if (value != NULL) {
+    changeset *c = decode(value, length);
+    free(value);
+    if (c != NULL) {
+      ++m_stats.hits;
+      return c;
+    }
+  } else if (error != MEMCACHED_NOTFOUND) {
+    ++m_stats.errors;
+  }
+  ++m_stats.misses;
+
+  changeset *c = fetch(id);
+  if (c != NULL) {
+    put(id, *c);
+  }
+  return c;
+}
+
+void memcached_changeset_cache::get_or_fetch(
+    const std::vector<osm_changeset_id_t> &ids,
+    cache<osm_changeset_id_t, changeset>::batch_type &out,
+    const batch_fetch_function &fetch) {
+  std::vector<osm_changeset_id_t> missing;
+  std::vector<std::string> keys;
+  std::vector<const char *> key_ptrs;
+  std::vector<size_t> key_lengths;
+
+  for (size_t start = 0; start < ids.size(); start += MGET_CHUNK) {
+    const size_t end = std::min(ids.size(), start + MGET_CHUNK);
+
+    keys.clear();
+    key_ptrs.clear();
+    key_lengths.clear();
+    for (size_t i = start; i < end; ++i) {
+      keys.push_back(key(ids[i]));
+    }
+    for (size_t i = 0; i < keys.size(); ++i) {
+      key_ptrs.push_back(keys[i].data());
+      key_lengths.push_back(keys[i].size());
+    }
+
+    // the changesets in this chunk which were found, so that the rest can
+    // be fetched from the database.
+    std::vector<bool> found(end - start, false);
+
+    if (memcached_mget(m_memc, &key_ptrs[0], &key_lengths[0],
+                       key_ptrs.size()) == MEMCACHED_SUCCESS) {
+      memcached_result_st *result = memcached_result_create(m_memc, NULL);
+      memcached_return error;
+      while ((result != NULL) &&
+             (memcached_fetch_result(m_memc, result, &error) != NULL)) {
+        // the results come back in any order, so the ID is got back from
+        // the key rather than its position in the chunk.
+        const char *k = memcached_result_key_value(result);
+        const size_t k_length = memcached_result_key_length(result);
+        if ((k_length <= m_prefix.size()) ||
+            (memcmp(k, m_prefix.data(), m_prefix.size()) != 0)) {
+          continue;
+        }
+        const osm_changeset_id_t id = osm_changeset_id_t(strtoll(
+            std::string(k + m_prefix.size(), k_length - m_prefix.size())
+                .c_str(),
+            NULL, 10));
+
+        changeset *c = decode(memcached_result_value(result),
+                              memcached_result_length(result));
+        if (c == NULL) {
+          continue;
+        }
+        for (size_t i = start; i < end; ++i) {
+          if ((ids[i] == id) && !found[i - start]) {
+            found[i - start] = true;
+            break;
+          }
+        }
+        out.push_back(
+            std::make_pair(id, boost::shared_ptr<changeset const>(c)));
+        ++m_stats.hits;
+      }
+      if (result != NULL) {
+        memcached_result_free(result);
+      }
+    } else {
+      ++m_stats.errors;
+    }
+
+    for (size_t i = start; i < end; ++i) {
+      if (!found[i - start]) {
+        missing.push_back(ids[i]);
+      }
+    }
+  }
+
+  if (!missing.empty()) {
+    m_stats.misses += missing.size();
+    const size_t first_fetched = out.size();
+    fetch(missing, out);
+    for (size_t i = first_fetched; i < out.size(); ++i) {
+      put(out[i].first, *out[i].second);
+    }
+  }
+}
+
+memcached_changeset_cache::stats memcached_changeset_cache::get_stats() const {
+  return m_stats;
+}
+
+std::string memcached_changeset_cache::key(osm_changeset_id_t id) const {
+  return m_prefix + std::to_string(id);
+}
+
+std::string memcached_changeset_cache::encode(const changeset &c) {
+  // "<data_public> <user_id> <display_name>", the display name last as it
+  // can have spaces in it.
+  return (boost::format("%1% %2% ") % (c.data_public ? 1 : 0) % c.user_id)
+             .str() +
+         c.display_name;
+}
+
+changeset *memcached_changeset_cache::decode(const char *data,
+                                             size_t length) {
+  const std::string value(data, length);
+
+  if ((value.size() < 4) || ((value[0] != '0') && (value[0] != '1')) ||
+      (value[1] != ' ')) {
+    return NULL;
+  }
+  const size_t name_start = value.find(' ', 2);
+  if ((name_start == std::string::npos) || (name_start == 2)) {
+    return NULL;
+  }
+  char *end = NULL;
+  const long long user_id = strtoll(value.c_str() + 2, &end, 10);
+  if (end != value.c_str() + name_start) {
+    return NULL;
+  }
+
+  return new changeset(value[0] == '1', value.substr(name_start + 1),
+                       osm_user_id_t(user_id));
+}
+
+memcached_changeset_cache *
+memcached_changeset_cache::create(const po::variables_map &opts) {
+  if (opts.count("changeset-memcache") == 0) {
+    return NULL;
+  }
+  return new memcached_changeset_cache(
+      opts["changeset-memcache"].as<std::string>(),
+      opts["changeset-memcache-prefix"].as<std::string>(),
+      time_t(opts["changeset-memcache-ttl"].as<int>()));
+}
+
+void memcached_changeset_cache::put(osm_changeset_id_t id,
+                                    const changeset &c) {
+  const std::string k = key(id), value = encode(c);
+  memcached_return error = memcached_set(m_memc, k.data(), k.size(),
+                                         value.data(), value.size(), m_ttl, 0);
+  // without blocking, the set is only buffered to be sent later.
+  if ((error != MEMCACHED_SUCCESS) && (error != MEMCACHED_BUFFERED)) {
+    ++m_stats.errors;
+  }
+}
@@ -0,0 +1,99 @@
+#include "cgimap/backend/apidb/node_density.hpp"
+#include "cgimap/backend/apidb/quad_tile.hpp"
+#include "cgimap/logger.hpp"
+
+#include <algorithm>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/format.hpp>
+
+namespace po = boost::program_options;
+namespace pt = boost::posix_time;
+
+namespace {
+
+// bboxes are only turned away when the lower bound is over the limit by
+// at least this fraction of it, to allow for nodes deleted since the
+// counts were updated.
+const int MARGIN_DIVISOR = 10;
+
+bool cell_less(const std::pair<tile_id_t, uint64_t> &a, tile_id_t b) {
+  return a.first < b;
+}
+
+} // anonymous namespace
+
+node_density::node_density(const counts_t &counts) : m_counts(counts) {
+  std::sort(m_counts.begin(), m_counts.end());
+  m_stats.cells = m_counts.size();
+  m_stats.bytes = sizeof(node_density) +
+                  m_counts.capacity() * sizeof(counts_t::value_type);
+  m_stats.rejected = 0;
+}
+
+uint64_t node_density::min_nodes(const bbox &bounds) const {
+  const std::vector<tile_id_t> cells = cells_inside_area(
+      bounds.minlat, bounds.minlon, bounds.maxlat, bounds.maxlon, ZOOM);
+
+  // both are sorted, so each search can start where the last one left off.
+  uint64_t total = 0;
+  counts_t::const_iterator itr = m_counts.begin();
+  for (std::vector<tile_id_t>::const_iterator cell = cells.begin();
+       cell != cells.end(); ++cell) {
+    itr = std::lower_bound(itr, m_counts.end(), *cell, cell_less);
+    if (itr == m_counts.end()) {
+      break;
+    }
+    if (itr->first == *cell) {
+      total += itr->second;
+    }
+  }
+  return total;
+}
+
+bool node_density::too_many_nodes(const bbox &bounds, int max_nodes) {
+  const uint64_t min = min_nodes(bounds);
+  if (min <= uint64_t(max_nodes) + uint64_t(max_nodes / MARGIN_DIVISOR)) {
+    return false;
+  }
+  ++m_stats.rejected;
+  logger::message(
+      boost::format("Turning away bbox with at least %1% nodes, from the "
+                    "node density counts") % min);
+  return true;
+}
+
+node_density::stats node_density::get_stats() const { return m_stats; }
+
+node_density *node_density::create(const po::variables_map &opts,
+                                   pqxx::transaction_base &w) {
+  if (opts.count("node-density") == 0) {
+    return NULL;
+  }
+
+  const pt::ptime start = pt::microsec_clock::universal_time();
+  counts_t counts;
+  try {
+    pqxx::result res = w.exec("SELECT cell, nodes FROM node_density");
+    counts.reserve(res.size());
+    for (pqxx::result::const_iterator itr = res.begin(); itr != res.end();
+         ++itr) {
+      counts.push_back(std::make_pair(itr[0].as<tile_id_t>(),
+                                      itr[1].as<uint64_t>()));
+    }
+
+  } catch (const std::exception &e) {
+    logger::message(
+        boost::format("Unable to load node density, not using it: %1%") %
+        e.what());
+    return NULL;
+  }
+
+  node_density *density = new node_density(counts);
+  logger::message(
+      boost::format("Loaded node density for %1% cells in %2% ms "
+                    "(%3% bytes)") %
+      density->m_stats.cells %
+      (pt::microsec_clock::universal_time() - start).total_milliseconds() %
+      density->m_stats.bytes);
+  return density;
+}
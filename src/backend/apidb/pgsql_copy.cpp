@@ -0,0 +1,244 @@
+#include "cgimap/backend/apidb/pgsql_copy.hpp"
+
+#include <cstring>
+#include <stdexcept>
+#include <boost/format.hpp>
+
+namespace {
+
+// the fixed part of the binary COPY header.
+const char COPY_SIGNATURE[] = "PGCOPY\n\377\r\n";
+const size_t COPY_SIGNATURE_LEN = 11; // including the trailing '\0'
+
+inline uint16_t read_uint16(const char *p) {
+  const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+  return (uint16_t(u[0]) << 8) | uint16_t(u[1]);
+}
+
+inline uint32_t read_uint32(const char *p) {
+  const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+  return (uint32_t(u[0]) << 24) | (uint32_t(u[1]) << 16) |
+         (uint32_t(u[2]) << 8) | uint32_t(u[3]);
+}
+
+inline uint64_t read_uint64(const char *p) {
+  return (uint64_t(read_uint32(p)) << 32) | uint64_t(read_uint32(p + 4));
+}
+
+void check_space(size_t pos, size_t needed, size_t len) {
+  if (pos + needed > len) {
+    throw std::runtime_error("Truncated message in binary COPY data.");
+  }
+}
+
+} // anonymous namespace
+
+copy_connection::policy::policy(const std::string &opts)
+    : pqxx::connect_direct(opts), m_handle(NULL) {}
+
+copy_connection::policy::handle
+copy_connection::policy::do_startconnect(handle orig) {
+  m_handle = pqxx::connect_direct::do_startconnect(orig);
+  return m_handle;
+}
+
+copy_connection::policy::handle
+copy_connection::policy::do_completeconnect(handle orig) {
+  m_handle = pqxx::connect_direct::do_completeconnect(orig);
+  return m_handle;
+}
+
+copy_connection::policy::handle
+copy_connection::policy::do_dropconnect(handle orig) throw() {
+  m_handle = pqxx::connect_direct::do_dropconnect(orig);
+  return m_handle;
+}
+
+copy_connection::policy::handle
+copy_connection::policy::do_disconnect(handle orig) throw() {
+  m_handle = pqxx::connect_direct::do_disconnect(orig);
+  return m_handle;
+}
+
+copy_connection::copy_connection(const std::string &opts)
+    : pqxx::connection_base(m_policy), m_options(opts), m_policy(m_options) {
+  init();
+}
+
+copy_connection::~copy_connection() throw() { close(); }
+
+PGconn *copy_connection::handle() const { return m_policy.m_handle; }
+
+pgsql_copy_parser::pgsql_copy_parser() : m_seen_header(false), m_data(NULL) {}
+
+bool pgsql_copy_parser::parse(const char *data, size_t len) {
+  size_t pos = 0;
+  m_data = data;
+  m_fields.clear();
+
+  if (!m_seen_header) {
+    check_space(pos, COPY_SIGNATURE_LEN + 8, len);
+    if (memcmp(data, COPY_SIGNATURE, COPY_SIGNATURE_LEN) != 0) {
+      throw std::runtime_error("Bad signature in binary COPY header.");
+    }
+    pos += COPY_SIGNATURE_LEN;
+    // flags field, followed by the length of the header extension area,
+    // which we don't need anything from.
+    pos += 4;
+    const uint32_t extension_len = read_uint32(data + pos);
+    pos += 4;
+    check_space(pos, extension_len, len);
+    pos += extension_len;
+    m_seen_header = true;
+  }
+
+  check_space(pos, 2, len);
+  const int16_t num_fields = int16_t(read_uint16(data + pos));
+  pos += 2;
+
+  // the trailer is a field count of -1
+  if (num_fields < 0) {
+    return false;
+  }
+
+  m_fields.reserve(num_fields);
+  for (int16_t i = 0; i < num_fields; ++i) {
+    check_space(pos, 4, len);
+    const int32_t field_len = int32_t(read_uint32(data + pos));
+    pos += 4;
+    m_fields.push_back(std::make_pair(pos, field_len));
+    if (field_len > 0) {
+      check_space(pos, field_len, len);
+      pos += field_len;
+    }
+  }
+
+  return true;
+}
+
+size_t pgsql_copy_parser::num_fields() const { return m_fields.size(); }
+
+bool pgsql_copy_parser::is_null(size_t i) const {
+  return m_fields.at(i).second < 0;
+}
+
+const char *pgsql_copy_parser::field(size_t i, int32_t expected_len) const {
+  const std::pair<size_t, int32_t> &f = m_fields.at(i);
+  if ((expected_len >= 0) && (f.second != expected_len)) {
+    throw std::runtime_error(
+        (boost::format("Expected binary COPY field %1% to have length %2%, "
+                       "but it was %3%.") % i % expected_len % f.second)
+            .str());
+  }
+  return m_data + f.first;
+}
+
+int64_t pgsql_copy_parser::get_int64(size_t i) const {
+  return int64_t(read_uint64(field(i, 8)));
+}
+
+int32_t pgsql_copy_parser::get_int32(size_t i) const {
+  return int32_t(read_uint32(field(i, 4)));
+}
+
+bool pgsql_copy_parser::get_bool(size_t i) const {
+  return *field(i, 1) != 0;
+}
+
+std::string pgsql_copy_parser::get_string(size_t i) const {
+  if (is_null(i)) {
+    throw std::runtime_error(
+        (boost::format("Unexpected null in binary COPY field %1%.") % i)
+            .str());
+  }
+  return std::string(field(i, -1), m_fields[i].second);
+}
+
+pgsql_copy_reader::pgsql_copy_reader(PGconn *conn, const std::string &query)
+    : m_conn(conn), m_buffer(NULL), m_done(false) {
+  const std::string copy = "COPY (" + query + ") TO STDOUT (FORMAT binary)";
+
+  PGresult *res = PQexec(m_conn, copy.c_str());
+  const bool ok = PQresultStatus(res) == PGRES_COPY_OUT;
+  const std::string error = ok ? std::string() : PQresultErrorMessage(res);
+  PQclear(res);
+
+  if (!ok) {
+    m_done = true;
+    throw std::runtime_error("Unable to start binary COPY: " + error);
+  }
+
+  next();
+}
+
+pgsql_copy_reader::~pgsql_copy_reader() {
+  if (!m_done) {
+    // any error has to be ignored here, but at least leave the connection
+    // in a usable state.
+    finish();
+  }
+}
+
+bool pgsql_copy_reader::done() const { return m_done; }
+
+void pgsql_copy_reader::next() {
+  if (m_done) {
+    return;
+  }
+
+  if (m_buffer != NULL) {
+    PQfreemem(m_buffer);
+    m_buffer = NULL;
+  }
+
+  const int len = PQgetCopyData(m_conn, &m_buffer, 0);
+
+  if (len > 0) {
+    if (!m_parser.parse(m_buffer, len)) {
+      const std::string error = finish();
+      if (!error.empty()) {
+        throw std::runtime_error("Error during binary COPY: " + error);
+      }
+    }
+
+  } else {
+    // the COPY is over, either successfully or with an error.
+    const std::string error = finish();
+    if ((len != -1) || !error.empty()) {
+      throw std::runtime_error("Error during binary COPY: " + error);
+    }
+  }
+}
+
+std::string pgsql_copy_reader::finish() {
+  std::string error;
+  m_done = true;
+
+  if (m_buffer != NULL) {
+    PQfreemem(m_buffer);
+    m_buffer = NULL;
+  }
+
+  // drain any data left after the trailer, or which wasn't read because
+  // the reader is being destroyed early.
+  char *buffer = NULL;
+  int len = 0;
+  while ((len = PQgetCopyData(m_conn, &buffer, 0)) > 0) {
+    PQfreemem(buffer);
+    buffer = NULL;
+  }
+  if (len == -2) {
+    error = PQerrorMessage(m_conn);
+  }
+
+  // and then the result of the COPY command itself.
+  PGresult *res = NULL;
+  while ((res = PQgetResult(m_conn)) != NULL) {
+    if ((PQresultStatus(res) != PGRES_COMMAND_OK) && error.empty()) {
+      error = PQresultErrorMessage(res);
+    }
+    PQclear(res);
+  }
+
+  return error;
+}
@@ -1,8 +1,11 @@
 #include "cgimap/backend/apidb/quad_tile.hpp"
+#include <algorithm>
 #include <cmath>
 #include <set>
+#include <stdint.h>
 
 using std::set;
+using std::vector;
 
 /* following functions liberally nicked from TomH's quad_tile
  * library.
@@ -43,3 +46,146 @@ std::vector<tile_id_t> tiles_for_area(double minlat, double minlon, double maxla
 
   return std::vector<tile_id_t>(tiles.begin(), tiles.end());
 }
+
+namespace {
+
+// the area to cover, in inclusive tile coordinates.
+struct tile_area {
+  unsigned int minx, maxx, miny, maxy;
+};
+
+// append a range to the list, extending the last one if they're adjacent.
+void add_range(vector<tile_range_t> &ranges, uint64_t first, uint64_t last) {
+  if (!ranges.empty() && (uint64_t(ranges.back().second) + 1 == first)) {
+    ranges.back().second = tile_id_t(last);
+  } else {
+    ranges.push_back(tile_range_t(tile_id_t(first), tile_id_t(last)));
+  }
+}
+
+/* add the ranges covering the part of the area inside the square block of
+ * tiles with its lowest corner at x, y and sides of 2^level tiles. the
+ * quarters are visited in the order of their tile numbers, so the ranges
+ * come out sorted.
+ */
+void split_block(const tile_area &area, unsigned int x, unsigned int y,
+                 int level, vector<tile_range_t> &ranges) {
+  const unsigned int last_x = x + (1u << level) - 1;
+  const unsigned int last_y = y + (1u << level) - 1;
+
+  if ((x > area.maxx) || (last_x < area.minx) || (y > area.maxy) ||
+      (last_y < area.miny)) {
+    return;
+  }
+
+  if ((x >= area.minx) && (last_x <= area.maxx) && (y >= area.miny) &&
+      (last_y <= area.maxy)) {
+    const uint64_t first = xy2tile(x, y);
+    add_range(ranges, first, first + (uint64_t(1) << (2 * level)) - 1);
+    return;
+  }
+
+  // x is the more significant bit of each pair in the tile number.
+  const unsigned int half = 1u << (level - 1);
+  split_block(area, x, y, level - 1, ranges);
+  split_block(area, x, y + half, level - 1, ranges);
+  split_block(area, x + half, y, level - 1, ranges);
+  split_block(area, x + half, y + half, level - 1, ranges);
+}
+
+// fill in the smallest gaps between the ranges until there are no more
+// than max_ranges of them.
+void merge_ranges(vector<tile_range_t> &ranges, size_t max_ranges) {
+  if ((max_ranges == 0) || (ranges.size() <= max_ranges)) {
+    return;
+  }
+
+  // the gaps, as (size, index of the range before the gap).
+  vector<std::pair<uint64_t, size_t> > gaps;
+  gaps.reserve(ranges.size() - 1);
+  for (size_t i = 0; i + 1 < ranges.size(); ++i) {
+    gaps.push_back(std::make_pair(
+        uint64_t(ranges[i + 1].first) - ranges[i].second - 1, i));
+  }
+  const size_t num_filled = ranges.size() - max_ranges;
+  std::nth_element(gaps.begin(), gaps.begin() + num_filled, gaps.end());
+
+  vector<bool> filled(ranges.size(), false);
+  for (size_t i = 0; i < num_filled; ++i) {
+    filled[gaps[i].second] = true;
+  }
+
+  vector<tile_range_t> merged;
+  merged.reserve(max_ranges);
+  merged.push_back(ranges[0]);
+  for (size_t i = 1; i < ranges.size(); ++i) {
+    if (filled[i - 1]) {
+      merged.back().second = ranges[i].second;
+    } else {
+      merged.push_back(ranges[i]);
+    }
+  }
+  ranges.swap(merged);
+}
+
+} // anonymous namespace
+
+std::vector<tile_range_t> tile_ranges_for_area(double minlat, double minlon,
+                                               double maxlat, double maxlon,
+                                               size_t max_ranges) {
+  tile_area area;
+  area.minx = lon2x(minlon);
+  area.maxx = lon2x(maxlon);
+  area.miny = lat2y(minlat);
+  area.maxy = lat2y(maxlat);
+
+  vector<tile_range_t> ranges;
+  if ((area.minx <= area.maxx) && (area.miny <= area.maxy)) {
+    split_block(area, 0, 0, 16, ranges);
+  }
+  merge_ranges(ranges, max_ranges);
+  return ranges;
+}
+
+std::vector<tile_id_t> cells_inside_area(double minlat, double minlon,
+                                         double maxlat, double maxlon,
+                                         int zoom) {
+  const int shift = 16 - zoom;
+  const int cell_size = 1 << shift;
+
+  // the tiles strictly inside the area, leaving out the edges.
+  const int minx = int(lon2x(minlon)) + 1, maxx = int(lon2x(maxlon)) - 1;
+  const int miny = int(lat2y(minlat)) + 1, maxy = int(lat2y(maxlat)) - 1;
+
+  vector<tile_id_t> cells;
+  if ((minx > maxx) || (miny > maxy)) {
+    return cells;
+  }
+
+  // the first cell starting at or after the min, and the last ending at
+  // or before the max.
+  const int first_cx = (minx + cell_size - 1) >> shift;
+  const int last_cx = ((maxx + 1) >> shift) - 1;
+  const int first_cy = (miny + cell_size - 1) >> shift;
+  const int last_cy = ((maxy + 1) >> shift) - 1;
+
+  for (int cx = first_cx; cx <= last_cx; ++cx) {
+    for (int cy = first_cy; cy <= last_cy; ++cy) {
+      cells.push_back(xy2tile(cx, cy));
+    }
+  }
+  std::sort(cells.begin(), cells.end());
+  return cells;
+}
+
+void split_tile_ranges(const std::vector<tile_range_t> &ranges,
+                       std::vector<tile_id_t> &first_tiles,
+                       std::vector<tile_id_t> &last_tiles) {
+  first_tiles.reserve(first_tiles.size() + ranges.size());
+  last_tiles.reserve(last_tiles.size() + ranges.size());
+  for (vector<tile_range_t>::const_iterator itr = ranges.begin();
+       itr != ranges.end(); ++itr) {
+    first_tiles.push_back(itr->first);
+    last_tiles.push_back(itr->second);
+  }
+}
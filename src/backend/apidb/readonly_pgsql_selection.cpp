@@ -1,11 +1,18 @@
 #include "cgimap/backend/apidb/readonly_pgsql_selection.hpp"
 #include "cgimap/backend/apidb/apidb.hpp"
 #include "cgimap/backend/apidb/pqxx_string_traits.hpp"
+#include "cgimap/backend/apidb/pqxx_binary_array.hpp"
+#include "cgimap/backend/apidb/id_set.hpp"
+#include "cgimap/backend/apidb/pgsql_copy.hpp"
+#include "cgimap/backend/apidb/statement_queue.hpp"
+#include "cgimap/backend/apidb/selection_plan.hpp"
+#include "cgimap/infix_ostream_iterator.hpp"
+#include "cgimap/time.hpp"
 #include "cgimap/logger.hpp"
 #include "cgimap/backend/apidb/quad_tile.hpp"
-#include "cgimap/infix_ostream_iterator.hpp"
 
 #include <sstream>
+#include <limits>
 #include <list>
 #include <vector>
 #include <boost/make_shared.hpp>
@@ -21,7 +28,6 @@
 
 namespace po = boost::program_options;
 namespace pt = boost::posix_time;
-using std::set;
 using std::stringstream;
 using std::list;
 using std::vector;
@@ -67,36 +73,36 @@ check_table_visibility(pqxx::work &w, osm_nwr_id_t id,
   }
 }
 
+/* bind an array of IDs as the next parameter of a prepared statement, either
+ * as text or in the binary array format.
+ */
+template <typename T>
+pqxx::prepare::invocation bind_ids(pqxx::prepare::invocation inv,
+                                   const T &ids, bool binary) {
+  if (binary) {
+    inv(to_binary_array(ids));
+  } else {
+    inv(ids);
+  }
+  return inv;
+}
+
 template <typename T>
-inline int insert_results(const pqxx::result &res, set<T> &elems) {
-  int num_inserted = 0;
+inline int insert_results(const pqxx::result &res, id_set<T> &elems) {
+  vector<T> ids;
+  ids.reserve(res.size());
 
   for (pqxx::result::const_iterator itr = res.begin(); itr != res.end();
        ++itr) {
-    const T id = (*itr)["id"].as<T>();
-
-    // note: only count the *new* rows inserted.
-    if (elems.insert(id).second) {
-      ++num_inserted;
-    }
+    ids.push_back((*itr)["id"].as<T>());
   }
 
-  return num_inserted;
+  // note: only count the *new* rows inserted.
+  return elems.insert_batch(ids);
 }
 
-/* Shim for functions not yet converted to prepared statements */
-inline int insert_results_of(pqxx::work &w, std::stringstream &query,
-                             set<osm_nwr_id_t> &elems) {
-  return insert_results(w.exec(query), elems);
-}
-
-void extract_elem(const pqxx::result::tuple &row, element_info &elem,
+void extract_user(element_info &elem,
                   cache<osm_changeset_id_t, changeset> &changeset_cache) {
-  elem.id = row["id"].as<osm_nwr_id_t>();
-  elem.version = row["version"].as<int>();
-  elem.timestamp = row["timestamp"].c_str();
-  elem.changeset = row["changeset_id"].as<osm_changeset_id_t>();
-  elem.visible = row["visible"].as<bool>();
   shared_ptr<changeset const> cs = changeset_cache.get(elem.changeset);
   if (cs->data_public) {
     elem.uid = cs->user_id;
@@ -107,6 +113,39 @@ void extract_elem(const pqxx::result::tuple &row, element_info &elem,
   }
 }
 
+/* rather than filling the changeset cache one changeset at a time as each
+ * row is extracted, the missing changesets for a whole result are fetched
+ * together beforehand. the element helpers below take the cache by pointer,
+ * which is null when the elements are to be written without metadata, and
+ * the changesets aren't looked up at all.
+ */
+void prefetch_changesets(
+    const pqxx::result &res,
+    cache<osm_changeset_id_t, changeset> *changeset_cache) {
+  if (changeset_cache == NULL) {
+    return;
+  }
+  vector<osm_changeset_id_t> ids;
+  ids.reserve(res.size());
+  for (pqxx::result::const_iterator itr = res.begin(); itr != res.end();
+       ++itr) {
+    ids.push_back((*itr)["changeset_id"].as<osm_changeset_id_t>());
+  }
+  changeset_cache->prefetch(ids.begin(), ids.end());
+}
+
+void extract_elem(const pqxx::result::tuple &row, element_info &elem,
+                  cache<osm_changeset_id_t, changeset> *changeset_cache) {
+  elem.id = row["id"].as<osm_nwr_id_t>();
+  elem.version = row["version"].as<int>();
+  elem.timestamp = row["timestamp"].c_str();
+  elem.changeset = row["changeset_id"].as<osm_changeset_id_t>();
+  elem.visible = row["visible"].as<bool>();
+  if (changeset_cache != NULL) {
+    extract_user(elem, *changeset_cache);
+  }
+}
+
 template <typename T>
 boost::optional<T> extract_optional(const pqxx::result::field &f) {
   if (f.is_null()) {
@@ -149,20 +188,68 @@ void extract_changeset(const pqxx::result::tuple &row,
   elem.num_changes = row["num_changes"].as<size_t>();
 }
 
-void extract_tags(const pqxx::result &res, tags_t &tags) {
+/* changeset tags and comments are fetched for a whole chunk of changesets at
+ * once, sorted by the changeset ID in the "id" column. as the changesets are
+ * also returned in ID order, the children for each one can be found by
+ * walking forward through the child rows, like a merge join.
+ *
+ * returns true if itr points at a child row of the parent with the given ID,
+ * skipping over any rows belonging to parents with lower IDs.
+ */
+template <typename T>
+inline bool next_child_row(pqxx::result::const_iterator &itr,
+                           const pqxx::result::const_iterator &end, T id) {
+  while (itr != end) {
+    const T child_id = itr["id"].as<T>();
+    if (child_id == id) {
+      return true;
+    } else if (child_id > id) {
+      return false;
+    }
+    ++itr;
+  }
+  return false;
+}
+
+template <typename T>
+void extract_tags(pqxx::result::const_iterator &itr,
+                  const pqxx::result::const_iterator &end, T id,
+                  tags_t &tags) {
   tags.clear();
-  for (pqxx::result::const_iterator itr = res.begin(); itr != res.end();
-       ++itr) {
-    tags.push_back(std::make_pair(std::string((*itr)["k"].c_str()),
-                                  std::string((*itr)["v"].c_str())));
+  for (; next_child_row(itr, end, id); ++itr) {
+    tags.push_back(std::make_pair(std::string(itr["k"].c_str()),
+                                  std::string(itr["v"].c_str())));
   }
 }
 
-void extract_nodes(const pqxx::result &res, nodes_t &nodes) {
-  nodes.clear();
-  for (pqxx::result::const_iterator itr = res.begin(); itr != res.end();
-       ++itr) {
-    nodes.push_back((*itr)[0].as<osm_nwr_id_t>());
+void extract_comments(pqxx::result::const_iterator &itr,
+                      const pqxx::result::const_iterator &end,
+                      osm_changeset_id_t id, comments_t &comments) {
+  changeset_comment_info comment;
+  comments.clear();
+  for (; next_child_row(itr, end, id); ++itr) {
+    comment.author_id = itr["author_id"].as<osm_user_id_t>();
+    comment.author_display_name = itr["display_name"].c_str();
+    comment.body = itr["body"].c_str();
+    comment.created_at = itr["created_at"].c_str();
+    comments.push_back(comment);
+  }
+}
+
+/* the child rows of nodes, ways and relations are read into vectors of
+ * (parent ID, child) pairs, sorted by parent ID, by either of the extraction
+ * strategies. they are then matched up to their parents in the same way as
+ * above.
+ */
+template <typename Rows, typename Container>
+void extract_children(typename Rows::const_iterator &itr, const Rows &rows,
+                      osm_nwr_id_t id, Container &children) {
+  children.clear();
+  while ((itr != rows.end()) && (itr->first < id)) {
+    ++itr;
+  }
+  for (; (itr != rows.end()) && (itr->first == id); ++itr) {
+    children.push_back(itr->second);
   }
 }
 
@@ -194,37 +281,284 @@ element_type type_from_name(const char *name) {
   return type;
 }
 
-void extract_members(const pqxx::result &res, members_t &members) {
+template <typename Rows>
+void read_tags(const pqxx::result &res, Rows &rows) {
+  rows.clear();
+  rows.reserve(res.size());
+  for (pqxx::result::const_iterator itr = res.begin(); itr != res.end();
+       ++itr) {
+    rows.push_back(std::make_pair(
+        itr["id"].as<osm_nwr_id_t>(),
+        std::make_pair(std::string(itr["k"].c_str()),
+                       std::string(itr["v"].c_str()))));
+  }
+}
+
+template <typename Rows>
+void read_way_nodes(const pqxx::result &res, Rows &rows) {
+  rows.clear();
+  rows.reserve(res.size());
+  for (pqxx::result::const_iterator itr = res.begin(); itr != res.end();
+       ++itr) {
+    rows.push_back(std::make_pair(itr["id"].as<osm_nwr_id_t>(),
+                                  itr["node_id"].as<osm_nwr_id_t>()));
+  }
+}
+
+template <typename Rows>
+void read_members(const pqxx::result &res, Rows &rows) {
   member_info member;
-  members.clear();
+  rows.clear();
+  rows.reserve(res.size());
   for (pqxx::result::const_iterator itr = res.begin(); itr != res.end();
        ++itr) {
-    member.type = type_from_name((*itr)["member_type"].c_str());
-    member.ref = (*itr)["member_id"].as<osm_nwr_id_t>();
-    member.role = (*itr)["member_role"].c_str();
-    members.push_back(member);
+    member.type = type_from_name(itr["member_type"].c_str());
+    member.ref = itr["member_id"].as<osm_nwr_id_t>();
+    member.role = itr["member_role"].c_str();
+    rows.push_back(std::make_pair(itr["id"].as<osm_nwr_id_t>(), member));
   }
 }
 
-void extract_comments(const pqxx::result &res, comments_t &comments) {
-  changeset_comment_info comment;
-  comments.clear();
+/* the same again, but for the binary COPY strategy. the columns are read by
+ * position, and must match the queries in the fetch_* functions below.
+ */
+template <typename Rows>
+void copy_tags(PGconn *conn, const std::string &query, Rows &rows) {
+  rows.clear();
+  for (pgsql_copy_reader reader(conn, query); !reader.done(); reader.next()) {
+    rows.push_back(std::make_pair(
+        osm_nwr_id_t(reader.get_int64(0)),
+        std::make_pair(reader.get_string(1), reader.get_string(2))));
+  }
+}
+
+template <typename Rows>
+void copy_way_nodes(PGconn *conn, const std::string &query, Rows &rows) {
+  rows.clear();
+  for (pgsql_copy_reader reader(conn, query); !reader.done(); reader.next()) {
+    rows.push_back(std::make_pair(osm_nwr_id_t(reader.get_int64(0)),
+                                  osm_nwr_id_t(reader.get_int64(1))));
+  }
+}
+
+template <typename Rows>
+void copy_members(PGconn *conn, const std::string &query, Rows &rows) {
+  member_info member;
+  rows.clear();
+  for (pgsql_copy_reader reader(conn, query); !reader.done(); reader.next()) {
+    member.type = type_from_name(reader.get_string(1).c_str());
+    member.ref = osm_nwr_id_t(reader.get_int64(2));
+    member.role = reader.get_string(3);
+    rows.push_back(std::make_pair(osm_nwr_id_t(reader.get_int64(0)), member));
+  }
+}
+
+template <typename Rows>
+void copy_rows(PGconn *conn, const std::string &query, Rows &rows,
+               cache<osm_changeset_id_t, changeset> *changeset_cache,
+               bool with_location) {
+  // the users are filled in after all the rows have been read, so that the
+  // changesets can be prefetched together.
+  vector<element_info *> added;
+  vector<osm_changeset_id_t> changeset_ids;
+
+  for (pgsql_copy_reader reader(conn, query); !reader.done(); reader.next()) {
+    const osm_nwr_id_t id = osm_nwr_id_t(reader.get_int64(0));
+
+    std::pair<typename Rows::iterator, bool> row =
+        rows.insert(std::make_pair(id, typename Rows::mapped_type()));
+    if (row.second) {
+      element_info &elem = row.first->second.info;
+      elem.id = id;
+      elem.visible = reader.get_bool(1);
+      elem.version = osm_nwr_id_t(reader.get_int64(2));
+      elem.changeset = osm_changeset_id_t(reader.get_int64(3));
+      elem.timestamp = format_time(reader.get_int64(4));
+      if (with_location) {
+        row.first->second.lat = double(reader.get_int32(5)) / SCALE;
+        row.first->second.lon = double(reader.get_int32(6)) / SCALE;
+      }
+      added.push_back(&elem);
+      changeset_ids.push_back(elem.changeset);
+    }
+  }
+
+  if (changeset_cache == NULL) {
+    return;
+  }
+  changeset_cache->prefetch(changeset_ids.begin(), changeset_ids.end());
+  for (vector<element_info *>::iterator itr = added.begin();
+       itr != added.end(); ++itr) {
+    extract_user(**itr, *changeset_cache);
+  }
+}
+
+/* COPY can't take parameters, so the IDs have to be put into the query as
+ * an array literal. they are all integers, so there's no need to escape
+ * them.
+ */
+std::string copy_query(const std::string &select, const std::string &id_column,
+                       const vector<osm_nwr_id_t> &ids,
+                       const std::string &order_by) {
+  std::ostringstream query;
+  query << select << " WHERE " << id_column << " = ANY('"
+        << pqxx::to_string(ids) << "'::bigint[])";
+  if (!order_by.empty()) {
+    query << " ORDER BY " << order_by;
+  }
+  return query.str();
+}
+
+/* the select queries for nodes, ways and relations return the full element
+ * columns, which are kept in the selection's row cache so that they don't
+ * have to be fetched again when writing out. like insert_results, this
+ * returns the number of *new* IDs inserted into the selection.
+ */
+template <typename Rows>
+void keep_row(const pqxx::result::tuple &tuple, osm_nwr_id_t id, Rows &rows,
+              cache<osm_changeset_id_t, changeset> *changeset_cache,
+              bool with_location) {
+  std::pair<typename Rows::iterator, bool> row =
+      rows.insert(std::make_pair(id, typename Rows::mapped_type()));
+  if (row.second) {
+    extract_elem(tuple, row.first->second.info, changeset_cache);
+    if (with_location) {
+      row.first->second.lon = double(tuple["longitude"].as<int64_t>()) / SCALE;
+      row.first->second.lat = double(tuple["latitude"].as<int64_t>()) / SCALE;
+    }
+  }
+}
+
+template <typename Rows>
+int insert_rows(const pqxx::result &res, id_set<osm_nwr_id_t> &elems,
+                Rows &rows,
+                cache<osm_changeset_id_t, changeset> *changeset_cache,
+                bool with_location) {
+  vector<osm_nwr_id_t> ids;
+  ids.reserve(res.size());
+  prefetch_changesets(res, changeset_cache);
+
   for (pqxx::result::const_iterator itr = res.begin(); itr != res.end();
        ++itr) {
-    comment.author_id = (*itr)["author_id"].as<osm_user_id_t>();
-    comment.author_display_name = (*itr)["display_name"].c_str();
-    comment.body = (*itr)["body"].c_str();
-    comment.created_at = (*itr)["created_at"].c_str();
-    comments.push_back(comment);
+    const osm_nwr_id_t id = itr["id"].as<osm_nwr_id_t>();
+    ids.push_back(id);
+    keep_row(*itr, id, rows, changeset_cache, with_location);
   }
+
+  return elems.insert_batch(ids);
+}
+
+// clang-format off
+
+// the element columns returned by all the queries which select nodes,
+// ways or relations, so that the rows can be kept in the selection and
+// written out later without querying the current_* tables again.
+const std::string node_columns =
+  "n.id, n.latitude, n.longitude, n.visible, n.version, n.changeset_id, "
+  "to_char(n.timestamp,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS timestamp ";
+const std::string way_columns =
+  "w.id, w.visible, w.version, w.changeset_id, "
+  "to_char(w.timestamp,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS timestamp ";
+const std::string relation_columns =
+  "r.id, r.visible, r.version, r.changeset_id, "
+  "to_char(r.timestamp,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS timestamp ";
+
+// the same columns again for the query compiled from a selection plan,
+// which returns all types of element together. the "type" column says
+// which each row is, and ways and relations have null locations, so that
+// the rows for each type can be put together with UNION ALL.
+const std::string plan_node_columns = "'n' AS type, " + node_columns;
+const std::string plan_way_columns =
+  "'w' AS type, w.id, NULL::integer AS latitude, "
+  "NULL::integer AS longitude, w.visible, w.version, w.changeset_id, "
+  "to_char(w.timestamp,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS timestamp ";
+const std::string plan_relation_columns =
+  "'r' AS type, r.id, NULL::integer AS latitude, "
+  "NULL::integer AS longitude, r.visible, r.version, r.changeset_id, "
+  "to_char(r.timestamp,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS timestamp ";
+
+/* the statements for selecting elements and extracting their child rows,
+ * which are needed on the helper connections as well as the main one.
+ */
+void prepare_element_statements(pqxx::connection_base &conn) {
+  // selecting a set of objects as a list. these are also used to fetch
+  // any rows not already in the selection when writing out.
+  conn.prepare("select_nodes",
+    "SELECT " + node_columns +
+      "FROM current_nodes n "
+      "WHERE n.id = ANY($1)")
+    PREPARE_ARGS(("bigint[]"));
+  conn.prepare("select_ways",
+    "SELECT " + way_columns +
+      "FROM current_ways w "
+      "WHERE w.id = ANY($1)")
+    PREPARE_ARGS(("bigint[]"));
+  conn.prepare("select_relations",
+    "SELECT " + relation_columns +
+      "FROM current_relations r "
+      "WHERE r.id = ANY($1)")
+    PREPARE_ARGS(("bigint[]"));
+
+  // extraction functions for child information, for a whole chunk of
+  // parent IDs at once. the parent ID is always returned as "id", and
+  // the results must be sorted by it.
+  conn.prepare("extract_way_nds",
+    "SELECT way_id AS id, node_id "
+      "FROM current_way_nodes "
+      "WHERE way_id = ANY($1) "
+      "ORDER BY way_id, sequence_id")
+    PREPARE_ARGS(("bigint[]"));
+  conn.prepare("extract_relation_members",
+    "SELECT relation_id AS id, member_type, member_id, member_role "
+      "FROM current_relation_members "
+      "WHERE relation_id = ANY($1) "
+      "ORDER BY relation_id, sequence_id")
+    PREPARE_ARGS(("bigint[]"));
+
+  // extraction functions for tags
+  conn.prepare("extract_node_tags",
+    "SELECT node_id AS id, k, v "
+      "FROM current_node_tags "
+      "WHERE node_id = ANY($1) "
+      "ORDER BY node_id")
+    PREPARE_ARGS(("bigint[]"));
+  conn.prepare("extract_way_tags",
+    "SELECT way_id AS id, k, v "
+      "FROM current_way_tags "
+      "WHERE way_id = ANY($1) "
+      "ORDER BY way_id")
+    PREPARE_ARGS(("bigint[]"));
+  conn.prepare("extract_relation_tags",
+    "SELECT relation_id AS id, k, v "
+      "FROM current_relation_tags "
+      "WHERE relation_id = ANY($1) "
+      "ORDER BY relation_id")
+    PREPARE_ARGS(("bigint[]"));
 }
 
+// clang-format on
+
 } // anonymous namespace
 
 readonly_pgsql_selection::readonly_pgsql_selection(
-    pqxx::connection &conn, cache<osm_changeset_id_t, changeset> &changeset_cache)
+    pqxx::connection_base &conn,
+    cache<osm_changeset_id_t, changeset> &changeset_cache, bool binary_arrays_,
+    PGconn *copy_handle_, const connections_t &helpers_,
+    existence_filter *filter_, node_density *density_)
     : w(conn), cc(changeset_cache)
-    , include_changeset_discussions(false) {}
+    , include_changeset_discussions(false)
+    , include_metadata(true)
+    , binary_arrays(binary_arrays_)
+    , copy_handle(copy_handle_)
+    , helpers(helpers_)
+    , filter(filter_)
+    , density(density_) {
+  // the helpers can only share a snapshot which lasts for the whole
+  // transaction, and this has to be set before running any queries.
+  if (!helpers.empty()) {
+    w.exec("SET TRANSACTION ISOLATION LEVEL REPEATABLE READ");
+  }
+}
 
 readonly_pgsql_selection::~readonly_pgsql_selection() {}
 
@@ -232,32 +566,33 @@ void readonly_pgsql_selection::write_nodes(output_formatter &formatter) {
   // get all nodes - they already contain their own tags, so
   // we don't need to do anything else.
   logger::message("Fetching nodes");
-  element_info elem;
-  double lon, lat;
   tags_t tags;
+  tag_rows_t tag_rows;
 
   // fetch in chunks...
-  set<osm_nwr_id_t>::iterator prev_itr = sel_nodes.begin();
+  flush_selects();
+  start_prefetch();
+  id_set<osm_nwr_id_t>::const_iterator prev_itr = sel_nodes.begin();
   size_t chunk_i = 0;
-  for (set<osm_nwr_id_t>::iterator n_itr = sel_nodes.begin();; ++n_itr, ++chunk_i) {
+  for (id_set<osm_nwr_id_t>::const_iterator n_itr = sel_nodes.begin();;
+       ++n_itr, ++chunk_i) {
     bool at_end = n_itr == sel_nodes.end();
     if ((chunk_i >= STRIDE) || ((chunk_i > 0) && at_end)) {
-      stringstream query;
-      query << "select n.id, n.latitude, n.longitude, n.visible, "
-               "to_char(n.timestamp,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') as "
-               "timestamp, n.changeset_id, n.version from current_nodes n "
-               "where n.id in (";
-      std::copy(prev_itr, n_itr, infix_ostream_iterator<osm_nwr_id_t>(query, ","));
-      query << ")";
-      pqxx::result nodes = w.exec(query);
-
-      for (pqxx::result::const_iterator itr = nodes.begin(); itr != nodes.end();
-           ++itr) {
-        extract_elem(*itr, elem, cc);
-        lon = double((*itr)["longitude"].as<int64_t>()) / (SCALE);
-        lat = double((*itr)["latitude"].as<int64_t>()) / (SCALE);
-        extract_tags(w.prepared("extract_node_tags")(elem.id).exec(), tags);
-        formatter.write_node(elem, lon, lat, tags);
+      const vector<osm_nwr_id_t> ids(prev_itr, n_itr);
+      poll_prefetch();
+      fetch_rows(element_type_node, ids);
+      fetch_tags(element_type_node, ids, tag_rows);
+      tag_rows_t::const_iterator tag_itr = tag_rows.begin();
+
+      for (vector<osm_nwr_id_t>::const_iterator itr = ids.begin();
+           itr != ids.end(); ++itr) {
+        element_rows_t::const_iterator row = node_rows.find(*itr);
+        if (row == node_rows.end()) {
+          continue;
+        }
+        extract_children(tag_itr, tag_rows, *itr, tags);
+        formatter.write_node(row->second.info, row->second.lon,
+                             row->second.lat, tags);
       }
 
       chunk_i = 0;
@@ -274,30 +609,49 @@ void readonly_pgsql_selection::write_ways(output_formatter &formatter) {
   // way nodes and tags are on a separate connections so that the
   // entire result set can be streamed from a single query.
   logger::message("Fetching ways");
-  element_info elem;
   nodes_t nodes;
   tags_t tags;
+  way_node_rows_t way_node_rows;
+  tag_rows_t tag_rows;
 
   // fetch in chunks...
-  set<osm_nwr_id_t>::iterator prev_itr = sel_ways.begin();
-  size_t chunk_i = 0;
-  for (set<osm_nwr_id_t>::iterator n_itr = sel_ways.begin();; ++n_itr, ++chunk_i) {
+  flush_selects();
+  start_prefetch();
+  id_set<osm_nwr_id_t>::const_iterator prev_itr = sel_ways.begin();
+  size_t chunk_i = 0, chunk_num = 0;
+  for (id_set<osm_nwr_id_t>::const_iterator n_itr = sel_ways.begin();;
+       ++n_itr, ++chunk_i) {
     bool at_end = n_itr == sel_ways.end();
     if ((chunk_i >= STRIDE) || ((chunk_i > 0) && at_end)) {
-      stringstream query;
-      query << "select w.id, w.visible, w.version, w.changeset_id, "
-               "to_char(w.timestamp,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') as "
-               "timestamp from current_ways w where w.id in (";
-      std::copy(prev_itr, n_itr, infix_ostream_iterator<osm_nwr_id_t>(query, ","));
-      query << ")";
-      pqxx::result ways = w.exec(query);
-
-      for (pqxx::result::const_iterator itr = ways.begin(); itr != ways.end();
-           ++itr) {
-        extract_elem(*itr, elem, cc);
-        extract_nodes(w.prepared("extract_way_nds")(elem.id).exec(), nodes);
-        extract_tags(w.prepared("extract_way_tags")(elem.id).exec(), tags);
-        formatter.write_way(elem, nodes, tags);
+      const vector<osm_nwr_id_t> ids(prev_itr, n_itr);
+      const prefetch_chunk *prefetch =
+          find_prefetch(way_prefetch, chunk_num++, ids);
+      if (prefetch != NULL) {
+        pqxx::pipeline &p = *helper_pipelines[prefetch->helper];
+        if (prefetch->has_rows) {
+          id_set<osm_nwr_id_t> ignored;
+          insert_rows(p.retrieve(prefetch->rows), ignored, way_rows,
+                      user_cache(), false);
+        }
+        read_way_nodes(p.retrieve(prefetch->children), way_node_rows);
+        read_tags(p.retrieve(prefetch->tags), tag_rows);
+      } else {
+        fetch_rows(element_type_way, ids);
+        fetch_way_nodes(ids, way_node_rows);
+        fetch_tags(element_type_way, ids, tag_rows);
+      }
+      way_node_rows_t::const_iterator nd_itr = way_node_rows.begin();
+      tag_rows_t::const_iterator tag_itr = tag_rows.begin();
+
+      for (vector<osm_nwr_id_t>::const_iterator itr = ids.begin();
+           itr != ids.end(); ++itr) {
+        element_rows_t::const_iterator row = way_rows.find(*itr);
+        if (row == way_rows.end()) {
+          continue;
+        }
+        extract_children(nd_itr, way_node_rows, *itr, nodes);
+        extract_children(tag_itr, tag_rows, *itr, tags);
+        formatter.write_way(row->second.info, nodes, tags);
       }
 
       chunk_i = 0;
@@ -311,32 +665,49 @@ void readonly_pgsql_selection::write_ways(output_formatter &formatter) {
 
 void readonly_pgsql_selection::write_relations(output_formatter &formatter) {
   logger::message("Fetching relations");
-  element_info elem;
   members_t members;
   tags_t tags;
+  member_rows_t member_rows;
+  tag_rows_t tag_rows;
 
   // fetch in chunks...
-  set<osm_nwr_id_t>::iterator prev_itr = sel_relations.begin();
-  size_t chunk_i = 0;
-  for (set<osm_nwr_id_t>::iterator n_itr = sel_relations.begin();;
+  flush_selects();
+  start_prefetch();
+  id_set<osm_nwr_id_t>::const_iterator prev_itr = sel_relations.begin();
+  size_t chunk_i = 0, chunk_num = 0;
+  for (id_set<osm_nwr_id_t>::const_iterator n_itr = sel_relations.begin();;
        ++n_itr, ++chunk_i) {
     bool at_end = n_itr == sel_relations.end();
     if ((chunk_i >= STRIDE) || ((chunk_i > 0) && at_end)) {
-      stringstream query;
-      query << "select r.id, r.visible, r.version, r.changeset_id, "
-               "to_char(r.timestamp,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') as "
-               "timestamp from current_relations r where r.id in (";
-      std::copy(prev_itr, n_itr, infix_ostream_iterator<osm_nwr_id_t>(query, ","));
-      query << ")";
-      pqxx::result relations = w.exec(query);
-
-      for (pqxx::result::const_iterator itr = relations.begin();
-           itr != relations.end(); ++itr) {
-        extract_elem(*itr, elem, cc);
-        extract_members(w.prepared("extract_relation_members")(elem.id).exec(),
-                        members);
-        extract_tags(w.prepared("extract_relation_tags")(elem.id).exec(), tags);
-        formatter.write_relation(elem, members, tags);
+      const vector<osm_nwr_id_t> ids(prev_itr, n_itr);
+      const prefetch_chunk *prefetch =
+          find_prefetch(relation_prefetch, chunk_num++, ids);
+      if (prefetch != NULL) {
+        pqxx::pipeline &p = *helper_pipelines[prefetch->helper];
+        if (prefetch->has_rows) {
+          id_set<osm_nwr_id_t> ignored;
+          insert_rows(p.retrieve(prefetch->rows), ignored, relation_rows,
+                      user_cache(), false);
+        }
+        read_members(p.retrieve(prefetch->children), member_rows);
+        read_tags(p.retrieve(prefetch->tags), tag_rows);
+      } else {
+        fetch_rows(element_type_relation, ids);
+        fetch_members(ids, member_rows);
+        fetch_tags(element_type_relation, ids, tag_rows);
+      }
+      member_rows_t::const_iterator member_itr = member_rows.begin();
+      tag_rows_t::const_iterator tag_itr = tag_rows.begin();
+
+      for (vector<osm_nwr_id_t>::const_iterator itr = ids.begin();
+           itr != ids.end(); ++itr) {
+        element_rows_t::const_iterator row = relation_rows.find(*itr);
+        if (row == relation_rows.end()) {
+          continue;
+        }
+        extract_children(member_itr, member_rows, *itr, members);
+        extract_children(tag_itr, tag_rows, *itr, tags);
+        formatter.write_relation(row->second.info, members, tags);
       }
 
       chunk_i = 0;
@@ -355,28 +726,28 @@ void readonly_pgsql_selection::write_changesets(output_formatter &formatter,
   comments_t comments;
 
   // fetch in chunks...
-  set<osm_changeset_id_t>::iterator prev_itr = sel_changesets.begin();
+  id_set<osm_changeset_id_t>::const_iterator prev_itr = sel_changesets.begin();
   size_t chunk_i = 0;
-  for (set<osm_changeset_id_t>::iterator n_itr = sel_changesets.begin();;
+  for (id_set<osm_changeset_id_t>::const_iterator n_itr =
+           sel_changesets.begin();;
        ++n_itr, ++chunk_i) {
     bool at_end = n_itr == sel_changesets.end();
     if ((chunk_i >= STRIDE) || ((chunk_i > 0) && at_end)) {
-      stringstream query;
-      query << "SELECT id, "
-            << "to_char(created_at,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS created_at, "
-            << "to_char(closed_at, 'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS closed_at, "
-            << "min_lat, max_lat, min_lon, max_lon, "
-            << "num_changes "
-            << "FROM changesets WHERE id IN (";
-      std::copy(prev_itr, n_itr, infix_ostream_iterator<osm_changeset_id_t>(query, ","));
-      query << ")";
-
-      pqxx::result changesets = w.exec(query);
+      const vector<osm_changeset_id_t> ids(prev_itr, n_itr);
+      cc.prefetch(ids.begin(), ids.end());
+      pqxx::result changesets = exec_ids("extract_changesets", ids);
+      pqxx::result changeset_tags = exec_ids("extract_changeset_tags", ids);
+      pqxx::result changeset_comments =
+          exec_ids("extract_changeset_comments", ids);
+      pqxx::result::const_iterator tag_itr = changeset_tags.begin();
+      pqxx::result::const_iterator comment_itr = changeset_comments.begin();
+
       for (pqxx::result::const_iterator itr = changesets.begin();
            itr != changesets.end(); ++itr) {
         extract_changeset(*itr, elem, cc);
-        extract_tags(w.prepared("extract_changeset_tags")(elem.id).exec(), tags);
-        extract_comments(w.prepared("extract_changeset_comments")(elem.id).exec(), comments);
+        extract_tags(tag_itr, changeset_tags.end(), elem.id, tags);
+        extract_comments(comment_itr, changeset_comments.end(), elem.id,
+                         comments);
         elem.comments_count = comments.size();
         formatter.write_changeset(elem, tags, include_changeset_discussions, comments, now);
       }
@@ -390,41 +761,182 @@ void readonly_pgsql_selection::write_changesets(output_formatter &formatter,
   }
 }
 
+template <typename T>
+pqxx::result readonly_pgsql_selection::exec_ids(const std::string &name,
+                                                const T &ids) {
+  return bind_ids(w.prepared(name), ids, binary_arrays).exec();
+}
+
+id_set<osm_nwr_id_t> &readonly_pgsql_selection::selected(element_type type) {
+  return (type == element_type_node)
+             ? sel_nodes
+             : ((type == element_type_way) ? sel_ways : sel_relations);
+}
+
+readonly_pgsql_selection::element_rows_t &
+readonly_pgsql_selection::rows_for(element_type type) {
+  return (type == element_type_node)
+             ? node_rows
+             : ((type == element_type_way) ? way_rows : relation_rows);
+}
+
+void readonly_pgsql_selection::fetch_rows(element_type type,
+                                          const vector<osm_nwr_id_t> &ids) {
+  element_rows_t &rows = rows_for(type);
+
+  // only the rows which weren't already returned by one of the select
+  // queries need fetching. normally this is only elements selected by ID
+  // from another source.
+  vector<osm_nwr_id_t> missing;
+  for (vector<osm_nwr_id_t>::const_iterator itr = ids.begin();
+       itr != ids.end(); ++itr) {
+    if (rows.count(*itr) == 0) {
+      missing.push_back(*itr);
+    }
+  }
+  if (missing.empty()) {
+    return;
+  }
+
+  const bool with_location = (type == element_type_node);
+
+  if (copy_handle != NULL) {
+    // clang-format off
+    std::string select =
+      "SELECT id, visible, version, changeset_id, "
+        "floor(extract(epoch FROM timestamp))::bigint";
+    if (with_location) {
+      select += ", latitude, longitude FROM current_nodes";
+    } else if (type == element_type_way) {
+      select += " FROM current_ways";
+    } else {
+      select += " FROM current_relations";
+    }
+    // clang-format on
+    copy_rows(copy_handle, copy_query(select, "id", missing, ""), rows,
+              user_cache(), with_location);
+
+  } else {
+    const char *prepared_name =
+        with_location ? "select_nodes"
+                      : ((type == element_type_way) ? "select_ways"
+                                                    : "select_relations");
+    id_set<osm_nwr_id_t> ignored;
+    insert_rows(exec_ids(prepared_name, missing), ignored, rows,
+                user_cache(), with_location);
+  }
+}
+
+void readonly_pgsql_selection::fetch_tags(element_type type,
+                                          const vector<osm_nwr_id_t> &ids,
+                                          tag_rows_t &rows) {
+  const char *name = (type == element_type_node)
+                         ? "node"
+                         : ((type == element_type_way) ? "way" : "relation");
+
+  if (copy_handle != NULL) {
+    const std::string id_column = std::string(name) + "_id";
+    const std::string select = "SELECT " + id_column + ", k, v FROM current_" +
+                               name + "_tags";
+    copy_tags(copy_handle, copy_query(select, id_column, ids, id_column),
+              rows);
+
+  } else {
+    read_tags(exec_ids(std::string("extract_") + name + "_tags", ids), rows);
+  }
+}
+
+void readonly_pgsql_selection::fetch_way_nodes(const vector<osm_nwr_id_t> &ids,
+                                               way_node_rows_t &rows) {
+  if (copy_handle != NULL) {
+    copy_way_nodes(
+        copy_handle,
+        copy_query("SELECT way_id, node_id FROM current_way_nodes", "way_id",
+                   ids, "way_id, sequence_id"),
+        rows);
+
+  } else {
+    read_way_nodes(exec_ids("extract_way_nds", ids), rows);
+  }
+}
+
+void readonly_pgsql_selection::fetch_members(const vector<osm_nwr_id_t> &ids,
+                                             member_rows_t &rows) {
+  if (copy_handle != NULL) {
+    // clang-format off
+    copy_members(
+      copy_handle,
+      copy_query(
+        "SELECT relation_id, member_type::text, member_id, member_role "
+          "FROM current_relation_members",
+        "relation_id", ids, "relation_id, sequence_id"),
+      rows);
+    // clang-format on
+
+  } else {
+    read_members(exec_ids("extract_relation_members", ids), rows);
+  }
+}
+
 data_selection::visibility_t
 readonly_pgsql_selection::check_node_visibility(osm_nwr_id_t id) {
+  if ((filter != NULL) && !filter->can_exist(element_type_node, id)) {
+    return non_exist;
+  }
   return check_table_visibility(w, id, "visible_node");
 }
 
 data_selection::visibility_t
 readonly_pgsql_selection::check_way_visibility(osm_nwr_id_t id) {
+  if ((filter != NULL) && !filter->can_exist(element_type_way, id)) {
+    return non_exist;
+  }
   return check_table_visibility(w, id, "visible_way");
 }
 
 data_selection::visibility_t
 readonly_pgsql_selection::check_relation_visibility(osm_nwr_id_t id) {
+  if ((filter != NULL) && !filter->can_exist(element_type_relation, id)) {
+    return non_exist;
+  }
   return check_table_visibility(w, id, "visible_relation");
 }
 
 int readonly_pgsql_selection::select_nodes(const std::vector<osm_nwr_id_t> &ids) {
+  flush_selects();
+  if ((filter != NULL) && !filter->any_can_exist(element_type_node, ids)) {
+    return 0;
+  }
   if (!ids.empty()) {
-    return insert_results(w.prepared("select_nodes")(ids).exec(), sel_nodes);
+    return insert_rows(exec_ids("select_nodes", ids), sel_nodes, node_rows,
+                       user_cache(), true);
   } else {
     return 0;
   }
 }
 
 int readonly_pgsql_selection::select_ways(const std::vector<osm_nwr_id_t> &ids) {
+  flush_selects();
+  if ((filter != NULL) && !filter->any_can_exist(element_type_way, ids)) {
+    return 0;
+  }
   if (!ids.empty()) {
-    return insert_results(w.prepared("select_ways")(ids).exec(), sel_ways);
+    return insert_rows(exec_ids("select_ways", ids), sel_ways,
+                       way_rows, user_cache(), false);
   } else {
     return 0;
   }
 }
 
 int readonly_pgsql_selection::select_relations(const std::vector<osm_nwr_id_t> &ids) {
+  flush_selects();
+  if ((filter != NULL) &&
+      !filter->any_can_exist(element_type_relation, ids)) {
+    return 0;
+  }
   if (!ids.empty()) {
-    return insert_results(w.prepared("select_relations")(ids).exec(),
-                          sel_relations);
+    return insert_rows(exec_ids("select_relations", ids),
+                       sel_relations, relation_rows, user_cache(), false);
   } else {
     return 0;
   }
@@ -432,83 +944,377 @@ int readonly_pgsql_selection::select_relations(const std::vector<osm_nwr_id_t> &
 
 int readonly_pgsql_selection::select_nodes_from_bbox(const bbox &bounds,
                                                      int max_nodes) {
-  const std::vector<tile_id_t> tiles = tiles_for_area(
-      bounds.minlat, bounds.minlon, bounds.maxlat, bounds.maxlon);
+  if ((density != NULL) && density->too_many_nodes(bounds, max_nodes)) {
+    return max_nodes + 1;
+  }
+
+  std::vector<tile_id_t> first_tiles, last_tiles;
+  split_tile_ranges(tile_ranges_for_area(bounds.minlat, bounds.minlon,
+                                         bounds.maxlat, bounds.maxlon),
+                    first_tiles, last_tiles);
 
-  // hack around problem with postgres' statistics, which was
-  // making it do seq scans all the time on smaug...
-  w.exec("set enable_mergejoin=false");
-  w.exec("set enable_hashjoin=false");
+  flush_selects();
 
-  return insert_results(
-      w.prepared("visible_node_in_bbox")(tiles)(int(bounds.minlat * SCALE))(
-            int(bounds.maxlat * SCALE))(int(bounds.minlon * SCALE))(
-            int(bounds.maxlon * SCALE))(max_nodes + 1).exec(),
-      sel_nodes);
+  return insert_rows(
+      bind_ids(bind_ids(w.prepared("visible_node_in_bbox"), first_tiles,
+                        binary_arrays),
+               last_tiles, binary_arrays)(int(bounds.minlat * SCALE))(
+          int(bounds.maxlat * SCALE))(int(bounds.minlon * SCALE))(
+          int(bounds.maxlon * SCALE))(max_nodes + 1).exec(),
+      sel_nodes, node_rows, user_cache(), true);
 }
 
 void readonly_pgsql_selection::select_nodes_from_relations() {
   logger::message("Filling sel_nodes (from relations)");
-
-  if (!sel_relations.empty()) {
-    insert_results(w.prepared("nodes_from_relations")(sel_relations).exec(),
-                   sel_nodes);
-  }
+  queue_select("nodes_from_relations", sel_relations, sel_nodes, node_rows,
+               true);
 }
 
 void readonly_pgsql_selection::select_ways_from_nodes() {
   logger::message("Filling sel_ways (from nodes)");
-
-  if (!sel_nodes.empty()) {
-    insert_results(w.prepared("ways_from_nodes")(sel_nodes).exec(), sel_ways);
-  }
+  queue_select("ways_from_nodes", sel_nodes, sel_ways, way_rows, false);
 }
 
 void readonly_pgsql_selection::select_ways_from_relations() {
   logger::message("Filling sel_ways (from relations)");
-
-  if (!sel_relations.empty()) {
-    insert_results(w.prepared("ways_from_relations")(sel_relations).exec(),
-                   sel_ways);
-  }
+  queue_select("ways_from_relations", sel_relations, sel_ways, way_rows,
+               false);
 }
 
 void readonly_pgsql_selection::select_relations_from_ways() {
   logger::message("Filling sel_relations (from ways)");
+  queue_select("relation_parents_of_ways", sel_ways, sel_relations,
+               relation_rows, false);
+}
+
+void readonly_pgsql_selection::select_nodes_from_way_nodes() {
+  queue_select("nodes_from_ways", sel_ways, sel_nodes, node_rows, true);
+}
+
+void readonly_pgsql_selection::select_relations_from_nodes() {
+  queue_select("relation_parents_of_nodes", sel_nodes, sel_relations,
+               relation_rows, false);
+}
+
+void readonly_pgsql_selection::select_relations_from_relations() {
+  queue_select("relation_parents_of_relations", sel_relations, sel_relations,
+               relation_rows, false);
+}
+
+void readonly_pgsql_selection::select_relations_members_of_relations() {
+  queue_select("relation_members_of_relations", sel_relations, sel_relations,
+               relation_rows, false);
+}
+
+void readonly_pgsql_selection::select_plan(const selection_plan &plan) {
+  flush_selects();
+  if (plan.empty() ||
+      (sel_nodes.empty() && sel_ways.empty() && sel_relations.empty())) {
+    return;
+  }
+
+  // the plan starts from the current selection, and only the rows which
+  // aren't already selected need to come back.
+  const plan_ctes ctes = compile_selection_plan(
+      plan, "SELECT unnest($1::bigint[]) AS id",
+      "SELECT unnest($2::bigint[]) AS id",
+      "SELECT unnest($3::bigint[]) AS id");
+
+  vector<std::string> selects;
+  if (ctes.nodes != ctes.seed_nodes) {
+    selects.push_back("SELECT " + plan_node_columns +
+                      "FROM current_nodes n WHERE n.id IN (SELECT id FROM " +
+                      ctes.nodes + " EXCEPT SELECT id FROM " +
+                      ctes.seed_nodes + ")");
+  }
+  if (ctes.ways != ctes.seed_ways) {
+    selects.push_back("SELECT " + plan_way_columns +
+                      "FROM current_ways w WHERE w.id IN (SELECT id FROM " +
+                      ctes.ways + " EXCEPT SELECT id FROM " + ctes.seed_ways +
+                      ")");
+  }
+  if (ctes.relations != ctes.seed_relations) {
+    selects.push_back(
+        "SELECT " + plan_relation_columns +
+        "FROM current_relations r WHERE r.id IN (SELECT id FROM " +
+        ctes.relations + " EXCEPT SELECT id FROM " + ctes.seed_relations +
+        ")");
+  }
+
+  std::ostringstream query;
+  query << ctes.with;
+  std::copy(selects.begin(), selects.end(),
+            infix_ostream_iterator<std::string>(query, " UNION ALL "));
+
+  // the query only depends on the steps in the plan, so it's prepared the
+  // first time each plan is used, and re-used after that. preparing the
+  // same definition again is a no-op.
+  const std::string name = selection_plan_name(plan);
+  logger::message("Running selection " + name);
+  w.conn().prepare(name, query.str())
+      PREPARE_ARGS(("bigint[]")("bigint[]")("bigint[]"));
 
-  if (!sel_ways.empty()) {
-    insert_results(w.prepared("relation_parents_of_ways")(sel_ways).exec(),
-                   sel_relations);
+  const pqxx::result res =
+      bind_ids(bind_ids(bind_ids(w.prepared(name), sel_nodes, binary_arrays),
+                        sel_ways, binary_arrays),
+               sel_relations, binary_arrays).exec();
+
+  prefetch_changesets(res, user_cache());
+
+  vector<osm_nwr_id_t> node_ids, way_ids, relation_ids;
+  for (pqxx::result::const_iterator itr = res.begin(); itr != res.end();
+       ++itr) {
+    const osm_nwr_id_t id = itr["id"].as<osm_nwr_id_t>();
+    switch (itr["type"].c_str()[0]) {
+    case 'n':
+      node_ids.push_back(id);
+      keep_row(*itr, id, node_rows, user_cache(), true);
+      break;
+    case 'w':
+      way_ids.push_back(id);
+      keep_row(*itr, id, way_rows, user_cache(), false);
+      break;
+    default:
+      relation_ids.push_back(id);
+      keep_row(*itr, id, relation_rows, user_cache(), false);
+      break;
+    }
   }
+
+  sel_nodes.insert_batch(node_ids);
+  sel_ways.insert_batch(way_ids);
+  sel_relations.insert_batch(relation_ids);
 }
 
-void readonly_pgsql_selection::select_nodes_from_way_nodes() {
-  if (!sel_ways.empty()) {
-    insert_results(w.prepared("nodes_from_ways")(sel_ways).exec(), sel_nodes);
+void readonly_pgsql_selection::queue_select(const std::string &name,
+                                            const id_set<osm_nwr_id_t> &from,
+                                            id_set<osm_nwr_id_t> &to,
+                                            element_rows_t &rows,
+                                            bool with_location) {
+  // if anything already queued adds to the set this one reads from, then
+  // it has to be run first, so that this gets the full set.
+  for (vector<pending_select>::const_iterator itr = pending_selects.begin();
+       itr != pending_selects.end(); ++itr) {
+    if (itr->to == &from) {
+      flush_selects();
+      break;
+    }
+  }
+
+  if (from.empty()) {
+    return;
   }
+
+  pending_select select;
+  select.name = name;
+  select.ids.assign(from.begin(), from.end());
+  select.to = &to;
+  select.rows = &rows;
+  select.with_location = with_location;
+  pending_selects.push_back(select);
 }
 
-void readonly_pgsql_selection::select_relations_from_nodes() {
-  if (!sel_nodes.empty()) {
-    insert_results(w.prepared("relation_parents_of_nodes")(sel_nodes).exec(),
-                   sel_relations);
+void readonly_pgsql_selection::flush_selects() {
+  if (pending_selects.empty()) {
+    return;
+  }
+
+  vector<pending_select> selects;
+  selects.swap(pending_selects);
+
+  vector<pqxx::result> results;
+  if (selects.size() == 1) {
+    // nothing to share the round trip with, so run it as a normal prepared
+    // statement, which can send the IDs in binary.
+    results.push_back(exec_ids(selects[0].name, selects[0].ids));
+
+  } else {
+    statement_queue queue(w);
+    for (vector<pending_select>::const_iterator itr = selects.begin();
+         itr != selects.end(); ++itr) {
+      queue.push_prepared(itr->name, vector<std::string>(1, w.quote(itr->ids)));
+    }
+    results = queue.flush();
+  }
+
+  for (size_t i = 0; i < selects.size(); ++i) {
+    insert_rows(results[i], *selects[i].to, *selects[i].rows,
+                user_cache(), selects[i].with_location);
   }
 }
 
-void readonly_pgsql_selection::select_relations_from_relations() {
-  if (!sel_relations.empty()) {
-    insert_results(
-        w.prepared("relation_parents_of_relations")(sel_relations).exec(),
-        sel_relations);
+void readonly_pgsql_selection::start_prefetch() {
+  if (helpers.empty() || !helper_txs.empty() ||
+      (sel_ways.empty() && sel_relations.empty())) {
+    return;
+  }
+
+  logger::message("Fetching ways and relations on helper connections");
+
+  const std::string snapshot =
+      w.exec("SELECT pg_export_snapshot()")[0][0].as<std::string>();
+
+  for (connections_t::const_iterator itr = helpers.begin();
+       itr != helpers.end(); ++itr) {
+    boost::shared_ptr<pqxx::work> tx =
+        boost::make_shared<pqxx::work>(boost::ref(**itr));
+    tx->exec("SET TRANSACTION ISOLATION LEVEL REPEATABLE READ; "
+             "SET TRANSACTION SNAPSHOT " + tx->quote(snapshot));
+    helper_txs.push_back(tx);
+
+    // hold all the queries back until they've all been inserted, then send
+    // them in one go, so that the server can get on with all of them.
+    boost::shared_ptr<pqxx::pipeline> p =
+        boost::make_shared<pqxx::pipeline>(boost::ref(*tx));
+    p->retain(std::numeric_limits<int>::max());
+    helper_pipelines.push_back(p);
+  }
+
+  queue_prefetch(sel_ways, way_rows, "select_ways", "extract_way_nds",
+                 "extract_way_tags", way_prefetch);
+  queue_prefetch(sel_relations, relation_rows, "select_relations",
+                 "extract_relation_members", "extract_relation_tags",
+                 relation_prefetch);
+
+  for (size_t i = 0; i < helper_pipelines.size(); ++i) {
+    helper_pipelines[i]->resume();
   }
 }
 
-void readonly_pgsql_selection::select_relations_members_of_relations() {
-  if (!sel_relations.empty()) {
-    insert_results(
-        w.prepared("relation_members_of_relations")(sel_relations).exec(),
-        sel_relations);
+void readonly_pgsql_selection::queue_prefetch(
+    const id_set<osm_nwr_id_t> &sel, const element_rows_t &rows,
+    const std::string &rows_name, const std::string &children_name,
+    const std::string &tags_name, vector<prefetch_chunk> &chunks) {
+  // the chunks must be the same as the ones the write functions use, and
+  // are handed out to the helpers in turn.
+  id_set<osm_nwr_id_t>::const_iterator prev_itr = sel.begin();
+  size_t chunk_i = 0;
+  for (id_set<osm_nwr_id_t>::const_iterator n_itr = sel.begin();;
+       ++n_itr, ++chunk_i) {
+    bool at_end = n_itr == sel.end();
+    if ((chunk_i >= STRIDE) || ((chunk_i > 0) && at_end)) {
+      prefetch_chunk chunk;
+      chunk.ids.assign(prev_itr, n_itr);
+      chunk.helper =
+          (way_prefetch.size() + relation_prefetch.size()) % helpers.size();
+      pqxx::pipeline &p = *helper_pipelines[chunk.helper];
+
+      vector<osm_nwr_id_t> missing;
+      for (vector<osm_nwr_id_t>::const_iterator itr = chunk.ids.begin();
+           itr != chunk.ids.end(); ++itr) {
+        if (rows.count(*itr) == 0) {
+          missing.push_back(*itr);
+        }
+      }
+      chunk.has_rows = !missing.empty();
+      if (chunk.has_rows) {
+        chunk.rows =
+            p.insert("EXECUTE " + rows_name + "(" + w.quote(missing) + ")");
+      }
+
+      const std::string ids = w.quote(chunk.ids);
+      chunk.children = p.insert("EXECUTE " + children_name + "(" + ids + ")");
+      chunk.tags = p.insert("EXECUTE " + tags_name + "(" + ids + ")");
+      chunks.push_back(chunk);
+
+      chunk_i = 0;
+      prev_itr = n_itr;
+    }
+
+    if (at_end)
+      break;
+  }
+}
+
+void readonly_pgsql_selection::poll_prefetch() {
+  for (size_t i = 0; i < helper_txs.size(); ++i) {
+    PQconsumeInput(helpers[i]->handle());
+  }
+}
+
+const readonly_pgsql_selection::prefetch_chunk *
+readonly_pgsql_selection::find_prefetch(const vector<prefetch_chunk> &chunks,
+                                        size_t chunk_num,
+                                        const vector<osm_nwr_id_t> &ids) const {
+  // the selection shouldn't change once it's being written out, but if it
+  // did then the prefetched chunks won't line up, and have to be ignored.
+  if ((chunk_num < chunks.size()) && (chunks[chunk_num].ids == ids)) {
+    return &chunks[chunk_num];
+  }
+  return NULL;
+}
+
+bool readonly_pgsql_selection::selected_versions(element_type type,
+                                                 id_versions_t &out) {
+  if (type == element_type_changeset) {
+    return selected_changeset_versions(out);
+  }
+
+  // the helpers are sent everything selected as soon as the first type of
+  // element is written, so removing elements later wouldn't save anything.
+  if (!helpers.empty()) {
+    return false;
+  }
+
+  // the select queries have already returned the rows, including the
+  // version, for most of the selected elements. any others are fetched a
+  // chunk at a time, and kept for writing out.
+  flush_selects();
+  const id_set<osm_nwr_id_t> &sel = selected(type);
+  const element_rows_t &rows = rows_for(type);
+  for (id_set<osm_nwr_id_t>::const_iterator itr = sel.begin();
+       itr != sel.end();) {
+    const id_set<osm_nwr_id_t>::const_iterator chunk_end =
+        (size_t(sel.end() - itr) > STRIDE) ? itr + STRIDE : sel.end();
+    const vector<osm_nwr_id_t> ids(itr, chunk_end);
+    fetch_rows(type, ids);
+    for (vector<osm_nwr_id_t>::const_iterator id = ids.begin();
+         id != ids.end(); ++id) {
+      element_rows_t::const_iterator row = rows.find(*id);
+      if (row != rows.end()) {
+        out.push_back(std::make_pair(*id, row->second.info.version));
+      }
+    }
+    itr = chunk_end;
+  }
+  return true;
+}
+
+bool readonly_pgsql_selection::selected_changeset_versions(
+    id_versions_t &out) {
+  if (sel_changesets.empty()) {
+    return true;
+  }
+  const vector<osm_changeset_id_t> ids(sel_changesets.begin(),
+                                       sel_changesets.end());
+  pqxx::result res = exec_ids("changeset_versions", ids);
+  out.reserve(out.size() + res.size());
+  for (pqxx::result::const_iterator itr = res.begin(); itr != res.end();
+       ++itr) {
+    // an open changeset can have its tags changed without anything else
+    // about it changing, and closes without the database changing at all,
+    // so it can't be given a version. once it's closed, only comments can
+    // be added or hidden.
+    osm_nwr_id_t version = 0;
+    if (!(*itr)["open"].as<bool>()) {
+      version = (*itr)["closed_at"].as<osm_nwr_id_t>();
+      version = (version * 0x100000001b3ull) ^
+                (*itr)["num_changes"].as<osm_nwr_id_t>();
+      version = (version * 0x100000001b3ull) ^
+                (*itr)["comments"].as<osm_nwr_id_t>();
+      version = (version * 0x100000001b3ull) ^
+                (*itr)["last_comment"].as<osm_nwr_id_t>();
+      version = std::max<osm_nwr_id_t>(version, 1);
+    }
+    out.push_back(std::make_pair((*itr)["id"].as<osm_nwr_id_t>(), version));
   }
+  return true;
+}
+
+void readonly_pgsql_selection::deselect(element_type type,
+                                        const vector<osm_nwr_id_t> &ids) {
+  vector<osm_nwr_id_t> batch(ids);
+  selected(type).erase_batch(batch);
 }
 
 bool readonly_pgsql_selection::supports_changesets() {
@@ -517,7 +1323,8 @@ bool readonly_pgsql_selection::supports_changesets() {
 
 int readonly_pgsql_selection::select_changesets(const std::vector<osm_changeset_id_t> &ids) {
   if (!ids.empty()) {
-    return insert_results(w.prepared("select_changesets")(ids).exec(), sel_changesets);
+    return insert_results(exec_ids("select_changesets", ids),
+                          sel_changesets);
   } else {
     return 0;
   }
@@ -527,6 +1334,12 @@ void readonly_pgsql_selection::select_changeset_discussions() {
   include_changeset_discussions = true;
 }
 
+void readonly_pgsql_selection::omit_metadata() { include_metadata = false; }
+
+cache<osm_changeset_id_t, changeset> *readonly_pgsql_selection::user_cache() {
+  return include_metadata ? &cc : NULL;
+}
+
 readonly_pgsql_selection::factory::factory(const po::variables_map &opts)
     : m_connection(connect_db_str(opts)),
       m_cache_connection(connect_db_str(opts)),
@@ -535,8 +1348,17 @@ readonly_pgsql_selection::factory::factory(const po::variables_map &opts)
       m_cache_errorhandler(m_cache_connection),
 #endif
       m_cache_tx(m_cache_connection, "changeset_cache"),
-      m_cache(boost::bind(fetch_changeset, boost::ref(m_cache_tx), _1),
-              opts["cachesize"].as<size_t>()) {
+      m_existence(existence_filter::create(opts, m_cache_tx)),
+      m_density(node_density::create(opts, m_cache_tx)),
+      m_memcache(memcached_changeset_cache::create(opts)),
+      m_cache(boost::bind(fetch_changeset_shared, boost::ref(m_cache_tx),
+                          m_memcache.get(), _1),
+              changeset_cache_bytes(opts["cache-bytes"].as<size_t>(),
+                                    opts["cachesize"].as<size_t>()),
+              boost::bind(fetch_changesets_shared, boost::ref(m_cache_tx),
+                          m_memcache.get(), _1, _2)),
+      m_binary_arrays(opts.count("binary-arrays") > 0),
+      m_copy_extract(opts.count("copy-extract") > 0) {
 
   if (m_connection.server_version() < 90300) {
     throw std::runtime_error("Expected Postgres version 9.3+, currently installed version "
@@ -557,18 +1379,27 @@ readonly_pgsql_selection::factory::factory(const po::variables_map &opts)
 
   logger::message("Preparing prepared statements.");
 
+  prepare_element_statements(m_connection);
+  prepare_changeset_statements(m_cache_connection);
+  create_helpers(opts);
+
   // clang-format off
 
   // select nodes with bbox
+  // the tile ranges are joined to the nodes on a range condition, which
+  // rules out hash and merge joins and leaves a range scan of the tile
+  // index for each.
   m_connection.prepare("visible_node_in_bbox",
-    "SELECT id "
-      "FROM current_nodes "
-      "WHERE tile = ANY($1) "
-        "AND latitude BETWEEN $2 AND $3 "
-        "AND longitude BETWEEN $4 AND $5 "
-        "AND visible = true "
-      "LIMIT $6")
-    PREPARE_ARGS(("bigint[]")("integer")("integer")("integer")("integer")("integer"));
+    "SELECT " + node_columns +
+      "FROM (SELECT unnest($1::bigint[]) AS first_tile, "
+                   "unnest($2::bigint[]) AS last_tile) AS t "
+        "JOIN current_nodes n "
+          "ON n.tile BETWEEN t.first_tile AND t.last_tile "
+      "WHERE n.latitude BETWEEN $3 AND $4 "
+        "AND n.longitude BETWEEN $5 AND $6 "
+        "AND n.visible = true "
+      "LIMIT $7")
+    PREPARE_ARGS(("bigint[]")("bigint[]")("integer")("integer")("integer")("integer")("integer"));
 
   // selecting node, way and relation visibility information
   m_connection.prepare("visible_node",
@@ -578,111 +1409,134 @@ readonly_pgsql_selection::factory::factory(const po::variables_map &opts)
   m_connection.prepare("visible_relation",
     "SELECT visible FROM current_relations WHERE id = $1")PREPARE_ARGS(("bigint"));
 
-  // extraction functions for child information
-  m_connection.prepare("extract_way_nds",
-    "SELECT node_id "
-      "FROM current_way_nodes "
-      "WHERE way_id=$1 "
-      "ORDER BY sequence_id ASC")
-    PREPARE_ARGS(("bigint"));
-  m_connection.prepare("extract_relation_members",
-    "SELECT member_type, member_id, member_role "
-      "FROM current_relation_members "
-      "WHERE relation_id=$1 "
-      "ORDER BY sequence_id ASC")
-    PREPARE_ARGS(("bigint"));
+  // extraction function for getting the changesets themselves, in chunks
+  // of IDs. these are sorted by ID so that child information (e.g: tags)
+  // for a whole chunk can be matched up to its parent in a single pass.
+  m_connection.prepare("extract_changesets",
+    "SELECT id, "
+        "to_char(created_at,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS created_at, "
+        "to_char(closed_at, 'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS closed_at, "
+        "min_lat, max_lat, min_lon, max_lon, num_changes "
+      "FROM changesets "
+      "WHERE id = ANY($1) "
+      "ORDER BY id")
+    PREPARE_ARGS(("bigint[]"));
+
+  // extraction functions for child information, for a whole chunk of
+  // parent IDs at once. the parent ID is always returned as "id", and
+  // the results must be sorted by it.
   m_connection.prepare("extract_changeset_comments",
-    "SELECT cc.author_id, u.display_name, cc.body, "
+    "SELECT cc.changeset_id AS id, cc.author_id, u.display_name, cc.body, "
         "to_char(cc.created_at,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS created_at "
       "FROM changeset_comments cc "
       "JOIN users u ON cc.author_id = u.id "
-      "WHERE cc.changeset_id=$1 AND cc.visible "
-      "ORDER BY cc.created_at ASC")
-    PREPARE_ARGS(("bigint"));
+      "WHERE cc.changeset_id = ANY($1) AND cc.visible "
+      "ORDER BY cc.changeset_id, cc.created_at")
+    PREPARE_ARGS(("bigint[]"));
 
-  // extraction functions for tags
-  m_connection.prepare("extract_node_tags",
-    "SELECT k, v FROM current_node_tags WHERE node_id=$1")PREPARE_ARGS(("bigint"));
-  m_connection.prepare("extract_way_tags",
-    "SELECT k, v FROM current_way_tags WHERE way_id=$1")PREPARE_ARGS(("bigint"));
-  m_connection.prepare("extract_relation_tags",
-    "SELECT k, v FROM current_relation_tags WHERE relation_id=$1")PREPARE_ARGS(("bigint"));
   m_connection.prepare("extract_changeset_tags",
-    "SELECT k, v FROM changeset_tags WHERE changeset_id=$1")PREPARE_ARGS(("bigint"));
-
-  // selecting a set of objects as a list
-  m_connection.prepare("select_nodes",
-    "SELECT id "
-      "FROM current_nodes "
-      "WHERE id = ANY($1)")
-    PREPARE_ARGS(("bigint[]"));
-  m_connection.prepare("select_ways",
-    "SELECT id "
-      "FROM current_ways "
-      "WHERE id = ANY($1)")
-    PREPARE_ARGS(("bigint[]"));
-  m_connection.prepare("select_relations",
-    "SELECT id "
-      "FROM current_relations "
-      "WHERE id = ANY($1)")
+    "SELECT changeset_id AS id, k, v "
+      "FROM changeset_tags "
+      "WHERE changeset_id = ANY($1) "
+      "ORDER BY changeset_id")
     PREPARE_ARGS(("bigint[]"));
+
   m_connection.prepare("select_changesets",
     "SELECT id "
       "FROM changesets "
       "WHERE id = ANY($1)")
     PREPARE_ARGS(("bigint[]"));
 
+  // everything about the changesets which can change, to make up versions
+  // for them from.
+  m_connection.prepare("changeset_versions",
+    "SELECT c.id, c.num_changes, "
+        "c.closed_at > (now() AT TIME ZONE 'UTC') AS open, "
+        "extract(epoch FROM c.closed_at)::bigint AS closed_at, "
+        "count(cc.id) AS comments, "
+        "coalesce(max(cc.id), 0) AS last_comment "
+      "FROM changesets c "
+      "LEFT JOIN changeset_comments cc "
+        "ON cc.changeset_id = c.id AND cc.visible "
+      "WHERE c.id = ANY($1) "
+      "GROUP BY c.id")
+    PREPARE_ARGS(("bigint[]"));
+
   // select ways used by nodes
   m_connection.prepare("ways_from_nodes",
-    "SELECT DISTINCT wn.way_id AS id "
-      "FROM current_way_nodes wn "
-      "WHERE wn.node_id = ANY($1)")
+    "SELECT " + way_columns +
+      "FROM current_ways w "
+      "WHERE w.id IN ("
+        "SELECT wn.way_id "
+          "FROM current_way_nodes wn "
+          "WHERE wn.node_id = ANY($1))")
     PREPARE_ARGS(("bigint[]"));
   // select nodes used by ways
   m_connection.prepare("nodes_from_ways",
-    "SELECT DISTINCT wn.node_id AS id "
-      "FROM current_way_nodes wn "
-      "WHERE wn.way_id = ANY($1)")
+    "SELECT " + node_columns +
+      "FROM current_nodes n "
+      "WHERE n.id IN ("
+        "SELECT wn.node_id "
+          "FROM current_way_nodes wn "
+          "WHERE wn.way_id = ANY($1))")
     PREPARE_ARGS(("bigint[]"));
 
   // Queries for getting relation parents of objects
   m_connection.prepare("relation_parents_of_nodes",
-    "SELECT DISTINCT rm.relation_id AS id "
-      "FROM current_relation_members rm "
-      "WHERE rm.member_type = 'Node' "
-        "AND rm.member_id = ANY($1)")
+    "SELECT " + relation_columns +
+      "FROM current_relations r "
+      "WHERE r.id IN ("
+        "SELECT rm.relation_id "
+          "FROM current_relation_members rm "
+          "WHERE rm.member_type = 'Node' "
+            "AND rm.member_id = ANY($1))")
     PREPARE_ARGS(("bigint[]"));
   m_connection.prepare("relation_parents_of_ways",
-    "SELECT DISTINCT rm.relation_id AS id "
-      "FROM current_relation_members rm "
-      "WHERE rm.member_type = 'Way' "
-        "AND rm.member_id = ANY($1)")
+    "SELECT " + relation_columns +
+      "FROM current_relations r "
+      "WHERE r.id IN ("
+        "SELECT rm.relation_id "
+          "FROM current_relation_members rm "
+          "WHERE rm.member_type = 'Way' "
+            "AND rm.member_id = ANY($1))")
     PREPARE_ARGS(("bigint[]"));
   m_connection.prepare("relation_parents_of_relations",
-    "SELECT DISTINCT rm.relation_id AS id "
-      "FROM current_relation_members rm "
-      "WHERE rm.member_type = 'Relation' "
-        "AND rm.member_id = ANY($1)")
+    "SELECT " + relation_columns +
+      "FROM current_relations r "
+      "WHERE r.id IN ("
+        "SELECT rm.relation_id "
+          "FROM current_relation_members rm "
+          "WHERE rm.member_type = 'Relation' "
+            "AND rm.member_id = ANY($1))")
     PREPARE_ARGS(("bigint[]"));
 
   // queries for filling elements which are used as members in relations
   m_connection.prepare("nodes_from_relations",
-    "SELECT DISTINCT rm.member_id AS id "
-      "FROM current_relation_members rm "
-      "WHERE rm.member_type = 'Node' "
-        "AND rm.relation_id = ANY($1)")
+    "SELECT " + node_columns +
+      "FROM current_nodes n "
+      "WHERE n.id IN ("
+        "SELECT rm.member_id "
+          "FROM current_relation_members rm "
+          "WHERE rm.member_type = 'Node' "
+            "AND rm.relation_id = ANY($1))")
     PREPARE_ARGS(("bigint[]"));
   m_connection.prepare("ways_from_relations",
-    "SELECT DISTINCT rm.member_id AS id "
-      "FROM current_relation_members rm "
-      "WHERE rm.member_type = 'Way' "
-        "AND rm.relation_id = ANY($1)")
+    "SELECT " + way_columns +
+      "FROM current_ways w "
+      "WHERE w.id IN ("
+        "SELECT rm.member_id "
+          "FROM current_relation_members rm "
+          "WHERE rm.member_type = 'Way' "
+            "AND rm.relation_id = ANY($1))")
     PREPARE_ARGS(("bigint[]"));
   m_connection.prepare("relation_members_of_relations",
-    "SELECT DISTINCT rm.member_id AS id "
-      "FROM current_relation_members rm "
-      "WHERE rm.member_type = 'Relation' "
-        "AND rm.relation_id = ANY($1)")
+    "SELECT " + relation_columns +
+      "FROM current_relations r "
+      "WHERE r.id IN ("
+        "SELECT rm.member_id "
+          "FROM current_relation_members rm "
+          "WHERE rm.member_type = 'Relation' "
+            "AND rm.relation_id = ANY($1))")
     PREPARE_ARGS(("bigint[]"));
 
   // clang-format on
@@ -690,8 +1544,45 @@ readonly_pgsql_selection::factory::factory(const po::variables_map &opts)
 
 readonly_pgsql_selection::factory::~factory() {}
 
+void readonly_pgsql_selection::factory::create_helpers(
+    const po::variables_map &opts) {
+  const size_t num_helpers = opts["extract-connections"].as<size_t>();
+
+  for (size_t i = 0; i < num_helpers; ++i) {
+    boost::shared_ptr<copy_connection> conn =
+        boost::make_shared<copy_connection>(connect_db_str(opts));
+    conn->set_client_encoding(opts["charset"].as<std::string>());
+#if PQXX_VERSION_MAJOR >= 4
+    m_helper_errorhandlers.push_back(
+        boost::make_shared<pqxx::quiet_errorhandler>(boost::ref(*conn)));
+#else
+    conn->set_noticer(std::auto_ptr<pqxx::noticer>(new pqxx::nonnoticer()));
+#endif
+
+    // the helpers run these with EXECUTE in a pipeline, where libpqxx won't
+    // prepare them on demand, so they have to be prepared up front.
+    prepare_element_statements(*conn);
+    conn->prepare_now("select_ways");
+    conn->prepare_now("select_relations");
+    conn->prepare_now("extract_way_nds");
+    conn->prepare_now("extract_relation_members");
+    conn->prepare_now("extract_way_tags");
+    conn->prepare_now("extract_relation_tags");
+
+    m_helper_connections.push_back(conn);
+  }
+}
+
 boost::shared_ptr<data_selection>
 readonly_pgsql_selection::factory::make_selection() {
-  return boost::make_shared<readonly_pgsql_selection>(boost::ref(m_connection),
-                                                      boost::ref(m_cache));
+  if (m_existence) {
+    m_existence->refresh(pt::second_clock::universal_time());
+  }
+  // each selection is one request, which counts as using a changeset once
+  // however many of its elements are in it.
+  m_cache.start_batch();
+  return boost::make_shared<readonly_pgsql_selection>(
+      boost::ref(m_connection), boost::ref(m_cache), m_binary_arrays,
+      m_copy_extract ? m_connection.handle() : NULL,
+      boost::cref(m_helper_connections), m_existence.get(), m_density.get());
 }
@@ -0,0 +1,135 @@
+#include "cgimap/backend/apidb/selection_plan.hpp"
+
+#include <sstream>
+#include <stdexcept>
+#include <boost/format.hpp>
+
+namespace {
+
+// which set a step reads from and which it adds to, and the query giving
+// the IDs it adds in terms of the set it reads (as %1%). these select from
+// the current_* tables in the same way as the step-by-step statements, so
+// that only elements which exist are added.
+struct step_sql {
+  char from, to;
+  const char *sql;
+};
+
+// clang-format off
+const step_sql plan_steps[] = {
+  // plan_nodes_from_relations
+  { 'r', 'n',
+    "SELECT n.id FROM current_nodes n "
+      "WHERE n.id IN ("
+        "SELECT rm.member_id FROM current_relation_members rm "
+          "WHERE rm.member_type = 'Node' "
+            "AND rm.relation_id IN (SELECT id FROM %1%))" },
+  // plan_ways_from_nodes
+  { 'n', 'w',
+    "SELECT w.id FROM current_ways w "
+      "WHERE w.id IN ("
+        "SELECT wn.way_id FROM current_way_nodes wn "
+          "WHERE wn.node_id IN (SELECT id FROM %1%))" },
+  // plan_ways_from_relations
+  { 'r', 'w',
+    "SELECT w.id FROM current_ways w "
+      "WHERE w.id IN ("
+        "SELECT rm.member_id FROM current_relation_members rm "
+          "WHERE rm.member_type = 'Way' "
+            "AND rm.relation_id IN (SELECT id FROM %1%))" },
+  // plan_relations_from_ways
+  { 'w', 'r',
+    "SELECT r.id FROM current_relations r "
+      "WHERE r.id IN ("
+        "SELECT rm.relation_id FROM current_relation_members rm "
+          "WHERE rm.member_type = 'Way' "
+            "AND rm.member_id IN (SELECT id FROM %1%))" },
+  // plan_nodes_from_way_nodes
+  { 'w', 'n',
+    "SELECT n.id FROM current_nodes n "
+      "WHERE n.id IN ("
+        "SELECT wn.node_id FROM current_way_nodes wn "
+          "WHERE wn.way_id IN (SELECT id FROM %1%))" },
+  // plan_relations_from_nodes
+  { 'n', 'r',
+    "SELECT r.id FROM current_relations r "
+      "WHERE r.id IN ("
+        "SELECT rm.relation_id FROM current_relation_members rm "
+          "WHERE rm.member_type = 'Node' "
+            "AND rm.member_id IN (SELECT id FROM %1%))" },
+  // plan_relations_from_relations
+  { 'r', 'r',
+    "SELECT r.id FROM current_relations r "
+      "WHERE r.id IN ("
+        "SELECT rm.relation_id FROM current_relation_members rm "
+          "WHERE rm.member_type = 'Relation' "
+            "AND rm.member_id IN (SELECT id FROM %1%))" },
+  // plan_relations_members_of_relations
+  { 'r', 'r',
+    "SELECT r.id FROM current_relations r "
+      "WHERE r.id IN ("
+        "SELECT rm.member_id FROM current_relation_members rm "
+          "WHERE rm.member_type = 'Relation' "
+            "AND rm.relation_id IN (SELECT id FROM %1%))" }
+};
+// clang-format on
+
+const size_t num_plan_steps = sizeof(plan_steps) / sizeof(plan_steps[0]);
+
+std::string &set_for(plan_ctes &ctes, char type) {
+  switch (type) {
+  case 'n':
+    return ctes.nodes;
+  case 'w':
+    return ctes.ways;
+  default:
+    return ctes.relations;
+  }
+}
+
+} // anonymous namespace
+
+plan_ctes compile_selection_plan(const data_selection::selection_plan &plan,
+                                 const std::string &seed_nodes,
+                                 const std::string &seed_ways,
+                                 const std::string &seed_relations) {
+  plan_ctes ctes;
+  ctes.seed_nodes = ctes.nodes = "n0";
+  ctes.seed_ways = ctes.ways = "w0";
+  ctes.seed_relations = ctes.relations = "r0";
+
+  std::ostringstream with;
+  with << "WITH n0 AS (" << seed_nodes << "), "
+       << "w0 AS (" << seed_ways << "), "
+       << "r0 AS (" << seed_relations << ")";
+
+  for (size_t i = 0; i < plan.size(); ++i) {
+    if (size_t(plan[i]) >= num_plan_steps) {
+      throw std::runtime_error("Unknown step in selection plan.");
+    }
+    const step_sql &step = plan_steps[plan[i]];
+
+    // each step's set is the one it adds to, plus whatever it adds. UNION
+    // removes the duplicates, so the sets stay the same size as the ones
+    // the step-by-step version would build.
+    std::string &to = set_for(ctes, step.to);
+    const std::string name =
+        (boost::format("%1%%2%") % step.to % (i + 1)).str();
+    with << ", " << name << " AS (SELECT id FROM " << to << " UNION "
+         << (boost::format(step.sql) % set_for(ctes, step.from)).str() << ")";
+    to = name;
+  }
+
+  ctes.with = with.str() + " ";
+  return ctes;
+}
+
+std::string selection_plan_name(const data_selection::selection_plan &plan) {
+  std::ostringstream name;
+  name << "plan";
+  for (data_selection::selection_plan::const_iterator itr = plan.begin();
+       itr != plan.end(); ++itr) {
+    name << "_" << int(*itr);
+  }
+  return name.str();
+}
@@ -0,0 +1,228 @@
+#include "cgimap/backend/apidb/shared_changeset_cache.hpp"
+
+#include <cstring>
+#include <stdexcept>
+#include <boost/format.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <sys/mman.h>
+
+namespace {
+
+// how many slots, starting from the one a changeset hashes to, are looked
+// at before giving up on a get, or evicting the oldest of them on a put.
+const size_t PROBE_LENGTH = 8;
+
+// the number of times a reader will try to copy a slot which is in the
+// middle of being written before treating it as a miss.
+const int READ_RETRIES = 4;
+
+// the longest display name which can be kept in a slot, in bytes.
+const size_t MAX_NAME_LENGTH = 255;
+
+boost::scoped_ptr<shared_changeset_cache> s_instance;
+
+inline size_t hash_id(osm_changeset_id_t id) {
+  // changeset IDs are mostly sequential, so spread them out over the table
+  // with fibonacci hashing.
+  return size_t((uint64_t(id) * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+} // anonymous namespace
+
+struct shared_changeset_cache::header {
+  uint64_t hits, misses, inserts, evictions;
+  // bumped on each put, so that the oldest entries can be found.
+  uint32_t clock;
+};
+
+struct shared_changeset_cache::slot {
+  // odd while the slot is being written.
+  uint32_t seq;
+  // the header's clock when the slot was written.
+  uint32_t stamp;
+  uint64_t id;
+  uint64_t user_id;
+  // zero if the slot has never been used. the ID can't be used to mark
+  // this, as there are changesets numbered zero and below.
+  uint8_t used;
+  uint8_t data_public;
+  uint8_t name_length;
+  char name[MAX_NAME_LENGTH];
+};
+
+shared_changeset_cache::shared_changeset_cache(size_t num_entries)
+    : m_header(NULL), m_slots(NULL), m_mask(0), m_bytes(0) {
+  size_t capacity = PROBE_LENGTH;
+  while (capacity < num_entries) {
+    capacity <<= 1;
+  }
+  m_mask = capacity - 1;
+  m_bytes = sizeof(header) + capacity * sizeof(slot);
+
+  // the mapping is shared with any processes forked after this, and
+  // anonymous mappings start off zeroed, which is an empty cache.
+  void *mem = mmap(NULL, m_bytes, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    throw std::runtime_error(
+        (boost::format("Unable to map %1% bytes of shared memory for the "
+                       "changeset cache.") % m_bytes).str());
+  }
+  m_header = static_cast<header *>(mem);
+  m_slots =
+      reinterpret_cast<slot *>(static_cast<char *>(mem) + sizeof(header));
+}
+
+shared_changeset_cache::~shared_changeset_cache() {
+  munmap(m_header, m_bytes);
+}
+
+changeset *shared_changeset_cache::get(osm_changeset_id_t id) {
+  const size_t start = hash_id(id);
+
+  for (size_t i = 0; i < PROBE_LENGTH; ++i) {
+    const slot &s = m_slots[(start + i) & m_mask];
+
+    // copy the slot out, and check that it wasn't written in the meantime.
+    slot copy;
+    bool consistent = false;
+    for (int retry = 0; (retry < READ_RETRIES) && !consistent; ++retry) {
+      const uint32_t seq = __atomic_load_n(&s.seq, __ATOMIC_ACQUIRE);
+      if ((seq & 1) == 0) {
+        memcpy(&copy, &s, sizeof(slot));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        consistent = __atomic_load_n(&s.seq, __ATOMIC_RELAXED) == seq;
+      }
+    }
+    if (!consistent) {
+      break;
+    }
+
+    // puts fill the first unused slot, so there's nothing further on.
+    if (!copy.used) {
+      break;
+    }
+    if (copy.id == uint64_t(id)) {
+      __atomic_fetch_add(&m_header->hits, 1, __ATOMIC_RELAXED);
+      return new changeset(copy.data_public != 0,
+                           std::string(copy.name, copy.name_length),
+                           osm_user_id_t(copy.user_id));
+    }
+  }
+
+  __atomic_fetch_add(&m_header->misses, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+void shared_changeset_cache::put(osm_changeset_id_t id, const changeset &c) {
+  if (c.display_name.size() > MAX_NAME_LENGTH) {
+    return;
+  }
+
+  const size_t start = hash_id(id);
+  const uint32_t now = __atomic_fetch_add(&m_header->clock, 1,
+                                          __ATOMIC_RELAXED);
+
+  // use the slot which already has this changeset, or the first unused
+  // one, or failing that the one which was written longest ago.
+  slot *target = NULL;
+  uint32_t oldest_age = 0;
+  for (size_t i = 0; i < PROBE_LENGTH; ++i) {
+    slot &s = m_slots[(start + i) & m_mask];
+    if ((__atomic_load_n(&s.used, __ATOMIC_RELAXED) == 0) ||
+        (__atomic_load_n(&s.id, __ATOMIC_RELAXED) == uint64_t(id))) {
+      target = &s;
+      break;
+    }
+    const uint32_t age = now - __atomic_load_n(&s.stamp, __ATOMIC_RELAXED);
+    if ((target == NULL) || (age > oldest_age)) {
+      target = &s;
+      oldest_age = age;
+    }
+  }
+
+  // claim the slot, unless another process is already writing it.
+  uint32_t seq = __atomic_load_n(&target->seq, __ATOMIC_RELAXED);
+  if ((seq & 1) ||
+      !__atomic_compare_exchange_n(&target->seq, &seq, seq + 1, false,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return;
+  }
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  const bool evicting = (target->used != 0) && (target->id != uint64_t(id));
+  __atomic_store_n(&target->stamp, now, __ATOMIC_RELAXED);
+  __atomic_store_n(&target->id, uint64_t(id), __ATOMIC_RELAXED);
+  __atomic_store_n(&target->used, uint8_t(1), __ATOMIC_RELAXED);
+  target->user_id = uint64_t(c.user_id);
+  target->data_public = c.data_public ? 1 : 0;
+  target->name_length = uint8_t(c.display_name.size());
+  memcpy(target->name, c.display_name.data(), c.display_name.size());
+
+  __atomic_store_n(&target->seq, seq + 2, __ATOMIC_RELEASE);
+
+  __atomic_fetch_add(&m_header->inserts, 1, __ATOMIC_RELAXED);
+  if (evicting) {
+    __atomic_fetch_add(&m_header->evictions, 1, __ATOMIC_RELAXED);
+  }
+}
+
+changeset *shared_changeset_cache::get_or_fetch(osm_changeset_id_t id,
+                                                const fetch_function &fetch) {
+  changeset *c = get(id);
+  if (c == NULL) {
+    c = fetch(id);
+    if (c != NULL) {
+      put(id, *c);
+    }
+  }
+  return c;
+}
+
+void shared_changeset_cache::get_or_fetch(
+    const std::vector<osm_changeset_id_t> &ids,
+    cache<osm_changeset_id_t, changeset>::batch_type &out,
+    const batch_fetch_function &fetch) {
+  std::vector<osm_changeset_id_t> missing;
+  for (std::vector<osm_changeset_id_t>::const_iterator itr = ids.begin();
+       itr != ids.end(); ++itr) {
+    changeset *c = get(*itr);
+    if (c != NULL) {
+      out.push_back(
+          std::make_pair(*itr, boost::shared_ptr<changeset const>(c)));
+    } else {
+      missing.push_back(*itr);
+    }
+  }
+
+  if (!missing.empty()) {
+    const size_t first_fetched = out.size();
+    fetch(missing, out);
+    for (size_t i = first_fetched; i < out.size(); ++i) {
+      put(out[i].first, *out[i].second);
+    }
+  }
+}
+
+shared_changeset_cache::stats shared_changeset_cache::get_stats() const {
+  stats s;
+  s.hits = __atomic_load_n(&m_header->hits, __ATOMIC_RELAXED);
+  s.misses = __atomic_load_n(&m_header->misses, __ATOMIC_RELAXED);
+  s.inserts = __atomic_load_n(&m_header->inserts, __ATOMIC_RELAXED);
+  s.evictions = __atomic_load_n(&m_header->evictions, __ATOMIC_RELAXED);
+  s.capacity = m_mask + 1;
+  s.bytes = m_bytes;
+  return s;
+}
+
+shared_changeset_cache *shared_changeset_cache::instance() {
+  return s_instance.get();
+}
+
+void shared_changeset_cache::initialise(size_t num_entries) {
+  if (num_entries > 0) {
+    s_instance.reset(new shared_changeset_cache(num_entries));
+  } else {
+    s_instance.reset();
+  }
+}
@@ -0,0 +1,61 @@
+#include "cgimap/backend/apidb/statement_queue.hpp"
+
+statement_queue::statement_queue(pqxx::transaction_base &w) : m_tx(w) {}
+
+void statement_queue::push(const std::string &sql) {
+  m_statements.push_back(sql);
+}
+
+void statement_queue::push_prepared(const std::string &name,
+                                    const std::vector<std::string> &args) {
+  // libpqxx only sends the PREPARE when a statement is first used through
+  // it, which won't happen if it's called with EXECUTE. this is a no-op if
+  // it has already been prepared on this connection.
+  m_tx.conn().prepare_now(name);
+
+  std::string sql = "EXECUTE " + name;
+  if (!args.empty()) {
+    sql += "(";
+    for (size_t i = 0; i < args.size(); ++i) {
+      if (i > 0) {
+        sql += ", ";
+      }
+      sql += args[i];
+    }
+    sql += ")";
+  }
+  m_statements.push_back(sql);
+}
+
+bool statement_queue::empty() const { return m_statements.empty(); }
+
+std::vector<pqxx::result> statement_queue::flush() {
+  std::vector<pqxx::result> results;
+  std::vector<std::string> statements;
+  statements.swap(m_statements);
+
+  if (statements.empty()) {
+    return results;
+  }
+
+  // hold back all the statements until complete() is called, so that they
+  // all go in the same batch.
+  pqxx::pipeline p(m_tx);
+  p.retain(int(statements.size()));
+
+  std::vector<pqxx::pipeline::query_id> ids;
+  ids.reserve(statements.size());
+  for (std::vector<std::string>::const_iterator itr = statements.begin();
+       itr != statements.end(); ++itr) {
+    ids.push_back(p.insert(*itr));
+  }
+  p.complete();
+
+  results.reserve(ids.size());
+  for (std::vector<pqxx::pipeline::query_id>::const_iterator itr = ids.begin();
+       itr != ids.end(); ++itr) {
+    results.push_back(p.retrieve(*itr));
+  }
+
+  return results;
+}
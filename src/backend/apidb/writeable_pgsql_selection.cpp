@@ -4,6 +4,7 @@
 #include "cgimap/backend/apidb/quad_tile.hpp"
 #include "cgimap/infix_ostream_iterator.hpp"
 #include "cgimap/backend/apidb/pqxx_string_traits.hpp"
+#include "cgimap/backend/apidb/selection_plan.hpp"
 #include <set>
 #include <sstream>
 #include <list>
@@ -13,6 +14,7 @@
 #include <boost/ref.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
 
 #if PQXX_VERSION_MAJOR >= 4
 #define PREPARE_ARGS(args)
@@ -48,6 +50,112 @@ std::string connect_db_str(const po::variables_map &options) {
   return ostr.str();
 }
 
+// clang-format off
+
+// the extraction queries for getting the data back out when the selection
+// set has been built up. these are kept as plain SQL, rather than only as
+// prepared statements, because they are also used to declare cursors when
+// streaming the results.
+const char *const extract_nodes_sql =
+  "SELECT n.id, n.latitude, n.longitude, n.visible, "
+      "to_char(n.timestamp,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS timestamp, "
+      "n.changeset_id, n.version, array_agg(t.k) as tag_k, array_agg(t.v) as tag_v "
+    "FROM current_nodes n "
+      "JOIN tmp_nodes tn ON n.id=tn.id "
+      "LEFT JOIN current_node_tags t ON n.id=t.node_id GROUP BY n.id";
+
+const char *const extract_ways_sql =
+  "SELECT w.id, w.visible, w.version, w.changeset_id, "
+      "to_char(w.timestamp,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS timestamp, "
+      "t.keys as tag_k, t.values as tag_v, wn.node_ids as node_ids "
+    "FROM current_ways w JOIN tmp_ways tw ON w.id=tw.id "
+      "LEFT JOIN LATERAL "
+        "(SELECT array_agg(k) AS keys, array_agg(v) AS values "
+        "FROM current_way_tags WHERE w.id=way_id ) t ON true "
+      "LEFT JOIN LATERAL "
+        "(SELECT array_agg(node_id) AS node_ids from "
+          "(SELECT * FROM current_way_nodes WHERE w.id=way_id ) x "
+        ") wn ON true ";
+
+const char *const extract_relations_sql =
+   "SELECT r.id, r.visible, r.version, r.changeset_id, "
+      "to_char(r.timestamp,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS timestamp, "
+      "t.keys as tag_k, t.values as tag_v, rm.types as member_types, "
+      "rm.ids as member_ids, rm.roles as member_roles "
+    "FROM current_relations r JOIN tmp_relations tr ON tr.id=r.id "
+      "LEFT JOIN LATERAL "
+        "(SELECT array_agg(k) AS keys, array_agg(v) AS values "
+        "FROM current_relation_tags WHERE r.id=relation_id ) t ON true "
+      "LEFT JOIN LATERAL "
+        "(SELECT array_agg(member_type) AS types, array_agg(member_id) AS ids, "
+        "array_agg(member_role) AS roles FROM "
+          "( SELECT * FROM current_relation_members WHERE r.id=relation_id "
+          "ORDER BY sequence_id) x"
+        ")rm ON true";
+
+const char *const extract_changesets_sql =
+   "SELECT c.id, "
+     "to_char(c.created_at,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS created_at, "
+     "to_char(c.closed_at, 'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS closed_at, "
+     "c.min_lat, c.max_lat, c.min_lon, c.max_lon, c.num_changes, t.keys as tag_k, "
+     "t.values as tag_v, cc.author_id as comment_author_id, "
+     "cc.display_name as comment_display_name, "
+     "cc.body as comment_body, cc.created_at as comment_created_at "
+   "FROM changesets c JOIN tmp_changesets tc ON tc.id=c.id "
+    "LEFT JOIN LATERAL "
+        "(SELECT array_agg(k) AS keys, array_agg(v) AS values "
+        "FROM changeset_tags WHERE c.id=changeset_id ) t ON true "
+    "LEFT JOIN LATERAL "
+      "(SELECT array_agg(author_id) as author_id, array_agg(display_name) "
+      "as display_name, array_agg(body) as body, "
+      "array_agg(created_at) as created_at FROM "
+        "(SELECT cc.author_id, u.display_name, cc.body, "
+        "to_char(cc.created_at,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS created_at "
+        "FROM changeset_comments cc JOIN users u ON cc.author_id = u.id "
+        "where cc.changeset_id=c.id AND cc.visible ORDER BY cc.created_at) x "
+      ")cc ON true";
+
+// clang-format on
+
+/* iterates over the rows of one of the extraction queries. if batch_size is
+ * zero, then the prepared statement is run and the whole result is returned
+ * at once. otherwise the rows are read through a server-side cursor, which
+ * means only batch_size rows need to be held in memory at any one time.
+ */
+class extract_cursor {
+public:
+  extract_cursor(pqxx::work &w, const std::string &prepared_name,
+                 const std::string &sql, size_t batch_size)
+      : m_w(w), m_prepared_name(prepared_name), m_done(false) {
+    if (batch_size > 0) {
+      m_stream.reset(new pqxx::icursorstream(
+          w, sql, prepared_name,
+          pqxx::icursorstream::difference_type(batch_size)));
+    }
+  }
+
+  // fetch the next batch of rows, returning false when there are no more.
+  bool next(pqxx::result &rows) {
+    if (m_stream) {
+      return bool(*m_stream >> rows) && !rows.empty();
+
+    } else if (!m_done) {
+      rows = m_w.prepared(m_prepared_name).exec();
+      m_done = true;
+      return true;
+
+    } else {
+      return false;
+    }
+  }
+
+private:
+  pqxx::work &m_w;
+  const std::string m_prepared_name;
+  bool m_done;
+  boost::scoped_ptr<pqxx::icursorstream> m_stream;
+};
+
 inline data_selection::visibility_t
 check_table_visibility(pqxx::work &w, osm_nwr_id_t id,
                        const std::string &prepared_name) {
@@ -64,14 +172,40 @@ check_table_visibility(pqxx::work &w, osm_nwr_id_t id,
   }
 }
 
+/* rather than filling the changeset cache one changeset at a time as each
+ * row is extracted, the missing changesets for a whole batch of rows are
+ * fetched together beforehand. the changeset IDs are in the named column.
+ * the cache is null when elements are written without metadata, and then
+ * nothing is looked up.
+ */
+void prefetch_changesets(
+    const pqxx::result &res, const char *column,
+    cache<osm_changeset_id_t, changeset> *changeset_cache) {
+  if (changeset_cache == NULL) {
+    return;
+  }
+  std::vector<osm_changeset_id_t> ids;
+  ids.reserve(res.size());
+  for (pqxx::result::const_iterator itr = res.begin(); itr != res.end();
+       ++itr) {
+    ids.push_back((*itr)[column].as<osm_changeset_id_t>());
+  }
+  changeset_cache->prefetch(ids.begin(), ids.end());
+}
+
 void extract_elem(const pqxx::result::tuple &row, element_info &elem,
-                  cache<osm_changeset_id_t, changeset> &changeset_cache) {
+                  cache<osm_changeset_id_t, changeset> *changeset_cache) {
   elem.id = row["id"].as<osm_nwr_id_t>();
   elem.version = row["version"].as<int>();
   elem.timestamp = row["timestamp"].c_str();
   elem.changeset = row["changeset_id"].as<osm_changeset_id_t>();
   elem.visible = row["visible"].as<bool>();
-  shared_ptr<changeset const> cs = changeset_cache.get(elem.changeset);
+  if (changeset_cache == NULL) {
+    elem.uid = boost::none;
+    elem.display_name = boost::none;
+    return;
+  }
+  shared_ptr<changeset const> cs = changeset_cache->get(elem.changeset);
   if (cs->data_public) {
     elem.uid = cs->user_id;
     elem.display_name = cs->display_name;
@@ -125,20 +259,25 @@ void extract_changeset(const pqxx::result::tuple &row,
 
 void extract_tags(const pqxx::result::tuple &row, tags_t &tags) {
   tags.clear();
-  std::vector<std::string> keys = psql_array_to_vector(row["tag_k"].c_str());
-  std::vector<std::string> values = psql_array_to_vector(row["tag_v"].c_str());
-  if (keys.size()!=values.size()) {
+  const pqxx::result::field k = row["tag_k"], v = row["tag_v"];
+  psql_array_reader keys(k.c_str(), k.size()), values(v.c_str(), v.size());
+  while (keys.next()) {
+    if (!values.next()) {
+      throw std::runtime_error("Mismatch in tags key and value size");
+    }
+    tags.push_back(std::make_pair(keys.str(), values.str()));
+  }
+  if (values.next()) {
     throw std::runtime_error("Mismatch in tags key and value size");
   }
-  for(int i=0; i<keys.size(); i++)
-     tags.push_back(std::make_pair(keys[i], values[i]));
 }
 
 void extract_nodes(const pqxx::result::tuple &row, nodes_t &nodes) {
   nodes.clear();
-  std::vector<std::string> ids = psql_array_to_vector(row["node_ids"].c_str());
-  for (int i=0; i<ids.size(); i++)
-    nodes.push_back(boost::lexical_cast<osm_nwr_id_t>(ids[i]));
+  const pqxx::result::field f = row["node_ids"];
+  for (psql_array_reader ids(f.c_str(), f.size()); ids.next();) {
+    nodes.push_back(osm_nwr_id_t(ids.as_int64()));
+  }
 }
 
 element_type type_from_name(const char *name) {
@@ -172,50 +311,73 @@ element_type type_from_name(const char *name) {
 void extract_members(const pqxx::result::tuple &row, members_t &members) {
   member_info member;
   members.clear();
-  std::vector<std::string> types = psql_array_to_vector(row["member_types"].c_str());
-  std::vector<std::string> ids = psql_array_to_vector(row["member_ids"].c_str());
-  std::vector<std::string> roles = psql_array_to_vector(row["member_roles"].c_str());
-  if (types.size()!=ids.size() || ids.size()!=roles.size()) {
-    throw std::runtime_error("Mismatch in members types, ids and roles size");
-  }
-  for (int i=0; i<ids.size(); i++) {
-    member.type = type_from_name(types[i].c_str());
-    member.ref = boost::lexical_cast<osm_nwr_id_t>(ids[i]);
-    member.role = roles[i];
+  const pqxx::result::field t = row["member_types"], i = row["member_ids"],
+                            r = row["member_roles"];
+  psql_array_reader types(t.c_str(), t.size()), ids(i.c_str(), i.size()),
+      roles(r.c_str(), r.size());
+  while (types.next()) {
+    if (!ids.next() || !roles.next()) {
+      throw std::runtime_error("Mismatch in members types, ids and roles size");
+    }
+    member.type = type_from_name(types.data());
+    member.ref = osm_nwr_id_t(ids.as_int64());
+    member.role.assign(roles.data(), roles.size());
     members.push_back(member);
   }
+  if (ids.next() || roles.next()) {
+    throw std::runtime_error("Mismatch in members types, ids and roles size");
+  }
 }
 
 void extract_comments(const pqxx::result::tuple &row, comments_t &comments) {
   changeset_comment_info comment;
   comments.clear();
-  std::vector<std::string> author_id = psql_array_to_vector(row["comment_author_id"].c_str());
-  std::vector<std::string> display_name = psql_array_to_vector(row["comment_display_name"].c_str());
-  std::vector<std::string> body = psql_array_to_vector(row["comment_body"].c_str());
-  std::vector<std::string> created_at = psql_array_to_vector(row["comment_created_at"].c_str());
-  if (author_id.size()!=display_name.size() || display_name.size()!=body.size()
-      || body.size()!=created_at.size()) {
-    throw std::runtime_error("Mismatch in comments author_id, display_name, body and created_at size");
-  }
-  for (int i=0; i<author_id.size(); i++) {
-    comment.author_id = boost::lexical_cast<osm_nwr_id_t>(author_id[i]);
-    comment.author_display_name = display_name[i];
-    comment.body = body[i];
-    comment.created_at = created_at[i];
+  const pqxx::result::field a = row["comment_author_id"],
+                            d = row["comment_display_name"],
+                            b = row["comment_body"],
+                            c = row["comment_created_at"];
+  psql_array_reader author_id(a.c_str(), a.size()),
+      display_name(d.c_str(), d.size()), body(b.c_str(), b.size()),
+      created_at(c.c_str(), c.size());
+  while (author_id.next()) {
+    if (!display_name.next() || !body.next() || !created_at.next()) {
+      throw std::runtime_error("Mismatch in comments author_id, display_name, body and created_at size");
+    }
+    comment.author_id = osm_user_id_t(author_id.as_int64());
+    comment.author_display_name.assign(display_name.data(),
+                                       display_name.size());
+    comment.body.assign(body.data(), body.size());
+    comment.created_at.assign(created_at.data(), created_at.size());
     comments.push_back(comment);
   }
+  if (display_name.next() || body.next() || created_at.next()) {
+    throw std::runtime_error("Mismatch in comments author_id, display_name, body and created_at size");
+  }
 }
 
 } // anonymous namespace
 
 writeable_pgsql_selection::writeable_pgsql_selection(
-    pqxx::connection &conn, cache<osm_changeset_id_t, changeset> &changeset_cache)
-    : w(conn), cc(changeset_cache)
-    , include_changeset_discussions(false) {
-  w.exec("CREATE TEMPORARY TABLE tmp_nodes (id bigint PRIMARY KEY)");
-  w.exec("CREATE TEMPORARY TABLE tmp_ways (id bigint PRIMARY KEY)");
-  w.exec("CREATE TEMPORARY TABLE tmp_relations (id bigint PRIMARY KEY)");
-  w.exec("CREATE TEMPORARY TABLE tmp_changesets (id bigint PRIMARY KEY)");
+    pqxx::connection &conn, cache<osm_changeset_id_t, changeset> &changeset_cache,
+    size_t extract_batch_size_, existence_filter *filter_,
+    node_density *density_, bool create_tables)
+    : w(conn), pending(w), cc(changeset_cache), filter(filter_)
+    , density(density_)
+    , include_changeset_discussions(false)
+    , include_metadata(true)
+    , extract_batch_size(extract_batch_size_) {
+  // unless asked to create them here, the temporary tables are created by
+  // the factory, and are always empty at the start of a transaction.
+  if (create_tables) {
+    // these are sent along with the first query, rather than taking a
+    // round trip each. they go when the transaction is rolled back.
+    pending.push("CREATE TEMPORARY TABLE tmp_nodes (id bigint PRIMARY KEY)");
+    pending.push("CREATE TEMPORARY TABLE tmp_ways (id bigint PRIMARY KEY)");
+    pending.push(
+        "CREATE TEMPORARY TABLE tmp_relations (id bigint PRIMARY KEY)");
+    pending.push(
+        "CREATE TEMPORARY TABLE tmp_changesets (id bigint PRIMARY KEY)");
+  }
   m_tables_empty = true;
 }
 
@@ -229,14 +391,20 @@ void writeable_pgsql_selection::write_nodes(output_formatter &formatter) {
   double lon, lat;
   tags_t tags;
 
-  pqxx::result nodes = w.prepared("extract_nodes").exec();
-  for (pqxx::result::const_iterator itr = nodes.begin(); itr != nodes.end();
-       ++itr) {
-    extract_elem(*itr, elem, cc);
-    lon = double((*itr)["longitude"].as<int64_t>()) / (SCALE);
-    lat = double((*itr)["latitude"].as<int64_t>()) / (SCALE);
-    extract_tags(*itr, tags);
-    formatter.write_node(elem, lon, lat, tags);
+  pending.flush();
+  extract_cursor cursor(w, "extract_nodes", extract_nodes_sql,
+                        extract_batch_size);
+  pqxx::result nodes;
+  while (cursor.next(nodes)) {
+    prefetch_changesets(nodes, "changeset_id", user_cache());
+    for (pqxx::result::const_iterator itr = nodes.begin(); itr != nodes.end();
+         ++itr) {
+      extract_elem(*itr, elem, user_cache());
+      lon = double((*itr)["longitude"].as<int64_t>()) / (SCALE);
+      lat = double((*itr)["latitude"].as<int64_t>()) / (SCALE);
+      extract_tags(*itr, tags);
+      formatter.write_node(elem, lon, lat, tags);
+    }
   }
 }
 
@@ -249,13 +417,19 @@ void writeable_pgsql_selection::write_ways(output_formatter &formatter) {
   nodes_t nodes;
   tags_t tags;
 
-  pqxx::result ways = w.prepared("extract_ways").exec();
-  for (pqxx::result::const_iterator itr = ways.begin(); itr != ways.end();
-       ++itr) {
-    extract_elem(*itr, elem, cc);
-    extract_nodes(*itr, nodes);
-    extract_tags(*itr, tags);
-    formatter.write_way(elem, nodes, tags);
+  pending.flush();
+  extract_cursor cursor(w, "extract_ways", extract_ways_sql,
+                        extract_batch_size);
+  pqxx::result ways;
+  while (cursor.next(ways)) {
+    prefetch_changesets(ways, "changeset_id", user_cache());
+    for (pqxx::result::const_iterator itr = ways.begin(); itr != ways.end();
+         ++itr) {
+      extract_elem(*itr, elem, user_cache());
+      extract_nodes(*itr, nodes);
+      extract_tags(*itr, tags);
+      formatter.write_way(elem, nodes, tags);
+    }
   }
 }
 
@@ -265,13 +439,19 @@ void writeable_pgsql_selection::write_relations(output_formatter &formatter) {
   members_t members;
   tags_t tags;
 
-  pqxx::result relations = w.prepared("extract_relations").exec();
-  for (pqxx::result::const_iterator itr = relations.begin();
-       itr != relations.end(); ++itr) {
-    extract_elem(*itr, elem, cc);
-    extract_members(*itr, members);
-    extract_tags(*itr, tags);
-    formatter.write_relation(elem, members, tags);
+  pending.flush();
+  extract_cursor cursor(w, "extract_relations", extract_relations_sql,
+                        extract_batch_size);
+  pqxx::result relations;
+  while (cursor.next(relations)) {
+    prefetch_changesets(relations, "changeset_id", user_cache());
+    for (pqxx::result::const_iterator itr = relations.begin();
+         itr != relations.end(); ++itr) {
+      extract_elem(*itr, elem, user_cache());
+      extract_members(*itr, members);
+      extract_tags(*itr, tags);
+      formatter.write_relation(elem, members, tags);
+    }
   }
 }
 
@@ -281,57 +461,84 @@ void writeable_pgsql_selection::write_changesets(output_formatter &formatter,
   tags_t tags;
   comments_t comments;
 
-  pqxx::result changesets = w.prepared("extract_changesets").exec();
-  for (pqxx::result::const_iterator itr = changesets.begin();
-       itr != changesets.end(); ++itr) {
-    extract_changeset(*itr, elem, cc);
-    extract_tags(*itr, tags);
-    extract_comments(*itr, comments);
-    elem.comments_count = comments.size();
-    formatter.write_changeset(elem, tags, include_changeset_discussions, comments, now);
+  pending.flush();
+  extract_cursor cursor(w, "extract_changesets", extract_changesets_sql,
+                        extract_batch_size);
+  pqxx::result changesets;
+  while (cursor.next(changesets)) {
+    prefetch_changesets(changesets, "id", &cc);
+    for (pqxx::result::const_iterator itr = changesets.begin();
+         itr != changesets.end(); ++itr) {
+      extract_changeset(*itr, elem, cc);
+      extract_tags(*itr, tags);
+      extract_comments(*itr, comments);
+      elem.comments_count = comments.size();
+      formatter.write_changeset(elem, tags, include_changeset_discussions,
+                                comments, now);
+    }
   }
 }
 
 data_selection::visibility_t
 writeable_pgsql_selection::check_node_visibility(osm_nwr_id_t id) {
+  if ((filter != NULL) && !filter->can_exist(element_type_node, id)) {
+    return non_exist;
+  }
   return check_table_visibility(w, id, "visible_node");
 }
 
 data_selection::visibility_t
 writeable_pgsql_selection::check_way_visibility(osm_nwr_id_t id) {
+  if ((filter != NULL) && !filter->can_exist(element_type_way, id)) {
+    return non_exist;
+  }
   return check_table_visibility(w, id, "visible_way");
 }
 
 data_selection::visibility_t
 writeable_pgsql_selection::check_relation_visibility(osm_nwr_id_t id) {
+  if ((filter != NULL) && !filter->can_exist(element_type_relation, id)) {
+    return non_exist;
+  }
   return check_table_visibility(w, id, "visible_relation");
 }
 
 int writeable_pgsql_selection::select_nodes(const std::vector<osm_nwr_id_t> &ids) {
+  if ((filter != NULL) && !filter->any_can_exist(element_type_node, ids)) {
+    return 0;
+  }
   m_tables_empty = false;
-  return w.prepared("add_nodes_list")(ids).exec().affected_rows();
+  return exec_pending("add_nodes_list", ids);
 }
 
 int writeable_pgsql_selection::select_ways(const std::vector<osm_nwr_id_t> &ids) {
+  if ((filter != NULL) && !filter->any_can_exist(element_type_way, ids)) {
+    return 0;
+  }
   m_tables_empty = false;
-  return w.prepared("add_ways_list")(ids).exec().affected_rows();
+  return exec_pending("add_ways_list", ids);
 }
 
 int writeable_pgsql_selection::select_relations(
     const std::vector<osm_nwr_id_t> &ids) {
+  if ((filter != NULL) &&
+      !filter->any_can_exist(element_type_relation, ids)) {
+    return 0;
+  }
   m_tables_empty = false;
-  return w.prepared("add_relations_list")(ids).exec().affected_rows();
+  return exec_pending("add_relations_list", ids);
 }
 
 int writeable_pgsql_selection::select_nodes_from_bbox(const bbox &bounds,
                                                       int max_nodes) {
-  const vector<tile_id_t> tiles = tiles_for_area(bounds.minlat, bounds.minlon,
-                                                 bounds.maxlat, bounds.maxlon);
+  if ((density != NULL) && density->too_many_nodes(bounds, max_nodes)) {
+    return max_nodes + 1;
+  }
 
-  // hack around problem with postgres' statistics, which was
-  // making it do seq scans all the time on smaug...
-  w.exec("set enable_mergejoin=false");
-  w.exec("set enable_hashjoin=false");
+  vector<tile_id_t> first_tiles, last_tiles;
+  split_tile_ranges(tile_ranges_for_area(bounds.minlat, bounds.minlon,
+                                         bounds.maxlat, bounds.maxlon),
+                    first_tiles, last_tiles);
 
   logger::message("Filling tmp_nodes from bbox");
   // optimise for the case where this is the first query run.
@@ -345,48 +552,97 @@ int writeable_pgsql_selection::select_nodes_from_bbox(const bbox &bounds,
   }
   m_tables_empty = false;
 
-  return w.prepared("visible_node_in_bbox")(tiles)(int(bounds.minlat * SCALE))(
-               int(bounds.maxlat * SCALE))(int(bounds.minlon * SCALE))(
-               int(bounds.maxlon * SCALE))(max_nodes + 1)
-      .exec()
-      .affected_rows();
+  std::vector<std::string> args;
+  args.push_back(w.quote(first_tiles));
+  args.push_back(w.quote(last_tiles));
+  args.push_back(w.quote(int(bounds.minlat * SCALE)));
+  args.push_back(w.quote(int(bounds.maxlat * SCALE)));
+  args.push_back(w.quote(int(bounds.minlon * SCALE)));
+  args.push_back(w.quote(int(bounds.maxlon * SCALE)));
+  args.push_back(w.quote(max_nodes + 1));
+  pending.push_prepared("visible_node_in_bbox", args);
+
+  return pending.flush().back().affected_rows();
 }
 
 void writeable_pgsql_selection::select_nodes_from_relations() {
   logger::message("Filling tmp_nodes (from relations)");
 
-  w.prepared("nodes_from_relations").exec();
+  pending.push_prepared("nodes_from_relations");
 }
 
 void writeable_pgsql_selection::select_ways_from_nodes() {
   logger::message("Filling tmp_ways (from nodes)");
-  w.prepared("ways_from_nodes").exec();
+  pending.push_prepared("ways_from_nodes");
 }
 
 void writeable_pgsql_selection::select_ways_from_relations() {
   logger::message("Filling tmp_ways (from relations)");
-  w.prepared("ways_from_relations").exec();
+  pending.push_prepared("ways_from_relations");
 }
 
 void writeable_pgsql_selection::select_relations_from_ways() {
   logger::message("Filling tmp_relations (from ways)");
-  w.prepared("relations_from_ways").exec();
+  pending.push_prepared("relations_from_ways");
 }
 
 void writeable_pgsql_selection::select_nodes_from_way_nodes() {
-  w.prepared("nodes_from_way_nodes").exec();
+  pending.push_prepared("nodes_from_way_nodes");
 }
 
 void writeable_pgsql_selection::select_relations_from_nodes() {
-  w.prepared("relations_from_nodes").exec();
+  pending.push_prepared("relations_from_nodes");
 }
 
 void writeable_pgsql_selection::select_relations_from_relations() {
-  w.prepared("relations_from_relations").exec();
+  pending.push_prepared("relations_from_relations");
 }
 
 void writeable_pgsql_selection::select_relations_members_of_relations() {
-  w.prepared("relation_members_of_relations").exec();
+  pending.push_prepared("relation_members_of_relations");
+}
+
+void writeable_pgsql_selection::select_plan(const selection_plan &plan) {
+  if (plan.empty()) {
+    return;
+  }
+
+  // each set is inserted into its temporary table by a data-modifying CTE.
+  // these all see the tables as they were before the statement, so only
+  // the IDs which weren't there at the start are inserted.
+  const plan_ctes ctes =
+      compile_selection_plan(plan, "SELECT id FROM tmp_nodes",
+                             "SELECT id FROM tmp_ways",
+                             "SELECT id FROM tmp_relations");
+
+  vector<std::string> inserts;
+  if (ctes.nodes != ctes.seed_nodes) {
+    inserts.push_back("INSERT INTO tmp_nodes SELECT id FROM " + ctes.nodes +
+                      " EXCEPT SELECT id FROM " + ctes.seed_nodes);
+  }
+  if (ctes.ways != ctes.seed_ways) {
+    inserts.push_back("INSERT INTO tmp_ways SELECT id FROM " + ctes.ways +
+                      " EXCEPT SELECT id FROM " + ctes.seed_ways);
+  }
+  if (ctes.relations != ctes.seed_relations) {
+    inserts.push_back("INSERT INTO tmp_relations SELECT id FROM " +
+                      ctes.relations + " EXCEPT SELECT id FROM " +
+                      ctes.seed_relations);
+  }
+
+  // all but the last insert go in the WITH clause, and the last is the
+  // statement itself.
+  std::ostringstream query;
+  query << ctes.with;
+  for (size_t i = 0; i + 1 < inserts.size(); ++i) {
+    query << ", plan_insert_" << i << " AS (" << inserts[i] << ") ";
+  }
+  query << inserts.back();
+
+  const std::string name = selection_plan_name(plan);
+  logger::message("Filling temporary tables with selection " + name);
+  w.conn().prepare(name, query.str());
+  pending.push_prepared(name);
 }
 
 bool writeable_pgsql_selection::supports_changesets() {
@@ -394,13 +650,59 @@ bool writeable_pgsql_selection::supports_changesets() {
 }
 
 int writeable_pgsql_selection::select_changesets(const std::vector<osm_changeset_id_t> &ids) {
-  return w.prepared("add_changesets_list")(ids).exec().affected_rows();
+  return exec_pending("add_changesets_list", ids);
 }
 
 void writeable_pgsql_selection::select_changeset_discussions() {
   include_changeset_discussions = true;
 }
 
+void writeable_pgsql_selection::omit_metadata() { include_metadata = false; }
+
+cache<osm_changeset_id_t, changeset> *writeable_pgsql_selection::user_cache() {
+  return include_metadata ? &cc : NULL;
+}
+
+bool writeable_pgsql_selection::selected_versions(element_type type,
+                                                  id_versions_t &out) {
+  if (type == element_type_changeset) {
+    return false;
+  }
+  const char *name =
+      (type == element_type_node)
+          ? "node_versions"
+          : ((type == element_type_way) ? "way_versions" : "relation_versions");
+  pending.flush();
+  pqxx::result res = w.prepared(name).exec();
+  out.reserve(out.size() + res.size());
+  for (pqxx::result::const_iterator itr = res.begin(); itr != res.end();
+       ++itr) {
+    out.push_back(std::make_pair((*itr)["id"].as<osm_nwr_id_t>(),
+                                 (*itr)["version"].as<osm_nwr_id_t>()));
+  }
+  return true;
+}
+
+void writeable_pgsql_selection::deselect(element_type type,
+                                         const std::vector<osm_nwr_id_t> &ids) {
+  if (ids.empty()) {
+    return;
+  }
+  const char *name =
+      (type == element_type_node)
+          ? "deselect_nodes"
+          : ((type == element_type_way) ? "deselect_ways"
+                                        : "deselect_relations");
+  exec_pending(name, ids);
+}
+
+template <typename T>
+int writeable_pgsql_selection::exec_pending(const std::string &name,
+                                            const std::vector<T> &ids) {
+  pending.push_prepared(name, std::vector<std::string>(1, w.quote(ids)));
+  return pending.flush().back().affected_rows();
+}
+
 namespace {
 /* this exists solely because converting boost::any seems to just
  * do type equality, with no fall-back to boost::lexical_cast or
@@ -446,8 +748,18 @@ writeable_pgsql_selection::factory::factory(const po::variables_map &opts)
       m_cache_errorhandler(m_cache_connection),
 #endif
       m_cache_tx(m_cache_connection, "changeset_cache"),
-      m_cache(boost::bind(fetch_changeset, boost::ref(m_cache_tx), _1),
-              get_or_convert_cachesize(opts)) {
+      m_existence(existence_filter::create(opts, m_cache_tx)),
+      m_density(node_density::create(opts, m_cache_tx)),
+      m_memcache(memcached_changeset_cache::create(opts)),
+      m_cache(boost::bind(fetch_changeset_shared, boost::ref(m_cache_tx),
+                          m_memcache.get(), _1),
+              changeset_cache_bytes(opts["cache-bytes"].as<size_t>(),
+                                    get_or_convert_cachesize(opts)),
+              boost::bind(fetch_changesets_shared, boost::ref(m_cache_tx),
+                          m_memcache.get(), _1, _2)),
+      m_extract_batch_size(opts["extract-batch-size"].as<size_t>()),
+      m_tables_per_request(opts.count("temp-tables-per-request") > 0),
+      m_tables_backend_pid(0) {
 
   if (m_connection.server_version() < 90300) {
     throw std::runtime_error("Expected Postgres version 9.3+, currently installed version "
@@ -468,6 +780,8 @@ writeable_pgsql_selection::factory::factory(const po::variables_map &opts)
 
   logger::message("Preparing prepared statements.");
 
+  prepare_changeset_statements(m_cache_connection);
+
   // clang-format off
 
   // select nodes with bbox
@@ -477,16 +791,21 @@ writeable_pgsql_selection::factory::factory(const po::variables_map &opts)
   // there are no existing nodes in the tmp_nodes table. there is
   // a check to ensure this assumption is not violated
   // (m_tables_empty).
+  // the tile ranges are joined to the nodes on a range condition, which
+  // rules out hash and merge joins and leaves a range scan of the tile
+  // index for each.
   m_connection.prepare("visible_node_in_bbox",
     "INSERT INTO tmp_nodes "
-      "SELECT id "
-        "FROM current_nodes "
-        "WHERE tile = ANY($1) "
-          "AND latitude BETWEEN $2 AND $3 "
-          "AND longitude BETWEEN $4 AND $5 "
-          "AND visible = true "
-        "LIMIT $6")
-    PREPARE_ARGS(("bigint[]")("integer")("integer")("integer")("integer")("integer"));
+      "SELECT n.id "
+        "FROM (SELECT unnest($1::bigint[]) AS first_tile, "
+                     "unnest($2::bigint[]) AS last_tile) AS t "
+          "JOIN current_nodes n "
+            "ON n.tile BETWEEN t.first_tile AND t.last_tile "
+        "WHERE n.latitude BETWEEN $3 AND $4 "
+          "AND n.longitude BETWEEN $5 AND $6 "
+          "AND n.visible = true "
+        "LIMIT $7")
+    PREPARE_ARGS(("bigint[]")("bigint[]")("integer")("integer")("integer")("integer")("integer"));
 
   // selecting node, way and relation visibility information
   m_connection.prepare("visible_node",
@@ -497,62 +816,11 @@ writeable_pgsql_selection::factory::factory(const po::variables_map &opts)
     "SELECT visible FROM current_relations WHERE id = $1")PREPARE_ARGS(("bigint"));
 
   // extraction functions for getting the data back out when the
-  // selection set has been built up.
-  m_connection.prepare("extract_nodes",
-    "SELECT n.id, n.latitude, n.longitude, n.visible, "
-        "to_char(n.timestamp,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS timestamp, "
-        "n.changeset_id, n.version, array_agg(t.k) as tag_k, array_agg(t.v) as tag_v "
-      "FROM current_nodes n "
-        "JOIN tmp_nodes tn ON n.id=tn.id "
-        "LEFT JOIN current_node_tags t ON n.id=t.node_id GROUP BY n.id");
-  m_connection.prepare("extract_ways",
-    "SELECT w.id, w.visible, w.version, w.changeset_id, "
-        "to_char(w.timestamp,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS timestamp, "
-        "t.keys as tag_k, t.values as tag_v, wn.node_ids as node_ids "
-      "FROM current_ways w JOIN tmp_ways tw ON w.id=tw.id "
-        "LEFT JOIN LATERAL "
-          "(SELECT array_agg(k) AS keys, array_agg(v) AS values "
-          "FROM current_way_tags WHERE w.id=way_id ) t ON true "
-        "LEFT JOIN LATERAL "
-          "(SELECT array_agg(node_id) AS node_ids from "
-            "(SELECT * FROM current_way_nodes WHERE w.id=way_id ) x "
-          ") wn ON true ");
-  m_connection.prepare("extract_relations",
-     "SELECT r.id, r.visible, r.version, r.changeset_id, "
-        "to_char(r.timestamp,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS timestamp, "
-        "t.keys as tag_k, t.values as tag_v, rm.types as member_types, "
-        "rm.ids as member_ids, rm.roles as member_roles "
-      "FROM current_relations r JOIN tmp_relations tr ON tr.id=r.id "
-        "LEFT JOIN LATERAL "
-          "(SELECT array_agg(k) AS keys, array_agg(v) AS values "
-          "FROM current_relation_tags WHERE r.id=relation_id ) t ON true "
-        "LEFT JOIN LATERAL "
-          "(SELECT array_agg(member_type) AS types, array_agg(member_id) AS ids, "
-          "array_agg(member_role) AS roles FROM "
-            "( SELECT * FROM current_relation_members WHERE r.id=relation_id "
-            "ORDER BY sequence_id) x"
-          ")rm ON true");
-  m_connection.prepare("extract_changesets",
-     "SELECT c.id, "
-       "to_char(c.created_at,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS created_at, "
-       "to_char(c.closed_at, 'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS closed_at, "
-       "c.min_lat, c.max_lat, c.min_lon, c.max_lon, c.num_changes, t.keys as tag_k, "
-       "t.values as tag_v, cc.author_id as comment_author_id, "
-       "cc.display_name as comment_display_name, "
-       "cc.body as comment_body, cc.created_at as comment_created_at "
-     "FROM changesets c JOIN tmp_changesets tc ON tc.id=c.id "
-      "LEFT JOIN LATERAL "
-          "(SELECT array_agg(k) AS keys, array_agg(v) AS values "
-          "FROM changeset_tags WHERE c.id=changeset_id ) t ON true "
-      "LEFT JOIN LATERAL "
-        "(SELECT array_agg(author_id) as author_id, array_agg(display_name) "
-        "as display_name, array_agg(body) as body, "
-        "array_agg(created_at) as created_at FROM "
-          "(SELECT cc.author_id, u.display_name, cc.body, "
-          "to_char(cc.created_at,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS created_at "
-          "FROM changeset_comments cc JOIN users u ON cc.author_id = u.id "
-          "where cc.changeset_id=c.id AND cc.visible ORDER BY cc.created_at) x "
-        ")cc ON true");
+  // selection set has been built up. see the *_sql definitions above.
+  m_connection.prepare("extract_nodes", extract_nodes_sql);
+  m_connection.prepare("extract_ways", extract_ways_sql);
+  m_connection.prepare("extract_relations", extract_relations_sql);
+  m_connection.prepare("extract_changesets", extract_changesets_sql);
 
   // selecting a set of nodes as a list
   m_connection.prepare("add_nodes_list",
@@ -585,6 +853,28 @@ writeable_pgsql_selection::factory::factory(const po::variables_map &opts)
         "WHERE c.id = ANY($1)")
     PREPARE_ARGS(("bigint[]"));
 
+  // the versions of the selected elements, for checking cached copies of
+  // them, and taking the ones which were written from the cache back out
+  // of the selection.
+  m_connection.prepare("node_versions",
+    "SELECT n.id, n.version "
+      "FROM current_nodes n JOIN tmp_nodes tn ON n.id = tn.id");
+  m_connection.prepare("way_versions",
+    "SELECT w.id, w.version "
+      "FROM current_ways w JOIN tmp_ways tw ON w.id = tw.id");
+  m_connection.prepare("relation_versions",
+    "SELECT r.id, r.version "
+      "FROM current_relations r JOIN tmp_relations tr ON r.id = tr.id");
+  m_connection.prepare("deselect_nodes",
+    "DELETE FROM tmp_nodes WHERE id = ANY($1)")
+    PREPARE_ARGS(("bigint[]"));
+  m_connection.prepare("deselect_ways",
+    "DELETE FROM tmp_ways WHERE id = ANY($1)")
+    PREPARE_ARGS(("bigint[]"));
+  m_connection.prepare("deselect_relations",
+    "DELETE FROM tmp_relations WHERE id = ANY($1)")
+    PREPARE_ARGS(("bigint[]"));
+
   // queries for filling elements which are used as members in relations
   m_connection.prepare("nodes_from_relations",
     "INSERT INTO tmp_nodes "
@@ -660,8 +950,47 @@ writeable_pgsql_selection::factory::factory(const po::variables_map &opts)
 
 writeable_pgsql_selection::factory::~factory() {}
 
+void writeable_pgsql_selection::factory::create_tables() {
+  // temporary tables only last as long as the session, so they have to be
+  // made again if libpqxx has had to reconnect since they were created.
+  m_connection.activate();
+  const int backend_pid = m_connection.backendpid();
+  if (backend_pid == m_tables_backend_pid) {
+    return;
+  }
+
+  // selections never commit, so their rows are rolled back anyway, but
+  // ON COMMIT DELETE ROWS makes sure that the tables start each
+  // transaction empty.
+  logger::message("Creating temporary tables");
+  pqxx::work w(m_connection, "create_tables");
+  // clang-format off
+  w.exec(
+    "CREATE TEMPORARY TABLE tmp_nodes (id bigint PRIMARY KEY) "
+      "ON COMMIT DELETE ROWS; "
+    "CREATE TEMPORARY TABLE tmp_ways (id bigint PRIMARY KEY) "
+      "ON COMMIT DELETE ROWS; "
+    "CREATE TEMPORARY TABLE tmp_relations (id bigint PRIMARY KEY) "
+      "ON COMMIT DELETE ROWS; "
+    "CREATE TEMPORARY TABLE tmp_changesets (id bigint PRIMARY KEY) "
+      "ON COMMIT DELETE ROWS");
+  // clang-format on
+  w.commit();
+  m_tables_backend_pid = backend_pid;
+}
+
 boost::shared_ptr<data_selection>
 writeable_pgsql_selection::factory::make_selection() {
-  return boost::make_shared<writeable_pgsql_selection>(boost::ref(m_connection),
-                                                       boost::ref(m_cache));
+  if (!m_tables_per_request) {
+    create_tables();
+  }
+  if (m_existence) {
+    m_existence->refresh(pt::second_clock::universal_time());
+  }
+  // each selection is one request, which counts as using a changeset once
+  // however many of its elements are in it.
+  m_cache.start_batch();
+  return boost::make_shared<writeable_pgsql_selection>(
+      boost::ref(m_connection), boost::ref(m_cache), m_extract_batch_size,
+      m_existence.get(), m_density.get(), m_tables_per_request);
 }
@@ -5,6 +5,7 @@
 #include <set>
 #include <sstream>
 #include <list>
+#include <stdexcept>
 #include <boost/make_shared.hpp>
 #include <boost/ref.hpp>
 
@@ -82,20 +83,26 @@ void extract_elem(const pqxx::result::tuple &row, element_info &elem) {
   elem.visible = true;
 }
 
-void extract_tags(const pqxx::result &res, tags_t &tags) {
+// tags come back inline with each element as hstore_to_array(tags), which
+// is a flat text array of alternating keys and values.
+void extract_tags(const pqxx::result::tuple &row, tags_t &tags) {
   tags.clear();
-  for (pqxx::result::const_iterator itr = res.begin(); itr != res.end();
-       ++itr) {
-    tags.push_back(std::make_pair(std::string((*itr)["k"].c_str()),
-                                  std::string((*itr)["v"].c_str())));
+  const pqxx::result::field f = row["tags"];
+  psql_array_reader arr(f.c_str(), f.size());
+  while (arr.next()) {
+    std::string key = arr.str();
+    if (!arr.next()) {
+      throw std::runtime_error("Odd number of elements in tags array");
+    }
+    tags.push_back(std::make_pair(key, arr.str()));
   }
 }
 
-void extract_nodes(const pqxx::result &res, nodes_t &nodes) {
+void extract_nodes(const pqxx::result::tuple &row, nodes_t &nodes) {
   nodes.clear();
-  for (pqxx::result::const_iterator itr = res.begin(); itr != res.end();
-       ++itr) {
-    nodes.push_back((*itr)[0].as<osm_nwr_id_t>());
+  const pqxx::result::field f = row["nodes"];
+  for (psql_array_reader ids(f.c_str(), f.size()); ids.next();) {
+    nodes.push_back(osm_nwr_id_t(ids.as_int64()));
   }
 }
 
@@ -122,21 +129,64 @@ element_type type_from_name(const char *name) {
   return type;
 }
 
-void extract_members(const pqxx::result &res, members_t &members) {
+void extract_members(const pqxx::result::tuple &row, members_t &members) {
   member_info member;
   members.clear();
-  for (pqxx::result::const_iterator itr = res.begin(); itr != res.end();
-       ++itr) {
-    member.type = type_from_name((*itr)["member_type"].c_str());
-    member.ref = (*itr)["member_id"].as<osm_nwr_id_t>();
-    member.role = (*itr)["member_role"].c_str();
+  const pqxx::result::field t = row["member_types"], i = row["member_ids"],
+                            r = row["member_roles"];
+  psql_array_reader types(t.c_str(), t.size()), ids(i.c_str(), i.size()),
+      roles(r.c_str(), r.size());
+  while (types.next()) {
+    if (!ids.next() || !roles.next()) {
+      throw std::runtime_error("Mismatch in members types, ids and roles size");
+    }
+    member.type = type_from_name(types.data());
+    member.ref = osm_nwr_id_t(ids.as_int64());
+    member.role.assign(roles.data(), roles.size());
     members.push_back(member);
   }
+  if (ids.next() || roles.next()) {
+    throw std::runtime_error("Mismatch in members types, ids and roles size");
+  }
+}
+
+/* prepare the statement to extract one type of element, with the given
+ * columns after the common ones, from the given tables. it's prepared
+ * twice: once joining users for their names, and once, with "_no_users" on
+ * the end of the name, without, for when elements are written without
+ * metadata. that one has NULL uid and display_name columns.
+ */
+void prepare_extract(pqxx::connection &conn, const std::string &name,
+                     const std::string &alias, const std::string &columns,
+                     const std::string &from) {
+  // clang-format off
+  const std::string common =
+    "SELECT " + alias + ".id, " + alias + ".version, "
+      "to_char(" + alias + ".tstamp,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') "
+        "AS timestamp, " +
+      alias + ".changeset_id, ";
+
+  conn.prepare(name,
+    common +
+      "nullif(" + alias + ".user_id,-1) AS uid, u.name AS display_name, " +
+      columns +
+    "FROM " + from +
+      "LEFT JOIN users u ON (" + alias + ".user_id = u.id)");
+
+  conn.prepare(name + "_no_users",
+    common +
+      "NULL::bigint AS uid, NULL::text AS display_name, " +
+      columns +
+    "FROM " + from);
+  // clang-format on
 }
 
 } // anonymous namespace
 
-snapshot_selection::snapshot_selection(pqxx::connection &conn) : w(conn) {
+snapshot_selection::snapshot_selection(pqxx::connection &conn,
+                                       bool has_way_geometry)
+    : w(conn), m_include_metadata(true), m_has_way_geometry(has_way_geometry),
+      m_tmp_nodes_empty(true) {
   w.exec("CREATE TEMPORARY TABLE tmp_nodes ("
          "id bigint NOT NULL PRIMARY KEY,"
          "version integer NOT NULL,"
@@ -168,6 +218,12 @@ snapshot_selection::snapshot_selection(pqxx::connection &conn) : w(conn) {
 
 snapshot_selection::~snapshot_selection() {}
 
+void snapshot_selection::omit_metadata() { m_include_metadata = false; }
+
+std::string snapshot_selection::extract_statement(const std::string &name) {
+  return m_include_metadata ? name : (name + "_no_users");
+}
+
 void snapshot_selection::write_nodes(output_formatter &formatter) {
   // get all nodes - they already contain their own tags, so
   // we don't need to do anything else.
@@ -175,35 +231,30 @@ void snapshot_selection::write_nodes(output_formatter &formatter) {
   element_info elem;
   tags_t tags;
 
-  pqxx::result nodes = w.prepared("extract_nodes").exec();
+  pqxx::result nodes = w.prepared(extract_statement("extract_nodes")).exec();
   for (pqxx::result::const_iterator itr = nodes.begin(); itr != nodes.end();
        ++itr) {
     extract_elem(*itr, elem);
-    if (itr["untagged"].as<bool>()) {
-      tags.clear();
-    } else {
-      extract_tags(w.prepared("extract_node_tags")(elem.id).exec(), tags);
-    }
+    extract_tags(*itr, tags);
     formatter.write_node(elem, (*itr)["lon"].as<double>(),
                          (*itr)["lat"].as<double>(), tags);
   }
 }
 
 void snapshot_selection::write_ways(output_formatter &formatter) {
-  // grab the ways, way nodes and tags
-  // way nodes and tags are on a separate connections so that the
-  // entire result set can be streamed from a single query.
+  // grab the ways, along with their way nodes and tags, which are
+  // returned as arrays on each row.
   logger::message("Fetching ways");
   element_info elem;
   nodes_t nodes;
   tags_t tags;
 
-  pqxx::result ways = w.prepared("extract_ways").exec();
+  pqxx::result ways = w.prepared(extract_statement("extract_ways")).exec();
   for (pqxx::result::const_iterator itr = ways.begin(); itr != ways.end();
        ++itr) {
     extract_elem(*itr, elem);
-    extract_nodes(w.prepared("extract_way_nds")(elem.id).exec(), nodes);
-    extract_tags(w.prepared("extract_way_tags")(elem.id).exec(), tags);
+    extract_nodes(*itr, nodes);
+    extract_tags(*itr, tags);
     formatter.write_way(elem, nodes, tags);
   }
 }
@@ -214,13 +265,13 @@ void snapshot_selection::write_relations(output_formatter &formatter) {
   members_t members;
   tags_t tags;
 
-  pqxx::result relations = w.prepared("extract_relations").exec();
+  pqxx::result relations =
+      w.prepared(extract_statement("extract_relations")).exec();
   for (pqxx::result::const_iterator itr = relations.begin();
        itr != relations.end(); ++itr) {
     extract_elem(*itr, elem);
-    extract_members(w.prepared("extract_relation_members")(elem.id).exec(),
-                    members);
-    extract_tags(w.prepared("extract_relation_tags")(elem.id).exec(), tags);
+    extract_members(*itr, members);
+    extract_tags(*itr, tags);
     formatter.write_relation(elem, members, tags);
   }
 }
@@ -241,6 +292,7 @@ data_selection::visibility_t
 }
 
 int snapshot_selection::select_nodes(const std::vector<osm_nwr_id_t> &ids) {
+  nodes_selected();
   return w.prepared("add_nodes_list")(ids).exec().affected_rows();
 }
 
@@ -254,6 +306,15 @@ int snapshot_selection::select_relations(const std::vector<osm_nwr_id_t> &ids) {
 
 int snapshot_selection::select_nodes_from_bbox(const bbox &bounds,
                                                int max_nodes) {
+  // the bounds are only useful for finding ways if all the nodes came from
+  // this one bbox.
+  if (m_tmp_nodes_empty) {
+    m_bounds = bounds;
+  } else {
+    m_bounds = boost::none;
+  }
+  m_tmp_nodes_empty = false;
+
   return w.prepared("nodes_from_bbox")(bounds.minlon)(bounds.minlat)(
                bounds.maxlon)(bounds.maxlat)(max_nodes + 1)
       .exec()
@@ -262,6 +323,7 @@ int snapshot_selection::select_nodes_from_bbox(const bbox &bounds,
 
 void snapshot_selection::select_nodes_from_relations() {
   logger::message("Filling tmp_nodes (from relations)");
+  nodes_selected();
 
   w.prepared("nodes_from_relations").exec();
 }
@@ -269,7 +331,15 @@ void snapshot_selection::select_nodes_from_relations() {
 void snapshot_selection::select_ways_from_nodes() {
   logger::message("Filling tmp_ways (from nodes)");
 
-  w.prepared("ways_from_nodes").exec();
+  if (m_has_way_geometry && m_bounds) {
+    // any way using one of the nodes must overlap the bounds, so the
+    // geometry index narrows the ways down to a few candidates which can
+    // be checked against tmp_nodes directly.
+    w.prepared("ways_from_bbox")(m_bounds->minlon)(m_bounds->minlat)(
+        m_bounds->maxlon)(m_bounds->maxlat).exec();
+  } else {
+    w.prepared("ways_from_nodes").exec();
+  }
 }
 
 void snapshot_selection::select_ways_from_relations() {
@@ -284,6 +354,7 @@ void snapshot_selection::select_relations_from_ways() {
 }
 
 void snapshot_selection::select_nodes_from_way_nodes() {
+  nodes_selected();
   w.prepared("nodes_from_way_nodes").exec();
 }
 
@@ -303,11 +374,49 @@ void snapshot_selection::select_relations_members_of_relations() {
   w.prepared("relation_members_of_relations").exec();
 }
 
+bool snapshot_selection::selected_versions(element_type type,
+                                           id_versions_t &out) {
+  if (type == element_type_changeset) {
+    return false;
+  }
+  const char *name =
+      (type == element_type_node)
+          ? "node_versions"
+          : ((type == element_type_way) ? "way_versions" : "relation_versions");
+  pqxx::result res = w.prepared(name).exec();
+  out.reserve(out.size() + res.size());
+  for (pqxx::result::const_iterator itr = res.begin(); itr != res.end();
+       ++itr) {
+    out.push_back(std::make_pair((*itr)["id"].as<osm_nwr_id_t>(),
+                                 (*itr)["version"].as<osm_nwr_id_t>()));
+  }
+  return true;
+}
+
+void snapshot_selection::deselect(element_type type,
+                                  const std::vector<osm_nwr_id_t> &ids) {
+  if (ids.empty()) {
+    return;
+  }
+  const char *name =
+      (type == element_type_node)
+          ? "deselect_nodes"
+          : ((type == element_type_way) ? "deselect_ways"
+                                        : "deselect_relations");
+  w.prepared(name)(ids).exec();
+}
+
+void snapshot_selection::nodes_selected() {
+  m_tmp_nodes_empty = false;
+  m_bounds = boost::none;
+}
+
 snapshot_selection::factory::factory(const po::variables_map &opts)
     : m_connection(connect_db_str(opts))
 #if PQXX_VERSION_MAJOR >= 4
     , m_errorhandler(m_connection)
 #endif
+    , m_has_way_geometry(false)
 {
   if (m_connection.server_version() < 90300) {
     throw std::runtime_error("Expected Postgres version 9.3+, currently installed version "
@@ -323,59 +432,67 @@ snapshot_selection::factory::factory(const po::variables_map &opts)
       std::auto_ptr<pqxx::noticer>(new pqxx::nonnoticer()));
 #endif
 
+  // the bbox and linestring columns on ways are optional in the schema, but
+  // either of them (and its index) can be used to find the ways in a bbox.
+  std::string way_geometry_column;
+  {
+    pqxx::work w(m_connection, "detect_way_geometry");
+    pqxx::result res = w.exec(
+        "SELECT column_name FROM information_schema.columns "
+        "WHERE table_schema = current_schema() AND table_name = 'ways' "
+        "AND column_name IN ('bbox', 'linestring') "
+        "ORDER BY column_name");
+    if (!res.empty()) {
+      way_geometry_column = res[0][0].c_str();
+    }
+  }
+  m_has_way_geometry = !way_geometry_column.empty();
+
   logger::message("Preparing prepared statements.");
 
   // clang-format off
 
   // extraction functions for getting the data back out when the
-  // selection set has been built up.
-  m_connection.prepare("extract_nodes",
-    "SELECT n.id, n.version, "
-        "to_char(n.tstamp,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS timestamp, "
-        "n.changeset_id, nullif(n.user_id,-1) AS uid, u.name AS display_name, "
-        "lon / " SCALE ". AS lon, lat / " SCALE ". AS lat, "
-        "tags = ''::hstore AS untagged " // Special-case untagged nodes
-      "FROM tmp_nodes n "
-        "LEFT JOIN users u ON (n.user_id = u.id)");
-  m_connection.prepare("extract_node_tags",
-    "SELECT (each(tags)).key AS k, (each(tags)).value AS v "
-      "FROM tmp_nodes WHERE id=$1")
-    PREPARE_ARGS(("bigint"));
-
-  m_connection.prepare("extract_ways",
-    "SELECT w.id, w.version, "
-        "to_char(w.tstamp,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS timestamp, "
-        "w.changeset_id, nullif(w.user_id,-1) AS uid, u.name AS display_name "
-      "FROM tmp_ways w "
-        "LEFT JOIN users u ON (w.user_id = u.id)");
-  m_connection.prepare("extract_way_nds",
-    "SELECT unnest(nodes) FROM tmp_ways "
-      "WHERE id=$1")
-    PREPARE_ARGS(("bigint"));
-  m_connection.prepare("extract_way_tags",
-    "SELECT (each(tags)).key AS k, "
-        "(each(tags)).value AS v "
-      "FROM tmp_ways "
-      "WHERE id=$1")
-    PREPARE_ARGS(("bigint"));
-
-  m_connection.prepare("extract_relations",
-    "SELECT r.id, r.version, "
-        "to_char(r.tstamp,'YYYY-MM-DD\"T\"HH24:MI:SS\"Z\"') AS timestamp, "
-        "r.changeset_id, nullif(r.user_id,-1) AS uid, u.name AS display_name "
-      "FROM tmp_relations r "
-        "LEFT JOIN users u ON (r.user_id = u.id)");
-  m_connection.prepare("extract_relation_members",
-    "SELECT member_type, member_id, member_role "
-      "FROM relation_members "
-      "WHERE relation_id=$1 "
-      "ORDER BY sequence_id ASC")
-    PREPARE_ARGS(("bigint"));
-  m_connection.prepare("extract_relation_tags",
-    "SELECT (each(tags)).key AS k, (each(tags)).value as v "
-      "FROM tmp_relations "
-      "WHERE id=$1")
-    PREPARE_ARGS(("bigint"));
+  // selection set has been built up. tags, way nodes and relation members
+  // come back as arrays on each element's row, rather than needing a query
+  // per element.
+  prepare_extract(m_connection, "extract_nodes", "n",
+    "lon / " SCALE ". AS lon, lat / " SCALE ". AS lat, "
+    "hstore_to_array(n.tags) AS tags ",
+    "tmp_nodes n ");
+
+  prepare_extract(m_connection, "extract_ways", "w",
+    "hstore_to_array(w.tags) AS tags, w.nodes ",
+    "tmp_ways w ");
+
+  prepare_extract(m_connection, "extract_relations", "r",
+    "hstore_to_array(r.tags) AS tags, "
+    "rm.member_types, rm.member_ids, rm.member_roles ",
+    "tmp_relations r "
+      "LEFT JOIN LATERAL ("
+        "SELECT array_agg(member_type ORDER BY sequence_id) AS member_types, "
+          "array_agg(member_id ORDER BY sequence_id) AS member_ids, "
+          "array_agg(member_role ORDER BY sequence_id) AS member_roles "
+        "FROM relation_members "
+        "WHERE relation_id = r.id) rm ON true ");
+
+  // the versions of the selected elements, which are copied into the
+  // temporary tables along with everything else, for checking cached
+  // copies of them. the ones written from the cache are then taken out of
+  // the selection.
+  m_connection.prepare("node_versions", "SELECT id, version FROM tmp_nodes");
+  m_connection.prepare("way_versions", "SELECT id, version FROM tmp_ways");
+  m_connection.prepare("relation_versions",
+    "SELECT id, version FROM tmp_relations");
+  m_connection.prepare("deselect_nodes",
+    "DELETE FROM tmp_nodes WHERE id = ANY($1)")
+    PREPARE_ARGS(("bigint[]"));
+  m_connection.prepare("deselect_ways",
+    "DELETE FROM tmp_ways WHERE id = ANY($1)")
+    PREPARE_ARGS(("bigint[]"));
+  m_connection.prepare("deselect_relations",
+    "DELETE FROM tmp_relations WHERE id = ANY($1)")
+    PREPARE_ARGS(("bigint[]"));
 
   // map? call geometry stuff
   m_connection.prepare("nodes_from_bbox",
@@ -384,7 +501,7 @@ snapshot_selection::factory::factory(const po::variables_map &opts)
           "ST_X(n.geom) * " SCALE ", ST_Y(n.geom) * " SCALE " "
         "FROM nodes n "
         "WHERE geom && ST_SetSRID(ST_MakeBox2D(ST_Point($1,$2),ST_Point($3,$4)),4326) "
-        "AND id NOT IN (SELECT id FROM tmp_nodes) "
+        "AND NOT EXISTS (SELECT 1 FROM tmp_nodes t WHERE t.id = n.id) "
         "LIMIT $5")
     PREPARE_ARGS(("double precision")("double precision")("double precision")("double precision")("integer"));
 
@@ -393,22 +510,22 @@ snapshot_selection::factory::factory(const po::variables_map &opts)
     "INSERT INTO tmp_nodes "
       "SELECT id,version,user_id,tstamp,changeset_id,tags, "
         "ST_X(geom) * " SCALE ", ST_Y(geom) * " SCALE
-        "FROM nodes WHERE id = ANY($1) "
-        "AND id NOT IN (SELECT id FROM tmp_nodes)")
+        "FROM nodes n WHERE id = ANY($1) "
+        "AND NOT EXISTS (SELECT 1 FROM tmp_nodes t WHERE t.id = n.id)")
     PREPARE_ARGS(("bigint[]"));
   m_connection.prepare("add_ways_list",
     "INSERT INTO tmp_ways "
       "SELECT id,version,user_id,tstamp,changeset_id,tags,nodes "
-        "FROM ways "
+        "FROM ways w "
         "WHERE id = ANY($1) "
-          "AND id NOT IN (SELECT id FROM tmp_ways)")
+          "AND NOT EXISTS (SELECT 1 FROM tmp_ways t WHERE t.id = w.id)")
     PREPARE_ARGS(("bigint[]"));
   m_connection.prepare("add_relations_list",
     "INSERT INTO tmp_relations "
       "SELECT id,version,user_id,tstamp,changeset_id,tags "
-        "FROM relations "
+        "FROM relations r "
         "WHERE id = ANY($1) "
-          "AND id NOT IN (SELECT id FROM tmp_relations)")
+          "AND NOT EXISTS (SELECT 1 FROM tmp_relations t WHERE t.id = r.id)")
     PREPARE_ARGS(("bigint[]"));
 
   // queries for filling elements which are used as members in relations
@@ -419,21 +536,36 @@ snapshot_selection::factory::factory(const po::variables_map &opts)
         "FROM tmp_relations r "
           "JOIN relation_members rm ON (r.id = rm.relation_id) "
           "JOIN nodes n ON (rm.member_type = 'N' AND rm.member_id = n.id) "
-        "WHERE rm.member_id NOT IN (SELECT id FROM tmp_nodes)");
+        "WHERE NOT EXISTS (SELECT 1 FROM tmp_nodes t WHERE t.id = n.id)");
   m_connection.prepare("ways_from_relations",
     "INSERT INTO tmp_ways "
       "SELECT DISTINCT w.id,w.version,w.user_id,w.tstamp,w.changeset_id,w.tags,w.nodes "
         "FROM tmp_relations r "
           "JOIN relation_members rm ON (r.id = rm.relation_id) "
           "JOIN ways w ON (rm.member_type = 'W' AND rm.member_id = w.id) "
-        "WHERE rm.member_id NOT IN (SELECT id FROM tmp_ways)");
+        "WHERE NOT EXISTS (SELECT 1 FROM tmp_ways t WHERE t.id = w.id)");
   m_connection.prepare("relation_members_of_relations",
     "INSERT INTO tmp_relations "
       "SELECT DISTINCT r.id,r.version,r.user_id,r.tstamp,r.changeset_id,r.tags  "
         "FROM tmp_relations tr "
           "JOIN relation_members rm ON (tr.id = rm.relation_id) "
           "JOIN relations r ON (rm.member_type = 'R' AND rm.member_id = r.id) "
-        "WHERE rm.member_id NOT IN (SELECT id FROM tmp_relations)");
+        "WHERE NOT EXISTS (SELECT 1 FROM tmp_relations t WHERE t.id = r.id)");
+
+  // select ways which use nodes already in the working set, when all of
+  // those nodes came from a bbox and the ways have an indexed geometry.
+  if (m_has_way_geometry) {
+    m_connection.prepare("ways_from_bbox",
+      "INSERT INTO tmp_ways "
+        "SELECT w.id,w.version,w.user_id,w.tstamp,w.changeset_id,w.tags,w.nodes "
+          "FROM ways w "
+          "WHERE w." + way_geometry_column + " && "
+              "ST_SetSRID(ST_MakeBox2D(ST_Point($1,$2),ST_Point($3,$4)),4326) "
+            "AND EXISTS (SELECT 1 FROM unnest(w.nodes) AS n(id) "
+                        "JOIN tmp_nodes t ON t.id = n.id) "
+            "AND NOT EXISTS (SELECT 1 FROM tmp_ways tw WHERE tw.id = w.id)")
+      PREPARE_ARGS(("double precision")("double precision")("double precision")("double precision"));
+  }
 
   // select ways which use nodes already in the working set
     m_connection.prepare("ways_from_nodes",
@@ -453,7 +585,7 @@ snapshot_selection::factory::factory(const po::variables_map &opts)
           "ST_X(n.geom) * 10000000, ST_Y(n.geom) * 10000000 "
         "FROM (SELECT DISTINCT unnest(nodes) AS node_id FROM tmp_ways) AS wn "
           "JOIN nodes n ON (wn.node_id = n.id) "
-        "WHERE node_id NOT IN (SELECT id FROM tmp_nodes)");
+        "WHERE NOT EXISTS (SELECT 1 FROM tmp_nodes t WHERE t.id = n.id)");
   // selecting relations which have members which are already in
   // the working set.
   m_connection.prepare("relations_from_ways",
@@ -488,5 +620,6 @@ snapshot_selection::factory::~factory() {}
 
 boost::shared_ptr<data_selection>
 snapshot_selection::factory::make_selection() {
-  return boost::make_shared<snapshot_selection>(boost::ref(m_connection));
+  return boost::make_shared<snapshot_selection>(boost::ref(m_connection),
+                                                m_has_way_geometry);
 }
@@ -569,8 +569,44 @@ struct static_data_selection : public data_selection {
     m_include_changeset_comments = true;
   }
 
+  virtual bool selected_versions(element_type type, id_versions_t &out) {
+    switch (type) {
+    case element_type_node:
+      add_versions(m_nodes, m_db->m_nodes, out);
+      return true;
+    case element_type_way:
+      add_versions(m_ways, m_db->m_ways, out);
+      return true;
+    case element_type_relation:
+      add_versions(m_relations, m_db->m_relations, out);
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  virtual void deselect(element_type type, const std::vector<osm_nwr_id_t> &ids) {
+    std::set<osm_nwr_id_t> &selected =
+      (type == element_type_node) ? m_nodes :
+      ((type == element_type_way) ? m_ways : m_relations);
+    BOOST_FOREACH(osm_nwr_id_t id, ids) {
+      selected.erase(id);
+    }
+  }
 
 private:
+  template <typename T>
+  static void add_versions(const std::set<osm_nwr_id_t> &ids,
+                           const std::map<osm_nwr_id_t, T> &elements,
+                           id_versions_t &out) {
+    BOOST_FOREACH(osm_nwr_id_t id, ids) {
+      typename std::map<osm_nwr_id_t, T>::const_iterator itr = elements.find(id);
+      if (itr != elements.end()) {
+        out.push_back(std::make_pair(id, itr->second.m_info.version));
+      }
+    }
+  }
+
   boost::shared_ptr<database> m_db;
   std::set<osm_changeset_id_t> m_changesets;
   std::set<osm_nwr_id_t> m_nodes, m_ways, m_relations;
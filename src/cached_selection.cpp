@@ -0,0 +1,291 @@
+#include "cgimap/cached_selection.hpp"
+#include "cgimap/cache.hpp"
+#include "cgimap/logger.hpp"
+
+#include <boost/bind.hpp>
+#include <boost/format.hpp>
+#include <boost/make_shared.hpp>
+
+using boost::shared_ptr;
+using std::vector;
+
+namespace {
+
+// the cache key for an element, with the type in the low bits so that
+// nodes, ways and relations with the same ID don't collide.
+inline uint64_t element_key(element_type type, osm_nwr_id_t id) {
+  return (uint64_t(id) << 2) | uint64_t(type);
+}
+
+// elements are only ever put into the cache, never fetched by it.
+cached_element *no_fetch(uint64_t) { return NULL; }
+
+/**
+ * passes everything through to another formatter, keeping a copy of each
+ * node, way and relation written in the element cache on the way.
+ */
+class caching_formatter : public output_formatter {
+public:
+  caching_formatter(output_formatter &out,
+                    cached_selection::element_cache &elements)
+      : m_out(out), m_elements(elements) {}
+
+  mime::type mime_type() const { return m_out.mime_type(); }
+  void start_document(const std::string &generator) {
+    m_out.start_document(generator);
+  }
+  void end_document() { m_out.end_document(); }
+  void error(const std::exception &e) { m_out.error(e); }
+  void write_bounds(const bbox &bounds) { m_out.write_bounds(bounds); }
+  void start_element_type(element_type type) {
+    m_out.start_element_type(type);
+  }
+  void end_element_type(element_type type) { m_out.end_element_type(type); }
+
+  void write_node(const element_info &elem, double lon, double lat,
+                  const tags_t &tags) {
+    m_out.write_node(elem, lon, lat, tags);
+    shared_ptr<cached_element> e = boost::make_shared<cached_element>();
+    e->info = elem;
+    e->lon = lon;
+    e->lat = lat;
+    e->tags = tags;
+    m_elements.put(element_key(element_type_node, elem.id), e);
+  }
+
+  void write_way(const element_info &elem, const nodes_t &nodes,
+                 const tags_t &tags) {
+    m_out.write_way(elem, nodes, tags);
+    shared_ptr<cached_element> e = boost::make_shared<cached_element>();
+    e->info = elem;
+    e->lon = e->lat = 0.0;
+    e->nodes = nodes;
+    e->tags = tags;
+    m_elements.put(element_key(element_type_way, elem.id), e);
+  }
+
+  void write_relation(const element_info &elem, const members_t &members,
+                      const tags_t &tags) {
+    m_out.write_relation(elem, members, tags);
+    shared_ptr<cached_element> e = boost::make_shared<cached_element>();
+    e->info = elem;
+    e->lon = e->lat = 0.0;
+    e->members = members;
+    e->tags = tags;
+    m_elements.put(element_key(element_type_relation, elem.id), e);
+  }
+
+  void write_changeset(const changeset_info &elem, const tags_t &tags,
+                       bool include_comments, const comments_t &comments,
+                       const boost::posix_time::ptime &now) {
+    m_out.write_changeset(elem, tags, include_comments, comments, now);
+  }
+
+  void flush() { m_out.flush(); }
+  void error(const std::string &s) { m_out.error(s); }
+
+private:
+  output_formatter &m_out;
+  cached_selection::element_cache &m_elements;
+};
+
+} // anonymous namespace
+
+size_t cache_object_size(const cached_element &e) {
+  // list entries have a pair of pointers on top of the value.
+  const size_t list_overhead = 2 * sizeof(void *);
+
+  size_t bytes = sizeof(cached_element) + e.info.timestamp.capacity();
+  if (e.info.display_name) {
+    bytes += e.info.display_name->capacity();
+  }
+  for (tags_t::const_iterator itr = e.tags.begin(); itr != e.tags.end();
+       ++itr) {
+    bytes += list_overhead + sizeof(tags_t::value_type) +
+             itr->first.capacity() + itr->second.capacity();
+  }
+  bytes += e.nodes.size() * (list_overhead + sizeof(nodes_t::value_type));
+  for (members_t::const_iterator itr = e.members.begin();
+       itr != e.members.end(); ++itr) {
+    bytes += list_overhead + sizeof(member_info) + itr->role.capacity();
+  }
+  return bytes;
+}
+
+cached_selection::cached_selection(shared_ptr<data_selection> inner,
+                                   element_cache &elements)
+    : m_inner(inner), m_elements(elements), m_include_metadata(true) {}
+
+cached_selection::~cached_selection() {}
+
+void cached_selection::write_nodes(output_formatter &formatter) {
+  if (write_from_cache(element_type_node, formatter)) {
+    caching_formatter caching(formatter, m_elements);
+    m_inner->write_nodes(caching);
+  } else {
+    m_inner->write_nodes(formatter);
+  }
+}
+
+void cached_selection::write_ways(output_formatter &formatter) {
+  if (write_from_cache(element_type_way, formatter)) {
+    caching_formatter caching(formatter, m_elements);
+    m_inner->write_ways(caching);
+  } else {
+    m_inner->write_ways(formatter);
+  }
+}
+
+void cached_selection::write_relations(output_formatter &formatter) {
+  if (write_from_cache(element_type_relation, formatter)) {
+    caching_formatter caching(formatter, m_elements);
+    m_inner->write_relations(caching);
+  } else {
+    m_inner->write_relations(formatter);
+  }
+}
+
+void cached_selection::write_changesets(output_formatter &formatter,
+                                        const boost::posix_time::ptime &now) {
+  m_inner->write_changesets(formatter, now);
+}
+
+bool cached_selection::write_from_cache(element_type type,
+                                        output_formatter &formatter) {
+  id_versions_t versions;
+  if (!m_include_metadata || !m_inner->selected_versions(type, versions)) {
+    return false;
+  }
+
+  vector<osm_nwr_id_t> written;
+  for (id_versions_t::const_iterator itr = versions.begin();
+       itr != versions.end(); ++itr) {
+    shared_ptr<cached_element const> e =
+        m_elements.peek(element_key(type, itr->first));
+    if (!e || (e->info.version != itr->second)) {
+      continue;
+    }
+    if (type == element_type_node) {
+      formatter.write_node(e->info, e->lon, e->lat, e->tags);
+    } else if (type == element_type_way) {
+      formatter.write_way(e->info, e->nodes, e->tags);
+    } else {
+      formatter.write_relation(e->info, e->members, e->tags);
+    }
+    written.push_back(itr->first);
+  }
+
+  logger::message(boost::format("Wrote %1% of %2% selected elements from "
+                                "the element cache") %
+                  written.size() % versions.size());
+  m_inner->deselect(type, written);
+  return true;
+}
+
+data_selection::visibility_t
+cached_selection::check_node_visibility(osm_nwr_id_t id) {
+  return m_inner->check_node_visibility(id);
+}
+
+data_selection::visibility_t
+cached_selection::check_way_visibility(osm_nwr_id_t id) {
+  return m_inner->check_way_visibility(id);
+}
+
+data_selection::visibility_t
+cached_selection::check_relation_visibility(osm_nwr_id_t id) {
+  return m_inner->check_relation_visibility(id);
+}
+
+int cached_selection::select_nodes(const vector<osm_nwr_id_t> &ids) {
+  return m_inner->select_nodes(ids);
+}
+
+int cached_selection::select_ways(const vector<osm_nwr_id_t> &ids) {
+  return m_inner->select_ways(ids);
+}
+
+int cached_selection::select_relations(const vector<osm_nwr_id_t> &ids) {
+  return m_inner->select_relations(ids);
+}
+
+int cached_selection::select_nodes_from_bbox(const bbox &bounds,
+                                             int max_nodes) {
+  return m_inner->select_nodes_from_bbox(bounds, max_nodes);
+}
+
+void cached_selection::select_nodes_from_relations() {
+  m_inner->select_nodes_from_relations();
+}
+
+void cached_selection::select_ways_from_nodes() {
+  m_inner->select_ways_from_nodes();
+}
+
+void cached_selection::select_ways_from_relations() {
+  m_inner->select_ways_from_relations();
+}
+
+void cached_selection::select_relations_from_ways() {
+  m_inner->select_relations_from_ways();
+}
+
+void cached_selection::select_nodes_from_way_nodes() {
+  m_inner->select_nodes_from_way_nodes();
+}
+
+void cached_selection::select_relations_from_nodes() {
+  m_inner->select_relations_from_nodes();
+}
+
+void cached_selection::select_relations_from_relations() {
+  m_inner->select_relations_from_relations();
+}
+
+void cached_selection::select_relations_members_of_relations() {
+  m_inner->select_relations_members_of_relations();
+}
+
+void cached_selection::select_plan(const selection_plan &plan) {
+  m_inner->select_plan(plan);
+}
+
+bool cached_selection::supports_changesets() {
+  return m_inner->supports_changesets();
+}
+
+int cached_selection::select_changesets(
+    const vector<osm_changeset_id_t> &ids) {
+  return m_inner->select_changesets(ids);
+}
+
+void cached_selection::select_changeset_discussions() {
+  m_inner->select_changeset_discussions();
+}
+
+void cached_selection::omit_metadata() {
+  m_include_metadata = false;
+  m_inner->omit_metadata();
+}
+
+bool cached_selection::selected_versions(element_type type,
+                                         id_versions_t &out) {
+  return m_inner->selected_versions(type, out);
+}
+
+void cached_selection::deselect(element_type type,
+                                const vector<osm_nwr_id_t> &ids) {
+  m_inner->deselect(type, ids);
+}
+
+cached_selection::factory::factory(
+    shared_ptr<data_selection::factory> inner, size_t max_bytes)
+    : m_inner(inner),
+      m_elements(new element_cache(no_fetch, max_bytes)) {}
+
+cached_selection::factory::~factory() {}
+
+shared_ptr<data_selection> cached_selection::factory::make_selection() {
+  return boost::make_shared<cached_selection>(m_inner->make_selection(),
+                                              boost::ref(*m_elements));
+}
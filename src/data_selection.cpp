@@ -1,10 +1,46 @@
 #include "cgimap/data_selection.hpp"
 
+#include <cstring>
+#include <stdexcept>
+#include <strings.h>
+
 data_selection::~data_selection() {}
 
 void data_selection::write_changesets(output_formatter &, const boost::posix_time::ptime &) {
 }
 
+void data_selection::select_plan(const selection_plan &plan) {
+  for (selection_plan::const_iterator itr = plan.begin(); itr != plan.end();
+       ++itr) {
+    switch (*itr) {
+    case plan_nodes_from_relations:
+      select_nodes_from_relations();
+      break;
+    case plan_ways_from_nodes:
+      select_ways_from_nodes();
+      break;
+    case plan_ways_from_relations:
+      select_ways_from_relations();
+      break;
+    case plan_relations_from_ways:
+      select_relations_from_ways();
+      break;
+    case plan_nodes_from_way_nodes:
+      select_nodes_from_way_nodes();
+      break;
+    case plan_relations_from_nodes:
+      select_relations_from_nodes();
+      break;
+    case plan_relations_from_relations:
+      select_relations_from_relations();
+      break;
+    case plan_relations_members_of_relations:
+      select_relations_members_of_relations();
+      break;
+    }
+  }
+}
+
 bool data_selection::supports_changesets() {
   return false;
 }
@@ -16,56 +52,130 @@ int data_selection::select_changesets(const std::vector<osm_changeset_id_t> &) {
 void data_selection::select_changeset_discussions() {
 }
 
+void data_selection::omit_metadata() {
+}
+
+bool data_selection::selected_versions(element_type, id_versions_t &) {
+  return false;
+}
+
+void data_selection::deselect(element_type, const std::vector<osm_nwr_id_t> &) {
+}
+
 data_selection::factory::~factory() {}
 
 
-std::vector<std::string> psql_array_to_vector(std::string str) {
+std::vector<std::string> psql_array_to_vector(const std::string &str) {
   std::vector<std::string> strs;
-  std::ostringstream value;
-  bool quotedValue = false, escaped = false, write = false;
-
-  if (str == "{NULL}" || str == "")
-    return strs;
-
-  for (int i=1; i<str.size(); i++) {
-    if (str[i]==',') {
-      if (quotedValue) {
-        value<<",";
-      } else {
-        write = true;
-      }
-    } else if (str[i]=='\"') {
-      if (escaped) {
-        value << "\"";
-        escaped = false;
-      } else if (quotedValue) {
-        quotedValue=false;
-      } else {
-        quotedValue = true;
-      }
-    } else if (str[i]=='\\'){
-      if (escaped) {
-        value << "\\";
-        escaped = false;
-      } else {
-        escaped = true;
-      }
-    } else if (str[i]=='}') {
-      if(quotedValue){
-        value << "}";
-      } else {
-        write = true;
-      }
-    } else {
-      value<<str[i];
+  for (psql_array_reader reader(str.data(), str.size()); reader.next();) {
+    strs.push_back(reader.str());
+  }
+  return strs;
+}
+
+psql_array_reader::psql_array_reader(const char *str, size_t len) {
+  init(str, len);
+}
+
+psql_array_reader::psql_array_reader(const char *str) {
+  init(str, strlen(str));
+}
+
+void psql_array_reader::init(const char *str, size_t len) {
+  m_pos = str;
+  m_end = str + len;
+  m_elem = str;
+  m_elem_len = 0;
+  m_null = false;
+
+  if ((len == 0) || ((len == 6) && (memcmp(str, "{NULL}", 6) == 0))) {
+    m_pos = m_end;
+  } else if (*m_pos == '{') {
+    ++m_pos;
+  } else {
+    throw std::runtime_error("Expected psql array to start with '{'.");
+  }
+}
+
+bool psql_array_reader::next() {
+  // the closing brace is left after the last element, so that this is
+  // where the end is noticed.
+  if ((m_pos >= m_end) || (*m_pos == '}')) {
+    m_pos = m_end;
+    return false;
+  }
+
+  const bool quoted = (*m_pos == '"');
+  if (quoted) {
+    ++m_pos;
+  }
+
+  // find the end of the element, which is the closing quote for a quoted
+  // element, or the next delimiter otherwise. either may be escaped.
+  const char *begin = m_pos;
+  bool escaped = false;
+  while ((m_pos < m_end) &&
+         (quoted ? (*m_pos != '"') : ((*m_pos != ',') && (*m_pos != '}')))) {
+    if (*m_pos == '\\') {
+      escaped = true;
+      ++m_pos;
+    }
+    ++m_pos;
+  }
+  if ((m_pos > m_end) || (quoted && (m_pos == m_end))) {
+    throw std::runtime_error("Unterminated element in psql array.");
+  }
+
+  set_element(begin, m_pos, escaped);
+  m_null = !quoted && !escaped && (m_elem_len == 4) &&
+           (strncasecmp(m_elem, "NULL", 4) == 0);
+
+  if (quoted) {
+    ++m_pos;
+  }
+  if ((m_pos < m_end) && (*m_pos == ',')) {
+    ++m_pos;
+  }
+  return true;
+}
+
+void psql_array_reader::set_element(const char *begin, const char *end,
+                                    bool escaped) {
+  if (!escaped) {
+    m_elem = begin;
+    m_elem_len = end - begin;
+    return;
+  }
+
+  m_unescaped.clear();
+  for (const char *p = begin; p < end; ++p) {
+    if (*p == '\\') {
+      ++p;
     }
+    m_unescaped.push_back(*p);
+  }
+  m_elem = m_unescaped.data();
+  m_elem_len = m_unescaped.size();
+}
 
-    if (write) {
-      strs.push_back(value.str());
-      value.str("");
-      value.clear();
-      write=false;
+int64_t psql_array_reader::as_int64() const {
+  const char *p = m_elem, *end = m_elem + m_elem_len;
+  const bool negative = (p < end) && (*p == '-');
+  if (negative) {
+    ++p;
+  }
+  if (p == end) {
+    throw std::runtime_error("Expected an integer in psql array, but got '" +
+                             str() + "'.");
+  }
+
+  uint64_t value = 0;
+  for (; p < end; ++p) {
+    if ((*p < '0') || (*p > '9')) {
+      throw std::runtime_error("Expected an integer in psql array, but got '" +
+                               str() + "'.");
     }
+    value = value * 10 + uint64_t(*p - '0');
   }
-  return strs;
+  return negative ? -int64_t(value) : int64_t(value);
 }
@@ -19,8 +19,16 @@ mime::type responder::resource_type() const { return mime_type; }
 
 std::string responder::extra_response_headers() const { return ""; }
 
+std::string responder::cache_control() const {
+  return "private, max-age=0, must-revalidate";
+}
+
+std::string responder::data_version() { return ""; }
+
 handler::handler(mime::type default_type) : mime_type(default_type) {}
 
 handler::~handler() {}
 
+bool handler::response_cacheable() const { return false; }
+
 void handler::set_resource_type(mime::type mt) { mime_type = mt; }
@@ -28,7 +28,8 @@ const std::string &element_type_name(element_type elt) {
 
 } // anonymous namespace
 
-json_formatter::json_formatter(json_writer *w) : writer(w) {}
+json_formatter::json_formatter(json_writer *w, bool include_metadata_)
+    : writer(w), include_metadata(include_metadata_) {}
 
 json_formatter::~json_formatter() {}
 
@@ -107,11 +108,13 @@ void json_formatter::write_common(const element_info &elem) {
   writer->entry_bool(elem.visible);
   writer->object_key("version");
   writer->entry_int(elem.version);
-  writer->object_key("changeset");
-  writer->entry_int(elem.changeset);
+  if (include_metadata) {
+    writer->object_key("changeset");
+    writer->entry_int(elem.changeset);
+  }
   writer->object_key("timestamp");
   writer->entry_string(elem.timestamp);
-  if (elem.display_name && elem.uid) {
+  if (include_metadata && elem.display_name && elem.uid) {
     writer->object_key("user");
     writer->entry_string(elem.display_name.get());
     writer->object_key("uid");
@@ -10,6 +10,9 @@ struct json_writer::pimpl_ {
   // so seems best to be on the safe side.
   yajl_gen gen;
 
+  // closed when the writer goes away, as the xml_writer's is.
+  output_buffer *out;
+
 #ifdef HAVE_YAJL2
   yajl_alloc_funcs alloc_funcs;
 #else
@@ -34,6 +37,8 @@ static void wrap_write(void *context, const char *str, unsigned int len) {
 
 json_writer::json_writer(boost::shared_ptr<output_buffer> &out, bool indent)
     : pimpl(new pimpl_()) {
+  pimpl->out = out.get();
+
 #ifdef HAVE_YAJL2
   pimpl->gen = yajl_gen_alloc(NULL);
 
@@ -70,6 +75,16 @@ json_writer::json_writer(boost::shared_ptr<output_buffer> &out, bool indent)
 json_writer::~json_writer() throw() {
   yajl_gen_clear(pimpl->gen);
   yajl_gen_free(pimpl->gen);
+
+  // close the output, so that anything buffered in it (e.g: the end of a
+  // compressed stream) is written, and so that it knows the document is
+  // complete. as with the xml_writer, there isn't much to be done if that
+  // fails, as the output stream might have gone away.
+  try {
+    pimpl->out->close();
+  } catch (...) {
+  }
+
   delete pimpl;
 }
 
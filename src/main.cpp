@@ -37,6 +37,7 @@
 #include "cgimap/backend.hpp"
 #include "cgimap/fcgi_request.hpp"
 #include "cgimap/process_request.hpp"
+#include "cgimap/response_cache.hpp"
 #include "cgimap/config.hpp"
 
 #ifdef ENABLE_APIDB
@@ -116,6 +117,8 @@ static void get_options(int argc, char **argv, po::variables_map &options) {
     ("maxdebt", po::value<int>(), "maximum debt (in Mb) to allow each client before rate limiting")
     ("port", po::value<int>(), "FCGI port number (e.g. 8000) to listen on. This option is for backwards compatibility, please use --socket for new configurations.")
     ("socket", po::value<string>(), "FCGI port number (e.g. :8000) or UNIX socket to listen on")
+    ("response-cache-bytes", po::value<size_t>()->default_value(0), "bytes of finished responses for map tiles and full ways and relations to keep in memory shared by all instances. 0 disables the response cache")
+    ("response-cache-changes", po::value<string>(), "directory of osmChange files, such as minutely diffs, to read changes from and drop the cached responses they make out of date. required with --response-cache-bytes")
     ;
   // clang-format on
 
@@ -182,6 +185,9 @@ static void process_requests(int socket, const po::variables_map &options) {
     if (req.accept_r() >= 0) {
       pt::ptime now(pt::second_clock::local_time());
       req.set_current_time(now);
+      if (response_cache::instance() != NULL) {
+        response_cache::instance()->read_changes(now);
+      }
       process_request(req, limiter, generator, route, factory, oauth_store);
     }
   }
@@ -284,6 +290,11 @@ int main(int argc, char **argv) {
       socket = 0;
     }
 
+    // anything the backend or the response cache shares between instances
+    // has to be set up before they're forked.
+    setup_backend_shared(options);
+    response_cache::initialise(options);
+
     // are we supposed to run as a daemon?
     if (options.count("daemon")) {
       size_t instances = 0;
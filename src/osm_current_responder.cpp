@@ -1,6 +1,9 @@
 #include "cgimap/config.hpp"
 #include "cgimap/osm_current_responder.hpp"
 
+#include <algorithm>
+#include <sstream>
+
 using std::list;
 using boost::shared_ptr;
 namespace pt = boost::posix_time;
@@ -49,3 +52,21 @@ void osm_current_responder::write(shared_ptr<output_formatter> formatter,
 
   fmt.end_document();
 }
+
+std::string osm_current_responder::versions_of(element_type type) {
+  data_selection::id_versions_t versions;
+  if (!sel->selected_versions(type, versions)) {
+    return "";
+  }
+  std::sort(versions.begin(), versions.end());
+
+  std::ostringstream out;
+  for (data_selection::id_versions_t::const_iterator itr = versions.begin();
+       itr != versions.end(); ++itr) {
+    if (itr->second == 0) {
+      return "";
+    }
+    out << int(type) << ":" << itr->first << "." << itr->second << " ";
+  }
+  return out.str();
+}
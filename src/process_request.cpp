@@ -5,6 +5,7 @@
 #include "cgimap/choose_formatter.hpp"
 #include "cgimap/output_formatter.hpp"
 #include "cgimap/output_writer.hpp"
+#include "cgimap/response_cache.hpp"
 
 #include <sstream>
 
@@ -15,6 +16,7 @@
 #include <boost/format.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/ref.hpp>
 #include <boost/tuple/tuple.hpp>
 
 using std::runtime_error;
@@ -77,6 +79,235 @@ void respond_error(const http::exception &e, request &r) {
   r.finish();
 }
 
+/**
+ * wraps the backend's factory to make selections which don't look up the
+ * elements' changesets and users, for requests which don't want them.
+ */
+class without_metadata_factory : public data_selection::factory {
+public:
+  explicit without_metadata_factory(factory_ptr inner) : m_inner(inner) {}
+
+  boost::shared_ptr<data_selection> make_selection() {
+    boost::shared_ptr<data_selection> sel = m_inner->make_selection();
+    sel->omit_metadata();
+    return sel;
+  }
+
+private:
+  factory_ptr m_inner;
+};
+
+/**
+ * passes everything written through to another buffer, keeping a copy of
+ * it for the response cache. a body which gets too big to be cached isn't
+ * kept at all.
+ */
+class capturing_buffer : public output_buffer {
+public:
+  capturing_buffer(shared_ptr<output_buffer> out, size_t max_bytes)
+      : m_out(out), m_max_bytes(max_bytes), m_too_big(false),
+        m_closed(false) {}
+
+  int write(const char *buffer, int len) {
+    if (!m_too_big) {
+      if (m_body.size() + len > m_max_bytes) {
+        m_too_big = true;
+        string().swap(m_body);
+      } else {
+        m_body.append(buffer, len);
+      }
+    }
+    return m_out->write(buffer, len);
+  }
+
+  int written() { return m_out->written(); }
+
+  int close() {
+    m_closed = true;
+    return m_out->close();
+  }
+
+  void flush() { m_out->flush(); }
+
+  // true if the whole body was written and closed off, so that what was
+  // kept can be sent to another client as it is.
+  bool complete() const { return m_closed && !m_too_big; }
+  const string &body() const { return m_body; }
+
+private:
+  shared_ptr<output_buffer> m_out;
+  size_t m_max_bytes;
+  bool m_too_big, m_closed;
+  string m_body;
+};
+
+/**
+ * passes everything through to another formatter, noting the elements and
+ * area written as the dependencies of the response, and whether an error
+ * was written into it.
+ */
+class dependency_formatter : public output_formatter {
+public:
+  dependency_formatter(output_formatter &out,
+                       response_cache::dependencies &deps)
+      : m_out(out), m_deps(deps), m_failed(false) {}
+
+  // true if the response ended with an error, e.g: from the database
+  // part-way through writing, rather than being complete.
+  bool failed() const { return m_failed; }
+
+  mime::type mime_type() const { return m_out.mime_type(); }
+  void start_document(const string &generator) {
+    m_out.start_document(generator);
+  }
+  void end_document() { m_out.end_document(); }
+  void error(const std::exception &e) {
+    m_failed = true;
+    m_out.error(e);
+  }
+  void write_bounds(const bbox &bounds) {
+    m_out.write_bounds(bounds);
+    m_deps.add_area(bounds);
+  }
+  void start_element_type(element_type type) {
+    m_out.start_element_type(type);
+  }
+  void end_element_type(element_type type) { m_out.end_element_type(type); }
+
+  void write_node(const element_info &elem, double lon, double lat,
+                  const tags_t &tags) {
+    m_out.write_node(elem, lon, lat, tags);
+    m_deps.add_element(element_type_node, elem.id);
+  }
+
+  void write_way(const element_info &elem, const nodes_t &nodes,
+                 const tags_t &tags) {
+    m_out.write_way(elem, nodes, tags);
+    m_deps.add_element(element_type_way, elem.id);
+  }
+
+  void write_relation(const element_info &elem, const members_t &members,
+                      const tags_t &tags) {
+    m_out.write_relation(elem, members, tags);
+    m_deps.add_element(element_type_relation, elem.id);
+  }
+
+  void write_changeset(const changeset_info &elem, const tags_t &tags,
+                       bool include_comments, const comments_t &comments,
+                       const boost::posix_time::ptime &now) {
+    m_out.write_changeset(elem, tags, include_comments, comments, now);
+  }
+
+  void flush() { m_out.flush(); }
+  void error(const string &s) {
+    m_failed = true;
+    m_out.error(s);
+  }
+
+private:
+  output_formatter &m_out;
+  response_cache::dependencies &m_deps;
+  bool m_failed;
+};
+
+/**
+ * the key for a response in the response cache, made of everything about
+ * the request which changes what's sent back: the path, which has the IDs
+ * and any format extension in it, the formats the client accepts, the
+ * encoding and whether metadata is wanted.
+ */
+string response_cache_key(request &req, const string &encoding,
+                          bool include_metadata) {
+  const char *accept = req.get_param("HTTP_ACCEPT");
+  return (format("%1%\n%2%\n%3%\n%4%") % get_request_path(req) %
+          ((accept == NULL) ? "" : accept) % encoding %
+          (include_metadata ? "metadata" : "no metadata")).str();
+}
+
+// the request headers which change what's sent back, so that caches keep
+// the variants negotiated from them apart.
+const char *const VARY = "Accept, Accept-Encoding, X-OSM-Metadata";
+
+void write_response_headers(request &req, const string &content_type,
+                            const string &encoding, const string &cache_control,
+                            const string &etag) {
+  req.status(200);
+  req.add_header("Content-Type", content_type);
+  req.add_header("Content-Encoding", encoding);
+  req.add_header("Cache-Control", cache_control);
+  if (!etag.empty()) {
+    req.add_header("ETag", etag);
+  }
+  req.add_header("Vary", VARY);
+}
+
+/**
+ * the ETag for a response, made from the version of the data in it along
+ * with everything else which changes the bytes sent back: the format, the
+ * encoding and whether metadata is written. it's a weak one, as a user
+ * changing their display name changes the response without changing any
+ * versions. empty if the responder can't tell what version its data is.
+ */
+string make_etag(const string &data_version, mime::type mime_type,
+                 const string &encoding, bool include_metadata) {
+  if (data_version.empty()) {
+    return "";
+  }
+
+  const string key =
+      (format("%1%\n%2%\n%3%\n%4%") % data_version %
+       mime::to_string(mime_type) % encoding % (include_metadata ? 1 : 0))
+          .str();
+
+  // FNV-1a, which is plenty to tell versions of the same resource apart.
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (string::const_iterator itr = key.begin(); itr != key.end(); ++itr) {
+    hash = (hash ^ uint64_t((unsigned char)*itr)) * 0x100000001b3ull;
+  }
+  return (format("W/\"%1$016x\"") % hash).str();
+}
+
+/**
+ * true if the client already has the response with the ETag, going by the
+ * If-None-Match header. as the ETags are weak, the weak comparison is used,
+ * ignoring any W/ prefixes.
+ */
+bool if_none_match(request &req, const string &etag) {
+  const char *header = req.get_param("HTTP_IF_NONE_MATCH");
+  if ((header == NULL) || etag.empty()) {
+    return false;
+  }
+
+  const string opaque = al::starts_with(etag, "W/") ? etag.substr(2) : etag;
+  std::vector<string> tags;
+  al::split(tags, header, al::is_any_of(","));
+  BOOST_FOREACH(string tag, tags) {
+    al::trim(tag);
+    if (tag == "*") {
+      return true;
+    }
+    if (al::starts_with(tag, "W/")) {
+      tag.erase(0, 2);
+    }
+    if (tag == opaque) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * tell the client that the response it already has is still current.
+ */
+void respond_not_modified(request &req, const string &etag,
+                          const string &cache_control) {
+  req.status(304);
+  req.add_header("ETag", etag);
+  req.add_header("Cache-Control", cache_control);
+  req.add_header("Vary", VARY);
+  req.finish();
+}
+
 /**
  * Return a 405 error.
  */
@@ -104,33 +335,94 @@ process_get_request(request &req, routes &route,
   logger::message(format("Started request for %1% from %2%") % request_name %
                   ip);
 
-  // constructor of responder handles dynamic validation (i.e: with db access).
-  responder_ptr_t responder = handler->responder(factory);
+  // the selection has to know before anything is selected if the
+  // elements' changesets and users won't be written.
+  const bool include_metadata = want_metadata(req);
+  if (!include_metadata) {
+    factory = boost::make_shared<without_metadata_factory>(factory);
+  }
 
   // get encoding to use
   shared_ptr<http::encoding> encoding = get_encoding(req);
 
+  // a response which is cached, and still up to date, is sent as it is,
+  // already compressed, without going near the database.
+  response_cache *cache =
+      handler->response_cacheable() ? response_cache::instance() : NULL;
+  string cache_key;
+  uint64_t started = 0;
+  if (cache != NULL) {
+    cache_key = response_cache_key(req, encoding->name(), include_metadata);
+    response_cache::entry cached;
+    if (cache->get(cache_key, cached)) {
+      logger::message(format("Sending cached response for %1%") %
+                      request_name);
+      write_response_headers(req, cached.content_type,
+                             cached.content_encoding, cached.cache_control,
+                             "");
+      req.put(cached.body);
+      req.finish();
+      return boost::make_tuple(request_name, size_t(cached.written));
+    }
+    // anything changed after this might not be in the response.
+    started = cache->epoch();
+  }
+
+  // constructor of responder handles dynamic validation (i.e: with db access).
+  responder_ptr_t responder = handler->responder(factory);
+
   // figure out best mime type
   mime::type best_mime_type = choose_best_mime_type(req, responder);
 
+  // responses for a few elements can be tagged with the versions of the
+  // data in them, found without writing the whole thing out. if the client
+  // already has the same version, there's no need to write it again.
+  const string etag = make_etag(responder->data_version(), best_mime_type,
+                                encoding->name(), include_metadata);
+  if (if_none_match(req, etag)) {
+    logger::message(format("Client already has current %1%") % request_name);
+    respond_not_modified(req, etag, responder->cache_control());
+    return boost::make_tuple(request_name, size_t(0));
+  }
+
   // TODO: use handler/responder to setup response headers.
   // write the response header
-  req.status(200);
-  req.add_header("Content-Type", (boost::format("%1%; charset=utf-8") %
-                                  mime::to_string(best_mime_type)).str());
-  req.add_header("Content-Encoding", encoding->name());
-  req.add_header("Cache-Control", "private, max-age=0, must-revalidate");
+  const string content_type =
+      (boost::format("%1%; charset=utf-8") % mime::to_string(best_mime_type))
+          .str();
+  write_response_headers(req, content_type, encoding->name(),
+                         responder->cache_control(), etag);
+
+  // keep a copy of what's written out, after it's been compressed, if the
+  // response is to be cached.
+  shared_ptr<output_buffer> body = req.get_buffer();
+  shared_ptr<capturing_buffer> capture;
+  if (cache != NULL) {
+    capture =
+        boost::make_shared<capturing_buffer>(body, cache->max_body_bytes());
+    body = capture;
+  }
 
   // create the XML writer with the FCGI streams as output
-  shared_ptr<output_buffer> out = encoding->buffer(req.get_buffer());
+  shared_ptr<output_buffer> out = encoding->buffer(body);
 
   // create the correct mime type output formatter.
   shared_ptr<output_formatter> o_formatter =
-      create_formatter(req, best_mime_type, out);
+      create_formatter(req, best_mime_type, out, include_metadata);
+
+  response_cache::dependencies deps;
+  shared_ptr<output_formatter> writing = o_formatter;
+  shared_ptr<dependency_formatter> noting;
+  if (cache != NULL) {
+    noting = boost::make_shared<dependency_formatter>(boost::ref(*o_formatter),
+                                                      boost::ref(deps));
+    writing = noting;
+  }
 
+  bool finished = false;
   try {
     // call to write the response
-    responder->write(o_formatter, generator, req.get_current_time());
+    responder->write(writing, generator, req.get_current_time());
 
     // ensure the request is finished
     req.finish();
@@ -140,6 +432,7 @@ process_get_request(request &req, routes &route,
     // half-written state...
     o_formatter->flush();
     out->flush();
+    finished = true;
 
   } catch (const output_writer::write_error &e) {
     // don't do anything - just go on to the next request.
@@ -153,7 +446,27 @@ process_get_request(request &req, routes &route,
     o_formatter->error(e.what());
   }
 
-  return boost::make_tuple(request_name, out->written());
+  const size_t written = out->written();
+  // the responder writes errors into the document and carries on, so a
+  // response which "finished" may still be an error, or cut short, and
+  // isn't to be sent to anyone else.
+  if (finished && capture && !noting->failed()) {
+    // the document is only closed off when its writer goes away.
+    writing.reset();
+    noting.reset();
+    o_formatter.reset();
+    if (capture->complete()) {
+      response_cache::entry e;
+      e.content_type = content_type;
+      e.content_encoding = encoding->name();
+      e.cache_control = responder->cache_control();
+      e.body = capture->body();
+      e.written = written;
+      cache->put(cache_key, e, deps, started);
+    }
+  }
+
+  return boost::make_tuple(request_name, written);
 }
 
 /**
@@ -1,6 +1,7 @@
 #include "cgimap/request_helpers.hpp"
 #include <sstream>
 #include <cstring>
+#include <strings.h>
 
 using std::string;
 using std::ostringstream;
@@ -56,6 +57,24 @@ string get_query_string(request &req) {
   }
 }
 
+bool want_metadata(request &req) {
+  const char *header = req.get_param("HTTP_X_OSM_METADATA");
+  if ((header != NULL) && (strcasecmp(header, "false") == 0)) {
+    return false;
+  }
+
+  typedef std::vector<std::pair<string, string> > params_t;
+  const params_t params =
+      http::parse_params(http::urldecode(get_query_string(req)));
+  for (params_t::const_iterator itr = params.begin(); itr != params.end();
+       ++itr) {
+    if ((itr->first == "metadata") && (itr->second == "false")) {
+      return false;
+    }
+  }
+  return true;
+}
+
 std::string get_request_path(request &req) {
   const char *request_uri = req.get_param("REQUEST_URI");
 
@@ -98,6 +117,7 @@ boost::shared_ptr<http::encoding> get_encoding(request &req) {
 
 namespace {
 const char *http_message_status_200 = "OK";
+const char *http_message_status_304 = "Not Modified";
 const char *http_message_status_400 = "Bad Request";
 const char *http_message_status_401 = "Unauthorized";
 const char *http_message_status_404 = "Not Found";
@@ -115,6 +135,9 @@ const char *status_message(int code) {
   case 200:
     msg = http_message_status_200;
     break;
+  case 304:
+    msg = http_message_status_304;
+    break;
   case 400:
     msg = http_message_status_400;
     break;
@@ -0,0 +1,749 @@
+#include "cgimap/response_cache.hpp"
+#include "cgimap/logger.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <libxml/parser.h>
+#include <sys/mman.h>
+
+namespace fs = boost::filesystem;
+namespace po = boost::program_options;
+namespace pt = boost::posix_time;
+
+namespace {
+
+// how many slots, starting from the one a key hashes to, are looked at
+// before giving up on a get, or replacing the oldest of them on a put.
+const size_t PROBE_LENGTH = 8;
+
+// the number of times a reader will try to copy a slot which is in the
+// middle of being written before treating it as a miss.
+const int READ_RETRIES = 4;
+
+// the ring gets an index slot for each this many bytes, which is about
+// the size of a compressed tile or full way.
+const size_t BYTES_PER_SLOT = 8192;
+
+// and the table of changed keys gets an entry for each this many bytes.
+// when it's half full, it's cleared and everything cached is thrown away.
+const size_t BYTES_PER_CHANGE = 256;
+const size_t MIN_CHANGES = 1 << 16;
+
+// responses bigger than this fraction of the ring aren't kept, so that a
+// few of them can't push everything else out.
+const size_t MAX_ENTRY_FRACTION = 8;
+
+// the zoom of the grid which areas and node locations are kept at, which
+// is the same as the API 0.7 map tiles.
+const int CELL_ZOOM = 14;
+
+// how often each process looks for new osmChange files, and how long the
+// lock on reading them can be held before another process takes it over
+// from one which has presumably died.
+const pt::time_duration CHANGES_INTERVAL = pt::seconds(10);
+const time_t FEED_LOCK_TIMEOUT = 600;
+
+// the longest name of an osmChange file which can be remembered as the
+// last one read.
+const size_t MAX_FILE_NAME = 255;
+
+boost::scoped_ptr<response_cache> s_instance;
+
+// 64-bit FNV-1a, which is the same in every process, unlike std::hash.
+uint64_t hash_key(const std::string &key) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (std::string::const_iterator itr = key.begin(); itr != key.end();
+       ++itr) {
+    h = (h ^ uint8_t(*itr)) * 0x100000001b3ull;
+  }
+  return h;
+}
+
+// a checksum of what follows each record in the ring, taken a word at a
+// time as bodies can be large. it only has to catch a response which was
+// partly overwritten, so it needn't be as good a hash as hash_key.
+uint64_t checksum(const char *data, size_t length) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(uint64_t));
+    h = (h ^ word) * 0x100000001b3ull;
+    h ^= h >> 32;
+  }
+  for (; i < length; ++i) {
+    h = (h ^ uint8_t(data[i])) * 0x100000001b3ull;
+  }
+  return h;
+}
+
+inline size_t spread(uint64_t key) {
+  return size_t((key * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+// elements are keyed with their type in the low bits, as in the element
+// cache. changesets are never dependencies, so their type is used for the
+// cells of the grid, offset by one so that no key is zero.
+inline uint64_t element_key(element_type type, osm_nwr_id_t id) {
+  return (uint64_t(id) << 2) | uint64_t(type);
+}
+
+inline uint64_t cell_key(uint32_t x, uint32_t y) {
+  return (((uint64_t(y) << CELL_ZOOM) | x) + 1) << 2;
+}
+
+inline uint32_t cell_x(double lon) {
+  const double x = std::floor((lon + 180.0) / 360.0 * (1 << CELL_ZOOM));
+  return uint32_t(std::min(std::max(x, 0.0), double((1 << CELL_ZOOM) - 1)));
+}
+
+inline uint32_t cell_y(double lat) {
+  const double y = std::floor((lat + 90.0) / 180.0 * (1 << CELL_ZOOM));
+  return uint32_t(std::min(std::max(y, 0.0), double((1 << CELL_ZOOM) - 1)));
+}
+
+inline size_t round_up(size_t n) { return (n + 7) & ~size_t(7); }
+
+size_t power_of_two_at_least(size_t n) {
+  size_t p = 1;
+  while (p < n) {
+    p <<= 1;
+  }
+  return p;
+}
+
+// osmChange files are read in order of their names, shorter ones first,
+// so that numbered files which aren't padded with zeros are in order.
+bool file_name_before(const std::string &a, const std::string &b) {
+  return (a.size() < b.size()) || ((a.size() == b.size()) && (a < b));
+}
+
+/**
+ * each response in the ring starts with this, followed by the key, the
+ * three headers, the dependencies' keys and the body, which are covered by
+ * the checksum.
+ */
+struct record {
+  uint64_t hash;
+  uint64_t started;
+  uint32_t key_length, type_length, encoding_length, cache_control_length;
+  uint64_t num_deps, body_length, written;
+  uint64_t checksum;
+};
+
+/**
+ * SAX callbacks collecting the elements in an osmChange file. it doesn't
+ * matter whether they were created, modified or deleted.
+ */
+struct change_parser {
+  explicit change_parser(response_cache::dependencies &changed)
+      : m_changed(changed), m_failed(false) {}
+
+  // the attributes of an element, as libxml's SAX2 interface gives them,
+  // are five pointers each, the fourth and fifth of which are the start
+  // and end of the value.
+  static bool attribute(int num_attributes, const xmlChar **attributes,
+                        const char *name, std::string &value) {
+    for (int i = 0; i < num_attributes; ++i) {
+      const xmlChar **attr = attributes + 5 * i;
+      if (strcmp((const char *)attr[0], name) == 0) {
+        value.assign((const char *)attr[3], attr[4] - attr[3]);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static osm_nwr_id_t id_attribute(int num_attributes,
+                                   const xmlChar **attributes,
+                                   const char *name) {
+    std::string value;
+    return attribute(num_attributes, attributes, name, value)
+               ? osm_nwr_id_t(strtoull(value.c_str(), NULL, 10))
+               : 0;
+  }
+
+  static void start_element(void *ctx, const xmlChar *name_,
+                            const xmlChar *, const xmlChar *, int,
+                            const xmlChar **, int num_attributes, int,
+                            const xmlChar **attributes) {
+    change_parser *parser = static_cast<change_parser *>(ctx);
+    const char *name = (const char *)name_;
+
+    if (strcmp(name, "node") == 0) {
+      parser->m_changed.add_element(
+          element_type_node, id_attribute(num_attributes, attributes, "id"));
+      // deleted nodes don't have to say where they were, but they're in
+      // any response which they'd change.
+      std::string lat, lon;
+      if (attribute(num_attributes, attributes, "lat", lat) &&
+          attribute(num_attributes, attributes, "lon", lon)) {
+        parser->m_changed.add_location(strtod(lon.c_str(), NULL),
+                                       strtod(lat.c_str(), NULL));
+      }
+
+    } else if (strcmp(name, "way") == 0) {
+      parser->m_changed.add_element(
+          element_type_way, id_attribute(num_attributes, attributes, "id"));
+
+    } else if (strcmp(name, "relation") == 0) {
+      parser->m_changed.add_element(
+          element_type_relation,
+          id_attribute(num_attributes, attributes, "id"));
+
+    } else if (strcmp(name, "nd") == 0) {
+      // a way which has started using a node now belongs in the responses
+      // which have that node in them.
+      parser->m_changed.add_element(
+          element_type_node, id_attribute(num_attributes, attributes, "ref"));
+
+    } else if (strcmp(name, "member") == 0) {
+      // and likewise for relations and their members.
+      std::string type;
+      const osm_nwr_id_t ref = id_attribute(num_attributes, attributes, "ref");
+      if (!attribute(num_attributes, attributes, "type", type)) {
+        return;
+      } else if (type == "node") {
+        parser->m_changed.add_element(element_type_node, ref);
+      } else if (type == "way") {
+        parser->m_changed.add_element(element_type_way, ref);
+      } else if (type == "relation") {
+        parser->m_changed.add_element(element_type_relation, ref);
+      }
+    }
+  }
+
+  static void warning(void *, const char *, ...) {}
+
+  // errors are only noted, as throwing through libxml isn't safe.
+  static void error(void *ctx, const char *fmt, ...) {
+    change_parser *parser = static_cast<change_parser *>(ctx);
+    if (!parser->m_failed) {
+      char buffer[1024];
+      va_list arg_ptr;
+      va_start(arg_ptr, fmt);
+      vsnprintf(buffer, sizeof(buffer) - 1, fmt, arg_ptr);
+      va_end(arg_ptr);
+      parser->m_error = buffer;
+      parser->m_failed = true;
+    }
+  }
+
+  response_cache::dependencies &m_changed;
+  bool m_failed;
+  std::string m_error;
+};
+
+} // anonymous namespace
+
+struct response_cache::header {
+  uint64_t hits, misses, stale, inserts, changes, files;
+  // the total number of bytes ever reserved in the ring, of which the last
+  // m_ring_bytes are still there.
+  uint64_t head;
+  // bumped for each batch of changes. responses started before the floor
+  // are out of date, whatever they depend on.
+  uint64_t epoch, floor;
+  // the number of keys in the table of changes.
+  uint64_t changed_keys;
+  // when the process reading the osmChange files started, or zero if
+  // none is.
+  int64_t feed_locked_at;
+  char last_file[MAX_FILE_NAME + 1];
+};
+
+struct response_cache::slot {
+  // odd while the slot is being written.
+  uint32_t seq;
+  // zero if the slot has never been used.
+  uint32_t length;
+  uint64_t hash;
+  // where the response starts in the ring, counted from the first byte
+  // ever written to it.
+  uint64_t pos;
+};
+
+struct response_cache::change {
+  // zero if the entry is empty.
+  uint64_t key;
+  uint64_t epoch;
+};
+
+void response_cache::dependencies::add_element(element_type type,
+                                               osm_nwr_id_t id) {
+  m_keys.push_back(element_key(type, id));
+}
+
+void response_cache::dependencies::add_location(double lon, double lat) {
+  m_keys.push_back(cell_key(cell_x(lon), cell_y(lat)));
+}
+
+void response_cache::dependencies::add_area(const bbox &bounds) {
+  const uint32_t max_x = cell_x(bounds.maxlon), max_y = cell_y(bounds.maxlat);
+  for (uint32_t y = cell_y(bounds.minlat); y <= max_y; ++y) {
+    for (uint32_t x = cell_x(bounds.minlon); x <= max_x; ++x) {
+      m_keys.push_back(cell_key(x, y));
+    }
+  }
+}
+
+const std::vector<uint64_t> &response_cache::dependencies::keys() const {
+  return m_keys;
+}
+
+bool response_cache::dependencies::empty() const { return m_keys.empty(); }
+
+response_cache::response_cache(size_t max_bytes,
+                               const std::string &changes_dir)
+    : m_header(NULL), m_slots(NULL), m_changes(NULL), m_ring(NULL),
+      m_slot_mask(0), m_change_mask(0), m_ring_bytes(round_up(max_bytes)),
+      m_bytes(0), m_changes_dir(changes_dir) {
+  if (m_ring_bytes == 0) {
+    throw std::runtime_error("Response cache must have some bytes.");
+  }
+  const size_t num_slots = power_of_two_at_least(
+      std::max(PROBE_LENGTH, m_ring_bytes / BYTES_PER_SLOT));
+  const size_t num_changes = power_of_two_at_least(
+      std::max(MIN_CHANGES, m_ring_bytes / BYTES_PER_CHANGE));
+  m_slot_mask = num_slots - 1;
+  m_change_mask = num_changes - 1;
+
+  const size_t header_bytes = round_up(sizeof(header));
+  m_bytes = header_bytes + num_slots * sizeof(slot) +
+            num_changes * sizeof(change) + m_ring_bytes;
+
+  // as for the shared changeset cache, the anonymous mapping is shared with
+  // processes forked after this, and starts off zeroed.
+  void *mem = mmap(NULL, m_bytes, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    throw std::runtime_error(
+        (boost::format("Unable to map %1% bytes of shared memory for the "
+                       "response cache.") % m_bytes).str());
+  }
+  char *base = static_cast<char *>(mem);
+  m_header = reinterpret_cast<header *>(base);
+  m_slots = reinterpret_cast<slot *>(base + header_bytes);
+  m_changes = reinterpret_cast<change *>(m_slots + num_slots);
+  m_ring = reinterpret_cast<char *>(m_changes + num_changes);
+
+  // anything in the directory already is older than this empty cache, so
+  // only files which turn up after it need reading.
+  if (!m_changes_dir.empty()) {
+    if (!fs::is_directory(m_changes_dir)) {
+      munmap(mem, m_bytes);
+      throw std::runtime_error(
+          (boost::format("Response cache changes directory %1% doesn't "
+                         "exist.") % m_changes_dir).str());
+    }
+    std::string newest;
+    for (fs::directory_iterator itr(m_changes_dir);
+         itr != fs::directory_iterator(); ++itr) {
+      const std::string name = itr->path().filename().string();
+      if (fs::is_regular_file(itr->status()) &&
+          (name.size() <= MAX_FILE_NAME) && file_name_before(newest, name)) {
+        newest = name;
+      }
+    }
+    memcpy(m_header->last_file, newest.c_str(), newest.size() + 1);
+  }
+}
+
+response_cache::~response_cache() { munmap(m_header, m_bytes); }
+
+size_t response_cache::max_body_bytes() const {
+  return m_ring_bytes / MAX_ENTRY_FRACTION;
+}
+
+uint64_t response_cache::epoch() const {
+  return __atomic_load_n(&m_header->epoch, __ATOMIC_ACQUIRE);
+}
+
+bool response_cache::get(const std::string &key, entry &out) {
+  const uint64_t hash = hash_key(key);
+  const size_t start = spread(hash);
+
+  for (size_t i = 0; i < PROBE_LENGTH; ++i) {
+    const slot &s = m_slots[(start + i) & m_slot_mask];
+
+    slot copy;
+    bool consistent = false;
+    for (int retry = 0; (retry < READ_RETRIES) && !consistent; ++retry) {
+      const uint32_t seq = __atomic_load_n(&s.seq, __ATOMIC_ACQUIRE);
+      if ((seq & 1) == 0) {
+        memcpy(&copy, &s, sizeof(slot));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        consistent = __atomic_load_n(&s.seq, __ATOMIC_RELAXED) == seq;
+      }
+    }
+    if (!consistent || (copy.length == 0)) {
+      break;
+    }
+    if ((copy.hash != hash) || (copy.length < sizeof(record))) {
+      continue;
+    }
+
+    // copy the response out of the ring, and then check that no-one has
+    // reserved space on top of it in the meantime.
+    if (__atomic_load_n(&m_header->head, __ATOMIC_ACQUIRE) >
+        copy.pos + m_ring_bytes) {
+      continue;
+    }
+    std::string buffer(copy.length, '\0');
+    ring_read(copy.pos, &buffer[0], copy.length);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&m_header->head, __ATOMIC_RELAXED) >
+        copy.pos + m_ring_bytes) {
+      continue;
+    }
+
+    record rec;
+    memcpy(&rec, buffer.data(), sizeof(record));
+    const size_t key_at = sizeof(record);
+    const size_t type_at = key_at + rec.key_length;
+    const size_t encoding_at = type_at + rec.type_length;
+    const size_t cache_control_at = encoding_at + rec.encoding_length;
+    const size_t deps_at = cache_control_at + rec.cache_control_length;
+    const size_t body_at = deps_at + rec.num_deps * sizeof(uint64_t);
+    if ((rec.hash != hash) || (body_at + rec.body_length > buffer.size()) ||
+        (buffer.compare(key_at, rec.key_length, key) != 0)) {
+      continue;
+    }
+
+    // a process which reserved space before the ring last wrapped around,
+    // and stalled before writing to it, can still write over this while
+    // it's being copied out, which checking the head doesn't catch.
+    if (checksum(buffer.data() + key_at,
+                 body_at + rec.body_length - key_at) != rec.checksum) {
+      continue;
+    }
+
+    // it's only any use if nothing it depends on has changed since it was
+    // made. the floor is checked last, in case the table of changes was
+    // cleared while this was looking through it.
+    bool stale = false;
+    for (uint64_t d = 0; (d < rec.num_deps) && !stale; ++d) {
+      uint64_t dep;
+      memcpy(&dep, buffer.data() + deps_at + d * sizeof(uint64_t),
+             sizeof(uint64_t));
+      stale = changed_at(dep) > rec.started;
+    }
+    if (stale ||
+        (rec.started < __atomic_load_n(&m_header->floor, __ATOMIC_ACQUIRE))) {
+      __atomic_fetch_add(&m_header->stale, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&m_header->misses, 1, __ATOMIC_RELAXED);
+      return false;
+    }
+
+    out.content_type.assign(buffer, type_at, rec.type_length);
+    out.content_encoding.assign(buffer, encoding_at, rec.encoding_length);
+    out.cache_control.assign(buffer, cache_control_at,
+                             rec.cache_control_length);
+    out.body.assign(buffer, body_at, rec.body_length);
+    out.written = rec.written;
+    __atomic_fetch_add(&m_header->hits, 1, __ATOMIC_RELAXED);
+    return true;
+  }
+
+  __atomic_fetch_add(&m_header->misses, 1, __ATOMIC_RELAXED);
+  return false;
+}
+
+void response_cache::put(const std::string &key, const entry &e,
+                         const dependencies &deps, uint64_t started) {
+  std::vector<uint64_t> dep_keys(deps.keys());
+  std::sort(dep_keys.begin(), dep_keys.end());
+  dep_keys.erase(std::unique(dep_keys.begin(), dep_keys.end()),
+                 dep_keys.end());
+
+  record rec;
+  rec.hash = hash_key(key);
+  rec.started = started;
+  rec.key_length = uint32_t(key.size());
+  rec.type_length = uint32_t(e.content_type.size());
+  rec.encoding_length = uint32_t(e.content_encoding.size());
+  rec.cache_control_length = uint32_t(e.cache_control.size());
+  rec.num_deps = dep_keys.size();
+  rec.body_length = e.body.size();
+  rec.written = e.written;
+
+  const size_t length =
+      round_up(sizeof(record) + key.size() + e.content_type.size() +
+               e.content_encoding.size() + e.cache_control.size() +
+               dep_keys.size() * sizeof(uint64_t) + e.body.size());
+  if (length > m_ring_bytes / MAX_ENTRY_FRACTION) {
+    return;
+  }
+
+  std::string buffer;
+  buffer.reserve(length);
+  buffer.append(reinterpret_cast<const char *>(&rec), sizeof(record));
+  buffer.append(key);
+  buffer.append(e.content_type);
+  buffer.append(e.content_encoding);
+  buffer.append(e.cache_control);
+  if (!dep_keys.empty()) {
+    buffer.append(reinterpret_cast<const char *>(&dep_keys[0]),
+                  dep_keys.size() * sizeof(uint64_t));
+  }
+  buffer.append(e.body);
+  rec.checksum = checksum(buffer.data() + sizeof(record),
+                          buffer.size() - sizeof(record));
+  memcpy(&buffer[0], &rec, sizeof(record));
+  buffer.resize(length, '\0');
+
+  // reserving the space first means that anyone reading what was there
+  // before can tell that it's gone.
+  const uint64_t pos =
+      __atomic_fetch_add(&m_header->head, uint64_t(length), __ATOMIC_ACQ_REL);
+  ring_write(pos, buffer.data(), length);
+
+  // use the slot which already has this key, or the first unused one, or
+  // failing that the one pointing furthest back in the ring.
+  const size_t start = spread(rec.hash);
+  slot *target = NULL;
+  uint64_t oldest_pos = 0;
+  for (size_t i = 0; i < PROBE_LENGTH; ++i) {
+    slot &s = m_slots[(start + i) & m_slot_mask];
+    const uint32_t slot_length = __atomic_load_n(&s.length, __ATOMIC_RELAXED);
+    if ((slot_length == 0) ||
+        (__atomic_load_n(&s.hash, __ATOMIC_RELAXED) == rec.hash)) {
+      target = &s;
+      break;
+    }
+    const uint64_t slot_pos = __atomic_load_n(&s.pos, __ATOMIC_RELAXED);
+    if ((target == NULL) || (slot_pos < oldest_pos)) {
+      target = &s;
+      oldest_pos = slot_pos;
+    }
+  }
+
+  // claim the slot, unless another process is already writing it.
+  uint32_t seq = __atomic_load_n(&target->seq, __ATOMIC_RELAXED);
+  if ((seq & 1) ||
+      !__atomic_compare_exchange_n(&target->seq, &seq, seq + 1, false,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return;
+  }
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  __atomic_store_n(&target->hash, rec.hash, __ATOMIC_RELAXED);
+  __atomic_store_n(&target->pos, pos, __ATOMIC_RELAXED);
+  __atomic_store_n(&target->length, uint32_t(length), __ATOMIC_RELAXED);
+
+  __atomic_store_n(&target->seq, seq + 2, __ATOMIC_RELEASE);
+  __atomic_fetch_add(&m_header->inserts, 1, __ATOMIC_RELAXED);
+}
+
+void response_cache::invalidate(const dependencies &changed) {
+  // responses started from now on are made after these changes.
+  const uint64_t at =
+      __atomic_add_fetch(&m_header->epoch, 1, __ATOMIC_ACQ_REL);
+
+  const std::vector<uint64_t> &keys = changed.keys();
+  for (std::vector<uint64_t>::const_iterator itr = keys.begin();
+       itr != keys.end(); ++itr) {
+    mark_changed(*itr, at);
+  }
+  __atomic_fetch_add(&m_header->changes, uint64_t(keys.size()),
+                     __ATOMIC_RELAXED);
+}
+
+void response_cache::read_changes(const pt::ptime &now) {
+  if (m_changes_dir.empty() ||
+      (!m_last_poll.is_not_a_date_time() &&
+       (now - m_last_poll < CHANGES_INTERVAL))) {
+    return;
+  }
+  m_last_poll = now;
+
+  if (!lock_feed()) {
+    return;
+  }
+
+  try {
+    std::vector<std::string> names;
+    const std::string last_file(m_header->last_file);
+    for (fs::directory_iterator itr(m_changes_dir);
+         itr != fs::directory_iterator(); ++itr) {
+      const std::string name = itr->path().filename().string();
+      // files being written are often hidden until they're complete.
+      if (fs::is_regular_file(itr->status()) && (name[0] != '.') &&
+          (name.size() <= MAX_FILE_NAME) && file_name_before(last_file, name)) {
+        names.push_back(name);
+      }
+    }
+    std::sort(names.begin(), names.end(), file_name_before);
+
+    for (std::vector<std::string>::const_iterator itr = names.begin();
+         itr != names.end(); ++itr) {
+      const std::string path = (fs::path(m_changes_dir) / *itr).string();
+      dependencies changed;
+      try {
+        parse_changes(path, changed);
+        invalidate(changed);
+        logger::message(boost::format("Read %1% changes from %2% for the "
+                                      "response cache") %
+                        changed.keys().size() % path);
+
+      } catch (const std::exception &e) {
+        // without knowing what it changed, nothing cached can be trusted.
+        flush_all();
+        logger::message(boost::format("Unable to read changes from %1%, "
+                                      "emptying the response cache: %2%") %
+                        path % e.what());
+      }
+      memcpy(m_header->last_file, itr->c_str(), itr->size() + 1);
+      __atomic_fetch_add(&m_header->files, 1, __ATOMIC_RELAXED);
+    }
+
+  } catch (const std::exception &e) {
+    logger::message(
+        boost::format("Unable to look for changes in %1%: %2%") %
+        m_changes_dir % e.what());
+  }
+
+  unlock_feed();
+}
+
+void response_cache::parse_changes(const std::string &filename,
+                                   dependencies &changed) {
+  xmlSAXHandler handler;
+  memset(&handler, 0, sizeof(handler));
+
+  handler.initialized = XML_SAX2_MAGIC;
+  handler.startElementNs = &change_parser::start_element;
+  handler.warning = &change_parser::warning;
+  handler.error = &change_parser::error;
+
+  // libxml reads gzipped files as well, so compressed diffs can be used
+  // as they are.
+  change_parser parser(changed);
+  const int status =
+      xmlSAXUserParseFile(&handler, &parser, filename.c_str());
+  if ((status != 0) || parser.m_failed) {
+    throw std::runtime_error(
+        (boost::format("XML ERROR: %1%") % parser.m_error).str());
+  }
+}
+
+response_cache::stats response_cache::get_stats() const {
+  stats s;
+  s.hits = __atomic_load_n(&m_header->hits, __ATOMIC_RELAXED);
+  s.misses = __atomic_load_n(&m_header->misses, __ATOMIC_RELAXED);
+  s.stale = __atomic_load_n(&m_header->stale, __ATOMIC_RELAXED);
+  s.inserts = __atomic_load_n(&m_header->inserts, __ATOMIC_RELAXED);
+  s.changes = __atomic_load_n(&m_header->changes, __ATOMIC_RELAXED);
+  s.files = __atomic_load_n(&m_header->files, __ATOMIC_RELAXED);
+  s.bytes = m_bytes;
+  return s;
+}
+
+response_cache *response_cache::instance() { return s_instance.get(); }
+
+void response_cache::initialise(const po::variables_map &opts) {
+  const size_t bytes = opts.count("response-cache-bytes")
+                           ? opts["response-cache-bytes"].as<size_t>()
+                           : 0;
+  if (bytes == 0) {
+    s_instance.reset();
+    return;
+  }
+  // without any changes to read, cached responses would never go out of
+  // date.
+  if (opts.count("response-cache-changes") == 0) {
+    throw std::runtime_error("The response cache needs a directory to read "
+                             "changes from.");
+  }
+  s_instance.reset(new response_cache(
+      bytes, opts["response-cache-changes"].as<std::string>()));
+}
+
+void response_cache::ring_read(uint64_t pos, char *out, size_t length) const {
+  const size_t offset = size_t(pos % m_ring_bytes);
+  const size_t first = std::min(length, m_ring_bytes - offset);
+  memcpy(out, m_ring + offset, first);
+  memcpy(out + first, m_ring, length - first);
+}
+
+void response_cache::ring_write(uint64_t pos, const char *data,
+                                size_t length) {
+  const size_t offset = size_t(pos % m_ring_bytes);
+  const size_t first = std::min(length, m_ring_bytes - offset);
+  memcpy(m_ring + offset, data, first);
+  memcpy(m_ring, data + first, length - first);
+}
+
+uint64_t response_cache::changed_at(uint64_t key) const {
+  for (size_t i = spread(key);; ++i) {
+    const change &c = m_changes[i & m_change_mask];
+    const uint64_t k = __atomic_load_n(&c.key, __ATOMIC_ACQUIRE);
+    if (k == key) {
+      return __atomic_load_n(&c.epoch, __ATOMIC_RELAXED);
+    } else if (k == 0) {
+      return 0;
+    }
+  }
+}
+
+void response_cache::mark_changed(uint64_t key, uint64_t at) {
+  // the table is kept at most half full, so the probes stay short.
+  if (__atomic_load_n(&m_header->changed_keys, __ATOMIC_RELAXED) >=
+      (m_change_mask + 1) / 2) {
+    flush_all();
+  }
+
+  for (size_t i = spread(key);; ++i) {
+    change &c = m_changes[i & m_change_mask];
+    const uint64_t k = __atomic_load_n(&c.key, __ATOMIC_RELAXED);
+    if (k == key) {
+      __atomic_store_n(&c.epoch, at, __ATOMIC_RELEASE);
+      return;
+    } else if (k == 0) {
+      // the epoch has to be there before anyone can find the key.
+      __atomic_store_n(&c.epoch, at, __ATOMIC_RELAXED);
+      __atomic_store_n(&c.key, key, __ATOMIC_RELEASE);
+      __atomic_fetch_add(&m_header->changed_keys, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+}
+
+void response_cache::flush_all() {
+  // the floor goes up before the table is cleared, so that anyone looking
+  // through the table while it is sees the new floor afterwards.
+  const uint64_t at =
+      __atomic_add_fetch(&m_header->epoch, 1, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&m_header->floor, at, __ATOMIC_RELEASE);
+  for (size_t i = 0; i <= m_change_mask; ++i) {
+    __atomic_store_n(&m_changes[i].key, uint64_t(0), __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&m_header->changed_keys, uint64_t(0), __ATOMIC_RELEASE);
+}
+
+bool response_cache::lock_feed() {
+  const int64_t now = int64_t(time(NULL));
+
+  int64_t since = 0;
+  if (__atomic_compare_exchange_n(&m_header->feed_locked_at, &since, now,
+                                  false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return true;
+  }
+  // a process which died while reading would otherwise hold it forever.
+  return (now - since >= FEED_LOCK_TIMEOUT) &&
+         __atomic_compare_exchange_n(&m_header->feed_locked_at, &since, now,
+                                     false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED);
+}
+
+void response_cache::unlock_feed() {
+  __atomic_store_n(&m_header->feed_locked_at, int64_t(0), __ATOMIC_RELEASE);
+}
@@ -44,6 +44,25 @@ match_osm_id::match_type match_osm_id::match(part_iterator &begin,
   throw error();
 }
 
+match_tile_id::match_tile_id() {}
+
+match_tile_id::match_type match_tile_id::match(part_iterator &begin,
+                                               const part_iterator &end) const {
+  if (begin != end) {
+    try {
+      std::string bit = *begin;
+      int64_t x = boost::lexical_cast<int64_t>(bit);
+      if (x >= 0) {
+        ++begin;
+        return match_type(x);
+      }
+    } catch (std::exception &e) {
+      throw error();
+    }
+  }
+  throw error();
+}
+
 match_name::match_name() {}
 
 match_name::match_type match_name::match(part_iterator &begin,
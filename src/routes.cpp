@@ -139,6 +139,7 @@ routes::routes()
 {
   using match::root_;
   using match::osm_id_;
+  using match::tile_id_;
 
   {
     using namespace api06;
@@ -165,7 +166,7 @@ routes::routes()
   {
     using namespace api07;
     r_experimental->add<map_handler>(root_ / "map");
-    r_experimental->add<map_handler>(root_ / "map" / "tile" / osm_id_);
+    r_experimental->add<map_handler>(root_ / "map" / "tile" / tile_id_);
   }
 #endif /* ENABLE_API07 */
 }
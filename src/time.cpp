@@ -3,6 +3,7 @@
 #include <stdexcept>
 #include <sstream>
 #include <ctype.h>
+#include <stdio.h>
 
 namespace bpt = boost::posix_time;
 namespace bdt = boost::date_time;
@@ -27,3 +28,32 @@ bpt::ptime parse_time(const std::string &s) {
   ostr << "Unable to parse string '" << s << "' as an ISO 8601 format date time.";
   throw std::runtime_error(ostr.str());
 }
+
+std::string format_time(int64_t t) {
+  // split into days and seconds within the day, rounding towards negative
+  // infinity so that times before the epoch work too.
+  int64_t days = t / 86400;
+  int64_t secs = t % 86400;
+  if (secs < 0) {
+    secs += 86400;
+    days -= 1;
+  }
+
+  // convert days since the epoch to a proleptic gregorian calendar date,
+  // working in 400 year eras starting on 0000-03-01.
+  const int64_t z = days + 719468;
+  const int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+  const int64_t doe = z - era * 146097;
+  const int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  const int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  const int64_t mp = (5 * doy + 2) / 153;
+  const int64_t day = doy - (153 * mp + 2) / 5 + 1;
+  const int64_t month = mp < 10 ? mp + 3 : mp - 9;
+  const int64_t year = yoe + era * 400 + (month <= 2 ? 1 : 0);
+
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%04d-%02d-%02dT%02d:%02d:%02dZ", int(year),
+           int(month), int(day), int(secs / 3600), int((secs / 60) % 60),
+           int(secs % 60));
+  return std::string(buf);
+}
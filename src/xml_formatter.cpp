@@ -30,7 +30,8 @@ const std::string &element_type_name(element_type elt) {
 
 } // anonymous namespace
 
-xml_formatter::xml_formatter(xml_writer *w) : writer(w) {}
+xml_formatter::xml_formatter(xml_writer *w, bool include_metadata_)
+    : writer(w), include_metadata(include_metadata_) {}
 
 xml_formatter::~xml_formatter() {}
 
@@ -92,9 +93,11 @@ void xml_formatter::write_common(const element_info &elem) {
   writer->attribute("id", elem.id);
   writer->attribute("visible", elem.visible);
   writer->attribute("version", elem.version);
-  writer->attribute("changeset", elem.changeset);
+  if (include_metadata) {
+    writer->attribute("changeset", elem.changeset);
+  }
   writer->attribute("timestamp", elem.timestamp);
-  if (elem.display_name && elem.uid) {
+  if (include_metadata && elem.display_name && elem.uid) {
     writer->attribute("user", elem.display_name.get());
     writer->attribute("uid", elem.uid.get());
   }
@@ -0,0 +1,174 @@
+#include "cgimap/backend/apidb/apidb.hpp"
+#include "cgimap/backend.hpp"
+#include "bench_helpers.hpp"
+#include "test_database.hpp"
+#include "test_formatter.hpp"
+
+#include <boost/format.hpp>
+#include <iostream>
+#include <vector>
+
+/* compares the time taken to extract a large set of nodes and ways, with
+ * their tags and way nodes, from a read-only selection using the default
+ * prepared statements, using binary COPY and fetching the ways on helper
+ * connections. for each it prints the best latency of the whole extract
+ * and the rate at which it read rows from the database. this needs a
+ * database server set up the same way as for the apidb backend tests.
+ */
+namespace {
+
+const osm_nwr_id_t FIRST_ID = 1000000;
+const int NODES_PER_WAY = 10;
+const int TAGS_PER_ELEMENT = 2;
+const int REPEATS = 3;
+
+// the ways in which the extract is run, as options to the backend.
+struct strategy {
+  const char *name, *option, *value;
+};
+const strategy STRATEGIES[] = {
+  { "prepared", NULL, NULL },
+  { "binary COPY", "--copy-extract", NULL },
+  { "1 helper", "--extract-connections", "1" },
+  { "2 helpers", "--extract-connections", "2" },
+  { "4 helpers", "--extract-connections", "4" },
+};
+
+// fill the database with num_nodes nodes, each with a couple of tags, and
+// ways of NODES_PER_WAY consecutive nodes, also tagged. the number of tags
+// has to match TAGS_PER_ELEMENT.
+void fill_bench_data(const std::string &db_name, size_t num_nodes) {
+  const size_t num_ways = num_nodes / NODES_PER_WAY;
+  std::vector<std::string> statements;
+
+  // clang-format off
+  statements.push_back((boost::format(
+    "INSERT INTO current_nodes "
+      "(id, latitude, longitude, changeset_id, visible, \"timestamp\", "
+      "tile, version) "
+    "SELECT i, (i %% 1000) * 100, (i / 1000) * 100, 1, true, "
+      "'2013-11-14T02:10:00Z', 0, 1 "
+    "FROM generate_series(%1%, %2%) AS i")
+    % FIRST_ID % (FIRST_ID + num_nodes - 1)).str());
+  statements.push_back((boost::format(
+    "INSERT INTO current_node_tags (node_id, k, v) "
+    "SELECT i, k, 'value ' || i "
+    "FROM generate_series(%1%, %2%) AS i, "
+      "(VALUES ('name'), ('amenity')) AS t(k)")
+    % FIRST_ID % (FIRST_ID + num_nodes - 1)).str());
+  statements.push_back((boost::format(
+    "INSERT INTO current_ways "
+      "(id, changeset_id, \"timestamp\", visible, version) "
+    "SELECT i, 1, '2013-11-14T02:10:00Z', true, 1 "
+    "FROM generate_series(%1%, %2%) AS i")
+    % FIRST_ID % (FIRST_ID + num_ways - 1)).str());
+  statements.push_back((boost::format(
+    "INSERT INTO current_way_nodes (way_id, node_id, sequence_id) "
+    "SELECT %1% + i / %2%, %1% + i, i %% %2% + 1 "
+    "FROM generate_series(0, %3%) AS i")
+    % FIRST_ID % NODES_PER_WAY % (num_ways * NODES_PER_WAY - 1)).str());
+  statements.push_back((boost::format(
+    "INSERT INTO current_way_tags (way_id, k, v) "
+    "SELECT i, k, 'value ' || i "
+    "FROM generate_series(%1%, %2%) AS i, "
+      "(VALUES ('highway'), ('name')) AS t(k)")
+    % FIRST_ID % (FIRST_ID + num_ways - 1)).str());
+  // clang-format on
+
+  load_bench_data(db_name, statements);
+}
+
+boost::shared_ptr<data_selection::factory>
+make_factory(const std::string &db_name, const strategy &s) {
+  std::vector<const char *> options;
+  options.push_back("--readonly");
+  if (s.option != NULL) {
+    options.push_back(s.option);
+  }
+  if (s.value != NULL) {
+    options.push_back(s.value);
+  }
+  return make_bench_factory(*make_apidb_backend(), db_name, options);
+}
+
+// select the nodes, the ways using them and the ways' nodes, as the map
+// call would, and write them all out. returns the best time in ms, and the
+// number of nodes written in num_nodes.
+double time_extract(data_selection::factory &factory,
+                    const std::vector<osm_nwr_id_t> &ids, size_t &num_nodes) {
+  return time_ms(REPEATS, [&]() {
+    boost::shared_ptr<data_selection> sel = factory.make_selection();
+    test_formatter f;
+    sel->select_nodes(ids);
+    sel->select_ways_from_nodes();
+    sel->select_nodes_from_way_nodes();
+    sel->write_nodes(f);
+    sel->write_ways(f);
+    num_nodes = f.m_nodes.size();
+  });
+}
+
+// the number of rows which extracting num_nodes nodes reads: the nodes and
+// their tags, and the ways using them with their way nodes and tags.
+size_t rows_read(size_t num_nodes) {
+  const size_t num_ways = num_nodes / NODES_PER_WAY;
+  return num_nodes * (1 + TAGS_PER_ELEMENT) +
+         num_ways * (1 + NODES_PER_WAY + TAGS_PER_ELEMENT);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  const size_t sizes[] = { 10000, 100000, 500000 };
+  const size_t num_strategies = sizeof(STRATEGIES) / sizeof(STRATEGIES[0]);
+
+  try {
+    std::cout << boost::format("%10s %10s %-12s %14s %14s\n") % "nodes" %
+                     "rows" % "strategy" % "latency (ms)" % "rows/s";
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+      // a fresh database for each size, so that the data doesn't overlap.
+      test_database tdb;
+      tdb.setup();
+      fill_bench_data(tdb.db_name(), sizes[i]);
+
+      std::vector<osm_nwr_id_t> ids;
+      ids.reserve(sizes[i]);
+      for (osm_nwr_id_t id = FIRST_ID; id < FIRST_ID + sizes[i]; ++id) {
+        ids.push_back(id);
+      }
+      const size_t rows = rows_read(sizes[i]);
+
+      size_t first_count = 0;
+      for (size_t j = 0; j < num_strategies; ++j) {
+        boost::shared_ptr<data_selection::factory> factory =
+            make_factory(tdb.db_name(), STRATEGIES[j]);
+
+        size_t count = 0;
+        const double ms = time_extract(*factory, ids, count);
+        if (j == 0) {
+          first_count = count;
+        } else if (count != first_count) {
+          std::cerr << "Mismatch in number of nodes written: " << first_count
+                    << " with " << STRATEGIES[0].name << ", " << count
+                    << " with " << STRATEGIES[j].name << std::endl;
+          return 1;
+        }
+
+        std::cout << boost::format("%10d %10d %-12s %14.1f %14.0f\n") %
+                         sizes[i] % rows % STRATEGIES[j].name % ms %
+                         (rows / (ms / 1000.0));
+      }
+    }
+
+  } catch (const test_database::setup_error &e) {
+    std::cerr << "Unable to set up test database: " << e.what() << std::endl;
+    return 1;
+
+  } catch (const std::exception &e) {
+    std::cerr << "EXCEPTION: " << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
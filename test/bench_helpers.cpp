@@ -0,0 +1,37 @@
+#include "bench_helpers.hpp"
+
+#include <boost/format.hpp>
+#include <boost/program_options.hpp>
+#include <pqxx/pqxx>
+
+namespace po = boost::program_options;
+
+void load_bench_data(const std::string &db_name,
+                     const std::vector<std::string> &statements) {
+  pqxx::connection conn((boost::format("dbname=%1%") % db_name).str());
+  pqxx::work w(conn);
+
+  for (std::vector<std::string>::const_iterator itr = statements.begin();
+       itr != statements.end(); ++itr) {
+    w.exec(*itr);
+  }
+
+  w.exec("ANALYZE");
+  w.commit();
+}
+
+boost::shared_ptr<data_selection::factory>
+make_bench_factory(backend &b, const std::string &db_name,
+                   const std::vector<const char *> &options) {
+  po::options_description desc = b.options();
+  std::vector<const char *> argv;
+  argv.push_back("");
+  argv.push_back("--dbname");
+  argv.push_back(db_name.c_str());
+  argv.insert(argv.end(), options.begin(), options.end());
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(int(argv.size()), &argv[0], desc), vm);
+  vm.notify();
+  return b.create(vm);
+}
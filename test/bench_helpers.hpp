@@ -0,0 +1,47 @@
+#ifndef TEST_BENCH_HELPERS_HPP
+#define TEST_BENCH_HELPERS_HPP
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include "cgimap/backend.hpp"
+#include "cgimap/data_selection.hpp"
+
+/* the plumbing shared by the microbenchmarks: timing the code being
+ * compared and, for those which run against a test database, filling it
+ * and making data selection factories which use it.
+ */
+
+// run f the given number of times, returning the best time in ms.
+template <typename F>
+double time_ms(int repeats, F f) {
+  double best = 0.0;
+  for (int i = 0; i < repeats; ++i) {
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    if ((i == 0) || (elapsed.count() < best)) {
+      best = elapsed.count();
+    }
+  }
+  return best;
+}
+
+// run the statements filling the database in a single transaction, then
+// analyze it so that the planner knows how big the tables have become.
+void load_bench_data(const std::string &db_name,
+                     const std::vector<std::string> &statements);
+
+// a factory for data selections from the backend using the database, with
+// any other options given as they would be on the command line.
+boost::shared_ptr<data_selection::factory>
+make_bench_factory(backend &b, const std::string &db_name,
+                   const std::vector<const char *> &options =
+                       std::vector<const char *>());
+
+#endif /* TEST_BENCH_HELPERS_HPP */
@@ -0,0 +1,90 @@
+#include "cgimap/backend/apidb/id_set.hpp"
+#include "cgimap/types.hpp"
+#include "bench_helpers.hpp"
+
+#include <boost/format.hpp>
+#include <iostream>
+#include <random>
+#include <set>
+#include <vector>
+
+/* compares filling a std::set one ID at a time, as insert_results used to,
+ * with batch inserts into an id_set. each batch stands in for the result of
+ * one of the select queries in a map call (nodes in the bbox, nodes of ways,
+ * etc...), and the batches overlap each other as those queries do.
+ */
+namespace {
+
+typedef std::vector<std::vector<osm_nwr_id_t> > batches_t;
+
+const size_t NUM_BATCHES = 4;
+const int REPEATS = 5;
+
+batches_t make_batches(size_t num_ids) {
+  std::mt19937_64 rng(num_ids);
+  // a range a bit larger than the number of IDs, so there are repeats.
+  std::uniform_int_distribution<osm_nwr_id_t> dist(1, num_ids + num_ids / 4);
+
+  batches_t batches(NUM_BATCHES);
+  for (size_t i = 0; i < num_ids; ++i) {
+    batches[i % NUM_BATCHES].push_back(dist(rng));
+  }
+  return batches;
+}
+
+size_t fill_std_set(const batches_t &batches) {
+  std::set<osm_nwr_id_t> ids;
+  size_t num_inserted = 0;
+  for (batches_t::const_iterator b = batches.begin(); b != batches.end();
+       ++b) {
+    for (std::vector<osm_nwr_id_t>::const_iterator itr = b->begin();
+         itr != b->end(); ++itr) {
+      if (ids.insert(*itr).second) {
+        ++num_inserted;
+      }
+    }
+  }
+  return num_inserted;
+}
+
+size_t fill_id_set(const batches_t &batches) {
+  id_set<osm_nwr_id_t> ids;
+  size_t num_inserted = 0;
+  for (batches_t::const_iterator b = batches.begin(); b != batches.end();
+       ++b) {
+    // the batch is copied, as the result rows would be.
+    std::vector<osm_nwr_id_t> batch(*b);
+    num_inserted += ids.insert_batch(batch);
+  }
+  return num_inserted;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  const size_t sizes[] = { 1000, 50000, 500000 };
+
+  std::cout << boost::format("%10s %14s %14s %8s\n") % "ids" %
+                   "std::set (ms)" % "id_set (ms)" % "speedup";
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    const batches_t batches = make_batches(sizes[i]);
+
+    size_t set_count = 0, id_set_count = 0;
+    const double set_ms =
+        time_ms(REPEATS, [&]() { set_count = fill_std_set(batches); });
+    const double id_set_ms =
+        time_ms(REPEATS, [&]() { id_set_count = fill_id_set(batches); });
+
+    if (set_count != id_set_count) {
+      std::cerr << "Mismatch in number of IDs inserted: " << set_count
+                << " != " << id_set_count << std::endl;
+      return 1;
+    }
+
+    std::cout << boost::format("%10d %14.3f %14.3f %7.1fx\n") % sizes[i] %
+                     set_ms % id_set_ms % (set_ms / id_set_ms);
+  }
+
+  return 0;
+}
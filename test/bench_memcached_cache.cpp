@@ -0,0 +1,140 @@
+#include "cgimap/cache.hpp"
+#include "cgimap/backend/apidb/changeset.hpp"
+#include "cgimap/backend/apidb/memcached_changeset_cache.hpp"
+
+#include <boost/bind.hpp>
+#include <boost/format.hpp>
+#include <boost/ref.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <ctime>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+/* simulates a rolling restart of a number of cgimap hosts, each coming
+ * back with an empty changeset cache, and counts the changesets each one
+ * has to fetch from the "database" while it warms up, with and without the
+ * memcached tier between the hosts and the database. changesets are looked
+ * up in batches, as a selection does when it prefetches them, drawn from a
+ * zipf distribution. needs a memcached server, given as the only argument
+ * (default localhost:11211), unless it is built as bench_memcached_standin,
+ * which links in an in-process stand-in for the server instead.
+ */
+namespace {
+
+const int NUM_HOSTS = 8;
+const size_t NUM_CHANGESETS = 200000;
+const size_t REQUESTS_PER_HOST = 2000;
+const size_t CHANGESETS_PER_REQUEST = 50;
+const size_t LOCAL_CACHE_ENTRIES = 10000;
+
+changeset *fetch_from_db(size_t &fetched, osm_changeset_id_t id) {
+  ++fetched;
+  return new changeset(true, (boost::format("user %1%") % (id % 10000)).str(),
+                       osm_user_id_t(id % 10000 + 1));
+}
+
+void fetch_batch_from_db(size_t &fetched,
+                         const std::vector<osm_changeset_id_t> &ids,
+                         cache<osm_changeset_id_t, changeset>::batch_type &out) {
+  for (size_t i = 0; i < ids.size(); ++i) {
+    out.push_back(std::make_pair(
+        ids[i],
+        boost::shared_ptr<changeset const>(fetch_from_db(fetched, ids[i]))));
+  }
+}
+
+changeset *fetch_through(memcached_changeset_cache *mc, size_t &fetched,
+                         osm_changeset_id_t id) {
+  if (mc == NULL) {
+    return fetch_from_db(fetched, id);
+  }
+  return mc->get_or_fetch(id,
+                          boost::bind(fetch_from_db, boost::ref(fetched), _1));
+}
+
+void fetch_batch_through(memcached_changeset_cache *mc, size_t &fetched,
+                         const std::vector<osm_changeset_id_t> &ids,
+                         cache<osm_changeset_id_t, changeset>::batch_type &out) {
+  if (mc == NULL) {
+    fetch_batch_from_db(fetched, ids, out);
+  } else {
+    mc->get_or_fetch(
+        ids, out, boost::bind(fetch_batch_from_db, boost::ref(fetched), _1,
+                              _2));
+  }
+}
+
+// restart each host in turn, returning the changesets fetched from the
+// database by each of them.
+std::vector<size_t> rolling_restart(const std::string &servers,
+                                    const std::string &prefix,
+                                    bool use_memcache) {
+  std::vector<double> weights(NUM_CHANGESETS);
+  for (size_t i = 0; i < NUM_CHANGESETS; ++i) {
+    weights[i] = 1.0 / double(i + 1);
+  }
+  std::discrete_distribution<size_t> zipf(weights.begin(), weights.end());
+
+  std::vector<size_t> fetched(NUM_HOSTS, 0);
+  for (int host = 0; host < NUM_HOSTS; ++host) {
+    std::mt19937_64 rng(host);
+    boost::scoped_ptr<memcached_changeset_cache> mc;
+    if (use_memcache) {
+      mc.reset(new memcached_changeset_cache(servers, prefix, 3600));
+    }
+    cache<osm_changeset_id_t, changeset> cc(
+        boost::bind(fetch_through, mc.get(), boost::ref(fetched[host]), _1),
+        changeset_cache_bytes(0, LOCAL_CACHE_ENTRIES),
+        boost::bind(fetch_batch_through, mc.get(), boost::ref(fetched[host]),
+                    _1, _2));
+
+    std::vector<osm_changeset_id_t> ids(CHANGESETS_PER_REQUEST);
+    for (size_t r = 0; r < REQUESTS_PER_HOST; ++r) {
+      for (size_t i = 0; i < CHANGESETS_PER_REQUEST; ++i) {
+        ids[i] = osm_changeset_id_t(zipf(rng) + 1);
+      }
+      cc.prefetch(ids.begin(), ids.end());
+      for (size_t i = 0; i < CHANGESETS_PER_REQUEST; ++i) {
+        cc.get(ids[i]);
+      }
+    }
+  }
+  return fetched;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  const std::string servers = (argc > 1) ? argv[1] : "localhost:11211";
+  // a fresh set of keys for each run.
+  const std::string prefix =
+      (boost::format("bench:%1%:%2%:") % getpid() % time(NULL)).str();
+
+  try {
+    std::vector<size_t> without = rolling_restart(servers, prefix, false);
+    std::vector<size_t> with = rolling_restart(servers, prefix, true);
+
+    std::cout << boost::format("%d hosts, %d lookups each\n") % NUM_HOSTS %
+                     (REQUESTS_PER_HOST * CHANGESETS_PER_REQUEST);
+    std::cout << boost::format("%6s %20s %20s\n") % "host" %
+                     "db fetches (local)" % "db fetches (memcache)";
+    size_t total_without = 0, total_with = 0;
+    for (int host = 0; host < NUM_HOSTS; ++host) {
+      std::cout << boost::format("%6d %20d %20d\n") % host % without[host] %
+                       with[host];
+      total_without += without[host];
+      total_with += with[host];
+    }
+    std::cout << boost::format("%6s %20d %20d\n") % "total" % total_without %
+                     total_with;
+
+  } catch (const std::exception &e) {
+    std::cerr << "EXCEPTION: " << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
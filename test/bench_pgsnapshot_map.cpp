@@ -0,0 +1,190 @@
+#include "cgimap/backend/pgsnapshot/pgsnapshot.hpp"
+#include "cgimap/backend.hpp"
+#include "bench_helpers.hpp"
+#include "test_database.hpp"
+#include "test_formatter.hpp"
+
+#include <boost/format.hpp>
+#include <iostream>
+#include <vector>
+
+/* compares the time taken by a map call against a pgsnapshot database
+ * when the ways have an indexed bbox column, which lets them be found with
+ * the geometry index, and after the column has been dropped, when they're
+ * found by joining through way_nodes. the test database is only used to
+ * get an empty, uniquely named database; the pgsnapshot schema is created
+ * here, and needs the postgis and hstore extensions to be available.
+ */
+namespace {
+
+const int GRID = 1000;
+const int NODES_PER_WAY = 10;
+const int REPEATS = 3;
+const int MAX_NODES = 50000;
+
+// a GRID x GRID grid of nodes 0.0001 degrees apart, with ways of
+// NODES_PER_WAY consecutive nodes along each row of the grid, every one of
+// them tagged.
+void fill_bench_data(const std::string &db_name) {
+  std::vector<std::string> statements;
+
+  // clang-format off
+  statements.push_back("CREATE EXTENSION IF NOT EXISTS hstore");
+  statements.push_back("CREATE EXTENSION IF NOT EXISTS postgis");
+  statements.push_back(
+    "CREATE TABLE users ("
+      "id int NOT NULL PRIMARY KEY, name text NOT NULL)");
+  statements.push_back(
+    "CREATE TABLE nodes ("
+      "id bigint NOT NULL PRIMARY KEY, version int NOT NULL, "
+      "user_id int NOT NULL, tstamp timestamp without time zone NOT NULL, "
+      "changeset_id bigint NOT NULL, tags hstore, "
+      "geom geometry(Point, 4326))");
+  statements.push_back(
+    "CREATE TABLE ways ("
+      "id bigint NOT NULL PRIMARY KEY, version int NOT NULL, "
+      "user_id int NOT NULL, tstamp timestamp without time zone NOT NULL, "
+      "changeset_id bigint NOT NULL, tags hstore, nodes bigint[], "
+      "bbox geometry(Geometry, 4326))");
+  statements.push_back(
+    "CREATE TABLE way_nodes ("
+      "way_id bigint NOT NULL, node_id bigint NOT NULL, "
+      "sequence_id int NOT NULL, PRIMARY KEY (way_id, sequence_id))");
+  statements.push_back(
+    "CREATE TABLE relations ("
+      "id bigint NOT NULL PRIMARY KEY, version int NOT NULL, "
+      "user_id int NOT NULL, tstamp timestamp without time zone NOT NULL, "
+      "changeset_id bigint NOT NULL, tags hstore)");
+  statements.push_back(
+    "CREATE TABLE relation_members ("
+      "relation_id bigint NOT NULL, member_id bigint NOT NULL, "
+      "member_type character(1) NOT NULL, member_role text NOT NULL, "
+      "sequence_id int NOT NULL, PRIMARY KEY (relation_id, sequence_id))");
+
+  statements.push_back("INSERT INTO users VALUES (1, 'bench')");
+  statements.push_back((boost::format(
+    "INSERT INTO nodes "
+    "SELECT i, 1, 1, '2013-11-14T02:10:00Z', 1, "
+      "hstore('name', 'node ' || i), "
+      "ST_SetSRID(ST_Point((i %% %1%) * 0.0001, (i / %1%) * 0.0001), 4326) "
+    "FROM generate_series(0, %2%) AS i")
+    % GRID % (GRID * GRID - 1)).str());
+  statements.push_back((boost::format(
+    "INSERT INTO way_nodes "
+    "SELECT i / %1%, i, i %% %1% FROM generate_series(0, %2%) AS i")
+    % NODES_PER_WAY % (GRID * GRID - 1)).str());
+  statements.push_back(
+    "INSERT INTO ways "
+    "SELECT wn.way_id, 1, 1, '2013-11-14T02:10:00Z', 1, "
+      "hstore('highway', 'residential'), "
+      "array_agg(wn.node_id ORDER BY wn.sequence_id), "
+      "ST_Envelope(ST_Collect(n.geom)) "
+    "FROM way_nodes wn JOIN nodes n ON wn.node_id = n.id "
+    "GROUP BY wn.way_id");
+
+  // the same indexes as the osmosis pgsnapshot scripts create.
+  statements.push_back(
+    "CREATE INDEX idx_nodes_geom ON nodes USING gist (geom)");
+  statements.push_back(
+    "CREATE INDEX idx_ways_bbox ON ways USING gist (bbox)");
+  statements.push_back(
+    "CREATE INDEX idx_way_nodes_node_id "
+    "ON way_nodes USING btree (node_id)");
+  statements.push_back(
+    "CREATE INDEX idx_relation_members_member_id_and_type "
+    "ON relation_members USING btree (member_id, member_type)");
+  // clang-format on
+
+  load_bench_data(db_name, statements);
+}
+
+boost::shared_ptr<data_selection::factory>
+make_factory(const std::string &db_name) {
+  return make_bench_factory(*make_pgsnapshot_backend(), db_name);
+}
+
+// run a map call on the bounds, as the api06 map handler would, and write
+// everything out. returns the best time in ms, and the number of nodes
+// written in num_nodes, which includes the nodes of the ways found.
+double time_map(data_selection::factory &factory, const bbox &bounds,
+                size_t &num_nodes) {
+  return time_ms(REPEATS, [&]() {
+    boost::shared_ptr<data_selection> sel = factory.make_selection();
+    test_formatter f;
+    sel->select_nodes_from_bbox(bounds, MAX_NODES);
+    data_selection::selection_plan plan;
+    plan.push_back(data_selection::plan_ways_from_nodes);
+    plan.push_back(data_selection::plan_nodes_from_way_nodes);
+    plan.push_back(data_selection::plan_relations_from_ways);
+    plan.push_back(data_selection::plan_relations_from_nodes);
+    plan.push_back(data_selection::plan_relations_from_relations);
+    sel->select_plan(plan);
+    sel->write_nodes(f);
+    sel->write_ways(f);
+    sel->write_relations(f);
+    num_nodes = f.m_nodes.size();
+  });
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  // square bboxes, in degrees, holding about 100, 10000 and 40000 nodes.
+  const double sizes[] = { 0.001, 0.01, 0.02 };
+  const size_t num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+
+  try {
+    test_database tdb;
+    fill_bench_data(tdb.db_name());
+
+    // the factory detects the bbox column when it's created, so time all
+    // the bboxes with it there, then drop it and time them again.
+    std::vector<double> index_ms(num_sizes), join_ms(num_sizes);
+    std::vector<size_t> index_nodes(num_sizes), join_nodes(num_sizes);
+    {
+      boost::shared_ptr<data_selection::factory> factory =
+          make_factory(tdb.db_name());
+      for (size_t i = 0; i < num_sizes; ++i) {
+        index_ms[i] = time_map(*factory, bbox(0.0, 0.0, sizes[i], sizes[i]),
+                               index_nodes[i]);
+      }
+    }
+    {
+      pqxx::connection conn(
+          (boost::format("dbname=%1%") % tdb.db_name()).str());
+      pqxx::work w(conn);
+      w.exec("ALTER TABLE ways DROP COLUMN bbox");
+      w.commit();
+    }
+    {
+      boost::shared_ptr<data_selection::factory> factory =
+          make_factory(tdb.db_name());
+      for (size_t i = 0; i < num_sizes; ++i) {
+        join_ms[i] = time_map(*factory, bbox(0.0, 0.0, sizes[i], sizes[i]),
+                              join_nodes[i]);
+      }
+    }
+
+    std::cout << boost::format("%10s %10s %16s %16s\n") % "bbox" % "nodes" %
+                     "bbox index (ms)" % "way_nodes (ms)";
+    for (size_t i = 0; i < num_sizes; ++i) {
+      if (index_nodes[i] != join_nodes[i]) {
+        std::cerr << "Mismatch in number of nodes written: " << index_nodes[i]
+                  << " != " << join_nodes[i] << std::endl;
+        return 1;
+      }
+      std::cout << boost::format("%10.3f %10d %16.1f %16.1f\n") % sizes[i] %
+                       index_nodes[i] % index_ms[i] % join_ms[i];
+    }
+
+  } catch (const test_database::setup_error &e) {
+    std::cerr << "Unable to set up test database: " << e.what() << std::endl;
+    return 1;
+
+  } catch (const std::exception &e) {
+    std::cerr << "EXCEPTION: " << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,232 @@
+#include "cgimap/data_selection.hpp"
+#include "cgimap/types.hpp"
+#include "bench_helpers.hpp"
+
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/* compares decoding the text form of Postgres arrays with the old
+ * psql_array_to_vector, which built a std::vector of std::strings through an
+ * ostringstream and then went through lexical_cast for the integer arrays,
+ * against psql_array_reader. the arrays are shaped like the ones the
+ * writeable selection reads back for each element: pairs of tag key and
+ * value arrays, some of which need quoting, and arrays of way node IDs.
+ */
+namespace {
+
+const size_t NUM_ELEMENTS = 100000;
+const int REPEATS = 5;
+
+// a copy of psql_array_to_vector as it was before psql_array_reader, kept
+// here as the baseline.
+std::vector<std::string> old_psql_array_to_vector(std::string str) {
+  std::vector<std::string> strs;
+  std::ostringstream value;
+  bool quotedValue = false, escaped = false, write = false;
+
+  if (str == "{NULL}" || str == "")
+    return strs;
+
+  for (int i=1; i<str.size(); i++) {
+    if (str[i]==',') {
+      if (quotedValue) {
+        value<<",";
+      } else {
+        write = true;
+      }
+    } else if (str[i]=='\"') {
+      if (escaped) {
+        value << "\"";
+        escaped = false;
+      } else if (quotedValue) {
+        quotedValue=false;
+      } else {
+        quotedValue = true;
+      }
+    } else if (str[i]=='\\'){
+      if (escaped) {
+        value << "\\";
+        escaped = false;
+      } else {
+        escaped = true;
+      }
+    } else if (str[i]=='}') {
+      if(quotedValue){
+        value << "}";
+      } else {
+        write = true;
+      }
+    } else {
+      value<<str[i];
+    }
+
+    if (write) {
+      strs.push_back(value.str());
+      value.str("");
+      value.clear();
+      write=false;
+    }
+  }
+  return strs;
+}
+
+struct tag_arrays {
+  std::string keys, values;
+};
+
+// tags as they'd come back from array_agg(k) and array_agg(v): most are
+// bare words, but names with spaces or commas get quoted, and the odd one
+// has an escaped quote in it.
+std::vector<tag_arrays> make_tag_arrays(std::mt19937_64 &rng) {
+  static const char *keys[] = { "highway", "name", "surface", "oneway",
+                                "maxspeed", "ref", "lanes", "addr:street" };
+  static const char *values[] = { "residential", "\"Acacia Avenue\"",
+                                  "asphalt", "yes", "30", "\"A 1, B 2\"",
+                                  "2", "\"The \\\"Old\\\" Road\"" };
+  std::uniform_int_distribution<size_t> num_tags(1, 8);
+  std::uniform_int_distribution<size_t> pick(0, 7);
+
+  std::vector<tag_arrays> arrays(NUM_ELEMENTS);
+  for (size_t i = 0; i < NUM_ELEMENTS; ++i) {
+    const size_t n = num_tags(rng);
+    arrays[i].keys = "{";
+    arrays[i].values = "{";
+    for (size_t j = 0; j < n; ++j) {
+      if (j > 0) {
+        arrays[i].keys += ",";
+        arrays[i].values += ",";
+      }
+      arrays[i].keys += keys[(i + j) % 8];
+      arrays[i].values += values[pick(rng)];
+    }
+    arrays[i].keys += "}";
+    arrays[i].values += "}";
+  }
+  return arrays;
+}
+
+// way node arrays, as from array_agg(node_id ORDER BY sequence_id), with
+// IDs in the billions as current nodes are.
+std::vector<std::string> make_way_node_arrays(std::mt19937_64 &rng) {
+  std::uniform_int_distribution<size_t> num_nodes(2, 40);
+  std::uniform_int_distribution<osm_nwr_id_t> node_id(1, 5000000000ull);
+
+  std::vector<std::string> arrays(NUM_ELEMENTS);
+  for (size_t i = 0; i < NUM_ELEMENTS; ++i) {
+    const size_t n = num_nodes(rng);
+    std::string &arr = arrays[i];
+    arr = "{";
+    for (size_t j = 0; j < n; ++j) {
+      if (j > 0) {
+        arr += ",";
+      }
+      arr += boost::lexical_cast<std::string>(node_id(rng));
+    }
+    arr += "}";
+  }
+  return arrays;
+}
+
+// each of the decoders builds the tags_t and nodes_t that the formatter
+// would be handed, and returns a count so that the work can't be skipped.
+size_t old_tags(const std::vector<tag_arrays> &arrays) {
+  size_t count = 0;
+  for (size_t i = 0; i < arrays.size(); ++i) {
+    const std::vector<std::string> keys =
+        old_psql_array_to_vector(arrays[i].keys);
+    const std::vector<std::string> values =
+        old_psql_array_to_vector(arrays[i].values);
+    tags_t tags;
+    for (size_t j = 0; j < keys.size(); ++j) {
+      tags.push_back(std::make_pair(keys[j], values[j]));
+    }
+    count += tags.size();
+  }
+  return count;
+}
+
+size_t reader_tags(const std::vector<tag_arrays> &arrays) {
+  size_t count = 0;
+  for (size_t i = 0; i < arrays.size(); ++i) {
+    psql_array_reader keys(arrays[i].keys.data(), arrays[i].keys.size());
+    psql_array_reader values(arrays[i].values.data(),
+                             arrays[i].values.size());
+    tags_t tags;
+    while (keys.next() && values.next()) {
+      tags.push_back(std::make_pair(keys.str(), values.str()));
+    }
+    count += tags.size();
+  }
+  return count;
+}
+
+size_t old_way_nodes(const std::vector<std::string> &arrays) {
+  size_t count = 0;
+  for (size_t i = 0; i < arrays.size(); ++i) {
+    const std::vector<std::string> ids = old_psql_array_to_vector(arrays[i]);
+    nodes_t nodes;
+    for (size_t j = 0; j < ids.size(); ++j) {
+      nodes.push_back(boost::lexical_cast<osm_nwr_id_t>(ids[j]));
+    }
+    count += nodes.size();
+  }
+  return count;
+}
+
+size_t reader_way_nodes(const std::vector<std::string> &arrays) {
+  size_t count = 0;
+  for (size_t i = 0; i < arrays.size(); ++i) {
+    psql_array_reader ids(arrays[i].data(), arrays[i].size());
+    nodes_t nodes;
+    while (ids.next()) {
+      nodes.push_back(osm_nwr_id_t(ids.as_int64()));
+    }
+    count += nodes.size();
+  }
+  return count;
+}
+
+bool report(const char *name, double old_ms, double reader_ms,
+            size_t old_count, size_t reader_count) {
+  if (old_count != reader_count) {
+    std::cerr << "Mismatch in number of " << name << " decoded: " << old_count
+              << " != " << reader_count << std::endl;
+    return false;
+  }
+  std::cout << boost::format("%10s %14.3f %14.3f %7.1fx\n") % name % old_ms %
+                   reader_ms % (old_ms / reader_ms);
+  return true;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  std::mt19937_64 rng(NUM_ELEMENTS);
+  const std::vector<tag_arrays> tags = make_tag_arrays(rng);
+  const std::vector<std::string> way_nodes = make_way_node_arrays(rng);
+
+  std::cout << boost::format("%10s %14s %14s %8s\n") % "arrays" %
+                   "old (ms)" % "reader (ms)" % "speedup";
+
+  size_t old_count = 0, reader_count = 0;
+  double old_ms = time_ms(REPEATS, [&]() { old_count = old_tags(tags); });
+  double reader_ms =
+      time_ms(REPEATS, [&]() { reader_count = reader_tags(tags); });
+  if (!report("tags", old_ms, reader_ms, old_count, reader_count)) {
+    return 1;
+  }
+
+  old_ms = time_ms(REPEATS, [&]() { old_count = old_way_nodes(way_nodes); });
+  reader_ms = time_ms(REPEATS,
+                      [&]() { reader_count = reader_way_nodes(way_nodes); });
+  if (!report("way nodes", old_ms, reader_ms, old_count, reader_count)) {
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,153 @@
+#include "cgimap/cache.hpp"
+#include "cgimap/backend/apidb/changeset.hpp"
+#include "cgimap/backend/apidb/shared_changeset_cache.hpp"
+
+#include <boost/bind.hpp>
+#include <boost/format.hpp>
+#include <boost/ref.hpp>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* compares the changeset cache hit rate and memory use of a number of
+ * forked instances each with their own cache<>, as cgimap has always run,
+ * with the same instances sharing a shared_changeset_cache underneath a
+ * small per-process cache<>. each instance looks up changesets drawn from a
+ * zipf distribution, as a few active changesets account for much of what
+ * gets looked at, and the "database" just counts the fetches made.
+ */
+namespace {
+
+const int NUM_INSTANCES = 5;
+const size_t NUM_CHANGESETS = 200000;
+const size_t LOOKUPS_PER_INSTANCE = 200000;
+const size_t SHARED_L1_SIZE = 100;
+
+// counts of fetches made by the children, in memory shared with the parent.
+struct counters {
+  uint64_t fetches;
+  uint64_t heap_bytes;
+};
+
+changeset *fetch_from_db(counters &c, osm_changeset_id_t id) {
+  __atomic_fetch_add(&c.fetches, 1, __ATOMIC_RELAXED);
+  return new changeset(true, (boost::format("user %1%") % (id % 10000)).str(),
+                       osm_user_id_t(id % 10000 + 1));
+}
+
+changeset *fetch_through_shared(shared_changeset_cache &shared, counters &c,
+                                osm_changeset_id_t id) {
+  return shared.get_or_fetch(id,
+                             boost::bind(fetch_from_db, boost::ref(c), _1));
+}
+
+size_t heap_in_use() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  return mallinfo2().uordblks;
+#else
+  return size_t(mallinfo().uordblks);
+#endif
+}
+
+// look up changesets as one instance would, through the given fetch
+// function, and record how much heap the cache ended up holding.
+void run_instance(int instance, size_t cache_size,
+                  const boost::function<changeset *(osm_changeset_id_t)> &f,
+                  counters &c) {
+  std::mt19937_64 rng(instance);
+  std::vector<double> weights(NUM_CHANGESETS);
+  for (size_t i = 0; i < NUM_CHANGESETS; ++i) {
+    weights[i] = 1.0 / double(i + 1);
+  }
+  std::discrete_distribution<size_t> zipf(weights.begin(), weights.end());
+
+  const size_t heap_before = heap_in_use();
+  cache<osm_changeset_id_t, changeset> cc(f,
+                                          changeset_cache_bytes(0, cache_size));
+  for (size_t i = 0; i < LOOKUPS_PER_INSTANCE; ++i) {
+    cc.get(osm_changeset_id_t(zipf(rng) + 1));
+  }
+  __atomic_fetch_add(&c.heap_bytes, heap_in_use() - heap_before,
+                     __ATOMIC_RELAXED);
+}
+
+// fork the instances, each running with the fetch function, and wait for
+// them all to finish.
+void run_instances(size_t cache_size,
+                   const boost::function<changeset *(osm_changeset_id_t)> &f,
+                   counters &c) {
+  std::vector<pid_t> children;
+  for (int i = 0; i < NUM_INSTANCES; ++i) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      throw std::runtime_error("fork failed.");
+    } else if (pid == 0) {
+      run_instance(i, cache_size, f, c);
+      _exit(0);
+    }
+    children.push_back(pid);
+  }
+  for (size_t i = 0; i < children.size(); ++i) {
+    waitpid(children[i], NULL, 0);
+  }
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  const size_t sizes[] = { 1000, 10000, 50000 };
+  const double lookups = double(NUM_INSTANCES) * LOOKUPS_PER_INSTANCE;
+
+  try {
+    void *mem = mmap(NULL, sizeof(counters), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+      throw std::runtime_error("mmap failed.");
+    }
+    counters &c = *static_cast<counters *>(mem);
+
+    std::cout << boost::format("%d instances, %d lookups each\n") %
+                     NUM_INSTANCES % LOOKUPS_PER_INSTANCE;
+    std::cout << boost::format("%10s %16s %16s %16s %16s\n") % "entries" %
+                     "per-proc hit %" % "per-proc MB" % "shared hit %" %
+                     "shared MB";
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+      c.fetches = c.heap_bytes = 0;
+      run_instances(sizes[i], boost::bind(fetch_from_db, boost::ref(c), _1),
+                    c);
+      const double local_hits = 1.0 - double(c.fetches) / lookups;
+      const double local_mb = double(c.heap_bytes) / (1024.0 * 1024.0);
+
+      // the shared cache is the same number of entries, but only one of
+      // them for all the instances, plus each instance's small cache<>.
+      c.fetches = c.heap_bytes = 0;
+      shared_changeset_cache shared(sizes[i]);
+      run_instances(SHARED_L1_SIZE,
+                    boost::bind(fetch_through_shared, boost::ref(shared),
+                                boost::ref(c), _1),
+                    c);
+      const double shared_hits = 1.0 - double(c.fetches) / lookups;
+      const double shared_mb =
+          double(shared.get_stats().bytes + c.heap_bytes) / (1024.0 * 1024.0);
+
+      std::cout << boost::format("%10d %16.1f %16.2f %16.1f %16.2f\n") %
+                       sizes[i] % (100.0 * local_hits) % local_mb %
+                       (100.0 * shared_hits) % shared_mb;
+    }
+
+    munmap(mem, sizeof(counters));
+
+  } catch (const std::exception &e) {
+    std::cerr << "EXCEPTION: " << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
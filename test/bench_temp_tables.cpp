@@ -0,0 +1,106 @@
+#include "cgimap/backend/apidb/apidb.hpp"
+#include "cgimap/backend.hpp"
+#include "bench_helpers.hpp"
+#include "test_database.hpp"
+#include "test_formatter.hpp"
+
+#include <boost/format.hpp>
+#include <iostream>
+#include <vector>
+
+/* measures the rate at which a writeable selection can serve small
+ * requests, now that the temporary tables are created once per connection,
+ * and compares it to the rate when each request creates them inside its own
+ * transaction, as it used to. this needs a database server set up the same
+ * way as for the apidb backend tests.
+ */
+namespace {
+
+const osm_nwr_id_t FIRST_ID = 1000000;
+const size_t NUM_NODES = 100;
+const int REQUESTS = 2000;
+
+void fill_bench_data(const std::string &db_name) {
+  std::vector<std::string> statements;
+
+  // clang-format off
+  statements.push_back((boost::format(
+    "INSERT INTO current_nodes "
+      "(id, latitude, longitude, changeset_id, visible, \"timestamp\", "
+      "tile, version) "
+    "SELECT i, 0, 0, 1, true, '2013-11-14T02:10:00Z', 0, 1 "
+    "FROM generate_series(%1%, %2%) AS i")
+    % FIRST_ID % (FIRST_ID + NUM_NODES - 1)).str());
+  // clang-format on
+
+  load_bench_data(db_name, statements);
+}
+
+boost::shared_ptr<data_selection::factory>
+make_factory(const std::string &db_name, const char *option) {
+  std::vector<const char *> options;
+  if (option != NULL) {
+    options.push_back(option);
+  }
+  return make_bench_factory(*make_apidb_backend(), db_name, options);
+}
+
+// run REQUESTS small requests, each selecting and writing out the nodes,
+// returning the total time in ms.
+double time_requests(data_selection::factory &factory,
+                     const std::vector<osm_nwr_id_t> &ids) {
+  return time_ms(1, [&]() {
+    for (int i = 0; i < REQUESTS; ++i) {
+      boost::shared_ptr<data_selection> sel = factory.make_selection();
+      test_formatter f;
+      sel->select_nodes(ids);
+      sel->write_nodes(f);
+      if (f.m_nodes.size() != ids.size()) {
+        throw std::runtime_error("Wrong number of nodes written.");
+      }
+    }
+  });
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  try {
+    test_database tdb;
+    tdb.setup();
+    fill_bench_data(tdb.db_name());
+
+    std::vector<osm_nwr_id_t> ids;
+    for (osm_nwr_id_t id = FIRST_ID; id < FIRST_ID + NUM_NODES; ++id) {
+      ids.push_back(id);
+    }
+
+    boost::shared_ptr<data_selection::factory> reused =
+        make_factory(tdb.db_name(), NULL);
+    boost::shared_ptr<data_selection::factory> per_request =
+        make_factory(tdb.db_name(), "--temp-tables-per-request");
+
+    // warm up the connections, prepared statements and changeset caches.
+    time_requests(*reused, ids);
+    time_requests(*per_request, ids);
+
+    const double reused_ms = time_requests(*reused, ids);
+    const double per_request_ms = time_requests(*per_request, ids);
+
+    std::cout << boost::format("%-32s %12.1f\n") % "requests/s, reused tables" %
+                     (REQUESTS * 1000.0 / reused_ms);
+    std::cout << boost::format("%-32s %12.1f\n") %
+                     "requests/s, per-request tables" %
+                     (REQUESTS * 1000.0 / per_request_ms);
+
+  } catch (const test_database::setup_error &e) {
+    std::cerr << "Unable to set up test database: " << e.what() << std::endl;
+    return 1;
+
+  } catch (const std::exception &e) {
+    std::cerr << "EXCEPTION: " << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,200 @@
+#include "cgimap/backend/apidb/quad_tile.hpp"
+#include "bench_helpers.hpp"
+#include "test_database.hpp"
+
+#include <boost/format.hpp>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+/* compares the old way of finding the tiles in a bbox, listing every one of
+ * them, with splitting the bbox into ranges of tiles. the first table is
+ * just the tile computation. the second is the latency of the node query
+ * each is used in, including computing the tiles, and the rate at which it
+ * returns nodes. it's run against a grid of nodes in a test database set
+ * up the same way as for the apidb backend tests.
+ */
+namespace {
+
+const int REPEATS = 5;
+const int MAX_NODES = 50000;
+
+// the nodes are laid out on a grid over this area.
+const double GRID_MINLAT = 51.0, GRID_MINLON = -1.0, GRID_SIZE = 1.0;
+const int GRID_STEPS = 200;
+
+// the bboxes queried are squares with these sides in degrees, centred on
+// the grid.
+const double SIDES[] = { 0.01, 0.05, 0.1, 0.25, 0.5 };
+
+const double SCALE = 10000000.0;
+
+struct bounds {
+  double minlat, minlon, maxlat, maxlon;
+};
+
+bounds centred_square(double side) {
+  const double lat = GRID_MINLAT + GRID_SIZE / 2;
+  const double lon = GRID_MINLON + GRID_SIZE / 2;
+  bounds b;
+  b.minlat = lat - side / 2;
+  b.maxlat = lat + side / 2;
+  b.minlon = lon - side / 2;
+  b.maxlon = lon + side / 2;
+  return b;
+}
+
+template <typename T>
+std::string array_literal(const std::vector<T> &values) {
+  std::ostringstream ostr;
+  ostr << "'{";
+  for (size_t i = 0; i < values.size(); ++i) {
+    ostr << (i > 0 ? "," : "") << values[i];
+  }
+  ostr << "}'::bigint[]";
+  return ostr.str();
+}
+
+void fill_bench_data(const std::string &db_name) {
+  std::ostringstream values;
+  osm_nwr_id_t id = 1000000;
+  for (int i = 0; i < GRID_STEPS; ++i) {
+    for (int j = 0; j < GRID_STEPS; ++j) {
+      const double lat = GRID_MINLAT + i * GRID_SIZE / GRID_STEPS;
+      const double lon = GRID_MINLON + j * GRID_SIZE / GRID_STEPS;
+      const tile_id_t tile = tiles_for_area(lat, lon, lat, lon).front();
+      values << ((id > 1000000) ? "," : "")
+             << boost::format("(%1%, %2%, %3%, 1, true, "
+                              "'2013-11-14T02:10:00Z', %4%, 1)") %
+                    id % int(lat * SCALE) % int(lon * SCALE) % tile;
+      ++id;
+    }
+  }
+
+  std::vector<std::string> statements;
+  statements.push_back(
+      "INSERT INTO current_nodes "
+      "(id, latitude, longitude, changeset_id, visible, \"timestamp\", "
+      "tile, version) VALUES " + values.str());
+  load_bench_data(db_name, statements);
+}
+
+std::string coords(const bounds &b) {
+  return (boost::format("n.latitude BETWEEN %1% AND %2% "
+                        "AND n.longitude BETWEEN %3% AND %4% ") %
+          int(b.minlat * SCALE) % int(b.maxlat * SCALE) %
+          int(b.minlon * SCALE) % int(b.maxlon * SCALE)).str();
+}
+
+// the node query as it used to be, with a list of every tile.
+size_t query_tiles(pqxx::connection &conn, const bounds &b) {
+  const std::vector<tile_id_t> tiles =
+      tiles_for_area(b.minlat, b.minlon, b.maxlat, b.maxlon);
+
+  pqxx::work w(conn);
+  w.exec("set enable_mergejoin=false; set enable_hashjoin=false");
+  pqxx::result res = w.exec(
+      (boost::format("SELECT n.id FROM current_nodes n "
+                     "WHERE n.tile = ANY(%1%) AND %2%"
+                     "AND n.visible = true LIMIT %3%") %
+       array_literal(tiles) % coords(b) % (MAX_NODES + 1)).str());
+  w.abort();
+  return res.size();
+}
+
+// the node query with the bbox split into ranges of tiles.
+size_t query_ranges(pqxx::connection &conn, const bounds &b) {
+  std::vector<tile_id_t> first_tiles, last_tiles;
+  split_tile_ranges(
+      tile_ranges_for_area(b.minlat, b.minlon, b.maxlat, b.maxlon),
+      first_tiles, last_tiles);
+
+  pqxx::work w(conn);
+  pqxx::result res = w.exec(
+      (boost::format("SELECT n.id "
+                     "FROM (SELECT unnest(%1%) AS first_tile, "
+                     "unnest(%2%) AS last_tile) AS t "
+                     "JOIN current_nodes n "
+                     "ON n.tile BETWEEN t.first_tile AND t.last_tile "
+                     "WHERE %3%AND n.visible = true LIMIT %4%") %
+       array_literal(first_tiles) % array_literal(last_tiles) % coords(b) %
+       (MAX_NODES + 1)).str());
+  w.abort();
+  return res.size();
+}
+
+void bench_computation() {
+  std::cout << boost::format("%8s %8s %8s %14s %14s\n") % "side" % "tiles" %
+                   "ranges" % "tiles (ms)" % "ranges (ms)";
+
+  for (size_t i = 0; i < sizeof(SIDES) / sizeof(SIDES[0]); ++i) {
+    const bounds b = centred_square(SIDES[i]);
+    size_t num_tiles = 0, num_ranges = 0;
+
+    const double tiles_ms = time_ms(REPEATS, [&]() {
+      num_tiles =
+          tiles_for_area(b.minlat, b.minlon, b.maxlat, b.maxlon).size();
+    });
+    const double ranges_ms = time_ms(REPEATS, [&]() {
+      num_ranges =
+          tile_ranges_for_area(b.minlat, b.minlon, b.maxlat, b.maxlon)
+              .size();
+    });
+
+    std::cout << boost::format("%8.2f %8d %8d %14.3f %14.3f\n") % SIDES[i] %
+                     num_tiles % num_ranges % tiles_ms % ranges_ms;
+  }
+}
+
+void bench_queries(const std::string &db_name) {
+  pqxx::connection conn((boost::format("dbname=%1%") % db_name).str());
+
+  std::cout << boost::format("%8s %8s %14s %14s %14s %14s\n") % "side" %
+                   "nodes" % "tiles (ms)" % "ranges (ms)" % "tiles rows/s" %
+                   "ranges rows/s";
+
+  for (size_t i = 0; i < sizeof(SIDES) / sizeof(SIDES[0]); ++i) {
+    const bounds b = centred_square(SIDES[i]);
+    size_t tiles_count = 0, ranges_count = 0;
+
+    const double tiles_ms =
+        time_ms(REPEATS, [&]() { tiles_count = query_tiles(conn, b); });
+    const double ranges_ms =
+        time_ms(REPEATS, [&]() { ranges_count = query_ranges(conn, b); });
+
+    if (tiles_count != ranges_count) {
+      throw std::runtime_error(
+          (boost::format("Mismatch in number of nodes found: %1% != %2%") %
+           tiles_count % ranges_count).str());
+    }
+
+    std::cout << boost::format("%8.2f %8d %14.3f %14.3f %14.0f %14.0f\n") %
+                     SIDES[i] % tiles_count % tiles_ms % ranges_ms %
+                     (tiles_count / (tiles_ms / 1000.0)) %
+                     (ranges_count / (ranges_ms / 1000.0));
+  }
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  try {
+    bench_computation();
+    std::cout << std::endl;
+
+    test_database tdb;
+    tdb.setup();
+    fill_bench_data(tdb.db_name());
+    bench_queries(tdb.db_name());
+
+  } catch (const test_database::setup_error &e) {
+    std::cerr << "Unable to set up test database: " << e.what() << std::endl;
+    return 1;
+
+  } catch (const std::exception &e) {
+    std::cerr << "EXCEPTION: " << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
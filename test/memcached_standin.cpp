@@ -0,0 +1,200 @@
+#include <libmemcached/memcached.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+/* an in-process stand-in for the parts of the libmemcached client which
+ * memcached_changeset_cache uses, so that bench_memcached_standin and
+ * test_memcached_changeset_cache can be run without a memcached server.
+ * every client talks to the same process-wide map, as they would to a single
+ * server which never evicts anything, so the bench numbers are the best case
+ * for the memcached tier: they count fetches, not the time taken by a round
+ * trip over the network.
+ *
+ * nothing listens on port 1, as with a real server, so that the tests can
+ * see what happens when memcached can't be reached.
+ *
+ * the libmemcached structures are defined by its header, so the stand-in
+ * keeps its own state and hands out pointers to that in their place.
+ */
+namespace {
+
+std::map<std::string, std::string> &store() {
+  static std::map<std::string, std::string> kv;
+  return kv;
+}
+
+struct client {
+  client() : reachable(false) {}
+
+  // false until a server has been pushed which isn't on port 1.
+  bool reachable;
+
+  // keys from the last mget, in reverse order, still to be fetched.
+  std::vector<std::string> pending;
+};
+
+// the servers as they were given to memcached_servers_parse.
+struct server_list {
+  std::string servers;
+};
+
+struct result {
+  std::string key, value;
+};
+
+client *as_client(memcached_st *ptr) {
+  return reinterpret_cast<client *>(ptr);
+}
+
+server_list *as_server_list(memcached_server_list_st ptr) {
+  return reinterpret_cast<server_list *>(ptr);
+}
+
+result *as_result(memcached_result_st *ptr) {
+  return reinterpret_cast<result *>(ptr);
+}
+
+const result *as_result(const memcached_result_st *ptr) {
+  return reinterpret_cast<const result *>(ptr);
+}
+
+} // anonymous namespace
+
+extern "C" {
+
+memcached_st *memcached_create(memcached_st *) {
+  return reinterpret_cast<memcached_st *>(new client);
+}
+
+void memcached_free(memcached_st *ptr) { delete as_client(ptr); }
+
+memcached_return_t memcached_behavior_set(memcached_st *,
+                                          const memcached_behavior_t,
+                                          uint64_t) {
+  return MEMCACHED_SUCCESS;
+}
+
+memcached_server_list_st memcached_servers_parse(const char *servers) {
+  server_list *list = new server_list;
+  list->servers = servers;
+  return reinterpret_cast<memcached_server_list_st>(list);
+}
+
+memcached_return_t memcached_server_push(memcached_st *ptr,
+                                         const memcached_server_list_st list) {
+  const std::string &servers = as_server_list(list)->servers;
+  const std::string unreachable = ":1";
+  if ((servers.size() < unreachable.size()) ||
+      (servers.compare(servers.size() - unreachable.size(),
+                       unreachable.size(), unreachable) != 0)) {
+    as_client(ptr)->reachable = true;
+  }
+  return MEMCACHED_SUCCESS;
+}
+
+void memcached_server_list_free(memcached_server_list_st list) {
+  delete as_server_list(list);
+}
+
+char *memcached_get(memcached_st *ptr, const char *key, size_t key_length,
+                    size_t *value_length, uint32_t *flags,
+                    memcached_return_t *error) {
+  if (!as_client(ptr)->reachable) {
+    *error = MEMCACHED_CONNECTION_FAILURE;
+    return NULL;
+  }
+
+  std::map<std::string, std::string>::const_iterator itr =
+    store().find(std::string(key, key_length));
+  if (itr == store().end()) {
+    *error = MEMCACHED_NOTFOUND;
+    return NULL;
+  }
+
+  char *value = static_cast<char *>(std::malloc(itr->second.size() + 1));
+  std::memcpy(value, itr->second.data(), itr->second.size());
+  value[itr->second.size()] = '\0';
+  *value_length = itr->second.size();
+  if (flags != NULL) {
+    *flags = 0;
+  }
+  *error = MEMCACHED_SUCCESS;
+  return value;
+}
+
+memcached_return_t memcached_set(memcached_st *ptr, const char *key,
+                                 size_t key_length, const char *value,
+                                 size_t value_length, time_t, uint32_t) {
+  if (!as_client(ptr)->reachable) {
+    return MEMCACHED_CONNECTION_FAILURE;
+  }
+  store()[std::string(key, key_length)] = std::string(value, value_length);
+  return MEMCACHED_SUCCESS;
+}
+
+memcached_return_t memcached_mget(memcached_st *ptr, const char *const *keys,
+                                  const size_t *key_length,
+                                  size_t number_of_keys) {
+  client *c = as_client(ptr);
+  c->pending.clear();
+  if (!c->reachable) {
+    return MEMCACHED_CONNECTION_FAILURE;
+  }
+  for (size_t i = number_of_keys; i > 0; --i) {
+    c->pending.push_back(std::string(keys[i - 1], key_length[i - 1]));
+  }
+  return MEMCACHED_SUCCESS;
+}
+
+memcached_result_st *memcached_result_create(const memcached_st *,
+                                             memcached_result_st *) {
+  return reinterpret_cast<memcached_result_st *>(new result);
+}
+
+void memcached_result_free(memcached_result_st *ptr) {
+  delete as_result(ptr);
+}
+
+memcached_result_st *memcached_fetch_result(memcached_st *ptr,
+                                            memcached_result_st *res,
+                                            memcached_return_t *error) {
+  client *c = as_client(ptr);
+  while (!c->pending.empty()) {
+    std::string key;
+    key.swap(c->pending.back());
+    c->pending.pop_back();
+
+    std::map<std::string, std::string>::const_iterator itr =
+      store().find(key);
+    if (itr != store().end()) {
+      as_result(res)->key = key;
+      as_result(res)->value = itr->second;
+      *error = MEMCACHED_SUCCESS;
+      return res;
+    }
+  }
+  *error = MEMCACHED_END;
+  return NULL;
+}
+
+const char *memcached_result_key_value(const memcached_result_st *self) {
+  return as_result(self)->key.data();
+}
+
+size_t memcached_result_key_length(const memcached_result_st *self) {
+  return as_result(self)->key.size();
+}
+
+const char *memcached_result_value(const memcached_result_st *self) {
+  return as_result(self)->value.data();
+}
+
+size_t memcached_result_length(const memcached_result_st *self) {
+  return as_result(self)->value.size();
+}
+
+} // extern "C"
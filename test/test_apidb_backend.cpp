@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <stdexcept>
 #include <boost/noncopyable.hpp>
@@ -70,6 +71,44 @@ void test_psql_array_to_vector() {
   }
 }
 
+void test_psql_array_reader() {
+  // integers can be read without going through a string, and a NULL
+  // element is only a null if it isn't quoted.
+  psql_array_reader ids("{1,-20,300000000000}");
+  std::vector<int64_t> values;
+  while (ids.next()) {
+    values.push_back(ids.as_int64());
+  }
+  assert_equal<size_t>(values.size(), 3, "number of integer elements");
+  assert_equal<int64_t>(values[0], 1, "first integer element");
+  assert_equal<int64_t>(values[1], -20, "second integer element");
+  assert_equal<int64_t>(values[2], 300000000000ll, "third integer element");
+
+  const std::string test = "{NULL,\"NULL\",\"a\\\\b\",\"\"}";
+  psql_array_reader reader(test.data(), test.size());
+  assert_equal<bool>(reader.next(), true, "has first element");
+  assert_equal<bool>(reader.is_null(), true, "unquoted NULL is null");
+  assert_equal<bool>(reader.next(), true, "has second element");
+  assert_equal<bool>(reader.is_null(), false, "quoted NULL is null");
+  assert_equal<std::string>(reader.str(), "NULL", "quoted NULL element");
+  assert_equal<bool>(reader.next(), true, "has third element");
+  assert_equal<std::string>(reader.str(), "a\\b", "escaped element");
+  assert_equal<bool>(reader.next(), true, "has fourth element");
+  assert_equal<std::string>(reader.str(), "", "empty element");
+  assert_equal<bool>(reader.next(), false, "has fifth element");
+
+  bool threw = false;
+  try {
+    psql_array_reader bad("{1,x}");
+    bad.next();
+    bad.next();
+    bad.as_int64();
+  } catch (const std::runtime_error &) {
+    threw = true;
+  }
+  assert_equal<bool>(threw, true, "reading non-integer as integer throws");
+}
+
 void test_single_nodes(boost::shared_ptr<data_selection> sel) {
   if (sel->check_node_visibility(1) != data_selection::exists) {
     throw std::runtime_error("Node 1 should be visible, but isn't");
@@ -255,6 +294,170 @@ void test_negative_changeset_ids(boost::shared_ptr<data_selection> sel) {
     f.m_nodes[1], "second node written");
 }
 
+void test_fractional_timestamp(boost::shared_ptr<data_selection> sel) {
+  // the fraction of a second is truncated, however the rows are extracted.
+  std::vector<osm_nwr_id_t> ids;
+  ids.push_back(11);
+  if (sel->select_nodes(ids) != 1) {
+    throw std::runtime_error("Selecting 1 node failed");
+  }
+
+  test_formatter f;
+  sel->write_nodes(f);
+  assert_equal<size_t>(f.m_nodes.size(), 1, "number of nodes written");
+  assert_equal<std::string>(f.m_nodes[0].elem.timestamp,
+                            "2016-04-16T15:09:00Z",
+                            "timestamp of node with fractional seconds");
+}
+
+void test_node_tags(boost::shared_ptr<data_selection> sel) {
+  std::vector<osm_nwr_id_t> ids;
+  ids.push_back(8);
+  ids.push_back(9);
+  ids.push_back(10);
+  if (sel->select_nodes(ids) != 3) {
+    throw std::runtime_error("Selecting 3 nodes failed");
+  }
+
+  test_formatter f;
+  sel->write_nodes(f);
+  assert_equal<size_t>(f.m_nodes.size(), 3, "number of nodes written");
+
+  tags_t tags_8, tags_10;
+  tags_8.push_back(std::make_pair("name", "eight"));
+  tags_10.push_back(std::make_pair("name", "ten"));
+
+  assert_equal<test_formatter::node_t>(
+    test_formatter::node_t(
+      element_info(8, 1, 0, "2016-04-16T15:09:00Z", boost::none, boost::none, true),
+      0.0, 0.0,
+      tags_8
+      ),
+    f.m_nodes[0], "first node written");
+  assert_equal<test_formatter::node_t>(
+    test_formatter::node_t(
+      element_info(9, 1, 0, "2016-04-16T15:09:00Z", boost::none, boost::none, true),
+      0.0, 0.0,
+      tags_t()
+      ),
+    f.m_nodes[1], "second (untagged) node written");
+  assert_equal<test_formatter::node_t>(
+    test_formatter::node_t(
+      element_info(10, 1, 0, "2016-04-16T15:09:00Z", boost::none, boost::none, true),
+      0.0, 0.0,
+      tags_10
+      ),
+    f.m_nodes[2], "third node written");
+}
+
+// run the same sequence of selects as the map call on a bbox around the
+// origin, either one at a time or together as a selection plan, and write
+// out everything selected.
+void write_map_call(data_selection &sel, bool as_plan, test_formatter &f) {
+  const int num_nodes =
+      sel.select_nodes_from_bbox(bbox(-0.05, -0.05, 0.05, 0.05), 100);
+  assert_equal<int>(num_nodes, 5, "number of nodes selected from bbox");
+
+  if (as_plan) {
+    data_selection::selection_plan plan;
+    plan.push_back(data_selection::plan_ways_from_nodes);
+    plan.push_back(data_selection::plan_nodes_from_way_nodes);
+    plan.push_back(data_selection::plan_relations_from_ways);
+    plan.push_back(data_selection::plan_relations_from_nodes);
+    plan.push_back(data_selection::plan_relations_from_relations);
+    sel.select_plan(plan);
+
+  } else {
+    sel.select_ways_from_nodes();
+    sel.select_nodes_from_way_nodes();
+    sel.select_relations_from_ways();
+    sel.select_relations_from_nodes();
+    sel.select_relations_from_relations();
+  }
+
+  sel.write_nodes(f);
+  sel.write_ways(f);
+  sel.write_relations(f);
+}
+
+template <typename T>
+bool id_less(const T &a, const T &b) {
+  return a.elem.id < b.elem.id;
+}
+
+// the IDs of the elements written, in order.
+template <typename T>
+std::vector<osm_nwr_id_t> written_ids(std::vector<T> elements) {
+  std::sort(elements.begin(), elements.end(), id_less<T>);
+  std::vector<osm_nwr_id_t> ids;
+  for (size_t i = 0; i < elements.size(); ++i) {
+    ids.push_back(elements[i].elem.id);
+  }
+  return ids;
+}
+
+template <typename T>
+void assert_same_elements(std::vector<T> a, std::vector<T> b,
+                          const std::string &message) {
+  std::sort(a.begin(), a.end(), id_less<T>);
+  std::sort(b.begin(), b.end(), id_less<T>);
+  assert_equal<size_t>(a.size(), b.size(), "number of " + message);
+  for (size_t i = 0; i < a.size(); ++i) {
+    assert_equal<T>(a[i], b[i], message);
+  }
+}
+
+void test_map_selects(boost::shared_ptr<data_selection> sel) {
+  // only the visible nodes at the origin are in the bbox, but way 1 brings
+  // in node 2. relations 1 and 2 use way 1 and node 9, and relation 3 uses
+  // relation 1. way 2 and relation 4 are nowhere near.
+  test_formatter f;
+  write_map_call(*sel, false, f);
+
+  const osm_nwr_id_t expected_nodes[] = { 1, 2, 4, 8, 9, 10 };
+  assert_equal<size_t>(f.m_nodes.size(), 6, "number of nodes written");
+  const std::vector<osm_nwr_id_t> nodes = written_ids(f.m_nodes);
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    assert_equal<osm_nwr_id_t>(nodes[i], expected_nodes[i],
+                               "ID of node written");
+  }
+
+  assert_equal<size_t>(f.m_ways.size(), 1, "number of ways written");
+  nodes_t way_nodes;
+  way_nodes.push_back(1);
+  way_nodes.push_back(2);
+  tags_t way_tags;
+  way_tags.push_back(std::make_pair("highway", "residential"));
+  assert_equal<test_formatter::way_t>(
+    f.m_ways[0],
+    test_formatter::way_t(
+      element_info(1, 1, 1, "2013-11-14T02:10:00Z", 1, std::string("user_1"),
+                   true),
+      way_nodes, way_tags),
+    "way written");
+
+  const osm_nwr_id_t expected_relations[] = { 1, 2, 3 };
+  assert_equal<size_t>(f.m_relations.size(), 3,
+                       "number of relations written");
+  const std::vector<osm_nwr_id_t> relations = written_ids(f.m_relations);
+  for (size_t i = 0; i < relations.size(); ++i) {
+    assert_equal<osm_nwr_id_t>(relations[i], expected_relations[i],
+                               "ID of relation written");
+  }
+}
+
+void test_map_plan(data_selection::factory &factory) {
+  // the steps run together as a selection plan should select and write
+  // exactly the same elements as running them one at a time.
+  test_formatter steps, planned;
+  write_map_call(*factory.make_selection(), false, steps);
+  write_map_call(*factory.make_selection(), true, planned);
+
+  assert_same_elements(steps.m_nodes, planned.m_nodes, "nodes");
+  assert_same_elements(steps.m_ways, planned.m_ways, "ways");
+  assert_same_elements(steps.m_relations, planned.m_relations, "relations");
+}
+
 void test_changeset(boost::shared_ptr<data_selection> sel) {
   assert_equal<bool>(sel->supports_changesets(), true,
                      "apidb should support changesets.");
@@ -567,6 +770,7 @@ int main(int, char **) {
     tdb.setup();
 
     test_psql_array_to_vector();
+    test_psql_array_reader();
 
     tdb.run(boost::function<void(boost::shared_ptr<data_selection>)>(
         &test_single_nodes));
@@ -586,6 +790,18 @@ int main(int, char **) {
     tdb.run(boost::function<void(boost::shared_ptr<data_selection>)>(
         &test_negative_changeset_ids));
 
+    tdb.run(boost::function<void(boost::shared_ptr<data_selection>)>(
+        &test_fractional_timestamp));
+
+    tdb.run(boost::function<void(boost::shared_ptr<data_selection>)>(
+        &test_node_tags));
+
+    tdb.run(boost::function<void(boost::shared_ptr<data_selection>)>(
+        &test_map_selects));
+
+    tdb.run(boost::function<void(data_selection::factory &)>(
+        &test_map_plan));
+
     tdb.run(boost::function<void(boost::shared_ptr<data_selection>)>(
               &test_changeset));
 
@@ -35,7 +35,53 @@ VALUES (1,       0,       0, 1, true,  '2013-11-14T02:10:00Z', 3221225472, 1),
        (4,       0,       0, 4, true,  '2015-03-02T19:25:00Z', 3221225472, 1),
        -- note: node 5 intentionally missing
        (6, 90000000, 90000000,  0, true,  '2016-04-16T15:09:00Z', 3229120632, 1),
-       (7, 90000000, 90000000, -1, true,  '2016-04-16T15:09:00Z', 3229120632, 1);
+       (7, 90000000, 90000000, -1, true,  '2016-04-16T15:09:00Z', 3229120632, 1),
+       -- nodes with and without tags, for checking tags are matched up to
+       -- the right nodes.
+       (8,       0,       0,  0, true,  '2016-04-16T15:09:00Z', 3221225472, 1),
+       (9,       0,       0,  0, true,  '2016-04-16T15:09:00Z', 3221225472, 1),
+       (10,      0,       0,  0, true,  '2016-04-16T15:09:00Z', 3221225472, 1),
+       -- a timestamp with fractional seconds, which are dropped when it's
+       -- written out.
+       (11, 90000000, 90000000,  0, true,  '2016-04-16T15:09:00.75Z', 3229120632, 1);
+
+INSERT INTO current_node_tags (node_id, k, v)
+VALUES (8, 'name', 'eight'),
+       (10, 'name', 'ten');
+
+-- a way from the nodes at the origin out to node 2, and one well away from
+-- them, for checking the map call.
+INSERT INTO current_ways (id, changeset_id, "timestamp", visible, version)
+VALUES (1, 1, '2013-11-14T02:10:00Z', true, 1),
+       (2, 1, '2013-11-14T02:10:00Z', true, 1);
+
+INSERT INTO current_way_nodes (way_id, node_id, sequence_id)
+VALUES (1, 1, 1),
+       (1, 2, 2),
+       (2, 6, 1),
+       (2, 7, 2);
+
+INSERT INTO current_way_tags (way_id, k, v)
+VALUES (1, 'highway', 'residential');
+
+-- relations using way 1, a node at the origin and relation 1, which are all
+-- found by a map call at the origin, and one using only things away from it.
+INSERT INTO current_relations (id, changeset_id, "timestamp", visible, version)
+VALUES (1, 1, '2013-11-14T02:10:00Z', true, 1),
+       (2, 1, '2013-11-14T02:10:00Z', true, 1),
+       (3, 1, '2013-11-14T02:10:00Z', true, 1),
+       (4, 1, '2013-11-14T02:10:00Z', true, 1);
+
+INSERT INTO current_relation_members
+  (relation_id, member_type, member_id, member_role, sequence_id)
+VALUES (1, 'Way', 1, 'outer', 1),
+       (2, 'Node', 9, 'stop', 1),
+       (3, 'Relation', 1, '', 1),
+       (4, 'Way', 2, '', 1),
+       (4, 'Node', 6, '', 2);
+
+INSERT INTO current_relation_tags (relation_id, k, v)
+VALUES (1, 'type', 'multipolygon');
 
 -- add some OAuth tokens, one valid and the others revoked or not valid.
 -- the API is publicly readable, so _all_ tokens can read the API. there is no
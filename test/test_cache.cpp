@@ -0,0 +1,334 @@
+#include "cgimap/cache.hpp"
+
+#include <stdexcept>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/ref.hpp>
+#include <boost/make_shared.hpp>
+
+namespace {
+
+template <typename T>
+void assert_equal(const T &a, const T &b, const std::string &message) {
+  if (a != b) {
+    std::ostringstream ostr;
+    ostr << "Expecting " << message << " to be equal, but " << a << " != "
+         << b;
+    throw std::runtime_error(ostr.str());
+  }
+}
+
+// each test uses its own object type, which used to be needed to start from
+// an empty cache, and keeps the tests independent of each other.
+template <int N> struct object {
+  explicit object(int v) : value(v) {}
+  int value;
+};
+
+// counts the calls made to fetch objects, and the number of keys asked for.
+struct fetch_counter {
+  fetch_counter() : single_calls(0), batch_calls(0), batch_keys(0) {}
+  int single_calls, batch_calls, batch_keys;
+};
+
+template <int N> object<N> *fetch_one(fetch_counter &counter, int key) {
+  ++counter.single_calls;
+  return new object<N>(key * 10);
+}
+
+// fetches all keys except negative ones, which are "not found".
+template <int N>
+void fetch_batch(fetch_counter &counter, const std::vector<int> &keys,
+                 typename cache<int, object<N> >::batch_type &out) {
+  ++counter.batch_calls;
+  counter.batch_keys += int(keys.size());
+  for (std::vector<int>::const_iterator itr = keys.begin(); itr != keys.end();
+       ++itr) {
+    if (*itr >= 0) {
+      out.push_back(std::make_pair(
+          *itr, boost::make_shared<object<N> const>(*itr * 10)));
+    }
+  }
+}
+
+// room for num objects in the cache.
+template <int N> size_t room_for(size_t num) {
+  return num * cache<int, object<N> >::charge(object<N>(0));
+}
+
+void test_prefetch() {
+  fetch_counter counter;
+  cache<int, object<0> > c(
+      boost::bind(fetch_one<0>, boost::ref(counter), _1), room_for<0>(100),
+      boost::bind(fetch_batch<0>, boost::ref(counter), _1, _2));
+
+  // one key is already cached, and the rest should come in one batch, with
+  // duplicates removed.
+  assert_equal<int>(c.get(1)->value, 10, "value of fetched object");
+  const int keys[] = { 1, 2, 3, 2, 4, 3 };
+  c.prefetch(keys, keys + 6);
+  assert_equal<int>(counter.batch_calls, 1, "number of batch fetches");
+  assert_equal<int>(counter.batch_keys, 3, "number of keys batch fetched");
+
+  for (int i = 1; i <= 4; ++i) {
+    assert_equal<int>(c.get(i)->value, i * 10, "value of prefetched object");
+  }
+  assert_equal<int>(counter.single_calls, 1, "number of single fetches");
+
+  // nothing is missing, so there's nothing to fetch.
+  c.prefetch(keys, keys + 6);
+  assert_equal<int>(counter.batch_calls, 1, "number of batch fetches");
+
+  // keys not found by the batch fetch are fetched one at a time later.
+  const int missing[] = { -1, 5 };
+  c.prefetch(missing, missing + 2);
+  assert_equal<int>(c.get(-1)->value, -10, "value of missing object");
+  assert_equal<int>(c.get(5)->value, 50, "value of prefetched object");
+  assert_equal<int>(counter.single_calls, 2, "number of single fetches");
+}
+
+void test_prefetch_without_batch() {
+  fetch_counter counter;
+  cache<int, object<1> > c(
+      boost::bind(fetch_one<1>, boost::ref(counter), _1), room_for<1>(100));
+
+  const int keys[] = { 1, 2, 3 };
+  c.prefetch(keys, keys + 3);
+  assert_equal<int>(counter.single_calls, 0, "number of single fetches");
+  assert_equal<int>(c.get(2)->value, 20, "value of fetched object");
+  assert_equal<int>(counter.single_calls, 1, "number of single fetches");
+}
+
+void test_prefetch_over_size() {
+  fetch_counter counter;
+  cache<int, object<2> > c(
+      boost::bind(fetch_one<2>, boost::ref(counter), _1), room_for<2>(4),
+      boost::bind(fetch_batch<2>, boost::ref(counter), _1, _2));
+
+  // more are prefetched than fit in the cache, but they're all kept until
+  // they've been asked for, so none have to be fetched again.
+  std::vector<int> keys;
+  for (int i = 0; i < 10; ++i) {
+    keys.push_back(i);
+  }
+  c.prefetch(keys.begin(), keys.end());
+  assert_equal<int>(counter.batch_keys, 10, "number of keys batch fetched");
+  for (int i = 0; i < 10; ++i) {
+    assert_equal<int>(c.get(i)->value, i * 10, "value of object");
+  }
+  assert_equal<int>(counter.single_calls, 0, "number of single fetches");
+  assert_equal<size_t>(c.get_stats().entries, 4, "entries after prefetch");
+}
+
+void test_prefetch_full_cache() {
+  fetch_counter counter;
+  cache<int, object<7> > c(
+      boost::bind(fetch_one<7>, boost::ref(counter), _1), room_for<7>(20),
+      boost::bind(fetch_batch<7>, boost::ref(counter), _1, _2));
+
+  // fill the cache with a working set which is used a few times, and
+  // objects which are only used once.
+  for (int j = 0; j < 3; ++j) {
+    for (int i = 0; i < 10; ++i) {
+      c.get(i);
+    }
+  }
+  for (int i = 100; i < 110; ++i) {
+    c.get(i);
+  }
+  assert_equal<size_t>(c.get_stats().entries, 20, "entries before prefetch");
+  assert_equal<int>(counter.single_calls, 20, "fetches to fill the cache");
+
+  // a batch much bigger than the small queue is fetched once, and every
+  // object in it is then got without fetching it again.
+  std::vector<int> keys;
+  for (int i = 1000; i < 1100; ++i) {
+    keys.push_back(i);
+  }
+  c.prefetch(keys.begin(), keys.end());
+  for (std::vector<int>::const_iterator itr = keys.begin(); itr != keys.end();
+       ++itr) {
+    assert_equal<int>(c.get(*itr)->value, *itr * 10,
+                      "value of prefetched object");
+  }
+  assert_equal<int>(counter.batch_calls, 1, "number of batch fetches");
+  assert_equal<int>(counter.batch_keys, 100, "number of keys batch fetched");
+  assert_equal<int>(counter.single_calls, 20,
+                    "single fetches after prefetching");
+
+  // and the batch, only used once, hasn't flushed out the working set.
+  for (int i = 0; i < 10; ++i) {
+    c.get(i);
+  }
+  assert_equal<int>(counter.single_calls, 20,
+                    "fetches for working set after prefetching");
+}
+
+void test_separate_instances() {
+  fetch_counter counter;
+  cache<int, object<3> > a(
+      boost::bind(fetch_one<3>, boost::ref(counter), _1), room_for<3>(10));
+  cache<int, object<3> > b(
+      boost::bind(fetch_one<3>, boost::ref(counter), _1), room_for<3>(10));
+
+  // caches of the same type each have their own objects.
+  a.get(1);
+  b.get(1);
+  assert_equal<int>(counter.single_calls, 2, "number of single fetches");
+  assert_equal<uint64_t>(a.get_stats().misses, 1, "misses in first cache");
+  assert_equal<uint64_t>(b.get_stats().misses, 1, "misses in second cache");
+}
+
+void test_byte_limit() {
+  fetch_counter counter;
+  cache<int, object<4> > c(
+      boost::bind(fetch_one<4>, boost::ref(counter), _1), room_for<4>(10));
+
+  for (int i = 0; i < 100; ++i) {
+    c.get(i);
+  }
+  cache<int, object<4> >::stats s = c.get_stats();
+  assert_equal<uint64_t>(s.misses, 100, "number of misses");
+  assert_equal<size_t>(s.entries, 10, "number of entries when full");
+  assert_equal<size_t>(s.bytes, room_for<4>(10), "number of bytes when full");
+  assert_equal<uint64_t>(s.evictions, 90, "number of evictions");
+}
+
+void test_scan_resistance() {
+  fetch_counter counter;
+  cache<int, object<5> > c(
+      boost::bind(fetch_one<5>, boost::ref(counter), _1), room_for<5>(20));
+
+  // a working set which is used a few times...
+  for (int j = 0; j < 3; ++j) {
+    for (int i = 0; i < 10; ++i) {
+      c.get(i);
+    }
+  }
+  assert_equal<int>(counter.single_calls, 10, "fetches for working set");
+
+  // ...shouldn't be flushed out by a scan over many more objects, each of
+  // which is only used once.
+  for (int i = 1000; i < 2000; ++i) {
+    c.get(i);
+  }
+  const int before = counter.single_calls;
+  for (int i = 0; i < 10; ++i) {
+    assert_equal<int>(c.get(i)->value, i * 10, "value of working set object");
+  }
+  assert_equal<int>(counter.single_calls - before, 0,
+                    "fetches for working set after scan");
+}
+
+void test_scan_resistance_repeated_reads() {
+  fetch_counter counter;
+  cache<int, object<8> > c(
+      boost::bind(fetch_one<8>, boost::ref(counter), _1), room_for<8>(20),
+      boost::bind(fetch_batch<8>, boost::ref(counter), _1, _2));
+
+  // a working set which is used by a few requests...
+  for (int j = 0; j < 3; ++j) {
+    c.start_batch();
+    for (int i = 0; i < 10; ++i) {
+      c.get(i);
+    }
+  }
+  assert_equal<int>(counter.single_calls, 10, "fetches for working set");
+
+  // ...shouldn't be flushed out by one request which reads each of many
+  // more objects more than once, as a map call does with the changesets
+  // of all its elements. nor by one which prefetches them first.
+  c.start_batch();
+  for (int i = 1000; i < 2000; ++i) {
+    c.get(i);
+    c.get(i);
+  }
+  c.start_batch();
+  std::vector<int> keys;
+  for (int i = 2000; i < 3000; ++i) {
+    keys.push_back(i);
+  }
+  c.prefetch(keys.begin(), keys.end());
+  for (int j = 0; j < 2; ++j) {
+    for (std::vector<int>::const_iterator itr = keys.begin();
+         itr != keys.end(); ++itr) {
+      c.get(*itr);
+    }
+  }
+
+  c.start_batch();
+  const int before = counter.single_calls;
+  for (int i = 0; i < 10; ++i) {
+    assert_equal<int>(c.get(i)->value, i * 10, "value of working set object");
+  }
+  assert_equal<int>(counter.single_calls - before, 0,
+                    "fetches for working set after repeated scan");
+
+  // but objects read by more than one request are still kept.
+  for (int j = 0; j < 2; ++j) {
+    c.start_batch();
+    for (int i = 100; i < 105; ++i) {
+      c.get(i);
+    }
+  }
+  c.start_batch();
+  for (int i = 3000; i < 4000; ++i) {
+    c.get(i);
+  }
+  const int after = counter.single_calls;
+  for (int i = 100; i < 105; ++i) {
+    c.get(i);
+  }
+  assert_equal<int>(counter.single_calls - after, 0,
+                    "fetches for objects used by two requests");
+}
+
+void test_peek_put() {
+  fetch_counter counter;
+  cache<int, object<6> > c(
+      boost::bind(fetch_one<6>, boost::ref(counter), _1), room_for<6>(10));
+
+  assert_equal<bool>(!c.peek(1), true, "peek before put is empty");
+  c.put(1, boost::make_shared<object<6> const>(5));
+  assert_equal<int>(c.peek(1)->value, 5, "value after put");
+
+  // putting again replaces the object, without adding another entry.
+  c.put(1, boost::make_shared<object<6> const>(6));
+  assert_equal<int>(c.get(1)->value, 6, "value after second put");
+  assert_equal<size_t>(c.get_stats().entries, 1, "number of entries");
+  assert_equal<int>(counter.single_calls, 0, "number of single fetches");
+
+  // puts are bounded by the byte limit, just like fetches.
+  for (int i = 2; i < 100; ++i) {
+    c.put(i, boost::make_shared<object<6> const>(i));
+  }
+  assert_equal<size_t>(c.get_stats().entries, 10, "entries after many puts");
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  try {
+    test_prefetch();
+    test_prefetch_without_batch();
+    test_prefetch_over_size();
+    test_prefetch_full_cache();
+    test_separate_instances();
+    test_byte_limit();
+    test_scan_resistance();
+    test_scan_resistance_repeated_reads();
+    test_peek_put();
+
+  } catch (const std::exception &ex) {
+    std::cerr << "EXCEPTION: " << ex.what() << std::endl;
+    return 1;
+
+  } catch (...) {
+    std::cerr << "UNKNOWN ERROR" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,198 @@
+#include "cgimap/cached_selection.hpp"
+#include "test_formatter.hpp"
+
+#include <stdexcept>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <boost/make_shared.hpp>
+#include <boost/ref.hpp>
+
+namespace {
+
+template <typename T>
+void assert_equal(const T &a, const T &b, const std::string &message) {
+  if (a != b) {
+    std::ostringstream ostr;
+    ostr << "Expecting " << message << " to be equal, but " << a << " != "
+         << b;
+    throw std::runtime_error(ostr.str());
+  }
+}
+
+// the "database" of nodes, shared by all the selections from a factory,
+// with a count of the nodes which have been written out from it.
+struct fake_db {
+  fake_db() : nodes_written(0) {}
+  std::map<osm_nwr_id_t, osm_nwr_id_t> versions;
+  int nodes_written;
+};
+
+/**
+ * a selection which can only select and write nodes by ID, and which can
+ * optionally list their versions for the element cache.
+ */
+class fake_selection : public data_selection {
+public:
+  fake_selection(fake_db &db, bool versions) : m_db(db), m_versions(versions) {}
+
+  void write_nodes(output_formatter &formatter) {
+    for (std::set<osm_nwr_id_t>::const_iterator itr = m_sel.begin();
+         itr != m_sel.end(); ++itr) {
+      const osm_nwr_id_t version = m_db.versions[*itr];
+      element_info elem(*itr, version, 1, "2017-01-01T00:00:00Z",
+                        osm_user_id_t(1), std::string("user"), true);
+      tags_t tags;
+      tags.push_back(std::make_pair("version", std::to_string(version)));
+      formatter.write_node(elem, 0.1 * *itr, 0.2 * *itr, tags);
+      ++m_db.nodes_written;
+    }
+  }
+  void write_ways(output_formatter &) {}
+  void write_relations(output_formatter &) {}
+
+  visibility_t check_node_visibility(osm_nwr_id_t) { return exists; }
+  visibility_t check_way_visibility(osm_nwr_id_t) { return exists; }
+  visibility_t check_relation_visibility(osm_nwr_id_t) { return exists; }
+
+  int select_nodes(const std::vector<osm_nwr_id_t> &ids) {
+    m_sel.insert(ids.begin(), ids.end());
+    return int(ids.size());
+  }
+  int select_ways(const std::vector<osm_nwr_id_t> &) { return 0; }
+  int select_relations(const std::vector<osm_nwr_id_t> &) { return 0; }
+  int select_nodes_from_bbox(const bbox &, int) { return 0; }
+  void select_nodes_from_relations() {}
+  void select_ways_from_nodes() {}
+  void select_ways_from_relations() {}
+  void select_relations_from_ways() {}
+  void select_nodes_from_way_nodes() {}
+  void select_relations_from_nodes() {}
+  void select_relations_from_relations() {}
+  void select_relations_members_of_relations() {}
+
+  bool selected_versions(element_type type, id_versions_t &out) {
+    if (!m_versions) {
+      return false;
+    }
+    if (type == element_type_node) {
+      for (std::set<osm_nwr_id_t>::const_iterator itr = m_sel.begin();
+           itr != m_sel.end(); ++itr) {
+        out.push_back(std::make_pair(*itr, m_db.versions[*itr]));
+      }
+    }
+    return true;
+  }
+
+  void deselect(element_type type, const std::vector<osm_nwr_id_t> &ids) {
+    if (type == element_type_node) {
+      for (std::vector<osm_nwr_id_t>::const_iterator itr = ids.begin();
+           itr != ids.end(); ++itr) {
+        m_sel.erase(*itr);
+      }
+    }
+  }
+
+private:
+  fake_db &m_db;
+  bool m_versions;
+  std::set<osm_nwr_id_t> m_sel;
+};
+
+struct fake_factory : public data_selection::factory {
+  fake_factory(fake_db &db, bool versions) : m_db(db), m_versions(versions) {}
+  boost::shared_ptr<data_selection> make_selection() {
+    return boost::make_shared<fake_selection>(boost::ref(m_db), m_versions);
+  }
+  fake_db &m_db;
+  bool m_versions;
+};
+
+// select and write out the nodes, returning what was written.
+std::vector<test_formatter::node_t>
+write_nodes(data_selection::factory &factory,
+            const std::vector<osm_nwr_id_t> &ids) {
+  boost::shared_ptr<data_selection> sel = factory.make_selection();
+  sel->select_nodes(ids);
+  test_formatter f;
+  sel->write_nodes(f);
+  return f.m_nodes;
+}
+
+void test_cached_nodes() {
+  fake_db db;
+  for (osm_nwr_id_t id = 1; id <= 10; ++id) {
+    db.versions[id] = 1;
+  }
+  cached_selection::factory factory(
+      boost::make_shared<fake_factory>(boost::ref(db), true), 1024 * 1024);
+
+  std::vector<osm_nwr_id_t> ids;
+  for (osm_nwr_id_t id = 1; id <= 5; ++id) {
+    ids.push_back(id);
+  }
+  std::vector<test_formatter::node_t> first = write_nodes(factory, ids);
+  assert_equal<size_t>(first.size(), 5, "nodes written first time");
+  assert_equal<int>(db.nodes_written, 5, "nodes from db first time");
+
+  // the same nodes again should all come from the cache, and be the same.
+  std::vector<test_formatter::node_t> second = write_nodes(factory, ids);
+  assert_equal<size_t>(second.size(), 5, "nodes written second time");
+  assert_equal<int>(db.nodes_written, 5, "nodes from db second time");
+  for (size_t i = 0; i < first.size(); ++i) {
+    assert_equal<test_formatter::node_t>(second[i], first[i],
+                                         "node written from cache");
+  }
+
+  // a node which has changed, and one which hasn't been seen before, come
+  // from the database, and the rest from the cache.
+  db.versions[3] = 2;
+  ids.push_back(6);
+  std::vector<test_formatter::node_t> third = write_nodes(factory, ids);
+  assert_equal<size_t>(third.size(), 6, "nodes written third time");
+  assert_equal<int>(db.nodes_written, 7, "nodes from db third time");
+  bool found_new_version = false;
+  for (size_t i = 0; i < third.size(); ++i) {
+    if (third[i].elem.id == 3) {
+      assert_equal<osm_nwr_id_t>(third[i].elem.version, 2,
+                                 "version of changed node");
+      assert_equal<std::string>(third[i].tags.front().second, "2",
+                                "tags of changed node");
+      found_new_version = true;
+    }
+  }
+  assert_equal<bool>(found_new_version, true, "changed node written");
+}
+
+void test_without_versions() {
+  fake_db db;
+  db.versions[1] = 1;
+  cached_selection::factory factory(
+      boost::make_shared<fake_factory>(boost::ref(db), false), 1024 * 1024);
+
+  // backends which can't list versions are passed straight through.
+  std::vector<osm_nwr_id_t> ids(1, 1);
+  write_nodes(factory, ids);
+  write_nodes(factory, ids);
+  assert_equal<int>(db.nodes_written, 2, "nodes from db without versions");
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  try {
+    test_cached_nodes();
+    test_without_versions();
+
+  } catch (const std::exception &ex) {
+    std::cerr << "EXCEPTION: " << ex.what() << std::endl;
+    return 1;
+
+  } catch (...) {
+    std::cerr << "UNKNOWN ERROR" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
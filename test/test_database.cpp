@@ -3,6 +3,7 @@
 
 #include <fstream>
 
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 
 namespace fs = boost::filesystem;
@@ -65,6 +66,19 @@ void test_database::setup() {
     m_oauth_store = apidb->create_oauth_store(vm);
   }
 
+  {
+    // a small batch size, so that the tests cover fetching more than one
+    // batch through the cursor.
+    po::options_description desc = apidb->options();
+    const char *argv[] = { "", "--dbname", m_db_name.c_str(),
+                           "--extract-batch-size", "2" };
+    int argc = sizeof(argv) / sizeof(*argv);
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    vm.notify();
+    m_writeable_stream_factory = apidb->create(vm);
+  }
+
   {
     po::options_description desc = apidb->options();
     const char *argv[] = { "", "--dbname", m_db_name.c_str(), "--readonly" };
@@ -74,15 +88,62 @@ void test_database::setup() {
     vm.notify();
     m_readonly_factory = apidb->create(vm);
   }
+
+  {
+    po::options_description desc = apidb->options();
+    const char *argv[] = { "", "--dbname", m_db_name.c_str(), "--readonly",
+                           "--binary-arrays" };
+    int argc = sizeof(argv) / sizeof(*argv);
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    vm.notify();
+    m_readonly_binary_factory = apidb->create(vm);
+  }
+
+  {
+    po::options_description desc = apidb->options();
+    const char *argv[] = { "", "--dbname", m_db_name.c_str(), "--readonly",
+                           "--copy-extract" };
+    int argc = sizeof(argv) / sizeof(*argv);
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    vm.notify();
+    m_readonly_copy_factory = apidb->create(vm);
+  }
+
+  {
+    po::options_description desc = apidb->options();
+    const char *argv[] = { "", "--dbname", m_db_name.c_str(), "--readonly",
+                           "--extract-connections", "2" };
+    int argc = sizeof(argv) / sizeof(*argv);
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    vm.notify();
+    m_readonly_parallel_factory = apidb->create(vm);
+  }
 }
 
+const std::string &test_database::db_name() const { return m_db_name; }
+
 test_database::~test_database() {
   if (m_writeable_factory) {
     m_writeable_factory.reset();
   }
+  if (m_writeable_stream_factory) {
+    m_writeable_stream_factory.reset();
+  }
   if (m_readonly_factory) {
     m_readonly_factory.reset();
   }
+  if (m_readonly_binary_factory) {
+    m_readonly_binary_factory.reset();
+  }
+  if (m_readonly_copy_factory) {
+    m_readonly_copy_factory.reset();
+  }
+  if (m_readonly_parallel_factory) {
+    m_readonly_parallel_factory.reset();
+  }
   if (m_oauth_store) {
     m_oauth_store.reset();
   }
@@ -122,21 +183,68 @@ std::string test_database::random_db_name() {
   return std::string(name);
 }
 
+namespace {
+// calls a test taking a selection with one made by the factory.
+void run_with_selection(
+    boost::function<void(boost::shared_ptr<data_selection>)> func,
+    data_selection::factory &factory) {
+  func(factory.make_selection());
+}
+} // anonymous namespace
+
 void test_database::run(
     boost::function<void(boost::shared_ptr<data_selection>)> func) {
+  run(boost::function<void(data_selection::factory &)>(
+      boost::bind(run_with_selection, func, _1)));
+}
+
+void test_database::run(
+    boost::function<void(data_selection::factory &)> func) {
   try {
-    func((*m_writeable_factory).make_selection());
+    func(*m_writeable_factory);
   } catch (const std::exception &e) {
     throw std::runtime_error(
         (boost::format("%1%, in writeable selection") % e.what()).str());
   }
 
   try {
-    func((*m_readonly_factory).make_selection());
+    func(*m_writeable_stream_factory);
+  } catch (const std::exception &e) {
+    throw std::runtime_error(
+        (boost::format("%1%, in writeable selection with extract batches") %
+         e.what()).str());
+  }
+
+  try {
+    func(*m_readonly_factory);
   } catch (const std::exception &e) {
     throw std::runtime_error(
         (boost::format("%1%, in read-only selection") % e.what()).str());
   }
+
+  try {
+    func(*m_readonly_binary_factory);
+  } catch (const std::exception &e) {
+    throw std::runtime_error(
+        (boost::format("%1%, in read-only selection with binary arrays") %
+         e.what()).str());
+  }
+
+  try {
+    func(*m_readonly_copy_factory);
+  } catch (const std::exception &e) {
+    throw std::runtime_error(
+        (boost::format("%1%, in read-only selection with binary COPY") %
+         e.what()).str());
+  }
+
+  try {
+    func(*m_readonly_parallel_factory);
+  } catch (const std::exception &e) {
+    throw std::runtime_error(
+        (boost::format("%1%, in read-only selection with helper connections") %
+         e.what()).str());
+  }
 }
 
 void test_database::run(
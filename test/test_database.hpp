@@ -41,14 +41,24 @@ struct test_database : public boost::noncopyable {
   void setup();
 
   // run a test. func will be called once with each of a writeable and
-  // readonly data selection backed by the database. the func should
-  // do its own testing - the run method here is just plumbing.
+  // readonly data selection backed by the database, and again with a
+  // writeable selection streaming its results in batches and readonly
+  // selections sending binary arrays, extracting with binary COPY and
+  // fetching on helper connections. the func should do its own testing -
+  // the run method here is just plumbing.
   void run(boost::function<void(boost::shared_ptr<data_selection>)> func);
 
+  // run a test. as above, but func is given each of the factories, for
+  // tests which need more than one selection.
+  void run(boost::function<void(data_selection::factory &)> func);
+
   // run a test. func will be called once with the OAuth store backed by
   // the database.
   void run(boost::function<void(boost::shared_ptr<oauth::store>)> func);
 
+  // the name of the test database, for connecting to it directly.
+  const std::string &db_name() const;
+
 private:
   // create a random, and hopefully unique, database name.
   static std::string random_db_name();
@@ -62,7 +72,9 @@ private:
   // factories using the test database which produce writeable and
   // read-only data selections.
   boost::shared_ptr<data_selection::factory> m_writeable_factory,
-      m_readonly_factory;
+      m_writeable_stream_factory, m_readonly_factory,
+      m_readonly_binary_factory, m_readonly_copy_factory,
+      m_readonly_parallel_factory;
 
   // oauth store based on the writeable connection.
   boost::shared_ptr<oauth::store> m_oauth_store;
@@ -0,0 +1,199 @@
+#include "cgimap/backend/apidb/existence_filter.hpp"
+
+#include <stdexcept>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/ref.hpp>
+
+namespace pt = boost::posix_time;
+
+namespace {
+
+template <typename T>
+void assert_equal(const T &a, const T &b, const std::string &message) {
+  if (a != b) {
+    std::ostringstream ostr;
+    ostr << "Expecting " << message << " to be equal, but " << a << " != "
+         << b;
+    throw std::runtime_error(ostr.str());
+  }
+}
+
+// stands in for the database, counting the times the IDs are fetched, and
+// throwing if the "database" is down.
+struct fake_db {
+  fake_db() : num_fetched(0), down(false) {
+    ids.node = 1000;
+    ids.way = 100;
+    ids.relation = 10;
+  }
+  existence_filter::max_ids ids;
+  int num_fetched;
+  bool down;
+};
+
+existence_filter::max_ids fetch(fake_db &db) {
+  if (db.down) {
+    throw std::runtime_error("database is down.");
+  }
+  ++db.num_fetched;
+  return db.ids;
+}
+
+const pt::ptime start(pt::time_from_string("2017-01-01 00:00:00"));
+
+void test_not_loaded() {
+  fake_db db;
+  existence_filter f(boost::bind(fetch, boost::ref(db)), pt::seconds(60),
+                     pt::seconds(1), 5);
+
+  // nothing is filtered before the first refresh.
+  assert_equal<bool>(f.can_exist(element_type_node, 1000000), true,
+                     "node before refresh");
+  assert_equal<int>(db.num_fetched, 0, "fetches before refresh");
+}
+
+void test_filter() {
+  fake_db db;
+  existence_filter f(boost::bind(fetch, boost::ref(db)), pt::seconds(60),
+                     pt::seconds(1), 5);
+  f.refresh(start);
+  assert_equal<int>(db.num_fetched, 1, "fetches after refresh");
+
+  // anything up to the highest ID plus the slack might exist.
+  assert_equal<bool>(f.can_exist(element_type_node, 1), true, "node 1");
+  assert_equal<bool>(f.can_exist(element_type_node, 1005), true, "node 1005");
+  assert_equal<bool>(f.can_exist(element_type_node, 1006), false,
+                     "node 1006");
+  assert_equal<bool>(f.can_exist(element_type_way, 106), false, "way 106");
+  assert_equal<bool>(f.can_exist(element_type_relation, 15), true,
+                     "relation 15");
+  assert_equal<bool>(f.can_exist(element_type_relation, 16), false,
+                     "relation 16");
+
+  // a list goes to the database if any of its IDs might exist.
+  std::vector<osm_nwr_id_t> ids;
+  ids.push_back(5000);
+  ids.push_back(6000);
+  assert_equal<bool>(f.any_can_exist(element_type_node, ids), false,
+                     "list of nodes above the highest");
+  ids.push_back(3);
+  assert_equal<bool>(f.any_can_exist(element_type_node, ids), true,
+                     "list including an existing node");
+  assert_equal<uint64_t>(f.get_stats().filtered, 4, "lookups filtered");
+}
+
+void test_refresh() {
+  fake_db db;
+  existence_filter f(boost::bind(fetch, boost::ref(db)), pt::seconds(60),
+                     pt::seconds(1), 5);
+  f.refresh(start);
+
+  // nothing is reloaded until the interval has passed.
+  db.ids.node = 1100;
+  f.refresh(start + pt::seconds(30));
+  assert_equal<int>(db.num_fetched, 1, "fetches within the interval");
+
+  // but a lookup above the highest IDs rechecks them first, so elements
+  // created since the last reload are still found.
+  assert_equal<bool>(f.can_exist(element_type_node, 1050), true,
+                     "node created since the last refresh");
+  assert_equal<int>(db.num_fetched, 2, "fetches after a recheck");
+  assert_equal<uint64_t>(f.get_stats().rechecks, 1, "rechecks");
+
+  // after a reload, the slack is twice the growth since the last one.
+  f.refresh(start + pt::seconds(60));
+  assert_equal<int>(db.num_fetched, 3, "fetches after the interval");
+  assert_equal<bool>(f.can_exist(element_type_node, 1300), true,
+                     "node within growth slack");
+  assert_equal<bool>(f.can_exist(element_type_node, 1301), false,
+                     "node beyond growth slack");
+  assert_equal<bool>(f.can_exist(element_type_way, 105), true,
+                     "way within minimum slack");
+  assert_equal<uint64_t>(f.get_stats().refreshes, 2, "refreshes");
+}
+
+void test_recheck() {
+  fake_db db;
+  existence_filter f(boost::bind(fetch, boost::ref(db)), pt::seconds(60),
+                     pt::seconds(1), 5);
+  f.refresh(start);
+
+  // IDs are only rechecked once they might be stale, and then not again
+  // until the recheck interval has passed, however many lookups there are.
+  assert_equal<bool>(f.can_exist(element_type_node, 2000), false,
+                     "node just after the refresh");
+  f.refresh(start + pt::seconds(1));
+  assert_equal<bool>(f.can_exist(element_type_node, 2000), false,
+                     "node after the recheck interval");
+  assert_equal<bool>(f.can_exist(element_type_way, 2000), false,
+                     "way within the recheck interval");
+  std::vector<osm_nwr_id_t> ids(1, 2000);
+  assert_equal<bool>(f.any_can_exist(element_type_relation, ids), false,
+                     "list of relations within the recheck interval");
+  assert_equal<int>(db.num_fetched, 2, "fetches");
+  assert_equal<uint64_t>(f.get_stats().rechecks, 1, "rechecks");
+
+  // IDs up to the slack above the highest go to the database without one.
+  assert_equal<bool>(f.can_exist(element_type_node, 1005), true,
+                     "node within the slack");
+
+  // an element created since then is found after the next recheck.
+  db.ids.node = 2000;
+  f.refresh(start + pt::seconds(2));
+  assert_equal<bool>(f.can_exist(element_type_node, 2000), true,
+                     "node created since the last recheck");
+  assert_equal<int>(db.num_fetched, 3, "fetches after a second recheck");
+
+  // if the recheck fails, nothing is filtered.
+  db.down = true;
+  f.refresh(start + pt::seconds(3));
+  assert_equal<bool>(f.can_exist(element_type_node, 1000000), true,
+                     "node after a failed recheck");
+  assert_equal<uint64_t>(f.get_stats().failures, 1, "failed rechecks");
+}
+
+void test_failed_refresh() {
+  fake_db db;
+  existence_filter f(boost::bind(fetch, boost::ref(db)), pt::seconds(60),
+                     pt::seconds(1), 5);
+  f.refresh(start);
+
+  // when the IDs can't be reloaded, nothing is filtered.
+  db.down = true;
+  f.refresh(start + pt::seconds(60));
+  assert_equal<bool>(f.can_exist(element_type_node, 1000000), true,
+                     "node after failed refresh");
+  assert_equal<uint64_t>(f.get_stats().failures, 1, "failed refreshes");
+
+  // and it's used again once they can.
+  db.down = false;
+  f.refresh(start + pt::seconds(120));
+  assert_equal<bool>(f.can_exist(element_type_node, 1000000), false,
+                     "node after recovering");
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  try {
+    test_not_loaded();
+    test_filter();
+    test_refresh();
+    test_recheck();
+    test_failed_refresh();
+
+  } catch (const std::exception &ex) {
+    std::cerr << "EXCEPTION: " << ex.what() << std::endl;
+    return 1;
+
+  } catch (...) {
+    std::cerr << "UNKNOWN ERROR" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
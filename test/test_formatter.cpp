@@ -25,6 +25,51 @@ bool test_formatter::node_t::operator==(const node_t &other) const {
   return std::equal(tags.begin(), tags.end(), other.tags.begin());
 }
 
+test_formatter::way_t::way_t(const element_info &elem_, const nodes_t &nodes_,
+                             const tags_t &tags_)
+  : elem(elem_), nodes(nodes_), tags(tags_) {}
+
+bool test_formatter::way_t::operator==(const way_t &other) const {
+#define CMP(sym) { if ((sym) != other. sym) { return false; } }
+  CMP(elem.id);
+  CMP(elem.version);
+  CMP(elem.changeset);
+  CMP(elem.timestamp);
+  CMP(elem.uid);
+  CMP(elem.display_name);
+  CMP(elem.visible);
+  CMP(nodes);
+  CMP(tags.size());
+#undef CMP
+  return std::equal(tags.begin(), tags.end(), other.tags.begin());
+}
+
+test_formatter::relation_t::relation_t(const element_info &elem_,
+                                       const members_t &members_,
+                                       const tags_t &tags_)
+  : elem(elem_), members(members_), tags(tags_) {}
+
+bool test_formatter::relation_t::operator==(const relation_t &other) const {
+#define CMP(sym) { if ((sym) != other. sym) { return false; } }
+  CMP(elem.id);
+  CMP(elem.version);
+  CMP(elem.changeset);
+  CMP(elem.timestamp);
+  CMP(elem.uid);
+  CMP(elem.display_name);
+  CMP(elem.visible);
+  CMP(members.size());
+  CMP(tags.size());
+#undef CMP
+  members_t::const_iterator a = members.begin(), b = other.members.begin();
+  for (; a != members.end(); ++a, ++b) {
+    if ((a->type != b->type) || (a->ref != b->ref) || (a->role != b->role)) {
+      return false;
+    }
+  }
+  return std::equal(tags.begin(), tags.end(), other.tags.begin());
+}
+
 test_formatter::changeset_t::changeset_t(const changeset_info &info,
                                          const tags_t &tags,
                                          bool include_comments,
@@ -87,10 +132,12 @@ void test_formatter::write_node(const element_info &elem, double lon, double lat
 }
 void test_formatter::write_way(const element_info &elem, const nodes_t &nodes,
                                const tags_t &tags) {
+  m_ways.push_back(way_t(elem, nodes, tags));
 }
 
 void test_formatter::write_relation(const element_info &elem,
                                     const members_t &members, const tags_t &tags) {
+  m_relations.push_back(relation_t(elem, members, tags));
 }
 
 void test_formatter::write_changeset(const changeset_info &elem, const tags_t &tags,
@@ -129,6 +176,53 @@ std::ostream &operator<<(std::ostream &out, const test_formatter::node_t &n) {
   return out;
 }
 
+std::ostream &operator<<(std::ostream &out, const test_formatter::way_t &w) {
+  out << "way(element_info("
+      << "id=" << w.elem.id << ", "
+      << "version=" << w.elem.version << ", "
+      << "changeset=" << w.elem.changeset << ", "
+      << "timestamp=" << w.elem.timestamp << ", "
+      << "uid=" << w.elem.uid << ", "
+      << "display_name=" << w.elem.display_name << ", "
+      << "visible=" << w.elem.visible << "), "
+      << "nodes[";
+  BOOST_FOREACH(const nodes_t::value_type &v, w.nodes) {
+    out << v << ", ";
+  }
+  out << "], tags{";
+  BOOST_FOREACH(const tags_t::value_type &v, w.tags) {
+    out << "\"" << v.first << "\" => \"" << v.second << "\", ";
+  }
+  out << "})";
+
+  return out;
+}
+
+std::ostream &operator<<(std::ostream &out,
+                         const test_formatter::relation_t &r) {
+  out << "relation(element_info("
+      << "id=" << r.elem.id << ", "
+      << "version=" << r.elem.version << ", "
+      << "changeset=" << r.elem.changeset << ", "
+      << "timestamp=" << r.elem.timestamp << ", "
+      << "uid=" << r.elem.uid << ", "
+      << "display_name=" << r.elem.display_name << ", "
+      << "visible=" << r.elem.visible << "), "
+      << "members[";
+  BOOST_FOREACH(const members_t::value_type &v, r.members) {
+    out << "member(type=" << v.type << ", "
+        << "ref=" << v.ref << ", "
+        << "role=\"" << v.role << "\"), ";
+  }
+  out << "], tags{";
+  BOOST_FOREACH(const tags_t::value_type &v, r.tags) {
+    out << "\"" << v.first << "\" => \"" << v.second << "\", ";
+  }
+  out << "})";
+
+  return out;
+}
+
 std::ostream &operator<<(std::ostream &out, const bbox &b) {
   out << "bbox("
       << b.minlon << ", "
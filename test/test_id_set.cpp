@@ -0,0 +1,181 @@
+#include "cgimap/backend/apidb/id_set.hpp"
+#include "cgimap/types.hpp"
+
+#include <stdexcept>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+namespace {
+
+template <typename T>
+void assert_equal(const T &a, const T &b, const std::string &message) {
+  if (a != b) {
+    std::ostringstream ostr;
+    ostr << "Expecting " << message << " to be equal, but " << a << " != "
+         << b;
+    throw std::runtime_error(ostr.str());
+  }
+}
+
+void assert_contents(const id_set<osm_nwr_id_t> &ids,
+                     const std::vector<osm_nwr_id_t> &expected) {
+  const std::vector<osm_nwr_id_t> actual(ids.begin(), ids.end());
+  if (actual != expected) {
+    std::ostringstream ostr;
+    ostr << "Expected set to contain [";
+    for (size_t i = 0; i < expected.size(); ++i) {
+      ostr << (i > 0 ? "," : "") << expected[i];
+    }
+    ostr << "], but it contains [";
+    for (size_t i = 0; i < actual.size(); ++i) {
+      ostr << (i > 0 ? "," : "") << actual[i];
+    }
+    ostr << "].";
+    throw std::runtime_error(ostr.str());
+  }
+}
+
+void test_batch_insert() {
+  id_set<osm_nwr_id_t> ids;
+
+  // unsorted, with duplicates
+  std::vector<osm_nwr_id_t> batch;
+  batch.push_back(5);
+  batch.push_back(3);
+  batch.push_back(5);
+  batch.push_back(1);
+  assert_equal<size_t>(ids.insert_batch(batch), 3,
+                       "number of new IDs from first batch");
+
+  std::vector<osm_nwr_id_t> expected;
+  expected.push_back(1);
+  expected.push_back(3);
+  expected.push_back(5);
+  assert_contents(ids, expected);
+
+  // overlapping with the existing IDs
+  batch.clear();
+  batch.push_back(6);
+  batch.push_back(3);
+  batch.push_back(2);
+  batch.push_back(6);
+  assert_equal<size_t>(ids.insert_batch(batch), 2,
+                       "number of new IDs from second batch");
+
+  expected.clear();
+  expected.push_back(1);
+  expected.push_back(2);
+  expected.push_back(3);
+  expected.push_back(5);
+  expected.push_back(6);
+  assert_contents(ids, expected);
+
+  // nothing new
+  batch.clear();
+  batch.push_back(1);
+  batch.push_back(6);
+  assert_equal<size_t>(ids.insert(batch.begin(), batch.end()), 0,
+                       "number of new IDs from repeated batch");
+  assert_contents(ids, expected);
+
+  // empty batch
+  batch.clear();
+  assert_equal<size_t>(ids.insert_batch(batch), 0,
+                       "number of new IDs from empty batch");
+  assert_contents(ids, expected);
+}
+
+void test_single_insert() {
+  id_set<osm_nwr_id_t> ids;
+
+  assert_equal<bool>(ids.insert(10), true, "first insert of 10");
+  assert_equal<bool>(ids.insert(2), true, "first insert of 2");
+  assert_equal<bool>(ids.insert(10), false, "second insert of 10");
+  assert_equal<size_t>(ids.size(), 2, "size after single inserts");
+
+  assert_equal<bool>(ids.count(2), true, "2 in set");
+  assert_equal<bool>(ids.count(10), true, "10 in set");
+  assert_equal<bool>(ids.count(5), false, "5 in set");
+
+  std::vector<osm_nwr_id_t> expected;
+  expected.push_back(2);
+  expected.push_back(10);
+  assert_contents(ids, expected);
+}
+
+void test_large_merge() {
+  id_set<osm_nwr_id_t> ids;
+
+  // evens, then multiples of three, so that about half of the second
+  // batch is already present.
+  std::vector<osm_nwr_id_t> evens, threes;
+  for (osm_nwr_id_t i = 0; i < 10000; i += 2) {
+    evens.push_back(10000 - i);
+  }
+  for (osm_nwr_id_t i = 0; i < 10000; i += 3) {
+    threes.push_back(i);
+  }
+
+  assert_equal<size_t>(ids.insert_batch(evens), 5000, "new evens");
+  assert_equal<size_t>(ids.insert_batch(threes), 1668, "new multiples of 3");
+  assert_equal<size_t>(ids.size(), 6668, "size after large merge");
+
+  osm_nwr_id_t prev = 0;
+  for (id_set<osm_nwr_id_t>::const_iterator itr = ids.begin();
+       itr != ids.end(); ++itr) {
+    if ((itr != ids.begin()) && (*itr <= prev)) {
+      throw std::runtime_error("Expected set to be strictly increasing.");
+    }
+    prev = *itr;
+  }
+}
+
+void test_erase_batch() {
+  id_set<osm_nwr_id_t> ids;
+  std::vector<osm_nwr_id_t> batch;
+  for (osm_nwr_id_t i = 1; i <= 10; ++i) {
+    batch.push_back(i);
+  }
+  ids.insert_batch(batch);
+
+  // in any order, with duplicates and IDs which aren't in the set.
+  std::vector<osm_nwr_id_t> to_erase;
+  to_erase.push_back(7);
+  to_erase.push_back(2);
+  to_erase.push_back(7);
+  to_erase.push_back(20);
+  assert_equal<size_t>(ids.erase_batch(to_erase), 2, "number erased");
+
+  std::vector<osm_nwr_id_t> expected;
+  expected.push_back(1);
+  expected.push_back(3);
+  expected.push_back(4);
+  expected.push_back(5);
+  expected.push_back(6);
+  expected.push_back(8);
+  expected.push_back(9);
+  expected.push_back(10);
+  assert_contents(ids, expected);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  try {
+    test_batch_insert();
+    test_single_insert();
+    test_large_merge();
+    test_erase_batch();
+
+  } catch (const std::exception &ex) {
+    std::cerr << "EXCEPTION: " << ex.what() << std::endl;
+    return 1;
+
+  } catch (...) {
+    std::cerr << "UNKNOWN ERROR" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
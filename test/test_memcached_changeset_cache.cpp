@@ -0,0 +1,229 @@
+#include "cgimap/backend/apidb/memcached_changeset_cache.hpp"
+
+#include <stdexcept>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <boost/bind.hpp>
+#include <boost/ref.hpp>
+#include <boost/scoped_ptr.hpp>
+
+namespace {
+
+template <typename T>
+void assert_equal(const T &a, const T &b, const std::string &message) {
+  if (a != b) {
+    std::ostringstream ostr;
+    ostr << "Expecting " << message << " to be equal, but " << a << " != "
+         << b;
+    throw std::runtime_error(ostr.str());
+  }
+}
+
+// stands in for the database, counting the changesets fetched.
+changeset *fetch_one(int &num_fetched, osm_changeset_id_t id) {
+  ++num_fetched;
+  return new changeset(true, "user " + std::to_string(id),
+                       osm_user_id_t(id * 10));
+}
+
+void fetch_batch(int &num_fetched, const std::vector<osm_changeset_id_t> &ids,
+                 cache<osm_changeset_id_t, changeset>::batch_type &out) {
+  for (std::vector<osm_changeset_id_t>::const_iterator itr = ids.begin();
+       itr != ids.end(); ++itr) {
+    boost::shared_ptr<changeset const> c(fetch_one(num_fetched, *itr));
+    out.push_back(std::make_pair(*itr, c));
+  }
+}
+
+void test_encode_decode() {
+  const changeset c(true, "a name with spaces", 1234);
+  const std::string value = memcached_changeset_cache::encode(c);
+  boost::scoped_ptr<changeset> d(
+      memcached_changeset_cache::decode(value.data(), value.size()));
+  assert_equal<bool>(d != NULL, true, "decoded changeset");
+  assert_equal<bool>(d->data_public, true, "decoded data_public");
+  assert_equal<std::string>(d->display_name, "a name with spaces",
+                            "decoded display_name");
+  assert_equal<osm_user_id_t>(d->user_id, 1234, "decoded user_id");
+
+  // anonymous users have an empty display name.
+  const changeset anon(false, "", 0);
+  const std::string anon_value = memcached_changeset_cache::encode(anon);
+  boost::scoped_ptr<changeset> e(
+      memcached_changeset_cache::decode(anon_value.data(), anon_value.size()));
+  assert_equal<bool>(e != NULL, true, "decoded anonymous changeset");
+  assert_equal<bool>(e->data_public, false, "anonymous data_public");
+  assert_equal<std::string>(e->display_name, "", "anonymous display_name");
+
+  const char *bad[] = { "", "1", "2 10 x", "1 x name", "1  name", "1 10" };
+  for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i) {
+    boost::scoped_ptr<changeset> b(
+        memcached_changeset_cache::decode(bad[i], strlen(bad[i])));
+    assert_equal<bool>(b == NULL, true,
+                       std::string("decoding malformed \"") + bad[i] + "\"");
+  }
+}
+
+void test_key() {
+  memcached_changeset_cache mc("127.0.0.1:1", "test:", 60);
+  assert_equal<std::string>(mc.key(42), "test:v1:42", "key for changeset");
+}
+
+void test_unreachable_server() {
+  // nothing listens on port 1, so everything should come from fetch.
+  memcached_changeset_cache mc("127.0.0.1:1", "test:", 60);
+  int num_fetched = 0;
+
+  boost::scoped_ptr<changeset> a(
+      mc.get_or_fetch(5, boost::bind(fetch_one, boost::ref(num_fetched), _1)));
+  assert_equal<bool>(a != NULL, true, "changeset from fetch");
+  assert_equal<std::string>(a->display_name, "user 5", "fetched name");
+
+  std::vector<osm_changeset_id_t> ids;
+  for (osm_changeset_id_t id = 1; id <= 300; ++id) {
+    ids.push_back(id);
+  }
+  cache<osm_changeset_id_t, changeset>::batch_type out;
+  mc.get_or_fetch(ids, out,
+                  boost::bind(fetch_batch, boost::ref(num_fetched), _1, _2));
+  assert_equal<size_t>(out.size(), 300, "changesets returned from batch");
+  assert_equal<int>(num_fetched, 301, "fetches with memcached unreachable");
+  assert_equal<uint64_t>(mc.get_stats().hits, 0, "hits");
+  assert_equal<uint64_t>(mc.get_stats().misses, 301, "misses");
+}
+
+// the changesets in a batch, keyed by ID, checking that none of them came
+// back twice.
+std::map<osm_changeset_id_t, std::string>
+names_by_id(const cache<osm_changeset_id_t, changeset>::batch_type &out) {
+  std::map<osm_changeset_id_t, std::string> names;
+  for (cache<osm_changeset_id_t, changeset>::batch_type::const_iterator itr =
+           out.begin();
+       itr != out.end(); ++itr) {
+    assert_equal<bool>(names.count(itr->first) == 0, true,
+                       "changeset returned once");
+    names[itr->first] = itr->second->display_name;
+  }
+  return names;
+}
+
+void test_put_then_get() {
+  // a changeset fetched by one host is there for the others.
+  memcached_changeset_cache first("127.0.0.1:11211", "put_then_get:", 60);
+  memcached_changeset_cache second("127.0.0.1:11211", "put_then_get:", 60);
+  int num_fetched = 0;
+
+  boost::scoped_ptr<changeset> a(first.get_or_fetch(
+      7, boost::bind(fetch_one, boost::ref(num_fetched), _1)));
+  assert_equal<int>(num_fetched, 1, "fetches on first get");
+  assert_equal<uint64_t>(first.get_stats().misses, 1, "misses on first get");
+
+  boost::scoped_ptr<changeset> b(second.get_or_fetch(
+      7, boost::bind(fetch_one, boost::ref(num_fetched), _1)));
+  assert_equal<bool>(b != NULL, true, "changeset from memcached");
+  assert_equal<int>(num_fetched, 1, "fetches after put");
+  assert_equal<uint64_t>(second.get_stats().hits, 1, "hits after put");
+  assert_equal<std::string>(b->display_name, "user 7", "name after put");
+  assert_equal<osm_user_id_t>(b->user_id, 70, "user ID after put");
+  assert_equal<uint64_t>(second.get_stats().errors, 0, "errors after put");
+}
+
+void test_full_hit() {
+  // more than one multi-get's worth, all of which are already in memcached.
+  std::vector<osm_changeset_id_t> ids;
+  for (osm_changeset_id_t id = 1; id <= 300; ++id) {
+    ids.push_back(id);
+  }
+  int num_fetched = 0;
+
+  memcached_changeset_cache first("127.0.0.1:11211", "full_hit:", 60);
+  cache<osm_changeset_id_t, changeset>::batch_type filled;
+  first.get_or_fetch(ids, filled,
+                     boost::bind(fetch_batch, boost::ref(num_fetched), _1, _2));
+  assert_equal<int>(num_fetched, 300, "fetches filling memcached");
+
+  memcached_changeset_cache second("127.0.0.1:11211", "full_hit:", 60);
+  cache<osm_changeset_id_t, changeset>::batch_type out;
+  second.get_or_fetch(
+      ids, out, boost::bind(fetch_batch, boost::ref(num_fetched), _1, _2));
+  assert_equal<int>(num_fetched, 300, "fetches with all in memcached");
+  assert_equal<uint64_t>(second.get_stats().hits, 300, "hits");
+  assert_equal<uint64_t>(second.get_stats().misses, 0, "misses");
+
+  const std::map<osm_changeset_id_t, std::string> names = names_by_id(out);
+  assert_equal<size_t>(names.size(), 300, "changesets returned");
+  for (osm_changeset_id_t id = 1; id <= 300; ++id) {
+    std::map<osm_changeset_id_t, std::string>::const_iterator itr =
+        names.find(id);
+    assert_equal<bool>(itr != names.end(), true, "changeset returned");
+    assert_equal<std::string>(itr->second, "user " + std::to_string(id),
+                              "name from memcached");
+  }
+}
+
+void test_partial_hit() {
+  // only the even changesets are in memcached, so just the odd ones should
+  // be fetched.
+  memcached_changeset_cache mc("127.0.0.1:11211", "partial_hit:", 60);
+  int num_fetched = 0;
+  for (osm_changeset_id_t id = 2; id <= 20; id += 2) {
+    boost::scoped_ptr<changeset> c(mc.get_or_fetch(
+        id, boost::bind(fetch_one, boost::ref(num_fetched), _1)));
+  }
+  assert_equal<int>(num_fetched, 10, "fetches filling memcached");
+
+  std::vector<osm_changeset_id_t> ids;
+  for (osm_changeset_id_t id = 1; id <= 20; ++id) {
+    ids.push_back(id);
+  }
+  cache<osm_changeset_id_t, changeset>::batch_type out;
+  mc.get_or_fetch(ids, out,
+                  boost::bind(fetch_batch, boost::ref(num_fetched), _1, _2));
+  assert_equal<int>(num_fetched, 20, "fetches for the missing changesets");
+  assert_equal<uint64_t>(mc.get_stats().hits, 10, "hits");
+  assert_equal<uint64_t>(mc.get_stats().misses, 20, "misses");
+
+  const std::map<osm_changeset_id_t, std::string> names = names_by_id(out);
+  assert_equal<size_t>(names.size(), 20, "changesets returned");
+  for (osm_changeset_id_t id = 1; id <= 20; ++id) {
+    std::map<osm_changeset_id_t, std::string>::const_iterator itr =
+        names.find(id);
+    assert_equal<bool>(itr != names.end(), true, "changeset returned");
+    assert_equal<std::string>(itr->second, "user " + std::to_string(id),
+                              "name of changeset");
+  }
+
+  // the ones which were fetched have been put back, so now all are there.
+  cache<osm_changeset_id_t, changeset>::batch_type again;
+  mc.get_or_fetch(ids, again,
+                  boost::bind(fetch_batch, boost::ref(num_fetched), _1, _2));
+  assert_equal<int>(num_fetched, 20, "fetches once all are in memcached");
+  assert_equal<size_t>(again.size(), 20, "changesets returned again");
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  try {
+    test_encode_decode();
+    test_key();
+    test_unreachable_server();
+    test_put_then_get();
+    test_full_hit();
+    test_partial_hit();
+
+  } catch (const std::exception &ex) {
+    std::cerr << "EXCEPTION: " << ex.what() << std::endl;
+    return 1;
+
+  } catch (...) {
+    std::cerr << "UNKNOWN ERROR" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,104 @@
+#include "cgimap/backend/apidb/node_density.hpp"
+#include "cgimap/backend/apidb/quad_tile.hpp"
+
+#include <stdexcept>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+template <typename T>
+void assert_equal(const T &a, const T &b, const std::string &message) {
+  if (a != b) {
+    std::ostringstream ostr;
+    ostr << "Expecting " << message << " to be equal, but " << a << " != "
+         << b;
+    throw std::runtime_error(ostr.str());
+  }
+}
+
+const int MAX_NODES = 50000;
+
+// the cell which the point is in.
+tile_id_t cell_at(double lat, double lon) {
+  return tiles_for_area(lat, lon, lat, lon).front() >>
+         (2 * (16 - node_density::ZOOM));
+}
+
+// a bbox which wholly contains the cell the point is in, and not much more.
+bbox around_cell(double lat, double lon) {
+  return bbox(lat - 0.1, lon - 0.2, lat + 0.1, lon + 0.2);
+}
+
+void test_min_nodes() {
+  node_density::counts_t counts;
+  counts.push_back(std::make_pair(cell_at(51.5, -0.1), uint64_t(1000)));
+  counts.push_back(std::make_pair(cell_at(51.5, 0.5), uint64_t(20)));
+  node_density density(counts);
+
+  // a bbox inside a cell doesn't wholly contain any of it.
+  assert_equal<uint64_t>(density.min_nodes(bbox(51.49, -0.11, 51.51, -0.09)),
+                         0, "nodes in a bbox smaller than a cell");
+
+  // a bbox around a cell gets its count.
+  assert_equal<uint64_t>(density.min_nodes(around_cell(51.5, -0.1)), 1000,
+                         "nodes in a bbox around a cell");
+
+  // and one around both cells gets both, with nothing for cells missing
+  // from the counts.
+  assert_equal<uint64_t>(density.min_nodes(bbox(51.3, -0.4, 51.7, 0.8)),
+                         1020, "nodes in a bbox around both cells");
+
+  assert_equal<size_t>(density.get_stats().cells, 2, "number of cells");
+}
+
+void test_too_many_nodes() {
+  const double lat = 10.0, lon = 10.0;
+  node_density::counts_t counts;
+  counts.push_back(std::make_pair(cell_at(lat, lon), uint64_t(0)));
+
+  // nodes well over the limit are turned away.
+  counts[0].second = 1000000;
+  node_density lots(counts);
+  assert_equal<bool>(lots.too_many_nodes(around_cell(lat, lon), MAX_NODES),
+                     true, "too many nodes, well over the limit");
+  assert_equal<uint64_t>(lots.get_stats().rejected, 1, "rejected bboxes");
+
+  // but not those just over, as some might have been deleted since.
+  counts[0].second = MAX_NODES + MAX_NODES / 10;
+  node_density close(counts);
+  assert_equal<bool>(close.too_many_nodes(around_cell(lat, lon), MAX_NODES),
+                     false, "too many nodes, just over the limit");
+  assert_equal<uint64_t>(close.get_stats().rejected, 0, "rejected bboxes");
+
+  counts[0].second += 1;
+  node_density over(counts);
+  assert_equal<bool>(over.too_many_nodes(around_cell(lat, lon), MAX_NODES),
+                     true, "too many nodes, past the margin");
+
+  // and never when the bbox doesn't wholly contain the cell.
+  assert_equal<bool>(
+      lots.too_many_nodes(bbox(lat, lon, lat + 0.01, lon + 0.01), MAX_NODES),
+      false, "too many nodes, bbox inside the cell");
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  try {
+    test_min_nodes();
+    test_too_many_nodes();
+
+  } catch (const std::exception &ex) {
+    std::cerr << "EXCEPTION: " << ex.what() << std::endl;
+    return 1;
+
+  } catch (...) {
+    std::cerr << "UNKNOWN ERROR" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
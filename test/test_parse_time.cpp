@@ -17,11 +17,33 @@ void assert_eq_time(pt::ptime expected, std::string str) {
   }
 }
 
+void assert_eq_format(const std::string &expected, int64_t t) {
+  const std::string formatted = format_time(t);
+  if (expected != formatted) {
+    std::ostringstream ostr;
+    ostr << "Expected " << expected << ", but got " << formatted
+         << " [from " << t << "] instead.";
+    throw std::runtime_error(ostr.str());
+  }
+}
+
 int main(int argc, char *argv[]) {
   try {
     assert_eq_time(pt::ptime(gg::date(2015, 8, 31), pt::time_duration(23, 40, 10)),
                    "2015-08-31T23:40:10Z");
 
+    assert_eq_format("1970-01-01T00:00:00Z", 0);
+    assert_eq_format("2015-08-31T23:40:10Z", 1441064410);
+    assert_eq_format("2000-02-29T12:00:00Z", 951825600);
+    assert_eq_format("1969-12-31T23:59:59Z", -1);
+
+    // should round-trip through parse_time
+    const pt::ptime epoch(gg::date(1970, 1, 1));
+    for (int64_t t = 0; t < 2000000000; t += 86399 * 367) {
+      const pt::ptime expected = epoch + pt::seconds(long(t));
+      assert_eq_time(expected, format_time(t));
+    }
+
   } catch (const std::exception &ex) {
     std::cerr << "EXCEPTION: " << ex.what() << std::endl;
     return 1;
@@ -0,0 +1,163 @@
+#include "cgimap/backend/apidb/pgsql_copy.hpp"
+
+#include <stdexcept>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+namespace {
+
+template <typename T>
+void assert_equal(const T &a, const T &b, const std::string &message) {
+  if (a != b) {
+    std::ostringstream ostr;
+    ostr << "Expecting " << message << " to be equal, but " << a << " != "
+         << b;
+    throw std::runtime_error(ostr.str());
+  }
+}
+
+// helpers to build binary COPY messages, in the same big-endian format as
+// the server sends them.
+void append_int16(std::string &buf, int16_t i) {
+  buf.push_back(char((i >> 8) & 0xff));
+  buf.push_back(char(i & 0xff));
+}
+
+void append_int32(std::string &buf, int32_t i) {
+  buf.push_back(char((i >> 24) & 0xff));
+  buf.push_back(char((i >> 16) & 0xff));
+  buf.push_back(char((i >> 8) & 0xff));
+  buf.push_back(char(i & 0xff));
+}
+
+void append_int64(std::string &buf, int64_t i) {
+  append_int32(buf, int32_t(uint64_t(i) >> 32));
+  append_int32(buf, int32_t(uint64_t(i) & 0xffffffff));
+}
+
+std::string copy_header() {
+  std::string buf("PGCOPY\n\377\r\n", 11);
+  append_int32(buf, 0); // flags
+  append_int32(buf, 0); // header extension length
+  return buf;
+}
+
+// a tuple of (bigint, boolean, integer, text, null)
+std::string copy_tuple(int64_t id, bool visible, int32_t lat,
+                       const std::string &k) {
+  std::string buf;
+  append_int16(buf, 5);
+  append_int32(buf, 8);
+  append_int64(buf, id);
+  append_int32(buf, 1);
+  buf.push_back(visible ? 1 : 0);
+  append_int32(buf, 4);
+  append_int32(buf, lat);
+  append_int32(buf, int32_t(k.size()));
+  buf.append(k);
+  append_int32(buf, -1);
+  return buf;
+}
+
+void test_parse_tuples() {
+  pgsql_copy_parser parser;
+
+  // the first message also holds the header
+  const std::string first = copy_header() + copy_tuple(1, true, -1, "name");
+  assert_equal<bool>(parser.parse(first.data(), first.size()), true,
+                     "first message is a tuple");
+  assert_equal<size_t>(parser.num_fields(), 5, "number of fields");
+  assert_equal<int64_t>(parser.get_int64(0), 1, "first ID");
+  assert_equal<bool>(parser.get_bool(1), true, "first visible");
+  assert_equal<int32_t>(parser.get_int32(2), -1, "first latitude");
+  assert_equal<std::string>(parser.get_string(3), "name", "first key");
+  assert_equal<bool>(parser.is_null(3), false, "first key is null");
+  assert_equal<bool>(parser.is_null(4), true, "first last field is null");
+
+  // later ones don't
+  const std::string second =
+      copy_tuple(int64_t(1) << 40, false, 900000000, "");
+  assert_equal<bool>(parser.parse(second.data(), second.size()), true,
+                     "second message is a tuple");
+  assert_equal<int64_t>(parser.get_int64(0), int64_t(1) << 40, "second ID");
+  assert_equal<bool>(parser.get_bool(1), false, "second visible");
+  assert_equal<int32_t>(parser.get_int32(2), 900000000, "second latitude");
+  assert_equal<std::string>(parser.get_string(3), "", "second key");
+
+  std::string trailer;
+  append_int16(trailer, -1);
+  assert_equal<bool>(parser.parse(trailer.data(), trailer.size()), false,
+                     "trailer is a tuple");
+}
+
+void test_parse_errors() {
+  {
+    // header with the wrong signature
+    std::string bad = copy_header() + copy_tuple(1, true, 0, "k");
+    bad[0] = 'X';
+    pgsql_copy_parser parser;
+    bool threw = false;
+    try {
+      parser.parse(bad.data(), bad.size());
+    } catch (const std::runtime_error &) {
+      threw = true;
+    }
+    assert_equal<bool>(threw, true, "bad signature throws");
+  }
+
+  {
+    // a tuple cut off part way through a field
+    const std::string truncated = copy_header() + copy_tuple(1, true, 0, "k");
+    pgsql_copy_parser parser;
+    bool threw = false;
+    try {
+      parser.parse(truncated.data(), truncated.size() - 6);
+    } catch (const std::runtime_error &) {
+      threw = true;
+    }
+    assert_equal<bool>(threw, true, "truncated tuple throws");
+  }
+
+  {
+    // reading a field as the wrong type, or a null as a string
+    const std::string msg = copy_header() + copy_tuple(1, true, 0, "k");
+    pgsql_copy_parser parser;
+    parser.parse(msg.data(), msg.size());
+
+    bool threw = false;
+    try {
+      parser.get_int32(0);
+    } catch (const std::runtime_error &) {
+      threw = true;
+    }
+    assert_equal<bool>(threw, true, "reading bigint as integer throws");
+
+    threw = false;
+    try {
+      parser.get_string(4);
+    } catch (const std::runtime_error &) {
+      threw = true;
+    }
+    assert_equal<bool>(threw, true, "reading null as string throws");
+  }
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  try {
+    test_parse_tuples();
+    test_parse_errors();
+
+  } catch (const std::exception &ex) {
+    std::cerr << "EXCEPTION: " << ex.what() << std::endl;
+    return 1;
+
+  } catch (...) {
+    std::cerr << "UNKNOWN ERROR" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,225 @@
+#include "cgimap/backend/apidb/quad_tile.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+template <typename T>
+void assert_equal(const T &a, const T &b, const std::string &message) {
+  if (a != b) {
+    std::ostringstream ostr;
+    ostr << "Expecting " << message << " to be equal, but " << a << " != "
+         << b;
+    throw std::runtime_error(ostr.str());
+  }
+}
+
+struct area {
+  double minlat, minlon, maxlat, maxlon;
+};
+
+// a mix of tiny, small and large areas, some on tile block boundaries and
+// some crossing the equator and prime meridian.
+const area areas[] = {
+  { 0.0, 0.0, 0.0, 0.0 },
+  { 51.5, -0.13, 51.51, -0.12 },
+  { -0.1, -0.1, 0.1, 0.1 },
+  { 51.25, -0.5, 51.75, 0.0 },
+  { -33.9, 18.4, -33.8, 18.6 },
+  { -90.0, -180.0, -89.9, -179.9 },
+  { 10.0, 10.0, 12.0, 13.0 },
+};
+
+// the tiles covered by the ranges, one by one.
+std::vector<tile_id_t> expand(const std::vector<tile_range_t> &ranges) {
+  std::vector<tile_id_t> tiles;
+  for (std::vector<tile_range_t>::const_iterator itr = ranges.begin();
+       itr != ranges.end(); ++itr) {
+    for (uint64_t t = itr->first; t <= itr->second; ++t) {
+      tiles.push_back(tile_id_t(t));
+    }
+  }
+  return tiles;
+}
+
+// ranges must be sorted, and separated by at least one tile, otherwise
+// they should have been joined up.
+void check_sorted(const std::vector<tile_range_t> &ranges,
+                  const std::string &message) {
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    if (ranges[i].first > ranges[i].second) {
+      throw std::runtime_error("Empty range in " + message + ".");
+    }
+    if ((i > 0) && (uint64_t(ranges[i - 1].second) + 1 >= ranges[i].first)) {
+      throw std::runtime_error("Unsorted or adjacent ranges in " + message +
+                               ".");
+    }
+  }
+}
+
+void test_exact_ranges() {
+  for (size_t i = 0; i < sizeof(areas) / sizeof(areas[0]); ++i) {
+    const area &a = areas[i];
+    std::ostringstream message;
+    message << "area " << i;
+
+    // without a limit, the ranges cover exactly the same tiles.
+    const std::vector<tile_range_t> ranges =
+        tile_ranges_for_area(a.minlat, a.minlon, a.maxlat, a.maxlon, 0);
+    check_sorted(ranges, message.str());
+
+    const std::vector<tile_id_t> tiles =
+        tiles_for_area(a.minlat, a.minlon, a.maxlat, a.maxlon);
+    const std::vector<tile_id_t> expanded = expand(ranges);
+    assert_equal<size_t>(expanded.size(), tiles.size(),
+                         "number of tiles in " + message.str());
+    for (size_t j = 0; j < tiles.size(); ++j) {
+      assert_equal<tile_id_t>(expanded[j], tiles[j],
+                              "tile in " + message.str());
+    }
+
+    // and there are far fewer ranges than tiles for anything but the
+    // smallest areas.
+    if (tiles.size() > 1000) {
+      assert_equal<bool>(ranges.size() * 10 < tiles.size(), true,
+                         "ranges much fewer than tiles in " + message.str());
+    }
+  }
+}
+
+void test_limited_ranges() {
+  const size_t limits[] = { 1, 4, 64 };
+
+  for (size_t i = 0; i < sizeof(areas) / sizeof(areas[0]); ++i) {
+    const area &a = areas[i];
+    const std::vector<tile_range_t> exact =
+        tile_ranges_for_area(a.minlat, a.minlon, a.maxlat, a.maxlon, 0);
+
+    for (size_t j = 0; j < sizeof(limits) / sizeof(limits[0]); ++j) {
+      std::ostringstream message;
+      message << "area " << i << " limited to " << limits[j] << " ranges";
+
+      const std::vector<tile_range_t> ranges = tile_ranges_for_area(
+          a.minlat, a.minlon, a.maxlat, a.maxlon, limits[j]);
+      check_sorted(ranges, message.str());
+      assert_equal<size_t>(ranges.size(), std::min(limits[j], exact.size()),
+                           "number of ranges in " + message.str());
+
+      // every exact range must be inside one of the limited ranges.
+      size_t k = 0;
+      for (std::vector<tile_range_t>::const_iterator itr = exact.begin();
+           itr != exact.end(); ++itr) {
+        while ((k < ranges.size()) && (ranges[k].second < itr->second)) {
+          ++k;
+        }
+        if ((k == ranges.size()) || (ranges[k].first > itr->first)) {
+          throw std::runtime_error("Tiles missing from " + message.str() +
+                                   ".");
+        }
+      }
+
+      // and the ends are the same, as only gaps are filled in.
+      if (!exact.empty()) {
+        assert_equal<tile_id_t>(ranges.front().first, exact.front().first,
+                                "first tile in " + message.str());
+        assert_equal<tile_id_t>(ranges.back().second, exact.back().second,
+                                "last tile in " + message.str());
+      }
+    }
+  }
+}
+
+void test_whole_world() {
+  // the whole world is a single block, so a single range.
+  const std::vector<tile_range_t> ranges =
+      tile_ranges_for_area(-90.0, -180.0, 90.0, 180.0, 0);
+  assert_equal<size_t>(ranges.size(), 1, "ranges for the whole world");
+  assert_equal<tile_id_t>(ranges[0].first, 0, "first tile in the world");
+  assert_equal<tile_id_t>(ranges[0].second, 0xffffffffu,
+                          "last tile in the world");
+}
+
+// the x and y coordinates of a tile, undoing the interleaving.
+void tile2xy(tile_id_t tile, unsigned int &x, unsigned int &y) {
+  x = y = 0;
+  for (int i = 15; i >= 0; --i) {
+    x |= ((tile >> (2 * i + 1)) & 1) << i;
+    y |= ((tile >> (2 * i)) & 1) << i;
+  }
+}
+
+void test_cells_inside() {
+  const int zoom = 11, shift = 2 * (16 - zoom);
+
+  for (size_t i = 0; i < sizeof(areas) / sizeof(areas[0]); ++i) {
+    const area &a = areas[i];
+    std::ostringstream message;
+    message << "area " << i;
+
+    // count the tiles of each cell which aren't on the edge of the area.
+    const std::vector<tile_id_t> tiles =
+        tiles_for_area(a.minlat, a.minlon, a.maxlat, a.maxlon);
+    unsigned int minx = 0xffff, maxx = 0, miny = 0xffff, maxy = 0;
+    for (size_t j = 0; j < tiles.size(); ++j) {
+      unsigned int x, y;
+      tile2xy(tiles[j], x, y);
+      minx = std::min(minx, x);
+      maxx = std::max(maxx, x);
+      miny = std::min(miny, y);
+      maxy = std::max(maxy, y);
+    }
+    std::map<tile_id_t, size_t> inner;
+    for (size_t j = 0; j < tiles.size(); ++j) {
+      unsigned int x, y;
+      tile2xy(tiles[j], x, y);
+      if ((x > minx) && (x < maxx) && (y > miny) && (y < maxy)) {
+        ++inner[tiles[j] >> shift];
+      }
+    }
+
+    // the cells inside are exactly those with all their tiles counted.
+    std::vector<tile_id_t> expected;
+    for (std::map<tile_id_t, size_t>::const_iterator itr = inner.begin();
+         itr != inner.end(); ++itr) {
+      if (itr->second == (size_t(1) << shift)) {
+        expected.push_back(itr->first);
+      }
+    }
+
+    const std::vector<tile_id_t> cells =
+        cells_inside_area(a.minlat, a.minlon, a.maxlat, a.maxlon, zoom);
+    assert_equal<size_t>(cells.size(), expected.size(),
+                         "number of cells in " + message.str());
+    for (size_t j = 0; j < cells.size(); ++j) {
+      assert_equal<tile_id_t>(cells[j], expected[j],
+                              "cell in " + message.str());
+    }
+  }
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  try {
+    test_exact_ranges();
+    test_limited_ranges();
+    test_whole_world();
+    test_cells_inside();
+
+  } catch (const std::exception &ex) {
+    std::cerr << "EXCEPTION: " << ex.what() << std::endl;
+    return 1;
+
+  } catch (...) {
+    std::cerr << "UNKNOWN ERROR" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
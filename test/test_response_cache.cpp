@@ -0,0 +1,556 @@
+#include "cgimap/config.hpp"
+#include "cgimap/response_cache.hpp"
+#include "cgimap/output_buffer.hpp"
+#include "cgimap/data_selection.hpp"
+#include "cgimap/process_request.hpp"
+#include "cgimap/rate_limiter.hpp"
+#include "cgimap/routes.hpp"
+#include "test_request.hpp"
+#ifdef HAVE_YAJL
+#include "cgimap/json_writer.hpp"
+#endif
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/program_options.hpp>
+#include <boost/ref.hpp>
+#include <boost/shared_ptr.hpp>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace fs = boost::filesystem;
+namespace po = boost::program_options;
+namespace pt = boost::posix_time;
+
+namespace {
+
+template <typename T>
+void assert_equal(const T &a, const T &b, const std::string &message) {
+  if (a != b) {
+    std::ostringstream ostr;
+    ostr << "Expecting " << message << " to be equal, but " << a << " != "
+         << b;
+    throw std::runtime_error(ostr.str());
+  }
+}
+
+response_cache::entry make_entry(const std::string &body) {
+  response_cache::entry e;
+  e.content_type = "text/xml; charset=utf-8";
+  e.content_encoding = "gzip";
+  e.cache_control = "private, max-age=0, must-revalidate";
+  e.body = body;
+  e.written = body.size() * 4;
+  return e;
+}
+
+/**
+ * a temporary directory for osmChange files, removed afterwards.
+ */
+struct temp_dir {
+  temp_dir() {
+    char name[] = "/tmp/test_response_cache_XXXXXX";
+    if (mkdtemp(name) == NULL) {
+      throw std::runtime_error("Unable to make temporary directory.");
+    }
+    path = name;
+  }
+  ~temp_dir() { fs::remove_all(path); }
+
+  void write(const std::string &name, const std::string &content) const {
+    std::ofstream out((fs::path(path) / name).string().c_str());
+    out << content;
+  }
+
+  std::string path;
+};
+
+const char *const NODE_2_CHANGE =
+    "<osmChange version=\"0.6\">\n"
+    "<modify>\n"
+    "  <node id=\"2\" version=\"2\" lat=\"51.5\" lon=\"-0.1\"/>\n"
+    "</modify>\n"
+    "</osmChange>\n";
+
+void test_get_put() {
+  temp_dir dir;
+  response_cache cache(1 << 20, dir.path);
+
+  response_cache::entry out;
+  assert_equal<bool>(cache.get("a", out), false, "get before put");
+
+  response_cache::dependencies deps;
+  deps.add_element(element_type_way, 1);
+  deps.add_element(element_type_node, 2);
+  cache.put("a", make_entry("body of a"), deps, cache.epoch());
+
+  assert_equal<bool>(cache.get("a", out), true, "get after put");
+  assert_equal<std::string>(out.body, "body of a", "body");
+  assert_equal<std::string>(out.content_type, "text/xml; charset=utf-8",
+                            "content type");
+  assert_equal<std::string>(out.content_encoding, "gzip", "encoding");
+  assert_equal<uint64_t>(out.written, 36, "bytes written");
+  assert_equal<bool>(cache.get("b", out), false, "get of another key");
+
+  // putting the same key again replaces what was there.
+  cache.put("a", make_entry("new body of a"), deps, cache.epoch());
+  assert_equal<bool>(cache.get("a", out), true, "get after second put");
+  assert_equal<std::string>(out.body, "new body of a", "replaced body");
+
+  response_cache::stats s = cache.get_stats();
+  assert_equal<uint64_t>(s.inserts, 2, "number of inserts");
+  assert_equal<uint64_t>(s.hits, 2, "number of hits");
+  assert_equal<uint64_t>(s.misses, 2, "number of misses");
+}
+
+void test_invalidate_elements() {
+  temp_dir dir;
+  response_cache cache(1 << 20, dir.path);
+  response_cache::entry out;
+
+  response_cache::dependencies deps;
+  deps.add_element(element_type_way, 1);
+  deps.add_element(element_type_node, 2);
+  cache.put("way 1", make_entry("way 1"), deps, cache.epoch());
+
+  // changes to anything else, including a way with the same ID as the
+  // node, leave it alone.
+  response_cache::dependencies other;
+  other.add_element(element_type_node, 1);
+  other.add_element(element_type_way, 2);
+  other.add_element(element_type_relation, 1);
+  cache.invalidate(other);
+  assert_equal<bool>(cache.get("way 1", out), true,
+                     "get after unrelated changes");
+
+  response_cache::dependencies node;
+  node.add_element(element_type_node, 2);
+  cache.invalidate(node);
+  assert_equal<bool>(cache.get("way 1", out), false,
+                     "get after a node in it changed");
+  assert_equal<uint64_t>(cache.get_stats().stale, 1, "number of stale gets");
+
+  // a response started after the change is up to date with it.
+  cache.put("way 1", make_entry("way 1 again"), deps, cache.epoch());
+  assert_equal<bool>(cache.get("way 1", out), true,
+                     "get of response made after the change");
+  assert_equal<std::string>(out.body, "way 1 again", "body after change");
+
+  // but one started before it, and finished after, isn't.
+  const uint64_t started = cache.epoch();
+  cache.invalidate(node);
+  cache.put("way 1", make_entry("way 1 racing"), deps, started);
+  assert_equal<bool>(cache.get("way 1", out), false,
+                     "get of response started before the change");
+}
+
+void test_invalidate_area() {
+  temp_dir dir;
+  response_cache cache(1 << 20, dir.path);
+  response_cache::entry out;
+
+  bbox tile(51.49, -0.11, 51.51, -0.09);
+  response_cache::dependencies deps;
+  deps.add_area(tile);
+  cache.put("tile", make_entry("tile"), deps, cache.epoch());
+
+  response_cache::dependencies elsewhere;
+  elsewhere.add_location(13.4, 52.5);
+  cache.invalidate(elsewhere);
+  assert_equal<bool>(cache.get("tile", out), true,
+                     "get after a node elsewhere changed");
+
+  // a node created in the area isn't in the response, but should be.
+  response_cache::dependencies inside;
+  inside.add_location(-0.1, 51.5);
+  cache.invalidate(inside);
+  assert_equal<bool>(cache.get("tile", out), false,
+                     "get after a node in the area changed");
+}
+
+void test_bounded_by_bytes() {
+  temp_dir dir;
+  const size_t max_bytes = 64 * 1024;
+  response_cache cache(max_bytes, dir.path);
+  response_cache::entry out;
+  response_cache::dependencies deps;
+
+  // bodies too big for a share of the cache aren't kept.
+  cache.put("big", make_entry(std::string(cache.max_body_bytes() + 1, 'x')),
+            deps, cache.epoch());
+  assert_equal<bool>(cache.get("big", out), false, "get of too big a body");
+
+  // many more bodies than fit, which wrap around the ring several times.
+  const int num_bodies = 500;
+  for (int i = 0; i < num_bodies; ++i) {
+    const std::string key = "key " + std::to_string(i);
+    cache.put(key, make_entry(std::string(1000, char('a' + i % 26)) + key),
+              deps, cache.epoch());
+  }
+
+  int found = 0;
+  for (int i = 0; i < num_bodies; ++i) {
+    const std::string key = "key " + std::to_string(i);
+    if (cache.get(key, out)) {
+      assert_equal<std::string>(
+          out.body, std::string(1000, char('a' + i % 26)) + key,
+          "body of found entry");
+      ++found;
+    }
+  }
+  assert_equal<bool>(found > 0, true, "some bodies are found");
+  assert_equal<bool>(size_t(found) * 1000 <= max_bytes, true,
+                     "no more found than there's room for");
+  assert_equal<bool>(
+      cache.get("key " + std::to_string(num_bodies - 1), out), true,
+      "most recent body found");
+  assert_equal<bool>(cache.get("key 0", out), false, "oldest body is gone");
+}
+
+void test_parse_changes() {
+  temp_dir dir;
+  dir.write("change.osc",
+            "<osmChange version=\"0.6\">\n"
+            "<create>\n"
+            "  <node id=\"10\" version=\"1\" lat=\"1.5\" lon=\"2.5\"/>\n"
+            "  <way id=\"20\" version=\"1\">\n"
+            "    <nd ref=\"10\"/><nd ref=\"11\"/>\n"
+            "    <tag k=\"highway\" v=\"path\"/>\n"
+            "  </way>\n"
+            "</create>\n"
+            "<delete>\n"
+            "  <relation id=\"30\" version=\"3\">\n"
+            "    <member type=\"way\" ref=\"20\" role=\"\"/>\n"
+            "    <member type=\"relation\" ref=\"31\" role=\"\"/>\n"
+            "  </relation>\n"
+            "</delete>\n"
+            "</osmChange>\n");
+
+  response_cache::dependencies changed;
+  response_cache::parse_changes((fs::path(dir.path) / "change.osc").string(),
+                                changed);
+
+  response_cache::dependencies expected;
+  expected.add_element(element_type_node, 10);
+  expected.add_location(2.5, 1.5);
+  expected.add_element(element_type_way, 20);
+  expected.add_element(element_type_node, 10);
+  expected.add_element(element_type_node, 11);
+  expected.add_element(element_type_relation, 30);
+  expected.add_element(element_type_way, 20);
+  expected.add_element(element_type_relation, 31);
+  assert_equal<bool>(changed.keys() == expected.keys(), true,
+                     "keys parsed from osmChange");
+
+  dir.write("broken.osc", "<osmChange><modify>");
+  bool threw = false;
+  try {
+    response_cache::dependencies broken;
+    response_cache::parse_changes(
+        (fs::path(dir.path) / "broken.osc").string(), broken);
+  } catch (const std::exception &) {
+    threw = true;
+  }
+  assert_equal<bool>(threw, true, "broken osmChange throws");
+}
+
+void test_read_changes() {
+  temp_dir dir;
+  // already there, so older than anything cached, and not read.
+  dir.write("1.osc", NODE_2_CHANGE);
+  response_cache cache(1 << 20, dir.path);
+  response_cache::entry out;
+  pt::ptime now = pt::second_clock::universal_time();
+
+  response_cache::dependencies deps;
+  deps.add_element(element_type_node, 2);
+  cache.put("node 2", make_entry("node 2"), deps, cache.epoch());
+  cache.read_changes(now);
+  assert_equal<bool>(cache.get("node 2", out), true,
+                     "get after reading no new files");
+  assert_equal<uint64_t>(cache.get_stats().files, 0, "files read");
+
+  // files are read in numeric order, and not until it's been long enough
+  // since the last look.
+  dir.write("10.osc", NODE_2_CHANGE);
+  dir.write("9.osc", "<osmChange version=\"0.6\"/>");
+  cache.read_changes(now + pt::seconds(1));
+  assert_equal<bool>(cache.get("node 2", out), true,
+                     "get before looking again");
+
+  now += pt::minutes(1);
+  cache.read_changes(now);
+  assert_equal<bool>(cache.get("node 2", out), false,
+                     "get after reading change to node");
+  assert_equal<uint64_t>(cache.get_stats().files, 2, "files read");
+
+  // a file which can't be read throws everything away, as there's no
+  // telling what it changed.
+  response_cache::dependencies unrelated;
+  unrelated.add_element(element_type_relation, 99);
+  cache.put("relation 99", make_entry("relation 99"), unrelated,
+            cache.epoch());
+  dir.write("11.osc", "not xml");
+  now += pt::minutes(1);
+  cache.read_changes(now);
+  assert_equal<bool>(cache.get("relation 99", out), false,
+                     "get after unreadable changes");
+  assert_equal<uint64_t>(cache.get_stats().files, 3, "files read");
+
+  // and it isn't read again.
+  cache.put("relation 99", make_entry("relation 99"), unrelated,
+            cache.epoch());
+  now += pt::minutes(1);
+  cache.read_changes(now);
+  assert_equal<bool>(cache.get("relation 99", out), true,
+                     "get after nothing new to read");
+}
+
+void test_shared_between_processes() {
+  temp_dir dir;
+  response_cache cache(1 << 20, dir.path);
+  response_cache::dependencies deps;
+  deps.add_element(element_type_way, 5);
+
+  // a forked child caches a response and marks something as changed, and
+  // the parent should see both.
+  cache.put("stale", make_entry("stale"), deps, cache.epoch());
+  pid_t pid = fork();
+  if (pid < 0) {
+    throw std::runtime_error("fork failed.");
+  } else if (pid == 0) {
+    response_cache::dependencies changed;
+    changed.add_element(element_type_way, 5);
+    cache.invalidate(changed);
+    response_cache::dependencies child_deps;
+    child_deps.add_element(element_type_way, 6);
+    cache.put("from child", make_entry("child"), child_deps, cache.epoch());
+    _exit(0);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  assert_equal<int>(WEXITSTATUS(status), 0, "child exit status");
+
+  response_cache::entry out;
+  assert_equal<bool>(cache.get("from child", out), true,
+                     "get of response put by child");
+  assert_equal<std::string>(out.body, "child", "body put by child");
+  assert_equal<bool>(cache.get("stale", out), false,
+                     "get of response invalidated by child");
+}
+
+// the "database" behind fake_selection: whether writing the nodes fails,
+// as a statement timing out would, and how many selections were made.
+struct fake_db {
+  fake_db() : fail(false), selections(0) {}
+  bool fail;
+  int selections;
+};
+
+/**
+ * a selection holding way 1 and its two nodes, which is all that a
+ * way/full call needs.
+ */
+class fake_selection : public data_selection {
+public:
+  explicit fake_selection(fake_db &db) : m_db(db) {}
+
+  void write_nodes(output_formatter &formatter) {
+    if (m_db.fail) {
+      throw std::runtime_error("canceling statement due to statement timeout");
+    }
+    for (osm_nwr_id_t id = 1; id <= 2; ++id) {
+      element_info elem(id, 1, 1, "2017-01-01T00:00:00Z", osm_user_id_t(1),
+                        std::string("user"), true);
+      formatter.write_node(elem, 0.1 * id, 0.2 * id, tags_t());
+    }
+  }
+  void write_ways(output_formatter &formatter) {
+    element_info elem(1, 1, 1, "2017-01-01T00:00:00Z", osm_user_id_t(1),
+                      std::string("user"), true);
+    nodes_t nodes;
+    nodes.push_back(1);
+    nodes.push_back(2);
+    formatter.write_way(elem, nodes, tags_t());
+  }
+  void write_relations(output_formatter &) {}
+
+  visibility_t check_node_visibility(osm_nwr_id_t) { return exists; }
+  visibility_t check_way_visibility(osm_nwr_id_t) { return exists; }
+  visibility_t check_relation_visibility(osm_nwr_id_t) { return non_exist; }
+
+  int select_nodes(const std::vector<osm_nwr_id_t> &) { return 0; }
+  int select_ways(const std::vector<osm_nwr_id_t> &ids) {
+    return int(std::count(ids.begin(), ids.end(), osm_nwr_id_t(1)));
+  }
+  int select_relations(const std::vector<osm_nwr_id_t> &) { return 0; }
+  int select_nodes_from_bbox(const bbox &, int) { return 0; }
+  void select_nodes_from_relations() {}
+  void select_ways_from_nodes() {}
+  void select_ways_from_relations() {}
+  void select_relations_from_ways() {}
+  void select_nodes_from_way_nodes() {}
+  void select_relations_from_nodes() {}
+  void select_relations_from_relations() {}
+  void select_relations_members_of_relations() {}
+
+private:
+  fake_db &m_db;
+};
+
+struct fake_factory : public data_selection::factory {
+  explicit fake_factory(fake_db &db) : m_db(db) {}
+  boost::shared_ptr<data_selection> make_selection() {
+    ++m_db.selections;
+    return boost::make_shared<fake_selection>(boost::ref(m_db));
+  }
+  fake_db &m_db;
+};
+
+// runs a way/full call for way 1 through process_request, returning the
+// status it was answered with.
+int get_way_full(boost::shared_ptr<data_selection::factory> factory) {
+  test_request req;
+  req.set_header("REQUEST_METHOD", "GET");
+  req.set_header("REQUEST_URI", "/api/0.6/way/1/full");
+  req.set_header("REMOTE_ADDR", "127.0.0.1");
+  req.set_current_time(pt::time_from_string("2017-01-01 00:00:00"));
+
+  null_rate_limiter limiter;
+  routes route;
+  boost::shared_ptr<oauth::store> no_store;
+  process_request(req, limiter, "test", route, factory, no_store);
+  return req.response_status();
+}
+
+void test_failed_response_not_cached() {
+  temp_dir dir;
+  po::variables_map vm;
+  vm.insert(std::make_pair(std::string("response-cache-bytes"),
+                           po::variable_value(size_t(1 << 20), false)));
+  vm.insert(std::make_pair(std::string("response-cache-changes"),
+                           po::variable_value(dir.path, false)));
+  response_cache::initialise(vm);
+  response_cache &cache = *response_cache::instance();
+
+  fake_db db;
+  boost::shared_ptr<data_selection::factory> factory =
+      boost::make_shared<fake_factory>(boost::ref(db));
+
+  // the error is written into the document, which is still sent with a
+  // 200, but mustn't be kept and sent to everyone else.
+  db.fail = true;
+  assert_equal<int>(get_way_full(factory), 200, "status of failed way/full");
+  assert_equal<uint64_t>(cache.get_stats().inserts, 0,
+                         "responses cached after a failure");
+
+  // so the next request goes to the database, and its response is kept.
+  db.fail = false;
+  assert_equal<int>(get_way_full(factory), 200, "status of way/full");
+  assert_equal<int>(db.selections, 2, "selections made after a failure");
+  assert_equal<uint64_t>(cache.get_stats().inserts, 1,
+                         "responses cached after a success");
+
+  assert_equal<int>(get_way_full(factory), 200, "status of cached way/full");
+  assert_equal<int>(db.selections, 2, "selections made for a cached response");
+
+  response_cache::initialise(po::variables_map());
+}
+
+#ifdef HAVE_YAJL
+/**
+ * keeps what's written to it, and whether it's been closed, as the buffer
+ * which captures a response for the cache does. only a closed body is put
+ * in the cache, as it's only then that it's known to be complete.
+ */
+struct closing_buffer : public output_buffer {
+  closing_buffer() : closed(false) {}
+  int write(const char *buffer, int len) {
+    body.append(buffer, len);
+    return len;
+  }
+  int written() { return body.size(); }
+  int close() {
+    closed = true;
+    return 0;
+  }
+  void flush() {}
+
+  std::string body;
+  bool closed;
+};
+
+void test_json_response() {
+  temp_dir dir;
+  response_cache cache(1 << 20, dir.path);
+
+  // the JSON writer closes its output when it goes away, as the XML one
+  // does, so that a JSON response is seen to be complete and is cached.
+  boost::shared_ptr<closing_buffer> capture(new closing_buffer);
+  boost::shared_ptr<output_buffer> out = capture;
+  {
+    json_writer writer(out);
+    writer.start_object();
+    writer.object_key("version");
+    writer.entry_string("0.6");
+    writer.end_object();
+    writer.flush();
+    assert_equal<bool>(capture->closed, false,
+                       "JSON output closed before the writer goes away");
+  }
+  assert_equal<bool>(capture->closed, true,
+                     "JSON output closed after the writer goes away");
+
+  response_cache::entry e = make_entry(capture->body);
+  e.content_type = "application/json; charset=utf-8";
+  response_cache::dependencies deps;
+  deps.add_element(element_type_node, 1);
+  cache.put("json", e, deps, cache.epoch());
+
+  response_cache::entry got;
+  assert_equal<bool>(cache.get("json", got), true, "get of JSON response");
+  assert_equal<std::string>(got.content_type,
+                            "application/json; charset=utf-8",
+                            "content type of JSON response");
+  assert_equal<std::string>(got.body, "{\"version\":\"0.6\"}",
+                            "body of JSON response");
+}
+#endif /* HAVE_YAJL */
+
+} // anonymous namespace
+
+int main() {
+  try {
+    test_get_put();
+    test_invalidate_elements();
+    test_invalidate_area();
+    test_bounded_by_bytes();
+    test_parse_changes();
+    test_read_changes();
+    test_shared_between_processes();
+    test_failed_response_not_cached();
+#ifdef HAVE_YAJL
+    test_json_response();
+#endif
+
+  } catch (const std::exception &e) {
+    std::cerr << "EXCEPTION: " << e.what() << std::endl;
+    return 1;
+
+  } catch (...) {
+    std::cerr << "UNKNOWN EXCEPTION" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
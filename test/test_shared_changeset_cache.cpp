@@ -0,0 +1,200 @@
+#include "cgimap/backend/apidb/shared_changeset_cache.hpp"
+
+#include <stdexcept>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/ref.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+template <typename T>
+void assert_equal(const T &a, const T &b, const std::string &message) {
+  if (a != b) {
+    std::ostringstream ostr;
+    ostr << "Expecting " << message << " to be equal, but " << a << " != "
+         << b;
+    throw std::runtime_error(ostr.str());
+  }
+}
+
+// stands in for the database, counting the changesets fetched.
+changeset *fetch_one(int &num_fetched, osm_changeset_id_t id) {
+  ++num_fetched;
+  return new changeset(true, "user " + std::to_string(id),
+                       osm_user_id_t(id * 10));
+}
+
+void fetch_batch(int &num_fetched, const std::vector<osm_changeset_id_t> &ids,
+                 cache<osm_changeset_id_t, changeset>::batch_type &out) {
+  for (std::vector<osm_changeset_id_t>::const_iterator itr = ids.begin();
+       itr != ids.end(); ++itr) {
+    boost::shared_ptr<changeset const> c(fetch_one(num_fetched, *itr));
+    out.push_back(std::make_pair(*itr, c));
+  }
+}
+
+void test_get_put() {
+  shared_changeset_cache shared(100);
+
+  assert_equal<bool>(shared.get(1) == NULL, true, "get before put is NULL");
+
+  shared.put(1, changeset(true, "alice", 10));
+  shared.put(2, changeset(false, "", 0));
+  boost::scoped_ptr<changeset> c1(shared.get(1)), c2(shared.get(2));
+  assert_equal<bool>(c1 != NULL, true, "changeset 1 found");
+  assert_equal<bool>(c1->data_public, true, "changeset 1 data_public");
+  assert_equal<std::string>(c1->display_name, "alice", "changeset 1 name");
+  assert_equal<osm_user_id_t>(c1->user_id, 10, "changeset 1 user_id");
+  assert_equal<bool>(c2 != NULL, true, "changeset 2 found");
+  assert_equal<bool>(c2->data_public, false, "changeset 2 data_public");
+
+  // putting the same changeset again replaces it, rather than adding it.
+  shared.put(1, changeset(true, "alicia", 10));
+  boost::scoped_ptr<changeset> c1b(shared.get(1));
+  assert_equal<std::string>(c1b->display_name, "alicia",
+                            "changeset 1 name after update");
+
+  // names which don't fit in a slot aren't cached.
+  shared.put(3, changeset(true, std::string(300, 'x'), 30));
+  assert_equal<bool>(shared.get(3) == NULL, true, "long name isn't cached");
+
+  shared_changeset_cache::stats s = shared.get_stats();
+  assert_equal<uint64_t>(s.inserts, 3, "number of inserts");
+  assert_equal<uint64_t>(s.hits, 3, "number of hits");
+  assert_equal<uint64_t>(s.misses, 2, "number of misses");
+  assert_equal<bool>(s.capacity >= 100, true, "capacity at least 100");
+}
+
+void test_non_positive_ids() {
+  shared_changeset_cache shared(100);
+
+  // changesets zero and below exist, and mustn't be mistaken for the
+  // slots which haven't been used yet.
+  assert_equal<bool>(shared.get(0) == NULL, true, "get 0 before put is NULL");
+  assert_equal<bool>(shared.get(-1) == NULL, true,
+                     "get -1 before put is NULL");
+
+  shared.put(0, changeset(true, "zero", 7));
+  shared.put(-1, changeset(false, "minus one", 8));
+  boost::scoped_ptr<changeset> c0(shared.get(0)), cm1(shared.get(-1));
+  assert_equal<bool>(c0 != NULL, true, "changeset 0 found");
+  assert_equal<std::string>(c0->display_name, "zero", "changeset 0 name");
+  assert_equal<osm_user_id_t>(c0->user_id, 7, "changeset 0 user_id");
+  assert_equal<bool>(cm1 != NULL, true, "changeset -1 found");
+  assert_equal<std::string>(cm1->display_name, "minus one",
+                            "changeset -1 name");
+
+  // and a second put of changeset 0 replaces it, rather than taking another
+  // slot.
+  shared.put(0, changeset(true, "zero again", 7));
+  boost::scoped_ptr<changeset> c0b(shared.get(0));
+  assert_equal<std::string>(c0b->display_name, "zero again",
+                            "changeset 0 name after update");
+  assert_equal<uint64_t>(shared.get_stats().evictions, 0,
+                         "evictions of non-positive IDs");
+}
+
+void test_eviction() {
+  shared_changeset_cache shared(16);
+  const size_t capacity = shared.get_stats().capacity;
+
+  // many more changesets than there's room for, all of which should still
+  // be put without error, with the oldest ones evicted.
+  for (osm_changeset_id_t id = 1; id <= 1000; ++id) {
+    shared.put(id, changeset(true, "u", osm_user_id_t(id)));
+  }
+  shared_changeset_cache::stats s = shared.get_stats();
+  assert_equal<uint64_t>(s.inserts, 1000, "number of inserts");
+  assert_equal<bool>(s.evictions >= 1000 - capacity, true,
+                     "at least the overflow is evicted");
+
+  size_t found = 0;
+  for (osm_changeset_id_t id = 1; id <= 1000; ++id) {
+    boost::scoped_ptr<changeset> c(shared.get(id));
+    if (c) {
+      assert_equal<osm_user_id_t>(c->user_id, osm_user_id_t(id),
+                                  "user_id of found changeset");
+      ++found;
+    }
+  }
+  assert_equal<bool>(found <= capacity, true, "no more found than capacity");
+  boost::scoped_ptr<changeset> last(shared.get(1000));
+  assert_equal<bool>(last != NULL, true, "most recent changeset found");
+}
+
+void test_get_or_fetch() {
+  shared_changeset_cache shared(100);
+  int num_fetched = 0;
+
+  boost::scoped_ptr<changeset> a(shared.get_or_fetch(
+      5, boost::bind(fetch_one, boost::ref(num_fetched), _1)));
+  boost::scoped_ptr<changeset> b(shared.get_or_fetch(
+      5, boost::bind(fetch_one, boost::ref(num_fetched), _1)));
+  assert_equal<int>(num_fetched, 1, "fetches for a repeated changeset");
+  assert_equal<std::string>(b->display_name, "user 5", "fetched name");
+
+  std::vector<osm_changeset_id_t> ids;
+  ids.push_back(5);
+  ids.push_back(6);
+  ids.push_back(7);
+  cache<osm_changeset_id_t, changeset>::batch_type out;
+  shared.get_or_fetch(ids, out,
+                      boost::bind(fetch_batch, boost::ref(num_fetched), _1,
+                                  _2));
+  assert_equal<size_t>(out.size(), 3, "changesets returned from batch");
+  assert_equal<int>(num_fetched, 3, "fetches after batch");
+
+  boost::scoped_ptr<changeset> c(shared.get(7));
+  assert_equal<bool>(c != NULL, true, "batch fetch added to the cache");
+}
+
+void test_shared_between_processes() {
+  shared_changeset_cache shared(100);
+
+  // a child process fills the cache, and the parent should see it.
+  pid_t pid = fork();
+  if (pid < 0) {
+    throw std::runtime_error("fork failed.");
+  } else if (pid == 0) {
+    shared.put(42, changeset(true, "child", 420));
+    _exit(0);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  assert_equal<int>(WEXITSTATUS(status), 0, "child exit status");
+
+  boost::scoped_ptr<changeset> c(shared.get(42));
+  assert_equal<bool>(c != NULL, true, "changeset put by child found");
+  assert_equal<std::string>(c->display_name, "child", "name put by child");
+  assert_equal<uint64_t>(shared.get_stats().inserts, 1,
+                         "inserts counted across processes");
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  try {
+    test_get_put();
+    test_non_positive_ids();
+    test_eviction();
+    test_get_or_fetch();
+    test_shared_between_processes();
+
+  } catch (const std::exception &ex) {
+    std::cerr << "EXCEPTION: " << ex.what() << std::endl;
+    return 1;
+
+  } catch (...) {
+    std::cerr << "UNKNOWN ERROR" << std::endl;
+    return 1;
+  }
+
+  return 0;
+}